@@ -0,0 +1,472 @@
+/**
+ * Benchmarks the built-in cores by feeding raw APDUs straight into Core::processRawAdpu, without any transport.
+ *
+ * For each core it measures registrations, authentications enforcing user presence and check-only authentications,
+ * first on a single thread and then on many threads sharing the same core, and reports:
+ * - Throughput, in operations per second
+ * - Latency percentiles of each operation
+ * - Heap allocations per operation made by the calling thread, both C++ (new) and SQLite (sqlite3_malloc)
+ *
+ * BiometricCore runs against benchmarks/veridis-mock.cpp, which always has a matching finger on the scanner.
+ * Since user presence is asynchronous, operations that fail with SW_CONDITIONS_NOT_SATISFIED are retried, like U2F clients do.
+ *
+ * Usage: core-bench [-n operations per thread] [-t threads] [-d database directory] [-k keypair pool depth] [-s seed] [core...]
+ * Cores: unsafe, stateless, derived, sqlite, biometric. All of them by default.
+ *
+ * With -k, registrations take their keypairs from a KeyPool of that depth, which is refilled in the background.
+ * With -s, keys and handles come from crypto::randomBytes seeded with that string, so single-threaded runs are repeatable.
+ *
+ * Build it with every file in src/, plus benchmarks/veridis-mock.cpp instead of the Veridis SDK.
+ * Compile with -DU2F_STATS to also get a per-stage breakdown at the end.
+ */
+
+#include <u2f/core-unsafe.h>
+#include <u2f/core-stateless.h>
+#include <u2f/core-derived.h>
+#include <u2f/core-sqlite.h>
+#include <u2f/core-biometric.h>
+#include <u2f/key-pool.h>
+#include <u2f/crypto-random.h>
+#include <u2f/stats.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+#include <thread>
+
+#define U2F_INS_REGISTER     0x01
+#define U2F_INS_AUTHENTICATE 0x02
+
+#define AUTH_ENFORCE_USER_SIGN 0x03
+#define AUTH_CHECK_ONLY        0x07
+
+#define SW_NO_ERROR                 0x9000
+#define SW_CONDITIONS_NOT_SATISFIED 0x6985
+
+// How long to keep retrying an operation waiting for user presence
+#define RETRY_TIMEOUT_NS 5000000000ULL
+
+// Largest APDU we build: Header + extended Lc + challenge + application + handle + extended Le
+#define MAX_REQUEST_SIZE (4 + 3 + 32 + 32 + 1 + 255 + 2)
+
+
+/*
+ * Allocation counting
+ *
+ * Only allocations made by the thread running the operation are counted.
+ * Background threads, like BiometricCore's capture thread, are not accounted for.
+ */
+static thread_local uint64_t newCount = 0;
+static thread_local uint64_t sqliteMallocCount = 0;
+
+// GCC can't tell that these are the replacements of new and delete
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+	newCount++;
+	void* ptr = malloc(size ? size : 1);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size) {
+	newCount++;
+	void* ptr = malloc(size ? size : 1);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+	operator delete[](ptr);
+}
+
+static sqlite3_mem_methods defaultSqliteMemMethods;
+
+static void* countingSqliteMalloc(int size) {
+	sqliteMallocCount++;
+	return defaultSqliteMemMethods.xMalloc(size);
+}
+
+static void* countingSqliteRealloc(void* ptr, int size) {
+	sqliteMallocCount++;
+	return defaultSqliteMemMethods.xRealloc(ptr, size);
+}
+
+/**
+ * Wraps SQLite's allocator with a counting one. Must be called before SQLite is used.
+ */
+static void countSqliteAllocations() {
+	sqlite3_config(SQLITE_CONFIG_GETMALLOC, &defaultSqliteMemMethods);
+	sqlite3_mem_methods countingMemMethods = defaultSqliteMemMethods;
+	countingMemMethods.xMalloc = countingSqliteMalloc;
+	countingMemMethods.xRealloc = countingSqliteRealloc;
+	sqlite3_config(SQLITE_CONFIG_MALLOC, &countingMemMethods);
+}
+
+
+/*
+ * Cores
+ */
+struct CoreType {
+	const char* name;
+	u2f::Core* (*create)(const char* databaseFilename);
+};
+
+static const CoreType coreTypes[] = {
+	{"unsafe",    [](const char* databaseFilename) -> u2f::Core* { return new u2f::UnsafeCore(); }},
+	{"stateless", [](const char* databaseFilename) -> u2f::Core* { return new u2f::StatelessCore("Benchmark"); }},
+	{"derived",   [](const char* databaseFilename) -> u2f::Core* { return new u2f::DerivedCore("Benchmark"); }},
+	{"sqlite",    [](const char* databaseFilename) -> u2f::Core* { return new u2f::SQLiteCore(databaseFilename); }},
+	{"biometric", [](const char* databaseFilename) -> u2f::Core* { return new u2f::BiometricCore(databaseFilename); }},
+};
+#define CORE_TYPE_COUNT (sizeof(coreTypes) / sizeof(coreTypes[0]))
+
+
+/*
+ * Operations
+ */
+enum Operation {
+	OPERATION_REGISTER,
+	OPERATION_AUTHENTICATE,
+	OPERATION_CHECK_ONLY,
+	OPERATION_COUNT
+};
+
+static const char* operationNames[OPERATION_COUNT] = {
+	"register",
+	"authenticate",
+	"check-only",
+};
+
+/**
+ * Builds an extended-length APDU, expecting up to 65536 bytes of response.
+ */
+static uint32_t buildApdu(uint8_t *apdu, uint8_t ins, uint8_t p1, const uint8_t *data, uint32_t dataSize) {
+	uint32_t size = 0;
+	apdu[size++] = 0x00;  // CLA
+	apdu[size++] = ins;
+	apdu[size++] = p1;
+	apdu[size++] = 0x00;  // P2
+	apdu[size++] = 0x00;  // Extended Lc
+	apdu[size++] = dataSize >> 8;
+	apdu[size++] = dataSize;
+	memcpy(&apdu[size], data, dataSize);
+	size += dataSize;
+	apdu[size++] = 0x00;  // Le = 65536
+	apdu[size++] = 0x00;
+	return size;
+}
+
+static uint32_t buildRegisterApdu(uint8_t *apdu, const u2f::crypto::Hash &challenge, const u2f::crypto::Hash &application) {
+	uint8_t data[2 * sizeof(u2f::crypto::Hash)];
+	memcpy(&data[0], challenge, sizeof(u2f::crypto::Hash));
+	memcpy(&data[sizeof(u2f::crypto::Hash)], application, sizeof(u2f::crypto::Hash));
+	return buildApdu(apdu, U2F_INS_REGISTER, 0x00, data, sizeof(data));
+}
+
+static uint32_t buildAuthenticateApdu(uint8_t *apdu, uint8_t control, const u2f::crypto::Hash &challenge, const u2f::crypto::Hash &application, const u2f::Handle &handle, uint8_t handleSize) {
+	uint8_t data[2 * sizeof(u2f::crypto::Hash) + 1 + sizeof(u2f::Handle)];
+	memcpy(&data[0], challenge, sizeof(u2f::crypto::Hash));
+	memcpy(&data[sizeof(u2f::crypto::Hash)], application, sizeof(u2f::crypto::Hash));
+	data[2 * sizeof(u2f::crypto::Hash)] = handleSize;
+	memcpy(&data[2 * sizeof(u2f::crypto::Hash) + 1], handle, handleSize);
+	return buildApdu(apdu, U2F_INS_AUTHENTICATE, control, data, 2 * sizeof(u2f::crypto::Hash) + 1 + handleSize);
+}
+
+
+/*
+ * Workers
+ */
+struct Worker {
+	u2f::Core* core;
+	Operation operation;
+	int index;
+	uint32_t operations;
+	u2f::stats::Histogram* latency;
+	std::atomic<int>* ready;
+	std::atomic<bool>* start;
+
+	uint8_t request[MAX_REQUEST_SIZE];
+	uint8_t* response;
+
+	// Results
+	uint64_t newCount;
+	uint64_t sqliteMallocCount;
+	uint64_t attempts;
+	uint32_t failures;
+};
+
+/**
+ * Sends a request, retrying while the user isn't present.
+ *
+ * @return The status word of the last response
+ */
+static uint16_t send(Worker &worker, uint32_t requestSize, bool retry, uint32_t &responseSize) {
+	uint64_t deadline = u2f::stats::now() + RETRY_TIMEOUT_NS;
+	while (true) {
+		worker.attempts++;
+		if (!worker.core->processRawAdpu(worker.request, requestSize, worker.response, U2F_MAX_RESPONSE_SIZE, responseSize) || responseSize < 2) {
+			return 0;
+		}
+		uint16_t sw = (worker.response[responseSize - 2] << 8) | worker.response[responseSize - 1];
+		if (!retry || sw != SW_CONDITIONS_NOT_SATISFIED || u2f::stats::now() > deadline) {
+			return sw;
+		}
+		std::this_thread::yield();
+	}
+}
+
+static void runWorker(Worker* worker) {
+	u2f::crypto::Hash challenge = {0};
+	u2f::crypto::Hash application = {0};
+	memcpy(application, &worker->index, sizeof(worker->index));
+
+	// Authentications need a handle: Register it before the clock starts
+	u2f::Handle handle;
+	uint8_t handleSize = 0;
+	if (worker->operation != OPERATION_REGISTER) {
+		uint32_t responseSize;
+		uint32_t requestSize = buildRegisterApdu(worker->request, challenge, application);
+		if (send(*worker, requestSize, true, responseSize) != SW_NO_ERROR) {
+			worker->failures = worker->operations;
+			worker->ready->fetch_add(1);
+			return;
+		}
+		handleSize = worker->response[1 + sizeof(u2f::crypto::PublicKey)];
+		memcpy(handle, &worker->response[1 + sizeof(u2f::crypto::PublicKey) + 1], handleSize);
+	}
+
+	uint64_t initialNewCount = newCount;
+	uint64_t initialSqliteMallocCount = sqliteMallocCount;
+	worker->attempts = 0;
+
+	// Wait for everybody else
+	worker->ready->fetch_add(1);
+	while (!worker->start->load()) {
+		std::this_thread::yield();
+	}
+
+	for (uint32_t i=0; i<worker->operations; i++) {
+		memcpy(challenge, &i, sizeof(i));
+
+		uint32_t requestSize;
+		uint16_t expected;
+		switch (worker->operation) {
+			case OPERATION_REGISTER:
+				requestSize = buildRegisterApdu(worker->request, challenge, application);
+				expected = SW_NO_ERROR;
+				break;
+			case OPERATION_AUTHENTICATE:
+				requestSize = buildAuthenticateApdu(worker->request, AUTH_ENFORCE_USER_SIGN, challenge, application, handle, handleSize);
+				expected = SW_NO_ERROR;
+				break;
+			default:
+				requestSize = buildAuthenticateApdu(worker->request, AUTH_CHECK_ONLY, challenge, application, handle, handleSize);
+				expected = SW_CONDITIONS_NOT_SATISFIED;
+				break;
+		}
+
+		uint32_t responseSize;
+		uint64_t startedAt = u2f::stats::now();
+		uint16_t sw = send(*worker, requestSize, worker->operation != OPERATION_CHECK_ONLY, responseSize);
+		worker->latency->record(u2f::stats::now() - startedAt);
+
+		if (sw != expected) {
+			worker->failures++;
+		}
+	}
+
+	worker->newCount = newCount - initialNewCount;
+	worker->sqliteMallocCount = sqliteMallocCount - initialSqliteMallocCount;
+}
+
+static u2f::KeyPool* keyPool = nullptr;
+
+/**
+ * Runs #operations of the specified type on each of #threadCount threads, sharing a new core, and prints the results.
+ */
+static bool run(const CoreType &coreType, Operation operation, int threadCount, uint32_t operations, const char* databaseFilename, u2f::stats::HistogramSnapshot &snapshot) {
+	unlink(databaseFilename);
+	u2f::Core* core = coreType.create(databaseFilename);
+	core->setKeyPool(keyPool);
+
+	u2f::stats::Histogram* latency = new u2f::stats::Histogram();
+	std::atomic<int> ready(0);
+	std::atomic<bool> start(false);
+
+	Worker* workers = new Worker[threadCount];
+	std::thread* threads = new std::thread[threadCount];
+	for (int i=0; i<threadCount; i++) {
+		Worker &worker = workers[i];
+		memset(&worker, 0, sizeof(Worker));
+		worker.core = core;
+		worker.operation = operation;
+		worker.index = i;
+		worker.operations = operations;
+		worker.latency = latency;
+		worker.ready = &ready;
+		worker.start = &start;
+		worker.response = new uint8_t[U2F_MAX_RESPONSE_SIZE];
+		threads[i] = std::thread(runWorker, &worker);
+	}
+
+	while (ready.load() < threadCount) {
+		std::this_thread::yield();
+	}
+	uint64_t startedAt = u2f::stats::now();
+	start.store(true);
+	for (int i=0; i<threadCount; i++) {
+		threads[i].join();
+	}
+	uint64_t elapsed = u2f::stats::now() - startedAt;
+
+	uint64_t totalNewCount = 0, totalSqliteMallocCount = 0, totalAttempts = 0, totalFailures = 0;
+	for (int i=0; i<threadCount; i++) {
+		totalNewCount += workers[i].newCount;
+		totalSqliteMallocCount += workers[i].sqliteMallocCount;
+		totalAttempts += workers[i].attempts;
+		totalFailures += workers[i].failures;
+		delete[] workers[i].response;
+	}
+	latency->snapshot(snapshot);
+
+	uint64_t total = (uint64_t)operations * threadCount;
+	printf("%-10s %-13s %7d %10.1f %10.1f %10.1f %10.1f %10.1f %8.1f %8.1f %8.2f %8" PRIu64 "\n",
+		coreType.name,
+		operationNames[operation],
+		threadCount,
+		total * 1e9 / elapsed,
+		snapshot.mean() / 1000,
+		snapshot.percentile(50) / 1000.,
+		snapshot.percentile(99) / 1000.,
+		snapshot.percentile(99.9) / 1000.,
+		(double)totalNewCount / total,
+		(double)totalSqliteMallocCount / total,
+		(double)totalAttempts / total,
+		totalFailures);
+	fflush(stdout);
+
+	delete[] threads;
+	delete[] workers;
+	delete latency;
+	delete core;
+	unlink(databaseFilename);
+	return totalFailures == 0;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-n operations per thread] [-t threads] [-d database directory] [-k keypair pool depth] [-s seed] [core...]\n", name);
+	fprintf(stderr, "Cores:");
+	for (unsigned i=0; i<CORE_TYPE_COUNT; i++) {
+		fprintf(stderr, " %s", coreTypes[i].name);
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv) {
+	uint32_t operations = 1000;
+	int threadCount = std::thread::hardware_concurrency();
+	const char* databaseDirectory = "/tmp";
+	uint32_t keyPoolDepth = 0;
+	const char* seed = nullptr;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:d:k:s:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				operations = atoi(optarg);
+				break;
+			case 't':
+				threadCount = atoi(optarg);
+				break;
+			case 'd':
+				databaseDirectory = optarg;
+				break;
+			case 'k':
+				keyPoolDepth = atoi(optarg);
+				break;
+			case 's':
+				seed = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (operations == 0 || threadCount <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (seed) {
+		u2f::crypto::setRandomSeed(seed, strlen(seed));
+	}
+
+	bool selected[CORE_TYPE_COUNT];
+	for (unsigned i=0; i<CORE_TYPE_COUNT; i++) {
+		selected[i] = optind == argc;
+	}
+	for (int arg=optind; arg<argc; arg++) {
+		unsigned i;
+		for (i=0; i<CORE_TYPE_COUNT && strcmp(argv[arg], coreTypes[i].name); i++);
+		if (i == CORE_TYPE_COUNT) {
+			usage(argv[0]);
+			return 1;
+		}
+		selected[i] = true;
+	}
+
+	countSqliteAllocations();
+
+	if (keyPoolDepth > 0) {
+		keyPool = new u2f::KeyPool(keyPoolDepth);
+	}
+
+	char databaseFilename[1024];
+	snprintf(databaseFilename, sizeof(databaseFilename), "%s/u2f-bench-%d.db", databaseDirectory, getpid());
+
+	printf("%-10s %-13s %7s %10s %10s %10s %10s %10s %8s %8s %8s %8s\n", "core", "operation", "threads", "ops/s", "mean(us)", "p50(us)", "p99(us)", "p99.9(us)", "new/op", "sqlite/op", "tries/op", "failures");
+
+	u2f::stats::HistogramSnapshot* snapshot = new u2f::stats::HistogramSnapshot;
+	bool success = true;
+	for (unsigned i=0; i<CORE_TYPE_COUNT; i++) {
+		if (!selected[i])
+			continue;
+		for (int operation=0; operation<OPERATION_COUNT; operation++) {
+			success &= run(coreTypes[i], (Operation)operation, 1, operations, databaseFilename, *snapshot);
+			if (threadCount > 1) {
+				success &= run(coreTypes[i], (Operation)operation, threadCount, operations, databaseFilename, *snapshot);
+			}
+		}
+	}
+	delete snapshot;
+
+	if (keyPool) {
+		printf("\nkeypair pool: depth %" PRIu32 ", %" PRIu64 " hits, %" PRIu64 " misses\n", keyPool->getDepth(), keyPool->getHits(), keyPool->getMisses());
+		delete keyPool;
+	}
+
+#ifdef U2F_STATS
+	printf("\n");
+	u2f::stats::print(stdout);
+#endif
+
+	return success ? 0 : 2;
+}
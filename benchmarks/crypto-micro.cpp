@@ -0,0 +1,449 @@
+/**
+ * Microbenchmarks of the crypto primitives the cores spend their CPU on, reporting nanoseconds and cycles per operation:
+ * - sha256: crypto::sha256 at message sizes from a single hash to a large attestation certificate
+ * - makeKeyPair: crypto::makeKeyPair
+ * - sign-raw: Backend::sign, r and s only
+ * - sign: crypto::sign, raw ECDSA plus the DER encoding. The difference with sign-raw is the cost of the encoding.
+ * - sign-raw-samekey: Backend::sign, always with the same key, like the attestation signer. Backends may cache what they derive from it.
+ * - signatureSize: crypto::signatureSize on a DER signature
+ * - aes-setKey, aes-encryptCbc, aes-decryptCbc: crypto::Aes256 as StatelessCore uses it, on 64-byte key handles
+ * - aes-decryptBlocks: The applicationHash halves of CHECK_HANDLES handles at once, as StatelessCore::checkHandles decrypts them
+ * - randomBytes: crypto::randomBytes, for a private key and for a key handle
+ *
+ * Key generation and signing are measured with each backend, the other operations don't depend on it.
+ * Each operation runs for about the specified time, several times, and the fastest run is kept to filter out noise.
+ * With -s, crypto::randomBytes is seeded with the specified string, so the keys are the same from run to run.
+ *
+ * Cycles come from the timestamp counter on x86, which ticks at a constant rate rather than at the current clock speed.
+ * They aren't available on other architectures.
+ *
+ * Usage: crypto-micro-bench [-t milliseconds per run] [-r runs] [-j JSON file, or - for stdout] [-s seed] [backend...]
+ * Backends: native, micro-ecc, and openssl when compiled with U2F_CRYPTO_OPENSSL. All of them by default.
+ *
+ * Build it with every file in src/.
+ */
+
+#include <u2f/crypto-backend.h>
+#include <u2f/crypto-aes.h>
+#include <u2f/crypto-p256.h>
+#include <u2f/crypto-random.h>
+#include <u2f/crypto-sha256.h>
+#include <u2f/stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_CYCLES 1
+#else
+#define HAS_CYCLES 0
+#endif
+
+// Distinct keys and messages used in turn, so that nothing can be cached between operations
+#define KEY_COUNT 64
+#define HANDLE_SIZE 64
+#define MAX_MESSAGE_SIZE 16384
+#define CHECK_HANDLES 16
+
+static u2f::crypto::PrivateKey privateKeys[KEY_COUNT];
+static u2f::crypto::Hash messageHashes[KEY_COUNT];
+static u2f::crypto::Signature signatures[KEY_COUNT];
+static uint8_t message[MAX_MESSAGE_SIZE];
+static uint8_t aesPassword[32];
+static u2f::crypto::Aes256 aes;
+static uint8_t rawHandles[KEY_COUNT][HANDLE_SIZE];
+static uint8_t handles[KEY_COUNT][HANDLE_SIZE];
+
+// Results are folded into this, so that the compiler can't drop the operations
+static volatile uint32_t sink;
+
+typedef bool (*OperationFunc)(uint32_t iterations, uint32_t size);
+
+struct Operation {
+	const char* name;
+	uint32_t size;
+	bool perBackend;
+	OperationFunc func;
+};
+
+struct Result {
+	const char* backend;
+	const char* operation;
+	uint32_t size;
+	uint64_t iterations;
+	double nanoseconds;
+	double cycles;
+};
+
+static bool runSha256(uint32_t iterations, uint32_t size) {
+	u2f::crypto::Hash hash;
+	for (uint32_t i=0; i<iterations; i++) {
+		message[0] = (uint8_t)i;
+		u2f::crypto::sha256(hash, message, (int)size, nullptr);
+		sink += hash[0];
+	}
+	return true;
+}
+
+static bool runMakeKeyPair(uint32_t iterations, uint32_t) {
+	u2f::crypto::PublicKey publicKey;
+	u2f::crypto::PrivateKey privateKey;
+	bool success = true;
+	for (uint32_t i=0; i<iterations; i++) {
+		success &= u2f::crypto::makeKeyPair(publicKey, privateKey);
+		sink += publicKey[1];
+	}
+	memset(privateKey, 0, sizeof(privateKey));
+	return success;
+}
+
+static bool runSignRaw(uint32_t iterations, uint32_t) {
+	u2f::crypto::Backend* backend = u2f::crypto::getBackend();
+	uint8_t rawSignature[64];
+	bool success = true;
+	for (uint32_t i=0; i<iterations; i++) {
+		success &= backend->sign(privateKeys[i % KEY_COUNT], messageHashes[i % KEY_COUNT], rawSignature);
+		sink += rawSignature[0];
+	}
+	return success;
+}
+
+static bool runSignRawSameKey(uint32_t iterations, uint32_t) {
+	u2f::crypto::Backend* backend = u2f::crypto::getBackend();
+	uint8_t rawSignature[64];
+	bool success = true;
+	for (uint32_t i=0; i<iterations; i++) {
+		success &= backend->sign(privateKeys[0], messageHashes[i % KEY_COUNT], rawSignature);
+		sink += rawSignature[0];
+	}
+	return success;
+}
+
+static bool runSign(uint32_t iterations, uint32_t) {
+	u2f::crypto::Signature signature;
+	bool success = true;
+	for (uint32_t i=0; i<iterations; i++) {
+		success &= u2f::crypto::sign(privateKeys[i % KEY_COUNT], messageHashes[i % KEY_COUNT], signature);
+		sink += signature[4];
+	}
+	return success;
+}
+
+static bool runSignatureSize(uint32_t iterations, uint32_t) {
+	for (uint32_t i=0; i<iterations; i++) {
+		sink += u2f::crypto::signatureSize(signatures[i % KEY_COUNT]);
+	}
+	return true;
+}
+
+static bool runAesSetKey(uint32_t iterations, uint32_t) {
+	u2f::crypto::Aes256 key;
+	uint8_t block[AES256_BLOCK_SIZE] = {};
+	for (uint32_t i=0; i<iterations; i++) {
+		aesPassword[0] = (uint8_t)i;
+		key.setKey(aesPassword);
+		key.encryptCbc(block, sizeof(block), block, block);
+		sink += block[0];
+	}
+	return true;
+}
+
+static bool runAesEncryptCbc(uint32_t iterations, uint32_t size) {
+	uint8_t handle[HANDLE_SIZE];
+	for (uint32_t i=0; i<iterations; i++) {
+		// The application hash is the IV
+		aes.encryptCbc(rawHandles[i % KEY_COUNT], size, handle, messageHashes[i % KEY_COUNT]);
+		sink += handle[0];
+	}
+	return true;
+}
+
+static bool runAesDecryptCbc(uint32_t iterations, uint32_t size) {
+	uint8_t rawHandle[HANDLE_SIZE];
+	for (uint32_t i=0; i<iterations; i++) {
+		aes.decryptCbc(handles[i % KEY_COUNT], size, rawHandle, messageHashes[i % KEY_COUNT]);
+		sink += rawHandle[0];
+	}
+	memset(rawHandle, 0, sizeof(rawHandle));
+	return true;
+}
+
+static bool runAesDecryptBlocks(uint32_t iterations, uint32_t size) {
+	const uint32_t count = size / AES256_BLOCK_SIZE;
+	const uint8_t* ciphertexts[2 * CHECK_HANDLES];
+	uint8_t plaintexts[2 * CHECK_HANDLES][AES256_BLOCK_SIZE];
+	uint8_t* outputs[2 * CHECK_HANDLES];
+	for (uint32_t i=0; i<iterations; i++) {
+		for (uint32_t j=0; j<count; j++) {
+			ciphertexts[j] = handles[(i + j / 2) % KEY_COUNT] + sizeof(u2f::crypto::PrivateKey) + (j % 2) * AES256_BLOCK_SIZE;
+			outputs[j] = plaintexts[j];
+		}
+		aes.decryptBlocks(count, ciphertexts, outputs);
+		sink += plaintexts[0][0];
+	}
+	return true;
+}
+
+static bool runRandomBytes(uint32_t iterations, uint32_t size) {
+	uint8_t bytes[HANDLE_SIZE];
+	bool success = true;
+	for (uint32_t i=0; i<iterations; i++) {
+		success &= u2f::crypto::randomBytes(bytes, size);
+		sink += bytes[0];
+	}
+	return success;
+}
+
+static const Operation operations[] = {
+	{ "sha256", 32, false, runSha256 },
+	{ "sha256", 64, false, runSha256 },
+	{ "sha256", 256, false, runSha256 },
+	{ "sha256", 1024, false, runSha256 },
+	{ "sha256", MAX_MESSAGE_SIZE, false, runSha256 },
+	{ "makeKeyPair", 0, true, runMakeKeyPair },
+	{ "sign-raw", 0, true, runSignRaw },
+	{ "sign", 0, true, runSign },
+	{ "sign-raw-samekey", 0, true, runSignRawSameKey },
+	{ "signatureSize", 0, false, runSignatureSize },
+	{ "aes-setKey", 0, false, runAesSetKey },
+	{ "aes-encryptCbc", HANDLE_SIZE, false, runAesEncryptCbc },
+	{ "aes-decryptCbc", HANDLE_SIZE, false, runAesDecryptCbc },
+	{ "aes-decryptBlocks", 2 * AES256_BLOCK_SIZE * CHECK_HANDLES, false, runAesDecryptBlocks },
+	{ "randomBytes", sizeof(u2f::crypto::PrivateKey), false, runRandomBytes },
+	{ "randomBytes", HANDLE_SIZE, false, runRandomBytes },
+};
+
+#define OPERATION_COUNT (sizeof(operations) / sizeof(operations[0]))
+
+static inline uint64_t cycles() {
+#if HAS_CYCLES
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Runs #operation for about #duration nanoseconds, #runs times, and keeps the fastest run.
+ */
+static bool measure(const Operation &operation, uint64_t duration, uint32_t runs, Result &result) {
+	// Find how many iterations fit in the duration, which also warms up the caches
+	uint32_t iterations = 1;
+	while (true) {
+		uint64_t startedAt = u2f::stats::now();
+		if (!operation.func(iterations, operation.size))
+			return false;
+		uint64_t elapsed = u2f::stats::now() - startedAt;
+		if (elapsed * 8 >= duration || iterations >= 0x80000000u) {
+			uint64_t scaled = elapsed == 0 ? (uint64_t)iterations * 8 : (uint64_t)iterations * duration / elapsed;
+			iterations = scaled == 0 ? 1 : scaled > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)scaled;
+			break;
+		}
+		iterations *= 2;
+	}
+
+	result.iterations = iterations;
+	result.nanoseconds = 0;
+	result.cycles = 0;
+	for (uint32_t run=0; run<runs; run++) {
+		uint64_t startedAt = u2f::stats::now();
+		uint64_t cyclesAtStart = cycles();
+		if (!operation.func(iterations, operation.size))
+			return false;
+		double elapsedCycles = (double)(cycles() - cyclesAtStart) / iterations;
+		double elapsed = (double)(u2f::stats::now() - startedAt) / iterations;
+
+		if (run == 0 || elapsed < result.nanoseconds) {
+			result.nanoseconds = elapsed;
+			result.cycles = elapsedCycles;
+		}
+	}
+	return true;
+}
+
+static void printResult(const Result &result) {
+	char name[32];
+	if (result.size) {
+		snprintf(name, sizeof(name), "%s/%u", result.operation, result.size);
+	} else {
+		snprintf(name, sizeof(name), "%s", result.operation);
+	}
+	char throughput[16] = "";
+	if (result.size) {
+		snprintf(throughput, sizeof(throughput), "%.1f", result.size * 1e3 / result.nanoseconds);
+	}
+
+	if (HAS_CYCLES) {
+		printf("%-10s %-20s %12.1f %12.1f %10s\n", result.backend, name, result.nanoseconds, result.cycles, throughput);
+	} else {
+		printf("%-10s %-20s %12.1f %12s %10s\n", result.backend, name, result.nanoseconds, "-", throughput);
+	}
+	fflush(stdout);
+}
+
+static bool writeJson(const char* path, const Result* results, uint32_t resultCount) {
+	FILE* file = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if (!file) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+
+	fprintf(file, "{\n\t\"sha256\": \"%s\",\n\t\"p256\": \"%s\",\n\t\"aes\": \"%s\",\n\t\"cycles\": %s,\n\t\"results\": [\n",
+		u2f::crypto::Sha256::getImplementationName(), u2f::crypto::p256::getImplementationName(), u2f::crypto::Aes256::getImplementationName(), HAS_CYCLES ? "true" : "false");
+	for (uint32_t i=0; i<resultCount; i++) {
+		const Result &result = results[i];
+		fprintf(file, "\t\t{\"backend\": ");
+		if (result.backend[0] == '-') {
+			fprintf(file, "null");
+		} else {
+			fprintf(file, "\"%s\"", result.backend);
+		}
+		fprintf(file, ", \"operation\": \"%s\", \"bytes\": %u, \"iterations\": %" PRIu64 ", \"ns_per_op\": %.2f, \"cycles_per_op\": ",
+			result.operation, result.size, result.iterations, result.nanoseconds);
+		if (HAS_CYCLES) {
+			fprintf(file, "%.2f}", result.cycles);
+		} else {
+			fprintf(file, "null}");
+		}
+		fprintf(file, "%s\n", i + 1 < resultCount ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+
+	bool success = !ferror(file);
+	if (file != stdout) {
+		success &= fclose(file) == 0;
+	}
+	if (!success) {
+		fprintf(stderr, "Failed to write %s\n", path);
+	}
+	return success;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-t milliseconds per run] [-r runs] [-j JSON file, or - for stdout] [-s seed] [backend...]\n", name);
+	fprintf(stderr, "Backends:");
+	u2f::crypto::Backend* backend;
+	for (unsigned i=0; (backend = u2f::crypto::listBackends(i)) != nullptr; i++) {
+		fprintf(stderr, " %s", backend->getName());
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv) {
+	uint64_t duration = 100;
+	uint32_t runs = 5;
+	const char* jsonPath = nullptr;
+	const char* seed = nullptr;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:r:j:s:h")) != -1) {
+		switch (opt) {
+			case 't':
+				duration = atoi(optarg);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'j':
+				jsonPath = optarg;
+				break;
+			case 's':
+				seed = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (duration == 0 || runs == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	duration *= 1000000;
+	if (seed) {
+		u2f::crypto::setRandomSeed(seed, strlen(seed));
+	}
+
+	u2f::crypto::Backend* selectedBackends[8];
+	uint32_t backendCount = 0;
+	u2f::crypto::Backend* backend;
+	for (unsigned i=0; (backend = u2f::crypto::listBackends(i)) != nullptr && backendCount < 8; i++) {
+		bool selected = optind == argc;
+		for (int arg=optind; arg<argc; arg++) {
+			selected |= !strcmp(argv[arg], backend->getName());
+		}
+		if (selected) {
+			selectedBackends[backendCount++] = backend;
+		}
+	}
+	for (int arg=optind; arg<argc; arg++) {
+		if (u2f::crypto::findBackend(argv[arg]) == nullptr) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// Same keys, messages and handles for every backend
+	u2f::crypto::PublicKey publicKey;
+	for (int i=0; i<KEY_COUNT; i++) {
+		if (!u2f::crypto::makeKeyPair(publicKey, privateKeys[i])) {
+			fprintf(stderr, "Failed to create keys\n");
+			return 2;
+		}
+		u2f::crypto::sha256(messageHashes[i], privateKeys[i], (int)sizeof(u2f::crypto::PrivateKey), nullptr);
+		if (!u2f::crypto::sign(privateKeys[i], messageHashes[i], signatures[i])) {
+			fprintf(stderr, "Failed to sign\n");
+			return 2;
+		}
+	}
+	for (uint32_t i=0; i<MAX_MESSAGE_SIZE; i++) {
+		message[i] = (uint8_t)(i * 31 + 7);
+	}
+	u2f::crypto::sha256(*(u2f::crypto::Hash*)aesPassword, "crypto-micro-bench", 18, nullptr);
+	aes.setKey(aesPassword);
+	for (int i=0; i<KEY_COUNT; i++) {
+		// Private key and application hash, like StatelessCore's handles
+		memcpy(rawHandles[i], privateKeys[i], sizeof(u2f::crypto::PrivateKey));
+		memcpy(rawHandles[i] + sizeof(u2f::crypto::PrivateKey), messageHashes[i], sizeof(u2f::crypto::Hash));
+		aes.encryptCbc(rawHandles[i], HANDLE_SIZE, handles[i], messageHashes[i]);
+	}
+
+	printf("SHA-256: %s\n", u2f::crypto::Sha256::getImplementationName());
+	printf("P-256: %s\n", u2f::crypto::p256::getImplementationName());
+	printf("AES: %s\n", u2f::crypto::Aes256::getImplementationName());
+	printf("%-10s %-20s %12s %12s %10s\n", "backend", "operation", "ns/op", "cycles/op", "MB/s");
+
+	Result* results = new Result[OPERATION_COUNT * (backendCount + 1)];
+	uint32_t resultCount = 0;
+	bool success = true;
+	for (uint32_t i=0; i<OPERATION_COUNT; i++) {
+		const Operation &operation = operations[i];
+		uint32_t passes = operation.perBackend ? backendCount : 1;
+		for (uint32_t pass=0; pass<passes; pass++) {
+			Result &result = results[resultCount];
+			result.backend = operation.perBackend ? selectedBackends[pass]->getName() : "-";
+			result.operation = operation.name;
+			result.size = operation.size;
+			u2f::crypto::setBackend(operation.perBackend ? selectedBackends[pass] : nullptr);
+
+			if (!measure(operation, duration, runs, result)) {
+				fprintf(stderr, "%s %s failed\n", result.backend, result.operation);
+				success = false;
+				continue;
+			}
+			printResult(result);
+			resultCount++;
+		}
+	}
+	u2f::crypto::setBackend(nullptr);
+
+	if (jsonPath) {
+		success &= writeJson(jsonPath, results, resultCount);
+	}
+
+	memset(privateKeys, 0, sizeof(privateKeys));
+	memset(rawHandles, 0, sizeof(rawHandles));
+	delete[] results;
+	return success ? 0 : 2;
+}
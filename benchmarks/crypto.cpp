@@ -0,0 +1,154 @@
+/**
+ * Compares the crypto backends on the same workload: key generation and signing of the same messages with the same keys.
+ *
+ * For each backend it reports throughput and latency percentiles of:
+ * - makeKeyPair: Backend::makeKeyPair
+ * - sign: crypto::sign, raw ECDSA plus the DER encoding, through SimpleSigner like authentications do
+ *
+ * Usage: crypto-bench [-n operations] [backend...]
+ * Backends: native, micro-ecc, and openssl when compiled with U2F_CRYPTO_OPENSSL. All of them by default.
+ *
+ * Build it with every file in src/.
+ */
+
+#include <u2f/crypto-backend.h>
+#include <u2f/crypto-simple.h>
+#include <u2f/stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Distinct keys signing in turn, so that a backend can't just cache one of them
+#define KEY_COUNT 64
+
+enum Operation {
+	OPERATION_MAKE_KEY_PAIR,
+	OPERATION_SIGN,
+	OPERATION_COUNT
+};
+
+static const char* operationNames[OPERATION_COUNT] = {
+	"makeKeyPair",
+	"sign",
+};
+
+static u2f::crypto::PrivateKey privateKeys[KEY_COUNT];
+static u2f::crypto::Hash messageHashes[KEY_COUNT];
+
+/**
+ * Runs #operations of the specified type with #backend and prints the results.
+ */
+static bool run(u2f::crypto::Backend* backend, Operation operation, uint32_t operations) {
+	u2f::crypto::setBackend(backend);
+	u2f::stats::Histogram* latency = new u2f::stats::Histogram();
+	u2f::stats::HistogramSnapshot* snapshot = new u2f::stats::HistogramSnapshot;
+
+	u2f::crypto::PublicKey publicKey;
+	u2f::crypto::PrivateKey privateKey;
+	u2f::crypto::Signature signature;
+	uint64_t failures = 0;
+
+	uint64_t startedAt = u2f::stats::now();
+	for (uint32_t i=0; i<operations; i++) {
+		uint64_t operationStartedAt = u2f::stats::now();
+		bool success;
+		switch (operation) {
+			case OPERATION_MAKE_KEY_PAIR:
+				success = backend->makeKeyPair(publicKey, privateKey);
+				break;
+			case OPERATION_SIGN:
+				success = u2f::crypto::SimpleSigner(privateKeys[i % KEY_COUNT]).sign(messageHashes[i % KEY_COUNT], signature);
+				break;
+			default:
+				success = false;
+		}
+		latency->record(u2f::stats::now() - operationStartedAt);
+		if (!success) {
+			failures++;
+		}
+	}
+	uint64_t elapsed = u2f::stats::now() - startedAt;
+	latency->snapshot(*snapshot);
+
+	printf("%-10s %-12s %10.1f %10.1f %10.1f %10.1f %8" PRIu64 "\n",
+		backend->getName(),
+		operationNames[operation],
+		operations * 1e9 / elapsed,
+		snapshot->mean() / 1000,
+		snapshot->percentile(50) / 1000.,
+		snapshot->percentile(99) / 1000.,
+		failures);
+	fflush(stdout);
+
+	memset(privateKey, 0, sizeof(privateKey));
+	delete snapshot;
+	delete latency;
+	return failures == 0;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-n operations] [backend...]\n", name);
+	fprintf(stderr, "Backends:");
+	u2f::crypto::Backend* backend;
+	for (unsigned i=0; (backend = u2f::crypto::listBackends(i)) != nullptr; i++) {
+		fprintf(stderr, " %s", backend->getName());
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv) {
+	uint32_t operations = 1000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				operations = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (operations == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (int arg=optind; arg<argc; arg++) {
+		if (u2f::crypto::findBackend(argv[arg]) == nullptr) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// Same keys and messages for every backend
+	u2f::crypto::PublicKey publicKey;
+	for (int i=0; i<KEY_COUNT; i++) {
+		if (!u2f::crypto::makeKeyPair(publicKey, privateKeys[i])) {
+			fprintf(stderr, "Failed to create keys\n");
+			return 2;
+		}
+		u2f::crypto::sha256(messageHashes[i], privateKeys[i], (int)sizeof(u2f::crypto::PrivateKey), nullptr);
+	}
+
+	printf("%-10s %-12s %10s %10s %10s %10s %8s\n", "backend", "operation", "ops/s", "mean(us)", "p50(us)", "p99(us)", "failures");
+
+	bool success = true;
+	u2f::crypto::Backend* backend;
+	for (unsigned i=0; (backend = u2f::crypto::listBackends(i)) != nullptr; i++) {
+		bool selected = optind == argc;
+		for (int arg=optind; arg<argc; arg++) {
+			selected |= !strcmp(argv[arg], backend->getName());
+		}
+		if (!selected)
+			continue;
+
+		for (int operation=0; operation<OPERATION_COUNT; operation++) {
+			success &= run(backend, (Operation)operation, operations);
+		}
+	}
+
+	return success ? 0 : 2;
+}
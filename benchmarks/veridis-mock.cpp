@@ -0,0 +1,43 @@
+/**
+ * Fake Veridis Biometric SDK, so that BiometricCore can be benchmarked without a fingerprint scanner.
+ *
+ * As soon as capture starts a finger is "placed" on the scanner, and every template matches every other.
+ *
+ * Link this instead of the real SDK.
+ */
+
+#include <veridisbiometric.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char mockTemplate[] = "mock-template";
+
+int veridiscap_addListener(const void* listenerHandle, VrBio_CaptureEventCallback eventCallback) {
+	eventCallback(VRBIO_CAPTURE_EVENT_IMAGE_CAPTURED, "mock", nullptr, listenerHandle);
+	return 0;
+}
+
+int veridiscap_removeListener(const void* listenerHandle) {
+	return 0;
+}
+
+int veridiscap_addListenerToReader(const void* listenerHandle, const char* readerName) {
+	return 0;
+}
+
+int veridisutil_templateFree(char** fingerprintTemplate) {
+	free(*fingerprintTemplate);
+	*fingerprintTemplate = nullptr;
+	return 0;
+}
+
+int veridisbio_extractEx(const VrBio_BiometricImage* image, char** fingerprintTemplate, int* fingerprintTemplateSize, const char* inputFormat, const char** outputFormat) {
+	*fingerprintTemplate = (char*)malloc(sizeof(mockTemplate));
+	memcpy(*fingerprintTemplate, mockTemplate, sizeof(mockTemplate));
+	*fingerprintTemplateSize = sizeof(mockTemplate);
+	return 0;
+}
+
+int veridisbio_match(const char* template1, int template1Size, const char* template2, int template2Size) {
+	return 100;
+}
@@ -13,15 +13,31 @@
 #include <u2f/core-stateless.h>
 #include <u2f/core-biometric.h>
 #include <u2f/core-sqlite.h>
+#include <u2f/crypto-attestation.h>
 #include <u2f/hid.h>
+#include <u2f/trace.h>
+#include <u2f/worker-pool.h>
 #include <hiddev/uhid.h>
 
 int main() {
+	// Record all traffic, to be replayed later with tools/replay.cpp
+// 	u2f::trace::Recorder trace;
+// 	trace.open("u2f.trace");
+
 // 	u2f::UnsafeCore core;
 	u2f::StatelessCore core("Password");
 // 	u2f::SQLiteCore core("handles.db");
 	//u2f::BiometricCore core("handles.db");
-	u2f::Hid hid(core);
+
+	// Use your own attestation key and certificate (DER or PEM) instead of the built-in ones
+// 	u2f::crypto::AttestationSigner* attestationSigner = u2f::crypto::AttestationSigner::fromFile("attestation.key", "attestation.crt");
+// 	core.setAttestationSigner(attestationSigner);
+
+	// Process U2F messages from different channels concurrently
+	u2f::WorkerPool pool;
+	u2f::Hid hid(core, &pool);
+// 	core.setTraceRecorder(&trace);
+// 	hid.setTraceRecorder(&trace);
 	hiddev::UHid uhid(hid);
 	uhid.run();
 	return 0;
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <inttypes.h>
+#include <mutex>
+
+namespace u2f {
+
+	/**
+	 * Free list of fixed-size buffers, shared by many objects that only need a buffer once in a while.
+	 *
+	 * Buffers are allocated on demand and recycled forever, so the pool grows to the peak number of buffers in use.
+	 */
+	class BufferPool {
+		std::mutex mutex;
+		uint32_t bufferSize;
+		void* freeList;   // Free buffers are linked through their first bytes
+		uint32_t allocated;
+
+	public:
+		/**
+		 * @param[in] bufferSize Size of each buffer, at least sizeof(void*)
+		 */
+		BufferPool(uint32_t bufferSize);
+
+		/**
+		 * Frees every buffer. Buffers still in use must not be released after this.
+		 */
+		~BufferPool();
+
+		inline uint32_t getBufferSize() const {
+			return bufferSize;
+		}
+
+		/**
+		 * Returns a free buffer, allocating one if needed.
+		 */
+		uint8_t* acquire();
+
+		/**
+		 * Returns a buffer to the pool.
+		 */
+		void release(uint8_t* buffer);
+
+		/**
+		 * Number of buffers allocated so far, in use or not
+		 */
+		uint32_t getAllocatedCount();
+	};
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <u2f/core.h>
+#include <u2f/handle-filter.h>
 #include <sqlite3.h>
 #include <veridisbiometric.h>
 #include <mutex>
@@ -9,8 +10,17 @@
 #include <chrono>
 
 namespace u2f {
+	/**
+	 * Stores handles in an SQLite database, along with the enrolled fingerprint template.
+	 *
+	 * User presence is checked by matching the fingerprint on the scanner against the one stored in the handle.
+	 *
+	 * It is safe to use from multiple threads, but requests are serialized: There is only one finger on the scanner anyway.
+	 * Handles that are definitely not in the database are rejected by a HandleFilter before waiting for the scanner.
+	 */
 	class BiometricCore : public Core {
 		sqlite3 *db;
+		HandleFilter filter;
 
 		std::mutex captureMutex;
 		volatile bool isCapturing;
@@ -33,7 +43,6 @@ namespace u2f {
 		virtual bool supportsWink();
 		virtual void wink();
 		virtual bool enroll(const crypto::Hash &applicationHash, Handle &handle, uint8_t &handleSize, crypto::PublicKey &publicKey);
-		virtual crypto::Signer* authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter);
-		virtual crypto::Signer* getAttestationSigner();
+		virtual bool authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter, crypto::SignerSlot &signer);
 	};
 }
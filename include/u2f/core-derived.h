@@ -0,0 +1,59 @@
+#pragma once
+
+#include <u2f/core-simple.h>
+#include <u2f/crypto-sha256.h>
+
+/**
+ * First byte of the handles created by DerivedCore
+ */
+#define DERIVED_HANDLE_VERSION 0x01
+
+#define DERIVED_NONCE_SIZE 16
+#define DERIVED_TAG_SIZE 16
+
+/**
+ * [version, nonce, tag]
+ */
+#define DERIVED_HANDLE_SIZE (1 + DERIVED_NONCE_SIZE + DERIVED_TAG_SIZE)
+
+namespace u2f {
+
+	/**
+	 * A stateless U2F core which stores nothing but a random nonce in the handle:
+	 * The private key is derived again from it on every authentication, instead of being encrypted.
+	 *
+	 * Handles are [DERIVED_HANDLE_VERSION, nonce, tag], where, with keys derived from the password:
+	 * - privateKey = HMAC-SHA256(derivationKey, [version, applicationHash, nonce])
+	 * - tag = HMAC-SHA256(macKey, [version, applicationHash, nonce]), truncated to DERIVED_TAG_SIZE bytes
+	 *
+	 * Handles are half the size of StatelessCore's, and checking one only takes the tag, which is 2 SHA-256 compressions.
+	 * authCounter is the timestamp, like StatelessCore.
+	 */
+	class DerivedCore : public SimpleCore {
+		crypto::HmacSha256 derivationKey;
+		crypto::HmacSha256 macKey;
+
+		void computeTag(const crypto::Hash &applicationHash, const uint8_t* nonce, uint8_t tag[DERIVED_TAG_SIZE]) const;
+		void derivePrivateKey(const crypto::Hash &applicationHash, const uint8_t* nonce, crypto::PrivateKey &privateKey) const;
+		bool checkHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize) const;
+
+	public:
+		DerivedCore(const char* password);
+
+		/**
+		 * Draws nonces until the derived private key is valid, which fails with negligible probability
+		 */
+		virtual bool createKeyPair(const crypto::Hash &applicationHash, Handle &handle, uint8_t &handleSize, crypto::PublicKey &publicKey);
+
+		/**
+		 * Always fails: Private keys come from the handles, so an arbitrary one can't be mapped
+		 */
+		virtual bool createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize);
+		virtual bool fetchHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter);
+
+		/**
+		 * Only checks the tag of each handle, without deriving its private key
+		 */
+		virtual void checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]);
+	};
+}
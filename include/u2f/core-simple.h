@@ -50,9 +50,28 @@ namespace u2f {
 		 */
 		virtual bool fetchHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter) = 0;
 
+		/**
+		 * Creates the keypair of a new registration, and its handle.
+		 *
+		 * The default implementation takes a random keypair, and maps it with createHandle().
+		 * Override it when the private key is derived from the handle instead.
+		 *
+		 * @param[in]  applicationHash Hash of the application the will own the new key
+		 * @param[out] handle The new handle that will be created
+		 * @param[out] handleSize Size of #handle
+		 * @param[out] publicKey The public key of the new keypair
+		 *
+		 * @return true if a new keypair and its handle were created successfully.
+		 */
+		virtual bool createKeyPair(const crypto::Hash &applicationHash, Handle &handle, uint8_t &handleSize, crypto::PublicKey &publicKey);
+
 
 		virtual bool enroll(const crypto::Hash &applicationHash, Handle &handle, uint8_t &handleSize, crypto::PublicKey &publicKey);
-		virtual crypto::Signer* authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter);
-		virtual crypto::Signer* getAttestationSigner();
+		virtual bool authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter, crypto::SignerSlot &signer);
+
+		/**
+		 * Calls fetchHandle() on each handle.
+		 */
+		virtual void checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]);
 	};
 }
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <u2f/core-simple.h>
+#include <u2f/handle-filter.h>
 #include <sqlite3.h>
+#include <mutex>
 
 namespace u2f {
 
@@ -13,14 +15,46 @@ namespace u2f {
 	 * - The authentication counter is applied per-key.
 	 *
 	 * On the other handm, it requires a reasonable amount of storage and is therefore not suitable for tiny embedded systems.
+	 *
+	 * It is safe to use from multiple threads: Database access is serialized, everything else runs concurrently.
+	 *
+	 * Handles that are definitely not in the database are rejected by a HandleFilter, without querying the table.
+	 * Other connections may write to the database too, such as another process sharing it:
+	 * Before a handle is rejected, the filter is rebuilt if the database has changed since it was loaded (See PRAGMA data_version).
 	 */
 	class SQLiteCore : public SimpleCore {
 		sqlite3 *db;
+		std::mutex dbMutex;
+		HandleFilter filter;
+		sqlite3_stmt *dataVersionStmt;
+		int64_t dataVersion;  // Of the database when the filter was loaded
+
+		/**
+		 * Reads PRAGMA data_version, which changes whenever another connection commits.
+		 *
+		 * @return -1 on failure
+		 */
+		int64_t readDataVersion();
+
+		/**
+		 * Rebuilds the filter if another connection has changed the database since it was loaded. Called with dbMutex held.
+		 *
+		 * @return true if it was rebuilt
+		 */
+		bool refreshFilter();
+
+		void loadFilter();
+
 	public:
 		SQLiteCore(const char* filename);
 		~SQLiteCore();
 
 		virtual bool createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize);
 		virtual bool fetchHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter);
+
+		/**
+		 * Looks up all handles that pass the filter with a single query, without incrementing their counters.
+		 */
+		virtual void checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]);
 	};
 }
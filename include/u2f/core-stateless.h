@@ -1,8 +1,29 @@
 #pragma once
 
 #include <u2f/core-simple.h>
+#include <u2f/crypto-aes.h>
 #include <sqlite3.h>
 
+/**
+ * First byte of the handles created by StatelessCore
+ */
+#define STATELESS_HANDLE_VERSION 0x01
+
+/**
+ * Size of the AES-CMAC tag at the end of a handle, untruncated
+ */
+#define STATELESS_TAG_SIZE AES256_BLOCK_SIZE
+
+/**
+ * [version, AES-CBC(privateKey), tag]
+ */
+#define STATELESS_HANDLE_SIZE (1 + sizeof(u2f::crypto::PrivateKey) + STATELESS_TAG_SIZE)
+
+/**
+ * AES-CBC([privateKey, applicationHash]), created before handles were versioned
+ */
+#define STATELESS_LEGACY_HANDLE_SIZE (sizeof(u2f::crypto::PrivateKey) + sizeof(u2f::crypto::Hash))
+
 namespace u2f {
 
 	/**
@@ -10,14 +31,51 @@ namespace u2f {
 	 *
 	 * Unlike it, though,
 	 * in the handle, but properly uses encryption.
+	 *
+	 * Handles are encrypted, then authenticated (Encrypt-then-MAC): [STATELESS_HANDLE_VERSION, AES-CBC(privateKey), tag],
+	 * where the tag is the AES-CMAC of [applicationHash, AES-CBC(privateKey)]. Both keys are derived from the password.
+	 * The tag is checked before anything is decrypted, so handles from other authenticators are rejected after 4 AES blocks,
+	 * and only 2 of them once the applicationHash is known, as in checkHandles().
+	 *
+	 * Legacy handles, AES-CBC([privateKey, applicationHash]) with the password's key, are still accepted unless disabled.
 	 */
 	class StatelessCore : public SimpleCore {
-		uint32_t aesKey[60];
+		crypto::Aes256 encryptionKey;
+		crypto::Aes256 macKey;
+		uint8_t macSubkey[AES256_BLOCK_SIZE];  // K1 of AES-CMAC
+		crypto::Aes256 legacyKey;
+		bool acceptLegacyHandles;
+
+		/**
+		 * AES-CMAC state after the applicationHash, which is the first half of the message
+		 */
+		void startTag(const crypto::Hash &applicationHash, uint8_t state[AES256_BLOCK_SIZE]) const;
+
+		/**
+		 * Completes the AES-CMAC with the encrypted private key of a handle
+		 */
+		void finishTag(const uint8_t state[AES256_BLOCK_SIZE], const uint8_t* ciphertext, uint8_t tag[STATELESS_TAG_SIZE]) const;
+
+		bool fetchLegacyHandle(const crypto::Hash &applicationHash, const Handle &handle, crypto::PrivateKey &privateKey);
 
 	public:
-		StatelessCore(const char* password);
+		/**
+		 * @param[in] password Secret from which the keys are derived
+		 * @param[in] acceptLegacyHandles Whether handles created before versioning are accepted.
+		 *            Disable it once every credential has been registered again, so that they are rejected without being decrypted.
+		 */
+		StatelessCore(const char* password, bool acceptLegacyHandles = true);
+
+		virtual ~StatelessCore();
 
 		virtual bool createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize);
 		virtual bool fetchHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter);
+
+		/**
+		 * Only checks the tag of each handle, starting from the AES-CMAC state after the applicationHash, which is computed once.
+		 * The tags of many handles are computed at once, so that their AES rounds overlap.
+		 * Legacy handles only have their applicationHash half decrypted, the blocks of many handles at once so that their AES rounds overlap.
+		 */
+		virtual void checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]);
 	};
 }
@@ -1,21 +1,125 @@
 #pragma once
 
 #include <u2f/crypto.h>
+#include <u2f/crypto-signer-slot.h>
+#include <u2f/stats.h>
+#include <u2f/trace.h>
+#include <u2f/key-pool.h>
+#include <atomic>
+
+/**
+ * Largest raw APDU response: 65536 bytes of data (Le=0) plus the 2-byte status word.
+ */
+#define U2F_MAX_RESPONSE_SIZE (0x10000 + 2)
 
 namespace u2f {
 	typedef uint8_t Handle[255];
 
+	/**
+	 * A raw APDU processed up to its signature, so that the signatures of many requests can be computed together.
+	 *
+	 * See Core::beginRawAdpu().
+	 */
+	struct DeferredAdpu {
+		uint8_t* rawResponse;
+		uint32_t responseSize;           // Without the signature and the status word
+		uint16_t sw;
+		crypto::SignerSlot signer;       // Empty if there's nothing to sign
+		crypto::Hash messageHash;        // What #signer must sign
+		bool signatureValid;             // Set by Core::signDeferred()
+		trace::Recorder* recorder;
+		stats::Instruction instruction;
+		uint64_t startedAt;
+	};
+
 	class Core {
 	private:
-		uint16_t processRequest(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize);
-		uint16_t processRegisterRequest(const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize);
-		uint16_t processAuthenticationRequest(uint8_t control, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize);
+		std::atomic<stats::Collector*> statsCollector{nullptr};
+		std::atomic<crypto::Signer*> attestationSigner{nullptr};
+		std::atomic<trace::Recorder*> traceRecorder{nullptr};
+		std::atomic<KeyPool*> keyPool{nullptr};
+
+		bool parseRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, uint8_t &cla, uint8_t &ins, uint8_t &p1, uint8_t &p2, const uint8_t *&request, uint32_t &requestSize, uint32_t &responseSize);
+		uint16_t processRequest(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize, DeferredAdpu &deferred);
+		uint16_t processRegisterRequest(const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize, DeferredAdpu &deferred);
+		uint16_t processAuthenticationRequest(uint8_t control, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize, DeferredAdpu &deferred);
 	public:
+		virtual ~Core() { }
+
+		/**
+		 * Processes a raw APDU, allocating a response buffer sized after the request's Le.
+		 *
+		 * @param[in]  rawRequest The raw APDU request
+		 * @param[in]  rawRequestSize Size of #rawRequest
+		 * @param[out] rawResponse Will point to the raw APDU response, including the status word. It must be deleted (with delete[]) by the caller.
+		 * @param[out] rawResponseSize Size of #rawResponse
+		 *
+		 * @return false if the APDU could not be parsed.
+		 */
 		virtual bool processRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, const uint8_t *&rawResponse, uint32_t& rawResponseSize);
 
+		/**
+		 * Processes a raw APDU, writing the response into a buffer owned by the caller.
+		 *
+		 * Transports should keep one such buffer around and reuse it for every request,
+		 * so that no memory has to be allocated per request.
+		 *
+		 * @param[in]  rawRequest The raw APDU request
+		 * @param[in]  rawRequestSize Size of #rawRequest
+		 * @param[out] rawResponse Buffer where the raw APDU response, including the status word, will be written.
+		 * @param[in]  rawResponseCapacity Size of #rawResponse. Responses larger than this fail with SW_WRONG_LENGTH.
+		 * @param[out] rawResponseSize Size of the response written to #rawResponse
+		 *
+		 * @return false if the APDU could not be parsed.
+		 */
+		virtual bool processRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, uint8_t *rawResponse, uint32_t rawResponseCapacity, uint32_t& rawResponseSize);
+
+		/**
+		 * Processes a raw APDU like processRawAdpu(), except for its signature.
+		 *
+		 * When many requests are pending, process each of them with beginRawAdpu(), sign all of them at once with signDeferred(),
+		 * and then complete each response with finishRawAdpu(). The requests may belong to different cores.
+		 *
+		 * @param[in]  rawRequest The raw APDU request. It must stay valid until finishRawAdpu().
+		 * @param[in]  rawRequestSize Size of #rawRequest
+		 * @param[out] rawResponse Buffer where the raw APDU response will be written.
+		 * @param[in]  rawResponseCapacity Size of #rawResponse.
+		 * @param[out] deferred The pending response, to be passed to signDeferred() and finishRawAdpu().
+		 *
+		 * @return false if the APDU could not be parsed. Then there's nothing to finish.
+		 */
+		bool beginRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, uint8_t *rawResponse, uint32_t rawResponseCapacity, DeferredAdpu &deferred);
+
+		/**
+		 * Computes the signatures of many requests started with beginRawAdpu(), with Signer::signBatch().
+		 */
+		static void signDeferred(uint32_t count, DeferredAdpu* const deferred[]);
+
+		/**
+		 * Completes a response started with beginRawAdpu(), once signDeferred() has been called.
+		 *
+		 * @param[in]  deferred The pending response
+		 * @param[out] rawResponseSize Size of the complete raw APDU response
+		 */
+		void finishRawAdpu(DeferredAdpu &deferred, uint32_t& rawResponseSize);
+
 		virtual bool supportsWink();
 		virtual void wink();
 
+		/**
+		 * Returns the latency statistics shared by all cores of the same type.
+		 *
+		 * @return nullptr unless compiled with U2F_STATS.
+		 */
+		stats::Collector* getStats();
+
+		/**
+		 * Records every raw APDU request and response into #recorder, or stops recording if nullptr.
+		 *
+		 * The recorder is not owned by the core, and must outlive it (or be unset before being destroyed).
+		 */
+		void setTraceRecorder(trace::Recorder* recorder);
+
 		/**
 		 * Creates a new handle.
 		 *
@@ -37,17 +141,69 @@ namespace u2f {
 		 * @param[in]  checkUserPresence If #userPresent should be populated.
 		 * @param[out] userPresent Indicates if the the user is present. (Only set if the handle is valid and #checkUserPresence is set)
 		 * @param[out] authCounter Monotonic counter of the number of times this handler (or this device) has been used. (Only set if the handle is valid)
+		 * @param[out] signer Will hold the signer used to sign the authentication requests. (Only set if the handle is valid)
+		 *                    Construct it in place with SignerSlot::emplace(), so that no memory is allocated and the key is wiped afterwards.
+		 *
+		 * @return false if the handle is invalid.
+		 */
+		virtual bool authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter, crypto::SignerSlot &signer) = 0;
+
+		/**
+		 * Checks which of many handles belong to this core, like a check-only authentication of each of them.
+		 *
+		 * Relying parties often have many credentials registered for the same user, and only one of them belongs to this token.
+		 * Cores should override this to look them up all at once.
+		 * The default implementation calls authenticate() on each handle, without checking for user presence.
 		 *
-		 * @return nullptr if the handle is invalid, or the the signer used to sign the authentication requests. It must be deleted by the caller.
+		 * @param[in]  applicationHash Identifies the application.
+		 * @param[in]  count Number of handles
+		 * @param[in]  handles The handles to check
+		 * @param[in]  handleSizes Size of each handle
+		 * @param[out] owned Will be set to true for each handle that is valid for #applicationHash
 		 */
-		virtual crypto::Signer* authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter) = 0;
+		virtual void checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]);
 
 		/**
 		 * Returns the signer used for attestation of the registration.
 		 *
-		 * @return The signer used to attestate the registration. It must be deleted by the caller.
+		 * The default implementation returns the signer set with setAttestationSigner(), or crypto::AttestationSigner::getDefault().
+		 *
+		 * @return The signer used to attestate the registration. It is reused for every registration and must not be deleted by the caller.
+		 */
+		virtual crypto::Signer* getAttestationSigner();
+
+		/**
+		 * Sets the signer used for attestation of the registration, e.g., one created with crypto::AttestationSigner::fromFile().
+		 *
+		 * The signer is not owned by the core, and must outlive it.
+		 *
+		 * @param[in] signer The attestation signer, or nullptr to use the built-in one.
+		 */
+		void setAttestationSigner(crypto::Signer* signer);
+
+		/**
+		 * Returns the pool new keypairs are taken from.
+		 *
+		 * The default implementation returns the pool set with setKeyPool().
+		 *
+		 * @return The pool, or nullptr to generate keypairs inline.
+		 */
+		virtual KeyPool* getKeyPool();
+
+		/**
+		 * Takes the keypairs of new handles from #pool instead of generating them during the registration.
+		 *
+		 * The pool is not owned by the core, and must outlive it. It may be shared by many cores.
+		 *
+		 * @param[in] pool The keypair pool, or nullptr to generate keypairs inline.
+		 */
+		void setKeyPool(KeyPool* pool);
+
+	protected:
+		/**
+		 * Creates the keypair of a new handle, taking it from getKeyPool() if there is one.
 		 */
-		virtual crypto::Signer* getAttestationSigner() = 0;
+		bool makeKeyPair(crypto::PublicKey &publicKey, crypto::PrivateKey &privateKey);
 	};
 
 	class Protocol {
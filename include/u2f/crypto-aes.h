@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AES256_KEY_SIZE 32
+#define AES256_BLOCK_SIZE 16
+#define AES256_ROUNDS 14
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Key schedule of Aes256, in the layout of the implementation in use
+		 */
+		struct AesSchedule {
+			alignas(16) uint8_t encrypt[AES256_ROUNDS + 1][AES256_BLOCK_SIZE];  // Round keys for the AES instructions
+			alignas(16) uint8_t decrypt[AES256_ROUNDS + 1][AES256_BLOCK_SIZE];  // Same, for the equivalent inverse cipher
+			uint32_t words[60];                                                 // crypto-algorithms' key schedule
+		};
+
+		/**
+		 * AES-256 with a fixed key, for wrapping key handles.
+		 *
+		 * Blocks are processed with the fastest implementation supported by the CPU, picked once at runtime:
+		 * AES-NI on x86, the ARMv8 crypto extensions on AArch64, or crypto-algorithms' portable tables everywhere else.
+		 * The hardware implementations run in constant time, and keep several independent blocks in flight
+		 * in decryptCbc(), decryptBlocks() and encryptCbcBatch(), so that their latencies overlap.
+		 *
+		 * The key schedule is wiped on destruction.
+		 */
+		class Aes256 {
+			AesSchedule schedule;
+
+		public:
+			Aes256();
+
+			explicit Aes256(const uint8_t key[AES256_KEY_SIZE]);
+
+			~Aes256();
+
+			Aes256(const Aes256&) = delete;
+			Aes256& operator=(const Aes256&) = delete;
+
+			void setKey(const uint8_t key[AES256_KEY_SIZE]);
+
+			/**
+			 * @param[in]  in Plaintext, a multiple of AES256_BLOCK_SIZE bytes
+			 * @param[out] out Ciphertext, same size. It may be #in.
+			 */
+			void encryptCbc(const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) const;
+
+			/**
+			 * Encrypts many independent messages of the same size with CBC, e.g. to compute the CBC-MAC of many handles.
+			 *
+			 * @param[in]  in Plaintext of each, #size bytes, a multiple of AES256_BLOCK_SIZE
+			 * @param[out] out Ciphertext of each. It may be the same as its plaintext.
+			 * @param[in]  iv IV of each
+			 */
+			void encryptCbcBatch(uint32_t count, const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]) const;
+
+			/**
+			 * @param[in]  in Ciphertext, a multiple of AES256_BLOCK_SIZE bytes
+			 * @param[out] out Plaintext, same size. It must not overlap #in.
+			 */
+			void decryptCbc(const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) const;
+
+			/**
+			 * Decrypts many independent blocks (ECB), e.g. one block from each of many handles.
+			 *
+			 * @param[in]  in Ciphertext block of each
+			 * @param[out] out Plaintext block of each. They must not overlap #in.
+			 */
+			void decryptBlocks(uint32_t count, const uint8_t* const in[], uint8_t* const out[]) const;
+
+			/**
+			 * @return The name of the implementation in use, e.g. "aes-ni", "armv8-ce" or "portable"
+			 */
+			static const char* getImplementationName();
+		};
+	};
+}
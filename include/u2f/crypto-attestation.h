@@ -0,0 +1,62 @@
+#pragma once
+
+#include <u2f/crypto.h>
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Signer used for attestation of registrations.
+		 *
+		 * The private key and the DER certificate are loaded (and validated) once, and the same instance is shared by every registration,
+		 * so nothing is allocated or parsed per request.
+		 *
+		 * Keys can be 32-byte raw private keys or SEC1 "EC PRIVATE KEY" structures, and certificates can be DER or PEM.
+		 * PEM inputs are decoded to DER at load time.
+		 *
+		 * Instances are immutable and safe to use from multiple threads.
+		 */
+		class AttestationSigner : public Signer {
+			PrivateKey privateKey;
+			PublicKey publicKey;
+			uint8_t *certificate;
+			uint16_t certificateSize;
+
+			AttestationSigner(const PrivateKey &privateKey, const PublicKey &publicKey, const uint8_t *certificate, uint16_t certificateSize);
+
+		public:
+			virtual ~AttestationSigner();
+
+			/**
+			 * Loads the attestation key and certificate from files.
+			 *
+			 * @return The new signer, or nullptr if the files cannot be read or parsed. It must be deleted by the caller.
+			 */
+			static AttestationSigner* fromFile(const char* privateKeyFilename, const char* certificateFilename);
+
+			/**
+			 * Loads the attestation key and certificate from memory. The buffers are copied.
+			 *
+			 * @return The new signer, or nullptr if the buffers cannot be parsed. It must be deleted by the caller.
+			 */
+			static AttestationSigner* fromMemory(const uint8_t *privateKey, uint32_t privateKeySize, const uint8_t *certificate, uint32_t certificateSize);
+
+			/**
+			 * Returns the built-in attestation signer, which uses a well-known key and a self-signed certificate.
+			 *
+			 * It is only meant for testing: Relying parties that check the attestation will reject it.
+			 */
+			static AttestationSigner* getDefault();
+
+			inline const PublicKey& getPublicKey() const {
+				return publicKey;
+			}
+
+			virtual bool sign(const Hash &messageHash, Signature &signature);
+
+			virtual bool getCertificate(const uint8_t *&certificate, uint16_t &certificateSize);
+
+		protected:
+			virtual const PrivateKey* getBatchKey();
+		};
+	};
+}
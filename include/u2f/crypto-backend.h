@@ -0,0 +1,84 @@
+#pragma once
+
+#include <u2f/crypto.h>
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Implementation of the P-256 operations behind crypto::makeKeyPair() and crypto::sign().
+		 *
+		 * Built-in backends:
+		 * - "native": crypto::p256, with deterministic (RFC6979) nonces
+		 * - "micro-ecc": micro-ecc, with deterministic (RFC6979) nonces. Signatures are the same as "native".
+		 * - "openssl": libcrypto's EVP interface, with random nonces. Only available when compiled with U2F_CRYPTO_OPENSSL.
+		 *   Each thread keeps the last few keys it signed with imported, since importing one costs as much as a signature.
+		 *
+		 * The default is "openssl" when available, or "native" otherwise. Define U2F_CRYPTO_DEFAULT_BACKEND to pick another one at compile time,
+		 * or call setBackend() at startup.
+		 *
+		 * Backends are safe to use from multiple threads.
+		 */
+		class Backend {
+		public:
+			virtual ~Backend() { }
+
+			virtual const char* getName() const = 0;
+
+			/**
+			 * Creates a new keypair.
+			 *
+			 * @param[out] publicKey Uncompressed point: 0x04, X, Y
+			 * @param[out] privateKey Big-endian scalar
+			 */
+			virtual bool makeKeyPair(PublicKey &publicKey, PrivateKey &privateKey) = 0;
+
+			/**
+			 * Computes an ECDSA signature.
+			 *
+			 * @param[in]  privateKey Big-endian scalar
+			 * @param[in]  messageHash Hash of the message
+			 * @param[out] rawSignature r and s, big-endian
+			 */
+			virtual bool sign(const PrivateKey &privateKey, const Hash &messageHash, uint8_t rawSignature[64]) = 0;
+
+			/**
+			 * Computes many ECDSA signatures at once, each with its own key.
+			 *
+			 * The default implementation calls sign() for each of them.
+			 *
+			 * @param[in]  count Number of signatures
+			 * @param[in]  privateKeys Key of each signature
+			 * @param[in]  messageHashes Hash of each message
+			 * @param[out] rawSignatures r and s of each signature, big-endian
+			 * @param[out] success Whether each signature succeeded
+			 */
+			virtual void signBatch(uint32_t count, const PrivateKey* const privateKeys[], const Hash* const messageHashes[], uint8_t rawSignatures[][64], bool success[]);
+		};
+
+		/**
+		 * @return The backend used by crypto::makeKeyPair() and crypto::sign()
+		 */
+		Backend* getBackend();
+
+		/**
+		 * Changes the backend used by crypto::makeKeyPair() and crypto::sign().
+		 *
+		 * It should be called at startup, but it is safe to call at any time.
+		 *
+		 * @param[in] backend The new backend, or nullptr to restore the default one. It must never be destroyed.
+		 */
+		void setBackend(Backend* backend);
+
+		/**
+		 * @return The built-in backend with the specified name, or nullptr if unknown or not compiled in.
+		 */
+		Backend* findBackend(const char* name);
+
+		/**
+		 * Lists the built-in backends.
+		 *
+		 * @return The backend at #index, or nullptr past the last one.
+		 */
+		Backend* listBackends(unsigned index);
+	};
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <u2f/crypto.h>
+#include <u2f/prefill-pool.h>
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Offline/online ECDSA: Nonces are drawn from the RNG and their k·G and k⁻¹ are computed ahead of time,
+		 * so a signature only takes two multiplications modulo n.
+		 *
+		 * Once set with setNoncePool(), crypto::sign() (And so SimpleSigner and AttestationSigner) takes its nonces from the pool,
+		 * regardless of the crypto::Backend, and falls back to the backend when the pool is empty.
+		 * Signatures then use random nonces instead of RFC6979 ones, so they are no longer deterministic.
+		 *
+		 * Every nonce is used exactly once: It is wiped from the pool when taken.
+		 */
+		class NoncePool : public PrefillPool {
+			struct Nonce {
+				uint8_t r[32];
+				uint8_t kInverse[32];
+			};
+
+		protected:
+			virtual bool generate(void* item);
+
+		public:
+			/**
+			 * @param[in] depth Maximum number of nonces kept. It is rounded up to a power of 2.
+			 * @param[in] lowWatermark The pool is refilled when it has this many nonces or less. Defaults to a quarter of #depth.
+			 * @param[in] highWatermark The pool is refilled up to this many nonces. Defaults to #depth.
+			 */
+			NoncePool(uint32_t depth = 256, uint32_t lowWatermark = UINT32_MAX, uint32_t highWatermark = UINT32_MAX);
+
+			virtual ~NoncePool();
+
+			/**
+			 * Computes an ECDSA signature with a nonce from the pool.
+			 *
+			 * @param[in]  privateKey Big-endian scalar
+			 * @param[in]  messageHash Hash of the message
+			 * @param[out] rawSignature r and s, big-endian
+			 *
+			 * @return false if the pool is empty (or, with negligible probability, the nonce didn't work for this message)
+			 */
+			bool sign(const PrivateKey &privateKey, const Hash &messageHash, uint8_t rawSignature[64]);
+		};
+
+		/**
+		 * Makes crypto::sign() use precomputed nonces from #pool, or go back to the backend's signatures if nullptr.
+		 *
+		 * The pool is not owned, and must outlive its use.
+		 */
+		void setNoncePool(NoncePool* pool);
+
+		NoncePool* getNoncePool();
+	};
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <u2f/crypto.h>
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * NIST P-256 (secp256r1) operations with the private key.
+		 *
+		 * Both key generation and signing are dominated by k·G. It is computed with a fixed-base comb:
+		 * Multiples of the generator for every 4-bit window of the scalar are precomputed once (About 33KB, built on first use),
+		 * so k·G only takes 65 point additions and no doublings.
+		 *
+		 * Table lookups scan every entry of a window, so memory access patterns don't depend on secret scalars.
+		 *
+		 * Field and scalar arithmetic use 64-bit limbs when the compiler has 128-bit integers (x86-64, AArch64), with field elements
+		 * in the Montgomery domain, and 32-bit limbs with the NIST fast reduction otherwise. On x86-64 CPUs with BMI2 and ADX,
+		 * products use MULX and two interleaved carry chains, detected at startup.
+		 */
+		namespace p256 {
+			/**
+			 * @return The name of the arithmetic in use, e.g. "64-bit mulx", "64-bit" or "32-bit"
+			 */
+			const char* getImplementationName();
+
+			/**
+			 * Computes the public key of a private key.
+			 *
+			 * @param[in]  privateKey Big-endian scalar
+			 * @param[out] publicKey Uncompressed point: 0x04, X, Y
+			 *
+			 * @return false if the private key is not in [1, n-1]
+			 */
+			bool computePublicKey(const PrivateKey &privateKey, PublicKey &publicKey);
+
+			/**
+			 * Computes an ECDSA signature with the specified nonce.
+			 *
+			 * @param[in]  privateKey Big-endian scalar
+			 * @param[in]  messageHash Hash of the message
+			 * @param[in]  k Big-endian nonce. It must be secret and never reused with another message.
+			 * @param[out] rawSignature r and s, big-endian
+			 *
+			 * @return false if #k or #privateKey is out of range, or r or s would be zero. A new nonce must be used.
+			 */
+			bool sign(const PrivateKey &privateKey, const Hash &messageHash, const uint8_t k[32], uint8_t rawSignature[64]);
+
+			/**
+			 * Offline half of sign(): Computes everything that depends only on the nonce, i.e., k·G and the inverse of k.
+			 *
+			 * @param[in]  k Big-endian nonce. It must be secret and only used for one signature.
+			 * @param[out] r x(k·G) mod n, big-endian
+			 * @param[out] kInverse k⁻¹ mod n, big-endian. It is as secret as #k.
+			 *
+			 * @return false if #k is out of range or r would be zero. A new nonce must be used.
+			 */
+			bool makeNonce(const uint8_t k[32], uint8_t r[32], uint8_t kInverse[32]);
+
+			/**
+			 * makeNonce() for many nonces at once.
+			 *
+			 * The scalar multiplications are interleaved, and the inversions (Of k and of each point's Z coordinate) are shared
+			 * with Montgomery's trick, so each nonce costs about a third less than with makeNonce().
+			 *
+			 * @param[out] success Set to false for each nonce that makeNonce() would have rejected
+			 */
+			void makeNonceBatch(uint32_t count, const uint8_t k[][32], uint8_t r[][32], uint8_t kInverse[][32], bool success[]);
+
+			/**
+			 * Online half of sign(): Only two multiplications modulo n.
+			 *
+			 * @param[in]  privateKey Big-endian scalar
+			 * @param[in]  messageHash Hash of the message
+			 * @param[in]  r From makeNonce()
+			 * @param[in]  kInverse From makeNonce(). It must never be used again.
+			 * @param[out] rawSignature r and s, big-endian
+			 *
+			 * @return false if #privateKey is out of range, or s would be zero. A new nonce must be used.
+			 */
+			bool signWithNonce(const PrivateKey &privateKey, const Hash &messageHash, const uint8_t r[32], const uint8_t kInverse[32], uint8_t rawSignature[64]);
+		};
+	};
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <u2f/crypto.h>
+#include <stddef.h>
+
+/**
+ * Bytes generated by a thread before it reseeds from the operating system
+ */
+#define RANDOM_RESEED_INTERVAL (1024 * 1024)
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Fills #data with cryptographically secure random bytes.
+		 *
+		 * Each thread runs its own ChaCha20 generator, seeded from getrandom() on first use, every RANDOM_RESEED_INTERVAL bytes,
+		 * and in the child after a fork, so that most calls take neither a system call nor a lock.
+		 * The key is replaced by the generator's own output every time it produces a buffer (Fast key erasure),
+		 * and bytes are wiped from the buffer as they are handed out, so nothing left in memory reveals past output.
+		 *
+		 * It is registered as micro-ecc's RNG at startup, so key generation (With the native and micro-ecc backends)
+		 * and NoncePool draw from it too, and the cores use it for their random key handles.
+		 *
+		 * @return false if the operating system's generator failed
+		 */
+		bool randomBytes(void* data, size_t size);
+
+		/**
+		 * Makes randomBytes() deterministic, for reproducible benchmarks and tests. NEVER use it in production.
+		 *
+		 * Each thread derives its generator from #seed and the order in which it first draws after this call,
+		 * so runs are repeatable when threads start drawing in the same order. Generators are never reseeded in this mode.
+		 * Keys generated by the OpenSSL backend don't go through randomBytes(), and stay random.
+		 *
+		 * @param[in] seed Any bytes, or nullptr to go back to the operating system's randomness
+		 * @param[in] size Size of #seed
+		 */
+		void setRandomSeed(const void* seed, size_t size);
+	};
+}
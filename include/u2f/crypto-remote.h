@@ -0,0 +1,150 @@
+#pragma once
+
+#include <u2f/crypto.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+/**
+ * Most requests in flight on a connection
+ */
+#define REMOTE_SIGNER_MAX_PENDING 256
+
+/**
+ * Most requests written at once
+ */
+#define REMOTE_SIGNER_MAX_BATCH 32
+
+/**
+ * Longest wait for a response, or for a free slot, before the connection is dropped
+ */
+#define REMOTE_SIGNER_TIMEOUT_MS 5000
+
+// Wire format, see RemoteSigner
+#define REMOTE_SIGNER_REQUEST_SIZE 40
+#define REMOTE_SIGNER_RESPONSE_HEADER_SIZE 8
+#define REMOTE_SIGNER_CMD_SIGN 0x01
+#define REMOTE_SIGNER_CMD_CERTIFICATE 0x02
+#define REMOTE_SIGNER_STATUS_OK 0x00
+#define REMOTE_SIGNER_STATUS_UNKNOWN_KEY 0x01
+#define REMOTE_SIGNER_STATUS_FAILED 0x02
+#define REMOTE_SIGNER_STATUS_BUSY 0x03
+#define REMOTE_SIGNER_STATUS_INVALID 0x04
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Signer whose private key lives in another process, the signing daemon (See tools/signer-daemon.cpp),
+		 * reached through a Unix domain socket. The process handling the transport never sees the key.
+		 *
+		 * Requests are pipelined: Any number of threads can sign at the same time over the same connection,
+		 * up to REMOTE_SIGNER_MAX_PENDING requests in flight, and responses are matched back by their id.
+		 * Signer::signBatch() writes all of its requests at once and then waits for all of them,
+		 * so that a batch costs a single round trip, and the daemon can sign them together.
+		 *
+		 * If the daemon goes away, pending signatures fail, and the next one reconnects.
+		 * So does a daemon that stops answering for REMOTE_SIGNER_TIMEOUT_MS: Its connection is dropped,
+		 * so that late responses can't be mistaken for those of the requests that come next.
+		 *
+		 * Every integer is big-endian. Requests are REMOTE_SIGNER_REQUEST_SIZE bytes:
+		 * - id (4 bytes): Chosen by the client, echoed in the response
+		 * - command (1 byte): REMOTE_SIGNER_CMD_SIGN or REMOTE_SIGNER_CMD_CERTIFICATE
+		 * - key (1 byte): Index of the key in the daemon
+		 * - reserved (2 bytes): 0
+		 * - hash (32 bytes): Hash to sign, or 0 for REMOTE_SIGNER_CMD_CERTIFICATE
+		 *
+		 * Responses may come in any order:
+		 * - id (4 bytes)
+		 * - status (1 byte): One of REMOTE_SIGNER_STATUS_*
+		 * - reserved (1 byte): 0
+		 * - size (2 bytes): Size of the data that follows: The DER signature, or the DER certificate (Possibly empty)
+		 */
+		class RemoteSigner : public Signer {
+			enum SlotState {
+				SLOT_FREE,
+				SLOT_WAITING,
+				SLOT_DONE,
+			};
+
+			struct Slot {
+				SlotState state;
+				uint32_t id;
+				Signature* signature;
+				bool success;
+			};
+
+			char* socketPath;
+			uint8_t key;
+			uint8_t* certificate;
+			uint16_t certificateSize;
+
+			std::mutex connectMutex;         // Serializes reconnections
+			std::mutex writeMutex;           // Keeps requests from interleaving on the socket
+			std::mutex mutex;                // Guards everything below
+			std::condition_variable slotChanged;
+			int fd;
+			bool connected;
+			uint32_t generation;             // Incremented on each connection, as fd numbers are reused
+			std::thread* reader;
+			uint32_t nextId;
+			uint32_t nextSlot;
+			uint32_t freeSlots;
+			Slot slots[REMOTE_SIGNER_MAX_PENDING];
+
+			RemoteSigner(const char* socketPath, uint8_t key);
+
+			bool openSocket();
+			bool ensureConnected();
+			bool fetchCertificate();
+			void disconnect();
+			bool writeRequests(uint32_t requestsGeneration, int requestsFd, const uint8_t* requests, uint32_t count);
+
+			/**
+			 * Fails every pending request, and shuts the connection down, so that the next request reconnects.
+			 * Called with #mutex held, when the daemon didn't answer in time.
+			 */
+			void abandonConnection();
+
+			/**
+			 * Writes a request for each hash, up to REMOTE_SIGNER_MAX_BATCH.
+			 * The slots of all of them are taken at once, waiting up to REMOTE_SIGNER_TIMEOUT_MS until enough are free:
+			 * Holding some while waiting for others could deadlock concurrent batches.
+			 *
+			 * @param[out] slotIndexes Slot of each request, or -1 if it couldn't be sent
+			 * @param[in]  wait Whether to wait for free slots. The caller must not hold any slot, on any connection, if so.
+			 *
+			 * @return false if there weren't enough free slots and #wait is false: Nothing was sent.
+			 */
+			bool sendRequests(uint32_t count, const Hash* const messageHashes[], Signature* const signatures[], int32_t slotIndexes[], bool wait);
+
+			/**
+			 * Waits for the responses of sendRequests(), and frees their slots.
+			 * Requests still unanswered after REMOTE_SIGNER_TIMEOUT_MS fail, along with the connection.
+			 */
+			void waitResponses(uint32_t count, const int32_t slotIndexes[], bool success[]);
+
+			static void readerFunc(RemoteSigner* signer, int fd);
+			static void signRemoteBatch(uint32_t count, Signer* const signers[], const Hash* const messageHashes[], Signature* const signatures[], bool success[]);
+
+		public:
+			/**
+			 * Connects to a signing daemon, and fetches the certificate of the key.
+			 *
+			 * @param[in] socketPath Path of the daemon's Unix domain socket
+			 * @param[in] key Index of the key in the daemon
+			 *
+			 * @return The new signer, or nullptr if the daemon can't be reached or doesn't have the key. It must be deleted by the caller.
+			 */
+			static RemoteSigner* connect(const char* socketPath, uint8_t key = 0);
+
+			virtual ~RemoteSigner();
+
+			virtual bool sign(const Hash &messageHash, Signature &signature);
+
+			virtual bool getCertificate(const uint8_t *&certificate, uint16_t &certificateSize);
+
+		protected:
+			virtual BatchFunc getBatchFunc();
+		};
+	};
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <u2f/crypto.h>
+#include <stddef.h>
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Incremental SHA-256.
+		 *
+		 * Blocks are compressed with the fastest implementation supported by the CPU, picked once at runtime:
+		 * The SHA extensions (SHA-NI) on x86, or portable C everywhere else.
+		 *
+		 * It doesn't allocate any memory, so it is cheap to create one per message on the stack.
+		 */
+		class Sha256 {
+			uint32_t state[8];
+			uint8_t buffer[64];
+			uint32_t bufferSize;
+			uint64_t totalSize;
+
+		public:
+			Sha256();
+
+			/**
+			 * Starts a new message, discarding everything hashed so far
+			 */
+			void reset();
+
+			/**
+			 * Appends data to the message
+			 */
+			Sha256& update(const void* data, size_t size);
+
+			/**
+			 * Writes the hash of the message, and starts a new one.
+			 */
+			void finish(Hash &hash);
+
+			/**
+			 * @return The name of the implementation in use, e.g. "sha-ni" or "portable"
+			 */
+			static const char* getImplementationName();
+		};
+
+		/**
+		 * HMAC-SHA256 with a 32-byte key.
+		 *
+		 * The hash states after the padded key blocks are kept, so that further MACs with the same key skip them.
+		 * Copy an initialized one to reuse its key, e.g. from several threads.
+		 */
+		class HmacSha256 {
+			Sha256 innerStart, outerStart;
+			Sha256 inner;
+
+		public:
+			~HmacSha256();
+
+			HmacSha256& init(const Hash &key);
+
+			/**
+			 * Starts a new MAC with the same key
+			 */
+			HmacSha256& restart();
+
+			HmacSha256& update(const void* data, size_t size);
+
+			void finish(Hash &mac);
+		};
+	};
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <u2f/crypto.h>
+#include <stddef.h>
+#include <new>
+#include <utility>
+
+/**
+ * Largest signer that can be constructed in a SignerSlot
+ */
+#define U2F_SIGNER_SLOT_SIZE 128
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * Holds the signer of a request, without allocating memory.
+		 *
+		 * Cores usually construct their signer right in the slot with emplace(). Signers that live elsewhere,
+		 * like a shared attestation signer or one taken from a pool, are borrowed instead, and legacy heap signers adopted.
+		 *
+		 * Releasing the slot, or destroying it, destroys an emplaced signer and wipes its bytes, and deletes an adopted one.
+		 */
+		class SignerSlot {
+			alignas(alignof(max_align_t)) uint8_t storage[U2F_SIGNER_SLOT_SIZE];
+			Signer* signer;
+			enum { NONE, EMPLACED, BORROWED, ADOPTED } ownership;
+
+		public:
+			inline SignerSlot()
+				: signer(nullptr), ownership(NONE)
+			{ }
+
+			inline ~SignerSlot() {
+				release();
+			}
+
+			SignerSlot(const SignerSlot&) = delete;
+			SignerSlot& operator=(const SignerSlot&) = delete;
+
+			/**
+			 * Constructs a signer of type T in the slot, releasing the previous one.
+			 *
+			 * @return The new signer, owned by the slot
+			 */
+			template<class T, class... Args>
+			T* emplace(Args&&... args) {
+				static_assert(sizeof(T) <= U2F_SIGNER_SLOT_SIZE, "Signer too large for SignerSlot, raise U2F_SIGNER_SLOT_SIZE");
+				static_assert(alignof(T) <= alignof(max_align_t), "Signer alignment too large for SignerSlot");
+				release();
+				T* ret = new (storage) T(std::forward<Args>(args)...);
+				signer = ret;
+				ownership = EMPLACED;
+				return ret;
+			}
+
+			/**
+			 * Uses a signer owned by someone else, which must outlive the slot's use of it. The previous one is released.
+			 */
+			void borrow(Signer* signer);
+
+			/**
+			 * Takes ownership of a signer created with new, which will be deleted on release. The previous one is released.
+			 */
+			void adopt(Signer* signer);
+
+			/**
+			 * Destroys or forgets the signer, leaving the slot empty.
+			 */
+			void release();
+
+			/**
+			 * @return The signer, or nullptr if the slot is empty
+			 */
+			inline Signer* get() const {
+				return signer;
+			}
+		};
+	};
+}
@@ -18,9 +18,17 @@ namespace u2f {
 
 			SimpleSigner(const PrivateKey &privateKey, const uint8_t *certificate, uint16_t certificateSize);
 
+			/**
+			 * Wipes the private key
+			 */
+			virtual ~SimpleSigner();
+
 			virtual bool sign(const Hash &messageHash, Signature &signature);
 
 			virtual bool getCertificate(const uint8_t *&certificate, uint16_t &certificateSize);
+
+		protected:
+			virtual const PrivateKey* getBatchKey();
 		};
 	};
 }
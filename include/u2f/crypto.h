@@ -9,9 +9,24 @@ namespace u2f {
 		typedef uint8_t PublicKey[65];
 		typedef uint8_t Signature[73];
 
+		/**
+		 * Hashes a nullptr-terminated list of (const void* buffer, int size) pairs.
+		 *
+		 * Kept for compatibility, crypto::Sha256 is typed and can be fed incrementally.
+		 */
 		void sha256(Hash &hash, ...);
 		bool makeKeyPair(PublicKey &publicKey, PrivateKey &privateKey);
 		bool sign(const PrivateKey &privateKey, const Hash &messageHash, Signature &signature);
+
+		/**
+		 * Computes many signatures at once, each with its own key, like calling sign() on each of them.
+		 *
+		 * Backends can share work between signatures: The native one does a single modular inversion for the whole batch.
+		 *
+		 * @param[out] success Whether each signature succeeded
+		 */
+		void signBatch(uint32_t count, const PrivateKey* const privateKeys[], const Hash* const messageHashes[], Signature* const signatures[], bool success[]);
+
 		uint8_t signatureSize(const Signature &signature);
 
 		/**
@@ -19,10 +34,19 @@ namespace u2f {
 		 *
 		 * This extra indirection layer allows you to be extra-paranoid with your private keys -- Use a crypto-chip and whatnot.
 		 *
-		 * Optionally, you can also retrieve a PEM certificate with the public key.
+		 * Optionally, you can also retrieve a DER certificate with the public key.
 		 */
 		class Signer {
 		public:
+			/**
+			 * Signs many hashes at once with signers of the same kind, e.g., in a single round trip to a remote signer.
+			 *
+			 * See getBatchFunc().
+			 */
+			typedef void (*BatchFunc)(uint32_t count, Signer* const signers[], const Hash* const messageHashes[], Signature* const signatures[], bool success[]);
+
+			virtual ~Signer() { }
+
 			/**
 			* Signs the messageHash with the private key.
 			*
@@ -34,14 +58,47 @@ namespace u2f {
 			virtual bool sign(const Hash &messageHash, Signature &signature) = 0;
 
 			/**
-			* Returns the attestation certificate as a PEM buffer.
+			* Signs many hashes at once, each with its own signer.
+			*
+			* Signers whose private key is in memory (See getBatchKey()) are signed together with crypto::signBatch().
+			* Signers with the same getBatchFunc() are signed together with it. The others are signed one by one.
+			*
+			* @param[in]  count Number of signatures
+			* @param[in]  signers Signer of each hash
+			* @param[in]  messageHashes SHA256 of each message being signed
+			* @param[out] signatures Buffer where each signature will be stored
+			* @param[out] success Whether each signature was successfully created
+			*/
+			static void signBatch(uint32_t count, Signer* const signers[], const Hash* const messageHashes[], Signature* const signatures[], bool success[]);
+
+			/**
+			* Returns the attestation certificate as a DER buffer.
 			*
 			* The buffer is valid until the Signer object is destructed and should not be freed by the caller.
 			*
-			* @param[out] certificate Will point to a buffer with the PEM certificate
+			* @param[out] certificate Will point to a buffer with the DER certificate
 			* @param[out] certificateSize Will be set with the size of #certificate
 			*/
 			virtual bool getCertificate(const uint8_t *&certificate, uint16_t &certificateSize) = 0;
+
+		protected:
+			/**
+			* Returns the private key, if sign() is just crypto::sign() with it, so that signBatch() can batch it with others.
+			*
+			* @return The private key, or nullptr (The default) if signatures must go through sign()
+			*/
+			virtual const PrivateKey* getBatchKey() {
+				return nullptr;
+			}
+
+			/**
+			* Returns the function that signs many hashes at once with this signer and others returning the same function.
+			*
+			* @return The function, or nullptr (The default) if signatures must go through sign()
+			*/
+			virtual BatchFunc getBatchFunc() {
+				return nullptr;
+			}
 		};
 	};
 }
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <u2f/core.h>
+#include <sqlite3.h>
+#include <atomic>
+
+// ~1% false positives
+#define HANDLE_FILTER_BITS_PER_HANDLE 10
+#define HANDLE_FILTER_HASHES 7
+
+#define HANDLE_FILTER_MIN_CAPACITY 1024
+
+namespace u2f {
+
+	/**
+	 * Bloom filter over the (applicationHash, handle) pairs stored in a "Handle" SQLite table.
+	 *
+	 * Browsers probe every handle a relying party knows about, and most of them belong to other authenticators.
+	 * This filter answers "definitely not ours" without touching the database.
+	 *
+	 * Lookups are lock-free. Changes (add and load) must be serialized by the caller, usually with the same lock that guards the database.
+	 *
+	 * The filter only knows the rows it was loaded with, and those given to add(): A row written by another connection
+	 * is rejected until the next load(), which the caller must do when the table may have changed.
+	 */
+	class HandleFilter {
+		struct Bits {
+			std::atomic<uint64_t>* words;
+			uint64_t bitCount;
+			uint32_t capacity;
+			uint32_t count;
+			Bits* next;
+
+			Bits(uint32_t capacity);
+			~Bits();
+		};
+
+		std::atomic<Bits*> bits;
+		Bits* retired;  // Replaced filters, kept until destruction since lookups may still be using them
+		uint64_t seed[2];
+
+		void hash(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, uint64_t &h1, uint64_t &h2) const;
+
+	public:
+		HandleFilter();
+		~HandleFilter();
+
+		/**
+		 * (Re)builds the filter from the applicationHash and handle columns of the Handle table.
+		 *
+		 * The filter is sized for twice as many handles as the table currently has.
+		 *
+		 * @return false if the table couldn't be read. In that case, the filter lets everything through.
+		 */
+		bool load(sqlite3* db);
+
+		/**
+		 * Adds a handle.
+		 *
+		 * @return false if the filter is over capacity and should be rebuilt with load()
+		 */
+		bool add(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize);
+
+		/**
+		 * @return false if the handle is definitely not in the table. Always true if the filter hasn't been loaded.
+		 */
+		bool mightContain(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize) const;
+	};
+}
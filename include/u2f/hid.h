@@ -1,7 +1,13 @@
 #pragma once
 
 #include <u2f/core.h>
+#include <u2f/worker-pool.h>
+#include <u2f/buffer-pool.h>
+#include <u2f/trace.h>
 #include <hiddev/core.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 // FIDO U2F HID Protocol
 // (Abstract and implementation-agnostic)
@@ -9,6 +15,12 @@
 
 #define HID_MAX_PENDING_REQUESTS 10
 
+// Largest message that fits in one initialization packet (57 bytes) + 128 continuation packets (59 bytes each)
+#define HID_MAX_PAYLOAD_SIZE 7609
+
+// Most handles in a single vendor CMD_CHECK_HANDLES request
+#define HID_MAX_CHECK_HANDLES 256
+
 namespace u2f {
 
 	class MultipartHidRequest {
@@ -16,10 +28,12 @@ namespace u2f {
 		uint16_t currentPayloadSize;
 		uint32_t expiresAt;
 	public:
+		uint64_t startedAt;
 		uint32_t cid;
 		uint8_t  cmd;
 		uint8_t* payload;
 		uint16_t payloadSize;
+		BufferPool* buffers;  // If set, payload is only held while a request is in progress
 
 		MultipartHidRequest();
 		~MultipartHidRequest();
@@ -42,15 +56,66 @@ namespace u2f {
 		bool isLocked(uint32_t channel);
 	};
 
+	class Hid;
+
+	/**
+	 * A CMD_MSG (or CMD_CHECK_HANDLES) waiting for (or being processed by) a WorkerPool
+	 */
+	class HidJob {
+	public:
+		Hid* hid;
+		uint32_t cid;
+		uint8_t cmd;
+		bool busy;
+		uint8_t* payload;
+		uint16_t payloadSize;
+
+		HidJob();
+		~HidJob();
+	};
+
 	class Hid : public u2f::Protocol, public hiddev::Device {
 		uint32_t channelIdCount;
 		HidLock lock;
 		MultipartHidRequest multipartRequest[HID_MAX_PENDING_REQUESTS];
+		uint8_t* responseBuffer;
+
+		WorkerPool* pool;
+		BufferPool* buffers;
+		std::mutex sendMutex;
+		std::mutex jobsMutex;
+		std::condition_variable jobFinished;
+		HidJob jobs[HID_MAX_PENDING_REQUESTS];
+
+		std::atomic<trace::Recorder*> traceRecorder{nullptr};
+
+		static void runJobs(void* const jobs[], uint32_t count);
+		void finishJob(HidJob* job);
+		void dispatchMessage(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize);
+		void processMessage(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize, uint8_t* responseBuffer);
+		void processCheckHandles(uint32_t cid, const uint8_t* payload, uint16_t payloadSize, uint8_t* responseBuffer);
 
 	public:
-		inline Hid(Core& core)
-			: Protocol(core)
-		{ }
+		/**
+		 * @param[in] core Core that will process U2F messages
+		 * @param[in] pool If set, CMD_MSG and CMD_CHECK_HANDLES requests are processed in this pool, and requests from different channels run concurrently.
+		 *                 The core must be safe to use from multiple threads.
+		 * @param[in] buffers If set, message buffers are borrowed from this pool only while in use, instead of being kept by each Hid.
+		 *                    Useful when there are many idle devices. Buffers must have at least HID_MAX_PAYLOAD_SIZE bytes.
+		 */
+		Hid(Core& core, WorkerPool* pool = nullptr, BufferPool* buffers = nullptr);
+
+		/**
+		 * Waits for pending CMD_MSG requests to finish
+		 */
+		~Hid();
+
+		/**
+		 * Records every HID report received and sent into #recorder, or stops recording if nullptr.
+		 *
+		 * The recorder is not owned by this object, and must outlive it (or be unset before being destroyed).
+		 */
+		void setTraceRecorder(trace::Recorder* recorder);
 
 		// HID functions
 		void getDescriptor(const uint8_t* &descriptorBuffer, uint16_t &descriptorSize) override;
@@ -60,6 +125,9 @@ namespace u2f {
 
 		// U2F Protocol functions
 		void handleRequest(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize);
+		/**
+		 * Sends a (possibly multi-packet) response. Thread-safe.
+		 */
 		void sendResponse(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize);
 		void sendErrorResponse(uint32_t cid, uint8_t err);
 
@@ -69,5 +137,10 @@ namespace u2f {
 		MultipartHidRequest* getPendingMultipartHidRequest(uint32_t cid);
 		MultipartHidRequest* getFreeMultipartHidRequest();
 
+		/**
+		 * Returns the APDU instruction of CMD_MSG messages, for statistics
+		 */
+		static stats::Instruction getInstruction(uint8_t cmd, const uint8_t* payload, uint16_t payloadSize);
+
 	};
 }
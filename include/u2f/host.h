@@ -0,0 +1,140 @@
+#pragma once
+
+#include <u2f/core-simple.h>
+#include <u2f/hid.h>
+#include <u2f/worker-pool.h>
+#include <u2f/buffer-pool.h>
+#include <sqlite3.h>
+#include <atomic>
+#include <mutex>
+
+// Tokens are allocated in slabs of this many tokens
+#define HOST_SLAB_SIZE 64
+
+namespace u2f {
+	class Host;
+
+	/**
+	 * Core of a token managed by a Host.
+	 *
+	 * Handles are stored in the Host's database along with the token id, so each token only sees its own handles.
+	 */
+	class HostedCore : public SimpleCore {
+		Host& host;
+		uint32_t tokenId;
+
+	public:
+		HostedCore(Host& host, uint32_t tokenId);
+
+		inline uint32_t getTokenId() const {
+			return tokenId;
+		}
+
+		virtual bool createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize);
+		virtual bool fetchHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter);
+		virtual crypto::Signer* getAttestationSigner();
+		virtual KeyPool* getKeyPool();
+	};
+
+	/**
+	 * A virtual authenticator managed by a Host: A core and its HID interface.
+	 *
+	 * Attach #hid to a HID transport to expose the token.
+	 */
+	class HostedToken {
+	public:
+		HostedCore core;
+		Hid hid;
+
+		HostedToken(Host& host, uint32_t id);
+	};
+
+	/**
+	 * Runs many virtual authenticators in a single process.
+	 *
+	 * Everything that can be shared is owned by the host:
+	 * - One WorkerPool processes the messages of every token
+	 * - Message buffers are borrowed from a shared BufferPool only while in use
+	 * - One SQLite connection, with statements prepared once, stores the handles of every token
+	 * - One attestation signer
+	 * - One keypair pool, if set
+	 *
+	 * Each token only keeps its protocol state (channels, locks, pending requests), which takes about a kilobyte,
+	 * and tokens are allocated in slabs of HOST_SLAB_SIZE.
+	 *
+	 * It is safe to use from multiple threads.
+	 */
+	class Host {
+		friend class HostedCore;
+		friend class HostedToken;
+		struct Slab;
+
+		WorkerPool pool;
+		BufferPool buffers;
+
+		sqlite3 *db;
+		std::mutex dbMutex;
+		sqlite3_stmt *insertHandleStatement;
+		sqlite3_stmt *selectHandleStatement;
+		sqlite3_stmt *updateCounterStatement;
+
+		std::atomic<crypto::Signer*> attestationSigner{nullptr};
+		std::atomic<KeyPool*> keyPool{nullptr};
+
+		std::mutex tokensMutex;
+		uint32_t maxTokens;
+		uint32_t tokenCount;
+		Slab **slabs;
+
+		bool createHandle(uint32_t tokenId, const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize);
+		bool fetchHandle(uint32_t tokenId, const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter);
+
+	public:
+		/**
+		 * @param[in] filename SQLite database where the handles of all tokens are stored
+		 * @param[in] maxTokens Token ids must be lower than this
+		 * @param[in] threadCount Threads processing messages. Defaults to the number of CPUs.
+		 */
+		Host(const char* filename, uint32_t maxTokens, int threadCount = 0);
+
+		/**
+		 * Destroys all tokens, waiting for messages still being processed
+		 */
+		~Host();
+
+		/**
+		 * Creates a token.
+		 *
+		 * Handles are kept in the database when tokens are destroyed, so a new token with the same id can use handles created by the old one.
+		 *
+		 * @return The new token, or nullptr if #id is out of range or already in use.
+		 */
+		HostedToken* createToken(uint32_t id);
+
+		/**
+		 * @return The token with the specified id, or nullptr. It is valid until destroyToken() is called.
+		 */
+		HostedToken* getToken(uint32_t id);
+
+		/**
+		 * Destroys a token, waiting for its messages still being processed.
+		 */
+		void destroyToken(uint32_t id);
+
+		uint32_t getTokenCount();
+
+		/**
+		 * Sets the attestation signer used by every token, or nullptr to use the built-in one.
+		 *
+		 * The signer is not owned by the host, and must outlive it.
+		 */
+		void setAttestationSigner(crypto::Signer* signer);
+
+		/**
+		 * Sets the keypair pool used by every token, or nullptr to generate keypairs inline.
+		 *
+		 * The pool is not owned by the host, and must outlive it.
+		 */
+		void setKeyPool(KeyPool* pool);
+	};
+}
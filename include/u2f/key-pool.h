@@ -0,0 +1,39 @@
+#pragma once
+
+#include <u2f/crypto.h>
+#include <u2f/prefill-pool.h>
+
+namespace u2f {
+
+	/**
+	 * Bounded pool of keypairs generated ahead of time, so registrations don't have to wait for a key generation.
+	 *
+	 * When a burst empties the pool, keypairs are generated inline.
+	 */
+	class KeyPool : public PrefillPool {
+		struct KeyPair {
+			crypto::PublicKey publicKey;
+			crypto::PrivateKey privateKey;
+		};
+
+	protected:
+		virtual bool generate(void* item);
+
+	public:
+		/**
+		 * @param[in] depth Maximum number of keypairs kept. It is rounded up to a power of 2.
+		 * @param[in] lowWatermark The pool is refilled when it has this many keypairs or less. Defaults to a quarter of #depth.
+		 * @param[in] highWatermark The pool is refilled up to this many keypairs. Defaults to #depth.
+		 */
+		KeyPool(uint32_t depth = 64, uint32_t lowWatermark = UINT32_MAX, uint32_t highWatermark = UINT32_MAX);
+
+		virtual ~KeyPool();
+
+		/**
+		 * Takes a keypair from the pool, or generates one with crypto::makeKeyPair() if it is empty.
+		 *
+		 * @return false if a keypair couldn't be generated
+		 */
+		bool makeKeyPair(crypto::PublicKey &publicKey, crypto::PrivateKey &privateKey);
+	};
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <inttypes.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+// Asynchronous binary logger
+//
+// Log calls copy their arguments as a binary record into a lock-free ring owned by the calling thread.
+// A background thread formats the records and writes them to stderr (Or whatever was set with log::setOutput).
+//
+// Messages below U2F_LOG_LEVEL are compiled out.
+// Format strings and tags are stored by reference, and must be string literals.
+// String arguments are copied (and possibly truncated), everything else is stored as 64-bit numbers.
+// A forked child leaves the records its parent hasn't written yet to the parent, and starts its own background thread.
+//
+// Usage:
+//   #define LOG_TAG "u2f-something"
+//   LOG_DEBUG("Hello %s, %d", name, 42);
+
+#define U2F_LOG_LEVEL_TRACE 0
+#define U2F_LOG_LEVEL_DEBUG 1
+#define U2F_LOG_LEVEL_INFO  2
+#define U2F_LOG_LEVEL_WARN  3
+#define U2F_LOG_LEVEL_ERROR 4
+#define U2F_LOG_LEVEL_NONE  5
+
+#ifndef U2F_LOG_LEVEL
+#define U2F_LOG_LEVEL U2F_LOG_LEVEL_INFO
+#endif
+
+#define U2F_LOG(level, tag, fmt, ...) \
+	do { if ((level) >= U2F_LOG_LEVEL) u2f::log::write((level), (tag), (fmt), ##__VA_ARGS__); } while (0)
+
+#define U2F_LOG_DUMP(level, tag, name, buffer, size) \
+	do { if ((level) >= U2F_LOG_LEVEL) u2f::log::dump((level), (tag), (name), (buffer), (size)); } while (0)
+
+#define LOG_TRACE(fmt, ...) U2F_LOG(U2F_LOG_LEVEL_TRACE, LOG_TAG, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) U2F_LOG(U2F_LOG_LEVEL_DEBUG, LOG_TAG, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...)  U2F_LOG(U2F_LOG_LEVEL_INFO,  LOG_TAG, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...)  U2F_LOG(U2F_LOG_LEVEL_WARN,  LOG_TAG, fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) U2F_LOG(U2F_LOG_LEVEL_ERROR, LOG_TAG, fmt, ##__VA_ARGS__)
+#define LOG_DUMP(name, buffer, size) U2F_LOG_DUMP(U2F_LOG_LEVEL_TRACE, LOG_TAG, name, buffer, size)
+
+// Records per thread. Must be a power of 2
+#define LOG_RING_SIZE 256
+#define LOG_RECORD_SIZE 256
+
+namespace u2f {
+	namespace log {
+		enum RecordType : uint8_t {
+			RECORD_TEXT,
+			RECORD_DUMP,
+		};
+
+		enum ArgumentType : uint8_t {
+			ARGUMENT_INT,
+			ARGUMENT_UINT,
+			ARGUMENT_DOUBLE,
+			ARGUMENT_STRING,
+			ARGUMENT_POINTER,
+		};
+
+		struct RecordHeader {
+			uint64_t timestamp;
+			const char* tag;
+			const char* format;   // Format string, or the name of the buffer on dumps
+			uint8_t  level;
+			RecordType type;
+			uint16_t size;        // Bytes used in #data
+			uint16_t offset;      // Dumps only: Offset of this chunk
+			uint16_t total;       // Dumps only: Size of the whole buffer
+		};
+
+		struct Record : RecordHeader {
+			uint8_t data[LOG_RECORD_SIZE - sizeof(RecordHeader)];
+		};
+
+		/**
+		 * Single-producer, single-consumer ring of records.
+		 *
+		 * Each thread has its own ring, which is only drained by the background thread.
+		 */
+		struct Ring {
+			// head and tail live on different cache lines
+			std::atomic<uint32_t> head;   // Written by the owner thread
+			uint8_t headPadding[64 - sizeof(std::atomic<uint32_t>)];
+			std::atomic<uint32_t> tail;   // Written by the drainer
+			uint8_t tailPadding[64 - sizeof(std::atomic<uint32_t>)];
+			std::atomic<uint32_t> dropped;
+			std::atomic<bool> orphaned;               // Owner thread has exited
+			Ring* next;
+			Record records[LOG_RING_SIZE];
+
+			Ring();
+		};
+
+		/**
+		 * Appends arguments to a record
+		 */
+		class Encoder {
+			Record* record;
+
+			bool put(ArgumentType type, const void* value, uint16_t size);
+
+		public:
+			inline Encoder(Record* record)
+				: record(record)
+			{ }
+
+			void putString(const char* value);
+
+			template<typename T>
+			inline typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type encode(T value) {
+				int64_t v = value;
+				put(ARGUMENT_INT, &v, sizeof(v));
+			}
+
+			template<typename T>
+			inline typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type encode(T value) {
+				uint64_t v = value;
+				put(ARGUMENT_UINT, &v, sizeof(v));
+			}
+
+			template<typename T>
+			inline typename std::enable_if<std::is_enum<T>::value>::type encode(T value) {
+				int64_t v = (int64_t)value;
+				put(ARGUMENT_INT, &v, sizeof(v));
+			}
+
+			template<typename T>
+			inline typename std::enable_if<std::is_floating_point<T>::value>::type encode(T value) {
+				double v = value;
+				put(ARGUMENT_DOUBLE, &v, sizeof(v));
+			}
+
+			template<typename T>
+			inline void encode(T* value) {
+				uint64_t v = (uintptr_t)value;
+				put(ARGUMENT_POINTER, &v, sizeof(v));
+			}
+
+			inline void encode(const char* value) {
+				putString(value);
+			}
+
+			inline void encode(char* value) {
+				putString(value);
+			}
+		};
+
+		/**
+		 * Returns a free record on the current thread's ring, or nullptr if it is full.
+		 */
+		Record* begin(uint8_t level, const char* tag, const char* format, RecordType type);
+
+		/**
+		 * Publishes the record returned by begin()
+		 */
+		void commit();
+
+		template<typename... Args>
+		inline void write(uint8_t level, const char* tag, const char* format, const Args&... args) {
+			Record* record = begin(level, tag, format, RECORD_TEXT);
+			if (record == nullptr)
+				return;
+
+			Encoder encoder(record);
+			int expand[] = {0, (encoder.encode(args), 0)...};
+			(void)expand;
+			commit();
+		}
+
+		/**
+		 * Logs a hex dump of #buffer
+		 */
+		void dump(uint8_t level, const char* tag, const char* name, const void* buffer, int size);
+
+		/**
+		 * Sets the file descriptor where logs are written. Defaults to stderr.
+		 */
+		void setOutput(int fd);
+
+		/**
+		 * Blocks until every record logged so far has been written.
+		 */
+		void flush();
+	};
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace u2f {
+
+	/**
+	 * Bounded pool of secret items computed ahead of time by a background thread, e.g., keypairs or signature nonces.
+	 *
+	 * The thread runs with the lowest scheduling priority and refills the pool to the high watermark whenever
+	 * it drops to the low watermark. Taking an item is lock-free.
+	 *
+	 * Items are kept in locked memory when possible, so they are never swapped out,
+	 * and wiped as soon as they are taken, and when the pool is stopped.
+	 *
+	 * A forked child never uses the items it inherits, which its parent may use too: They are wiped in the child,
+	 * and the pool refills from scratch, restarting its thread on the first take().
+	 *
+	 * Subclasses implement generate(), and must call start() at the end of their constructor and stop() at the start of their destructor.
+	 */
+	class PrefillPool {
+		size_t itemSize;
+		uint8_t* items;
+		size_t itemsSize;
+		std::atomic<uint32_t>* sequences;
+		uint32_t mask;
+		uint32_t lowWatermark;
+		uint32_t highWatermark;
+
+		alignas(64) std::atomic<uint32_t> pushPosition;
+		alignas(64) std::atomic<uint32_t> popPosition;
+
+		alignas(64) std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+
+		std::mutex mutex;
+		std::condition_variable refill;
+		std::atomic<bool> stopping;
+		std::thread* thread;
+		std::atomic<bool> restartThread;  // Set in the child after a fork, if the thread was running
+
+		// Live pools, for the fork handlers
+		PrefillPool* previous;
+		PrefillPool* next;
+
+		bool push(const void* item);
+		bool pop(void* item);
+
+		/**
+		 * Wipes the items and empties the queue. Called in the child after a fork, where only the forking thread exists.
+		 */
+		void resetAfterFork();
+
+		static void threadFunc(PrefillPool* pool);
+		static void registerForkHandlers();
+		static void prepareFork();
+		static void parentAfterFork();
+		static void childAfterFork();
+
+	protected:
+		/**
+		 * @param[in] itemSize Size of each item
+		 * @param[in] depth Maximum number of items kept. It is rounded up to a power of 2.
+		 * @param[in] lowWatermark The pool is refilled when it has this many items or less. UINT32_MAX uses a quarter of #depth.
+		 * @param[in] highWatermark The pool is refilled up to this many items. UINT32_MAX uses #depth.
+		 */
+		PrefillPool(size_t itemSize, uint32_t depth, uint32_t lowWatermark, uint32_t highWatermark);
+
+		/**
+		 * Starts the background thread
+		 */
+		void start();
+
+		/**
+		 * Stops the background thread and wipes the items left
+		 */
+		void stop();
+
+		/**
+		 * Computes a new item. Called from the background thread.
+		 *
+		 * @return false on failure. The thread then waits until the next take() to retry.
+		 */
+		virtual bool generate(void* item) = 0;
+
+		/**
+		 * Takes an item from the pool, counting a hit, or counts a miss if it is empty.
+		 *
+		 * @return false if the pool is empty
+		 */
+		bool take(void* item);
+
+	public:
+		virtual ~PrefillPool();
+
+		/**
+		 * Allocates pools aligned on cache lines, which the global operator new only does from C++17
+		 */
+		static void* operator new(size_t size);
+		static void* operator new[](size_t size);
+		static void operator delete(void* pointer);
+		static void operator delete[](void* pointer);
+
+		/**
+		 * Number of items ready to be taken
+		 */
+		uint32_t getSize() const;
+
+		inline uint32_t getDepth() const {
+			return mask + 1;
+		}
+
+		/**
+		 * Number of items taken from the pool
+		 */
+		inline uint64_t getHits() const {
+			return hits.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Number of times the pool was empty
+		 */
+		inline uint64_t getMisses() const {
+			return misses.load(std::memory_order_relaxed);
+		}
+	};
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <atomic>
+
+// Per-stage latency statistics
+//
+// Timing is only compiled in when U2F_STATS is defined, otherwise Scope and Timer are no-ops.
+
+// Histograms have 16 linear sub-buckets per power of two (~6% resolution), up to 2^40ns (~18 minutes)
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_MAX_MAGNITUDE 40
+#define STATS_HISTOGRAM_BUCKETS ((STATS_MAX_MAGNITUDE - STATS_SUB_BUCKET_BITS + 2) << STATS_SUB_BUCKET_BITS)
+
+#define STATS_MAX_COLLECTORS 16
+
+namespace u2f {
+	namespace stats {
+		enum Stage {
+			STAGE_REQUEST,         // Whole Core::processRawAdpu
+			STAGE_PARSE,           // APDU parsing
+			STAGE_ENROLL,          // Core::enroll
+			STAGE_AUTHENTICATE,    // Core::authenticate, including user presence
+			STAGE_FETCH_HANDLE,    // SimpleCore::fetchHandle
+			STAGE_ATTESTATION,     // Core::getAttestationSigner
+			STAGE_SHA256,          // Request hashing (crypto::Sha256)
+			STAGE_SIGN,            // crypto::sign, ECDSA only
+			STAGE_DER,             // crypto::sign, DER encoding
+			STAGE_HID_REASSEMBLY,  // From the first to the last packet of a multipart HID message
+			STAGE_HID_SEND,        // Hid::sendResponse
+			STAGE_COUNT
+		};
+
+		// Values match the APDU INS byte
+		enum Instruction {
+			INSTRUCTION_OTHER        = 0x00,
+			INSTRUCTION_REGISTER     = 0x01,
+			INSTRUCTION_AUTHENTICATE = 0x02,
+			INSTRUCTION_VERSION      = 0x03,
+			INSTRUCTION_COUNT
+		};
+
+		const char* getStageName(Stage stage);
+		const char* getInstructionName(Instruction instruction);
+		Instruction getInstruction(uint8_t ins);
+
+		/**
+		 * Monotonic timestamp, in nanoseconds
+		 */
+		uint64_t now();
+
+		/**
+		 * Immutable copy of a Histogram
+		 */
+		struct HistogramSnapshot {
+			uint64_t count;
+			uint64_t sum;
+			uint64_t min;
+			uint64_t max;
+			uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+
+			double mean() const;
+
+			/**
+			 * @param[in] percentile Between 0 and 100
+			 * @return The (approximate) value at the given percentile, in nanoseconds
+			 */
+			uint64_t percentile(double percentile) const;
+		};
+
+		/**
+		 * Lock-free log-linear histogram of durations in nanoseconds, in the spirit of HdrHistogram.
+		 */
+		class Histogram {
+			std::atomic<uint64_t> count;
+			std::atomic<uint64_t> sum;
+			std::atomic<uint64_t> min;
+			std::atomic<uint64_t> max;
+			std::atomic<uint64_t> buckets[STATS_HISTOGRAM_BUCKETS];
+
+		public:
+			Histogram();
+
+			static int getBucket(uint64_t value);
+			static uint64_t getBucketValue(int bucket);
+
+			void record(uint64_t value);
+			void snapshot(HistogramSnapshot &snapshot) const;
+			void reset();
+		};
+
+		/**
+		 * Immutable copy of a Collector, with one histogram for each instruction and stage.
+		 */
+		struct Snapshot {
+			const char* name;
+			HistogramSnapshot histograms[INSTRUCTION_COUNT][STAGE_COUNT];
+
+			/**
+			 * Prints count, mean and percentiles (in microseconds) of every non-empty histogram
+			 */
+			void print(FILE* file) const;
+		};
+
+		/**
+		 * Histograms of every stage of every instruction, for one kind of core.
+		 */
+		class Collector {
+			const char* name;
+			Histogram histograms[INSTRUCTION_COUNT][STAGE_COUNT];
+
+		public:
+			Collector(const char* name);
+
+			inline const char* getName() const {
+				return name;
+			}
+
+			void record(Instruction instruction, Stage stage, uint64_t duration);
+			void snapshot(Snapshot &snapshot) const;
+			void reset();
+		};
+
+		/**
+		 * Returns the Collector with the specified name, creating it if needed.
+		 *
+		 * Collectors are never destroyed. Returns nullptr if there are already STATS_MAX_COLLECTORS collectors.
+		 */
+		Collector* getCollector(const char* name);
+
+		/**
+		 * Returns the number of collectors created so far, and fills #collectors with up to #maxCollectors of them
+		 */
+		int getCollectors(Collector** collectors, int maxCollectors);
+
+		/**
+		 * Prints a snapshot of every collector
+		 */
+		void print(FILE* file);
+
+#ifdef U2F_STATS
+		/**
+		 * Makes #collector and #instruction the target of all Timers created by this thread, until destructed.
+		 */
+		class Scope {
+			Collector* previousCollector;
+			Instruction previousInstruction;
+
+		public:
+			Scope(Collector* collector, Instruction instruction = INSTRUCTION_OTHER);
+			~Scope();
+
+			void setInstruction(Instruction instruction);
+		};
+
+		/**
+		 * Records the time between its creation and stop() (or destruction) into the current Scope, if any.
+		 */
+		class Timer {
+			Stage stage;
+			uint64_t start;
+
+		public:
+			inline Timer(Stage stage)
+				: stage(stage), start(now())
+			{ }
+
+			inline ~Timer() {
+				stop();
+			}
+
+			void stop();
+		};
+
+		/**
+		 * Records a duration measured elsewhere into the current Scope, if any.
+		 */
+		void record(Stage stage, uint64_t duration);
+#else
+		class Scope {
+		public:
+			inline Scope(Collector* collector, Instruction instruction = INSTRUCTION_OTHER) { }
+			inline void setInstruction(Instruction instruction) { }
+		};
+
+		class Timer {
+		public:
+			inline Timer(Stage stage) { }
+			inline void stop() { }
+		};
+
+		inline void record(Stage stage, uint64_t duration) { }
+#endif
+	};
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Binary traces of U2F traffic
+//
+// A trace file is a 16-byte header followed by records. Every integer is little-endian.
+//
+// File header:
+//   char     magic[8]     "U2FTRACE"
+//   uint32_t version      TRACE_VERSION
+//   uint32_t reserved
+//
+// Record:
+//   uint64_t timestamp    Nanoseconds since the trace was opened
+//   uint8_t  type         RecordType
+//   uint8_t  reserved[3]
+//   uint32_t size         Size of the data that follows
+//   uint8_t  data[size]
+
+#define TRACE_MAGIC "U2FTRACE"
+#define TRACE_VERSION 1
+#define TRACE_FILE_HEADER_SIZE 16
+#define TRACE_RECORD_HEADER_SIZE 16
+
+// Largest record we are willing to read: An extended APDU with 65535 bytes of data
+#define TRACE_MAX_RECORD_SIZE 0x10010
+
+namespace u2f {
+	namespace trace {
+		enum RecordType : uint8_t {
+			RECORD_HID_OUTPUT_REPORT = 1,  // Host to device HID report, as received by Hid::receivedOutputReport
+			RECORD_HID_INPUT_REPORT  = 2,  // Device to host HID report, as sent by Hid::sendResponse
+			RECORD_APDU_REQUEST      = 3,  // Raw APDU received by Core::processRawAdpu
+			RECORD_APDU_RESPONSE     = 4,  // Raw APDU returned by Core::processRawAdpu
+		};
+
+		struct RecordHeader {
+			uint64_t timestamp;
+			RecordType type;
+			uint32_t size;
+		};
+
+		/**
+		 * Writes records to a trace file.
+		 *
+		 * Safe to use from multiple threads: Records are never interleaved, but may be out of timestamp order.
+		 */
+		class Recorder {
+			FILE* file;
+			uint64_t openedAt;
+
+		public:
+			Recorder();
+			~Recorder();
+
+			/**
+			 * Creates (or truncates) a trace file and writes its header.
+			 *
+			 * @return false if the file couldn't be created
+			 */
+			bool open(const char* filename);
+
+			/**
+			 * Closes the trace. It must not be in use by any Core or Hid anymore.
+			 */
+			void close();
+
+			inline bool isOpen() const {
+				return file != nullptr;
+			}
+
+			/**
+			 * Appends a record. Does nothing if the trace isn't open.
+			 */
+			void record(RecordType type, const uint8_t* data, uint32_t size);
+		};
+
+		/**
+		 * Reads records from a trace file, sequentially.
+		 */
+		class Reader {
+			FILE* file;
+			uint8_t* buffer;
+
+		public:
+			Reader();
+			~Reader();
+
+			/**
+			 * @return false if the file couldn't be opened or isn't a trace
+			 */
+			bool open(const char* filename);
+			void close();
+
+			/**
+			 * Goes back to the first record
+			 */
+			bool rewind();
+
+			/**
+			 * Reads the next record.
+			 *
+			 * @param[out] header Header of the record
+			 * @param[out] data Will point to the record data. It is only valid until the next call.
+			 *
+			 * @return false at the end of the trace, or if it is truncated or corrupted
+			 */
+			bool next(RecordHeader &header, const uint8_t* &data);
+		};
+
+		const char* getRecordTypeName(RecordType type);
+	};
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <inttypes.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// Most tasks handed at once to a BatchFunc
+#define WORKER_POOL_MAX_BATCH 16
+
+namespace u2f {
+
+	/**
+	 * Fixed set of threads running tasks from a bounded FIFO queue.
+	 *
+	 * Tasks are plain function pointers + argument, so submitting doesn't allocate.
+	 */
+	class WorkerPool {
+	public:
+		typedef void (*TaskFunc)(void* arg);
+		typedef void (*BatchFunc)(void* const args[], uint32_t count);
+
+	private:
+		struct Task {
+			TaskFunc func;
+			BatchFunc batchFunc;
+			void* arg;
+		};
+
+		std::mutex mutex;
+		std::condition_variable taskAvailable;
+		bool stopping;
+
+		Task* queue;
+		uint32_t queueSize;
+		uint32_t queueHead;
+		uint32_t queueCount;
+		uint32_t running;
+
+		std::thread** threads;
+		int threadCount;
+
+		static void threadFunc(WorkerPool* pool);
+
+	public:
+		/**
+		 * @param[in] threadCount Number of worker threads. 0 uses one thread per CPU.
+		 * @param[in] queueSize Maximum number of tasks waiting for a thread.
+		 */
+		WorkerPool(int threadCount = 0, uint32_t queueSize = 256);
+
+		/**
+		 * Runs every task already submitted, then stops the threads.
+		 */
+		~WorkerPool();
+
+		/**
+		 * Queues a task to be run in one of the worker threads.
+		 *
+		 * @return false if the queue is full.
+		 */
+		bool submit(TaskFunc func, void* arg);
+
+		/**
+		 * Queues a task that can run together with other queued tasks of the same #func.
+		 *
+		 * While tasks are piling up in the queue, each thread takes its share of the consecutive tasks of the same #func
+		 * (up to WORKER_POOL_MAX_BATCH) and runs them with a single call. Otherwise, #func is called with a single task.
+		 *
+		 * @return false if the queue is full.
+		 */
+		bool submitBatch(BatchFunc func, void* arg);
+
+		/**
+		 * Number of tasks waiting or running
+		 */
+		uint32_t getQueueDepth();
+
+		inline int getThreadCount() const {
+			return threadCount;
+		}
+	};
+}
@@ -0,0 +1,40 @@
+#include <u2f/buffer-pool.h>
+
+u2f::BufferPool::BufferPool(uint32_t bufferSize)
+: bufferSize(bufferSize < sizeof(void*) ? sizeof(void*) : bufferSize), freeList(nullptr), allocated(0)
+{ }
+
+u2f::BufferPool::~BufferPool() {
+	while (freeList) {
+		void* next = *(void**)freeList;
+		delete[] (uint8_t*)freeList;
+		freeList = next;
+	}
+}
+
+uint8_t* u2f::BufferPool::acquire() {
+	{
+		std::unique_lock<std::mutex> lck(mutex);
+		if (freeList) {
+			void* buffer = freeList;
+			freeList = *(void**)buffer;
+			return (uint8_t*)buffer;
+		}
+		allocated++;
+	}
+	return new uint8_t[bufferSize];
+}
+
+void u2f::BufferPool::release(uint8_t* buffer) {
+	if (buffer == nullptr)
+		return;
+
+	std::unique_lock<std::mutex> lck(mutex);
+	*(void**)buffer = freeList;
+	freeList = buffer;
+}
+
+uint32_t u2f::BufferPool::getAllocatedCount() {
+	std::unique_lock<std::mutex> lck(mutex);
+	return allocated;
+}
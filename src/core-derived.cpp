@@ -0,0 +1,130 @@
+#include <u2f/core-derived.h>
+#include <u2f/crypto-p256.h>
+#include <u2f/crypto-random.h>
+#include <u2f/log.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "u2f-core-derived"
+
+// Nonces drawn before giving up on a registration. Each one only fails with negligible probability.
+#define DERIVED_MAX_TRIES 16
+
+/**
+ * Constant-time comparison, so that a forged tag doesn't learn how many of its bytes are right
+ */
+static bool tagsEqual(const uint8_t* a, const uint8_t* b) {
+	uint8_t difference = 0;
+	for (int i=0; i<DERIVED_TAG_SIZE; i++) {
+		difference |= a[i] ^ b[i];
+	}
+	return difference == 0;
+}
+
+/**
+ * Key for a single purpose: SHA-256(passwordHash, label)
+ */
+static void deriveKey(const u2f::crypto::Hash &passwordHash, const char* label, u2f::crypto::HmacSha256 &key) {
+	u2f::crypto::Hash derived;
+	u2f::crypto::Sha256()
+		.update(passwordHash, sizeof(passwordHash))
+		.update(label, strlen(label))
+		.finish(derived);
+	key.init(derived);
+	memset(derived, 0, sizeof(derived));
+}
+
+u2f::DerivedCore::DerivedCore(const char* password) {
+	crypto::Hash passwordHash;
+	const char* salt = "U2F Device Library";
+	crypto::Sha256()
+		.update(salt, strlen(salt))
+		.update(password, strlen(password))
+		.finish(passwordHash);
+
+	deriveKey(passwordHash, "Private key derivation v1", derivationKey);
+	deriveKey(passwordHash, "Derived handle authentication v1", macKey);
+	memset(passwordHash, 0, sizeof(passwordHash));
+}
+
+void u2f::DerivedCore::computeTag(const crypto::Hash &applicationHash, const uint8_t* nonce, uint8_t tag[DERIVED_TAG_SIZE]) const {
+	const uint8_t version = DERIVED_HANDLE_VERSION;
+	crypto::Hash mac;
+	crypto::HmacSha256(macKey)
+		.update(&version, 1)
+		.update(applicationHash, sizeof(crypto::Hash))
+		.update(nonce, DERIVED_NONCE_SIZE)
+		.finish(mac);
+	memcpy(tag, mac, DERIVED_TAG_SIZE);
+}
+
+void u2f::DerivedCore::derivePrivateKey(const crypto::Hash &applicationHash, const uint8_t* nonce, crypto::PrivateKey &privateKey) const {
+	const uint8_t version = DERIVED_HANDLE_VERSION;
+	crypto::HmacSha256(derivationKey)
+		.update(&version, 1)
+		.update(applicationHash, sizeof(crypto::Hash))
+		.update(nonce, DERIVED_NONCE_SIZE)
+		.finish(privateKey);
+}
+
+bool u2f::DerivedCore::checkHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize) const {
+	if (handleSize != DERIVED_HANDLE_SIZE || handle[0] != DERIVED_HANDLE_VERSION)
+		return false;
+
+	const uint8_t* nonce = handle + 1;
+	uint8_t tag[DERIVED_TAG_SIZE];
+	computeTag(applicationHash, nonce, tag);
+	return tagsEqual(tag, nonce + DERIVED_NONCE_SIZE);
+}
+
+bool u2f::DerivedCore::createKeyPair(const crypto::Hash &applicationHash, Handle &handle, uint8_t &handleSize, crypto::PublicKey &publicKey) {
+	handle[0] = DERIVED_HANDLE_VERSION;
+	uint8_t* nonce = handle + 1;
+	crypto::PrivateKey privateKey;
+	for (int i=0; i<DERIVED_MAX_TRIES; i++) {
+		if (!crypto::randomBytes(nonce, DERIVED_NONCE_SIZE)) {
+			LOG_ERROR("Failed to generate a handle");
+			return false;
+		}
+
+		// Out of [1, n-1] with a probability of about 2^-32
+		derivePrivateKey(applicationHash, nonce, privateKey);
+		bool valid = crypto::p256::computePublicKey(privateKey, publicKey);
+		memset(privateKey, 0, sizeof(privateKey));
+		if (valid) {
+			computeTag(applicationHash, nonce, nonce + DERIVED_NONCE_SIZE);
+			handleSize = DERIVED_HANDLE_SIZE;
+			return true;
+		}
+	}
+	LOG_ERROR("Failed to derive a valid private key");
+	return false;
+}
+
+bool u2f::DerivedCore::createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize) {
+	LOG_ERROR("Private keys are derived from handles, and can't be mapped to new ones");
+	return false;
+}
+
+bool u2f::DerivedCore::fetchHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter) {
+	// The tag is checked first: No key is derived unless the handle is ours, for this applicationHash
+	if (!checkHandle(applicationHash, handle, handleSize)) {
+		LOG_DEBUG("Handle authentication failed");
+		return false;
+	}
+	derivePrivateKey(applicationHash, handle + 1, privateKey);
+
+	// AuthCounter must be monotonically increasing.
+	// Since we want to be stateless, we can use timestamp for it
+	struct timespec spec;
+	clock_gettime(CLOCK_REALTIME, &spec);
+	authCounter = spec.tv_sec;
+
+	return true;
+}
+
+void u2f::DerivedCore::checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]) {
+	for (uint32_t i=0; i<count; i++) {
+		owned[i] = checkHandle(applicationHash, *handles[i], handleSizes[i]);
+	}
+}
@@ -9,9 +9,13 @@ bool u2f::SimpleCore::enroll(const crypto::Hash &applicationHash, Handle &handle
 		return false;
 	}
 
+	return createKeyPair(applicationHash, handle, handleSize, publicKey);
+}
+
+bool u2f::SimpleCore::createKeyPair(const crypto::Hash &applicationHash, Handle &handle, uint8_t &handleSize, crypto::PublicKey &publicKey) {
 	//Create the keypair
 	crypto::PrivateKey privateKey;
-	if (!crypto::makeKeyPair(publicKey, privateKey)) {
+	if (!makeKeyPair(publicKey, privateKey)) {
 		//Failed to create a key.
 		//I guess this shoudn't happen?
 		return false;
@@ -21,12 +25,16 @@ bool u2f::SimpleCore::enroll(const crypto::Hash &applicationHash, Handle &handle
 	return createHandle(applicationHash, privateKey, handle, handleSize);
 }
 
-u2f::crypto::Signer* u2f::SimpleCore::authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter) {
+bool u2f::SimpleCore::authenticate(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, bool checkUserPresence, bool &userPresent, uint32_t &authCounter, crypto::SignerSlot &signer) {
 	crypto::PrivateKey privateKey;
 
 	// Fetch the key
-	if (!fetchHandle(applicationHash, handle, handleSize, privateKey, authCounter)) {
-		return nullptr;
+	stats::Timer fetchHandleTimer(stats::STAGE_FETCH_HANDLE);
+	bool fetched = fetchHandle(applicationHash, handle, handleSize, privateKey, authCounter);
+	fetchHandleTimer.stop();
+	if (!fetched) {
+		memset(privateKey, 0, sizeof(privateKey));
+		return false;
 	}
 
 	// Check for user presence
@@ -34,37 +42,21 @@ u2f::crypto::Signer* u2f::SimpleCore::authenticate(const crypto::Hash &applicati
 		userPresent = isUserPresent();
 	}
 
-	return new crypto::SimpleSigner(privateKey);
+	signer.emplace<crypto::SimpleSigner>(privateKey);
+	memset(privateKey, 0, sizeof(privateKey));
+	return true;
 }
 
-u2f::crypto::Signer* u2f::SimpleCore::getAttestationSigner() {
-	static const crypto::PrivateKey privateKey = {
-		0xf3, 0xfc, 0xcc, 0x0d, 0x00, 0xd8, 0x03, 0x19, 0x54, 0xf9, 0x08, 0x64, 0xd4, 0x3c, 0x24, 0x7f,
-		0x4b, 0xf5, 0xf0, 0x66, 0x5c, 0x6b, 0x50, 0xcc, 0x17, 0x74, 0x9a, 0x27, 0xd1, 0xcf, 0x76, 0x64
-	};
-	static const uint8_t certificate[] = {
-		0x30, 0x82, 0x01, 0x3c, 0x30, 0x81, 0xe4, 0xa0, 0x03, 0x02, 0x01, 0x02, 0x02, 0x0a, 0x47, 0x90,
-		0x12, 0x80, 0x00, 0x11, 0x55, 0x95, 0x73, 0x52, 0x30, 0x0a, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce,
-		0x3d, 0x04, 0x03, 0x02, 0x30, 0x17, 0x31, 0x15, 0x30, 0x13, 0x06, 0x03, 0x55, 0x04, 0x03, 0x13,
-		0x0c, 0x47, 0x6e, 0x75, 0x62, 0x62, 0x79, 0x20, 0x50, 0x69, 0x6c, 0x6f, 0x74, 0x30, 0x1e, 0x17,
-		0x0d, 0x31, 0x32, 0x30, 0x38, 0x31, 0x34, 0x31, 0x38, 0x32, 0x39, 0x33, 0x32, 0x5a, 0x17, 0x0d,
-		0x31, 0x33, 0x30, 0x38, 0x31, 0x34, 0x31, 0x38, 0x32, 0x39, 0x33, 0x32, 0x5a, 0x30, 0x31, 0x31,
-		0x2f, 0x30, 0x2d, 0x06, 0x03, 0x55, 0x04, 0x03, 0x13, 0x26, 0x50, 0x69, 0x6c, 0x6f, 0x74, 0x47,
-		0x6e, 0x75, 0x62, 0x62, 0x79, 0x2d, 0x30, 0x2e, 0x34, 0x2e, 0x31, 0x2d, 0x34, 0x37, 0x39, 0x30,
-		0x31, 0x32, 0x38, 0x30, 0x30, 0x30, 0x31, 0x31, 0x35, 0x35, 0x39, 0x35, 0x37, 0x33, 0x35, 0x32,
-		0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x08, 0x2a,
-		0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07, 0x03, 0x42, 0x00, 0x04, 0x8d, 0x61, 0x7e, 0x65, 0xc9,
-		0x50, 0x8e, 0x64, 0xbc, 0xc5, 0x67, 0x3a, 0xc8, 0x2a, 0x67, 0x99, 0xda, 0x3c, 0x14, 0x46, 0x68,
-		0x2c, 0x25, 0x8c, 0x46, 0x3f, 0xff, 0xdf, 0x58, 0xdf, 0xd2, 0xfa, 0x3e, 0x6c, 0x37, 0x8b, 0x53,
-		0xd7, 0x95, 0xc4, 0xa4, 0xdf, 0xfb, 0x41, 0x99, 0xed, 0xd7, 0x86, 0x2f, 0x23, 0xab, 0xaf, 0x02,
-		0x03, 0xb4, 0xb8, 0x91, 0x1b, 0xa0, 0x56, 0x99, 0x94, 0xe1, 0x01, 0x30, 0x0a, 0x06, 0x08, 0x2a,
-		0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x02, 0x03, 0x47, 0x00, 0x30, 0x44, 0x02, 0x20, 0x60, 0xcd,
-		0xb6, 0x06, 0x1e, 0x9c, 0x22, 0x26, 0x2d, 0x1a, 0xac, 0x1d, 0x96, 0xd8, 0xc7, 0x08, 0x29, 0xb2,
-		0x36, 0x65, 0x31, 0xdd, 0xa2, 0x68, 0x83, 0x2c, 0xb8, 0x36, 0xbc, 0xd3, 0x0d, 0xfa, 0x02, 0x20,
-		0x63, 0x1b, 0x14, 0x59, 0xf0, 0x9e, 0x63, 0x30, 0x05, 0x57, 0x22, 0xc8, 0xd8, 0x9b, 0x7f, 0x48,
-		0x88, 0x3b, 0x90, 0x89, 0xb8, 0x8d, 0x60, 0xd1, 0xd9, 0x79, 0x59, 0x02, 0xb3, 0x04, 0x10, 0xdf
-	};
-	return new crypto::SimpleSigner(privateKey, certificate, sizeof(certificate));
+void u2f::SimpleCore::checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]) {
+	crypto::PrivateKey privateKey;
+	uint32_t authCounter;
+
+	stats::Timer fetchHandleTimer(stats::STAGE_FETCH_HANDLE);
+	for (uint32_t i=0; i<count; i++) {
+		owned[i] = fetchHandle(applicationHash, *handles[i], handleSizes[i], privateKey, authCounter);
+	}
+	fetchHandleTimer.stop();
+	memset(privateKey, 0, sizeof(privateKey));
 }
 
 bool u2f::SimpleCore::isUserPresent() {
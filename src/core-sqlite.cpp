@@ -1,14 +1,21 @@
 #include <u2f/core-sqlite.h>
-#include <string.h>
+#include <u2f/crypto-random.h>
+#include <u2f/log.h>
 #include <stdio.h>
+#include <string.h>
+
+#define LOG_TAG "u2f-core-sqlite"
 
-#define LOG(fmt, ...) fprintf(stderr, "u2f-core-sqlite: " fmt "\n", ##__VA_ARGS__)
+// Handles looked up per query by checkHandles(), well below SQLite's limit of bound parameters
+#define CHECK_HANDLES_BATCH_SIZE 128
 
-u2f::SQLiteCore::SQLiteCore(const char* filename) {
+u2f::SQLiteCore::SQLiteCore(const char* filename)
+: dataVersionStmt(nullptr), dataVersion(-1)
+{
 	// Open the DB
 	int ret = sqlite3_open(filename, &db);
 	if (ret != SQLITE_OK) {
-		LOG("Can't open database: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Can't open database: %s", sqlite3_errmsg(db));
 		sqlite3_close(db);
 		db = nullptr;
 	}
@@ -25,31 +32,76 @@ u2f::SQLiteCore::SQLiteCore(const char* filename) {
 			nullptr, nullptr, nullptr);
 
 	if (ret != SQLITE_OK) {
-		LOG("Can'create table Handle: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Can'create table Handle: %s", sqlite3_errmsg(db));
 		sqlite3_close(db);
 		db = nullptr;
+		return;
 	}
+
+	ret = sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &dataVersionStmt, nullptr);
+	if (ret != SQLITE_OK) {
+		LOG_ERROR("Failed prepare 'data version' statement: %s", sqlite3_errmsg(db));
+		dataVersionStmt = nullptr;
+	}
+
+	loadFilter();
 }
 
 u2f::SQLiteCore::~SQLiteCore() {
 	if (db) {
+		sqlite3_finalize(dataVersionStmt);
 		sqlite3_close(db);
 	}
 }
 
+int64_t u2f::SQLiteCore::readDataVersion() {
+	if (!dataVersionStmt)
+		return -1;
+
+	int64_t version = -1;
+	if (sqlite3_step(dataVersionStmt) == SQLITE_ROW) {
+		version = sqlite3_column_int64(dataVersionStmt, 0);
+	} else {
+		LOG_ERROR("Failed to read data version: %s", sqlite3_errmsg(db));
+	}
+	sqlite3_reset(dataVersionStmt);
+	return version;
+}
+
+void u2f::SQLiteCore::loadFilter() {
+	// Read before loading, so that a commit made meanwhile triggers another load
+	dataVersion = readDataVersion();
+	filter.load(db);
+}
+
+bool u2f::SQLiteCore::refreshFilter() {
+	int64_t version = readDataVersion();
+	if (version < 0 || version == dataVersion)
+		return false;
+
+	LOG_DEBUG("Database changed by another connection, reloading the filter");
+	loadFilter();
+	return true;
+}
+
 bool u2f::SQLiteCore::createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize) {
 	if (!db)
 		return false; // Database is closed
 
+	std::unique_lock<std::mutex> lck(dbMutex);
+
 	//Create a new random handle
 	handleSize = 64;
-	sqlite3_randomness(handleSize, handle);
+	if (!crypto::randomBytes(handle, handleSize)) {
+		LOG_ERROR("Failed to generate a handle");
+		return false;
+	}
 
 
 	sqlite3_stmt *stmt = nullptr;
 	int ret = sqlite3_prepare_v2(db, "INSERT INTO Handle (applicationHash, handle, privateKey) VALUES (?1, ?2, ?3);", -1, &stmt, nullptr);
 	if (ret != SQLITE_OK) {
-		LOG("Failed prepare Insert statement: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Failed prepare Insert statement: %s", sqlite3_errmsg(db));
 		return false;
 	}
 	sqlite3_bind_blob(stmt, 1, applicationHash, sizeof(crypto::Hash), SQLITE_STATIC);
@@ -60,9 +112,13 @@ bool u2f::SQLiteCore::createHandle(const crypto::Hash &applicationHash, const cr
 	sqlite3_finalize(stmt);
 
 	if (ret != SQLITE_DONE) {
-		LOG("Failed to insert handle: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Failed to insert handle: %s", sqlite3_errmsg(db));
 		return false;
 	}
+
+	if (!filter.add(applicationHash, handle, handleSize)) {
+		loadFilter(); // Over capacity, grow it
+	}
 	return true;
 }
 
@@ -70,10 +126,20 @@ bool u2f::SQLiteCore::fetchHandle(const u2f::crypto::Hash &applicationHash, cons
 	if (!db)
 		return false; // Database is closed
 
+	bool filtered = !filter.mightContain(applicationHash, handle, handleSize);
+
+	// Select + update of the counter must be atomic
+	std::unique_lock<std::mutex> lck(dbMutex);
+
+	if (filtered && (!refreshFilter() || !filter.mightContain(applicationHash, handle, handleSize))) {
+		LOG_DEBUG("Handle rejected by filter");
+		return false;
+	}
+
 	sqlite3_stmt *stmt = nullptr;
 	int ret = sqlite3_prepare_v2(db, "Select privateKey, authCounter FROM Handle WHERE applicationHash = ?1 AND handle = ?2;", -1, &stmt, nullptr);
 	if (ret != SQLITE_OK) {
-		LOG("Failed prepare 'select handle' statement: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Failed prepare 'select handle' statement: %s", sqlite3_errmsg(db));
 		return false;
 	}
 	sqlite3_bind_blob(stmt, 1, applicationHash, sizeof(crypto::Hash), SQLITE_STATIC);
@@ -86,7 +152,7 @@ bool u2f::SQLiteCore::fetchHandle(const u2f::crypto::Hash &applicationHash, cons
 		return false;
 	} else if (ret != SQLITE_ROW) {
 		//Some error?!
-		LOG("Failed select handle: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Failed select handle: %s", sqlite3_errmsg(db));
 		sqlite3_finalize(stmt);
 		return false;
 	}
@@ -99,17 +165,87 @@ bool u2f::SQLiteCore::fetchHandle(const u2f::crypto::Hash &applicationHash, cons
 	// Increment authCounter
 	ret = sqlite3_prepare_v2(db, "UPDATE Handle SET authCounter = authCounter + 1 WHERE applicationHash = ?1 AND handle = ?2;", -1, &stmt, nullptr);
 	if (ret != SQLITE_OK) {
-		LOG("Failed prepare 'update authCounter' statement: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Failed prepare 'update authCounter' statement: %s", sqlite3_errmsg(db));
 		return false;
 	}
 	sqlite3_bind_blob(stmt, 1, applicationHash, sizeof(crypto::Hash), SQLITE_STATIC);
 	sqlite3_bind_blob(stmt, 2, handle, handleSize, SQLITE_STATIC);
 	ret = sqlite3_step(stmt);
 	if (ret != SQLITE_DONE) {
-		LOG("Failed to update authCounter: %s\n", sqlite3_errmsg(db));
+		LOG_ERROR("Failed to update authCounter: %s", sqlite3_errmsg(db));
 		return false;
 	}
 
-	LOG("counter = %d", authCounter);
+	LOG_DEBUG("counter = %d", authCounter);
 	return true;
 }
+
+void u2f::SQLiteCore::checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]) {
+	for (uint32_t i=0; i<count; i++) {
+		owned[i] = false;
+	}
+	if (!db)
+		return; // Database is closed
+
+	// Make sure that the filter is up to date before trusting it to reject anything
+	for (uint32_t i=0; i<count; i++) {
+		if (!filter.mightContain(applicationHash, *handles[i], handleSizes[i])) {
+			std::unique_lock<std::mutex> lck(dbMutex);
+			refreshFilter();
+			break;
+		}
+	}
+
+	// Skip handles that are definitely not ours
+	uint32_t candidates[CHECK_HANDLES_BATCH_SIZE];
+	uint32_t candidateCount = 0;
+	uint32_t next = 0;
+	while (next < count || candidateCount) {
+		while (next < count && candidateCount < CHECK_HANDLES_BATCH_SIZE) {
+			if (filter.mightContain(applicationHash, *handles[next], handleSizes[next])) {
+				candidates[candidateCount++] = next;
+			}
+			next++;
+		}
+		if (candidateCount == 0)
+			break;
+
+		// SELECT handle FROM Handle WHERE applicationHash = ?1 AND handle IN (?2, ?3, ...);
+		char sql[80 + 4 * CHECK_HANDLES_BATCH_SIZE];
+		int sqlSize = snprintf(sql, sizeof(sql), "SELECT handle FROM Handle WHERE applicationHash = ?1 AND handle IN (?");
+		for (uint32_t i=1; i<candidateCount; i++) {
+			sql[sqlSize++] = ',';
+			sql[sqlSize++] = '?';
+		}
+		sqlSize += snprintf(sql + sqlSize, sizeof(sql) - sqlSize, ");");
+
+		std::unique_lock<std::mutex> lck(dbMutex);
+
+		sqlite3_stmt *stmt = nullptr;
+		int ret = sqlite3_prepare_v2(db, sql, sqlSize, &stmt, nullptr);
+		if (ret != SQLITE_OK) {
+			LOG_ERROR("Failed prepare 'check handles' statement: %s", sqlite3_errmsg(db));
+			return;
+		}
+		sqlite3_bind_blob(stmt, 1, applicationHash, sizeof(crypto::Hash), SQLITE_STATIC);
+		for (uint32_t i=0; i<candidateCount; i++) {
+			sqlite3_bind_blob(stmt, i + 2, *handles[candidates[i]], handleSizes[candidates[i]], SQLITE_STATIC);
+		}
+
+		while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+			const void* handle = sqlite3_column_blob(stmt, 0);
+			int handleSize = sqlite3_column_bytes(stmt, 0);
+			// The same handle may have been asked for more than once
+			for (uint32_t i=0; i<candidateCount; i++) {
+				if (handleSizes[candidates[i]] == handleSize && !memcmp(*handles[candidates[i]], handle, handleSize)) {
+					owned[candidates[i]] = true;
+				}
+			}
+		}
+		if (ret != SQLITE_DONE) {
+			LOG_ERROR("Failed to check handles: %s", sqlite3_errmsg(db));
+		}
+		sqlite3_finalize(stmt);
+		candidateCount = 0;
+	}
+}
@@ -1,53 +1,133 @@
 #include <u2f/core-stateless.h>
-#include <aes.h>
+#include <u2f/crypto-sha256.h>
+#include <u2f/log.h>
 #include <string.h>
 #include <time.h>
-#include <stdio.h>
 
-#define LOG(fmt, ...) fprintf(stderr, "u2f-core-stateless: " fmt "\n", ##__VA_ARGS__)
+#define LOG_TAG "u2f-core-stateless"
 
-u2f::StatelessCore::StatelessCore(const char* password) {
+// Handles checked at once by checkHandles()
+#define CHECK_BATCH 16
+
+/**
+ * Constant-time comparison, so that a forged tag doesn't learn how many of its bytes are right
+ */
+static bool tagsEqual(const uint8_t* a, const uint8_t* b) {
+	uint8_t difference = 0;
+	for (int i=0; i<STATELESS_TAG_SIZE; i++) {
+		difference |= a[i] ^ b[i];
+	}
+	return difference == 0;
+}
+
+/**
+ * Key for a single purpose: SHA-256(passwordHash, label)
+ */
+static void deriveKey(const u2f::crypto::Hash &passwordHash, const char* label, u2f::crypto::Aes256 &key) {
+	u2f::crypto::Hash derived;
+	u2f::crypto::Sha256()
+		.update(passwordHash, sizeof(passwordHash))
+		.update(label, strlen(label))
+		.finish(derived);
+	key.setKey(derived);
+	memset(derived, 0, sizeof(derived));
+}
+
+u2f::StatelessCore::StatelessCore(const char* password, bool acceptLegacyHandles) : acceptLegacyHandles(acceptLegacyHandles) {
 	crypto::Hash passwordHash;
 	const char* salt = "U2F Device Library";
-	crypto::sha256(
-		passwordHash,
-		salt, strlen(salt),
-		password, strlen(password),
-		nullptr);
+	crypto::Sha256()
+		.update(salt, strlen(salt))
+		.update(password, strlen(password))
+		.finish(passwordHash);
+
+	legacyKey.setKey(passwordHash);
+	deriveKey(passwordHash, "Handle encryption v1", encryptionKey);
+	deriveKey(passwordHash, "Handle authentication v1", macKey);
+	memset(passwordHash, 0, sizeof(passwordHash));
 
-	aes_key_setup(passwordHash, aesKey, 256);
+	// K1 = 2 * AES(0) in GF(2^128), as in RFC4493. Every message is 4 complete blocks, so K2 is never needed.
+	uint8_t block[AES256_BLOCK_SIZE] = {};
+	macKey.encryptCbc(block, sizeof(block), block, block);
+	for (int i=0; i<AES256_BLOCK_SIZE; i++) {
+		macSubkey[i] = (uint8_t)(block[i] << 1) | (i + 1 < AES256_BLOCK_SIZE ? block[i + 1] >> 7 : 0);
+	}
+	macSubkey[AES256_BLOCK_SIZE - 1] ^= (uint8_t)(0x87 & -(block[0] >> 7));
+	memset(block, 0, sizeof(block));
 }
 
-bool u2f::StatelessCore::createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize) {
-	// Creates the unencrypted handle: [privateKey, applicationHash]
-	handleSize = sizeof(crypto::Hash) + sizeof(crypto::PrivateKey);
-	uint8_t rawHandle[sizeof(crypto::PrivateKey) + sizeof(crypto::Hash)];
-	memcpy(rawHandle, privateKey, sizeof(crypto::PrivateKey));
-	memcpy(rawHandle + sizeof(crypto::PrivateKey), applicationHash, sizeof(crypto::Hash));
+u2f::StatelessCore::~StatelessCore() {
+	memset(macSubkey, 0, sizeof(macSubkey));
+}
 
-	aes_encrypt_cbc(rawHandle, handleSize, handle, aesKey, 256, applicationHash);
-	return true;
+void u2f::StatelessCore::startTag(const crypto::Hash &applicationHash, uint8_t state[AES256_BLOCK_SIZE]) const {
+	const uint8_t zero[AES256_BLOCK_SIZE] = {};
+	uint8_t blocks[sizeof(crypto::Hash)];
+	macKey.encryptCbc(applicationHash, sizeof(crypto::Hash), blocks, zero);
+	memcpy(state, blocks + sizeof(crypto::Hash) - AES256_BLOCK_SIZE, AES256_BLOCK_SIZE);
 }
 
-bool u2f::StatelessCore::fetchHandle(const u2f::crypto::Hash &applicationHash, const u2f::Handle &handle, uint8_t handleSize, u2f::crypto::PrivateKey &privateKey, uint32_t &authCounter) {
-	// Invalid size
-	if (handleSize != sizeof(crypto::Hash) + sizeof(crypto::PrivateKey)) {
-		LOG("Invalid handle size: %d", handleSize);
-		return false;
+void u2f::StatelessCore::finishTag(const uint8_t state[AES256_BLOCK_SIZE], const uint8_t* ciphertext, uint8_t tag[STATELESS_TAG_SIZE]) const {
+	uint8_t blocks[sizeof(crypto::PrivateKey)];
+	memcpy(blocks, ciphertext, sizeof(blocks));
+	for (int i=0; i<AES256_BLOCK_SIZE; i++) {
+		blocks[sizeof(blocks) - AES256_BLOCK_SIZE + i] ^= macSubkey[i];
 	}
+	macKey.encryptCbc(blocks, sizeof(blocks), blocks, state);
+	memcpy(tag, blocks + sizeof(blocks) - AES256_BLOCK_SIZE, STATELESS_TAG_SIZE);
+}
+
+bool u2f::StatelessCore::createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize) {
+	// [version, AES-CBC(privateKey), AES-CMAC(applicationHash, AES-CBC(privateKey))]
+	handleSize = STATELESS_HANDLE_SIZE;
+	handle[0] = STATELESS_HANDLE_VERSION;
+	uint8_t* ciphertext = handle + 1;
+	encryptionKey.encryptCbc(privateKey, sizeof(crypto::PrivateKey), ciphertext, applicationHash);
+
+	uint8_t state[AES256_BLOCK_SIZE];
+	startTag(applicationHash, state);
+	finishTag(state, ciphertext, ciphertext + sizeof(crypto::PrivateKey));
+	return true;
+}
 
+bool u2f::StatelessCore::fetchLegacyHandle(const crypto::Hash &applicationHash, const Handle &handle, crypto::PrivateKey &privateKey) {
 	//Decrypt the handle
 	uint8_t rawHandle[sizeof(crypto::PrivateKey) + sizeof(crypto::Hash)];
-	aes_decrypt_cbc(handle, handleSize, rawHandle, aesKey, 256, applicationHash);
+	legacyKey.decryptCbc(handle, sizeof(rawHandle), rawHandle, applicationHash);
 
 	// Invalid applicationHash
 	if (memcmp(rawHandle + sizeof(crypto::PrivateKey), applicationHash, sizeof(crypto::Hash))) {
-		LOG("applicationHash check failed");
+		LOG_DEBUG("applicationHash check failed");
+		memset(rawHandle, 0, sizeof(rawHandle));
 		return false;
 	}
 
 	// Sounds OK, output the privateKey
 	memcpy(privateKey, rawHandle, sizeof(crypto::PrivateKey));
+	memset(rawHandle, 0, sizeof(rawHandle));
+	return true;
+}
+
+bool u2f::StatelessCore::fetchHandle(const u2f::crypto::Hash &applicationHash, const u2f::Handle &handle, uint8_t handleSize, u2f::crypto::PrivateKey &privateKey, uint32_t &authCounter) {
+	if (handleSize == STATELESS_HANDLE_SIZE && handle[0] == STATELESS_HANDLE_VERSION) {
+		// The tag is checked first: Nothing is decrypted unless the handle is ours, for this applicationHash
+		const uint8_t* ciphertext = handle + 1;
+		uint8_t state[AES256_BLOCK_SIZE], tag[STATELESS_TAG_SIZE];
+		startTag(applicationHash, state);
+		finishTag(state, ciphertext, tag);
+		if (!tagsEqual(tag, ciphertext + sizeof(crypto::PrivateKey))) {
+			LOG_DEBUG("Handle authentication failed");
+			return false;
+		}
+		encryptionKey.decryptCbc(ciphertext, sizeof(crypto::PrivateKey), privateKey, applicationHash);
+	} else if (handleSize == STATELESS_LEGACY_HANDLE_SIZE && acceptLegacyHandles) {
+		if (!fetchLegacyHandle(applicationHash, handle, privateKey))
+			return false;
+	} else {
+		// Invalid size
+		LOG_DEBUG("Invalid handle size: %d", handleSize);
+		return false;
+	}
 
 	// AuthCounter must be monotonically increasing.
 	// Since we want to be stateless, we can use timestamp for it
@@ -57,3 +137,88 @@ bool u2f::StatelessCore::fetchHandle(const u2f::crypto::Hash &applicationHash, c
 
 	return true;
 }
+
+void u2f::StatelessCore::checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]) {
+	// Versioned handles: Every tag starts from the same state, since the applicationHash comes first,
+	// so up to CHECK_BATCH tags are completed at once
+	uint8_t state[AES256_BLOCK_SIZE];
+	uint8_t messages[CHECK_BATCH][sizeof(crypto::PrivateKey)];
+	uint8_t* messagePointers[CHECK_BATCH];
+	const uint8_t* states[CHECK_BATCH];
+	uint32_t indexes[CHECK_BATCH];
+	for (uint32_t j=0; j<CHECK_BATCH; j++) {
+		messagePointers[j] = messages[j];
+		states[j] = state;
+	}
+
+	bool started = false;
+	uint32_t legacyCount = 0;
+	uint32_t i = 0;
+	while (i < count) {
+		uint32_t batch = 0;
+		for (; i<count && batch<CHECK_BATCH; i++) {
+			owned[i] = false;
+			if (handleSizes[i] == STATELESS_LEGACY_HANDLE_SIZE && acceptLegacyHandles) {
+				legacyCount++;
+			}
+			if (handleSizes[i] != STATELESS_HANDLE_SIZE || (*handles[i])[0] != STATELESS_HANDLE_VERSION)
+				continue;
+			memcpy(messages[batch], *handles[i] + 1, sizeof(crypto::PrivateKey));
+			for (int k=0; k<AES256_BLOCK_SIZE; k++) {
+				messages[batch][sizeof(crypto::PrivateKey) - AES256_BLOCK_SIZE + k] ^= macSubkey[k];
+			}
+			indexes[batch++] = i;
+		}
+		if (batch == 0)
+			continue;
+
+		if (!started) {
+			startTag(applicationHash, state);
+			started = true;
+		}
+		macKey.encryptCbcBatch(batch, messagePointers, sizeof(crypto::PrivateKey), messagePointers, states);
+		for (uint32_t j=0; j<batch; j++) {
+			const uint8_t* tag = messages[j] + sizeof(crypto::PrivateKey) - AES256_BLOCK_SIZE;
+			owned[indexes[j]] = tagsEqual(tag, *handles[indexes[j]] + 1 + sizeof(crypto::PrivateKey));
+		}
+	}
+	if (legacyCount == 0)
+		return;
+
+	// Legacy handles are AES-CBC([privateKey, applicationHash]): The applicationHash is in the last 2 blocks,
+	// which can be decrypted using the previous ciphertext blocks, without ever touching the private key.
+	const uint32_t firstBlock = sizeof(crypto::PrivateKey) / AES256_BLOCK_SIZE;
+	const uint32_t lastBlock = (sizeof(crypto::PrivateKey) + sizeof(crypto::Hash)) / AES256_BLOCK_SIZE;
+	const uint32_t blocks = lastBlock - firstBlock;
+
+	// Gathers those blocks from up to CHECK_BATCH handles, and decrypts them all at once
+	const uint8_t* ciphertexts[CHECK_BATCH * blocks];
+	uint8_t plaintexts[CHECK_BATCH * blocks][AES256_BLOCK_SIZE];
+	uint8_t* outputs[CHECK_BATCH * blocks];
+	for (uint32_t j=0; j<CHECK_BATCH * blocks; j++) {
+		outputs[j] = plaintexts[j];
+	}
+
+	i = 0;
+	while (i < count) {
+		uint32_t batch = 0;
+		for (; i<count && batch<CHECK_BATCH; i++) {
+			if (handleSizes[i] != STATELESS_LEGACY_HANDLE_SIZE)
+				continue;
+			for (uint32_t block=0; block<blocks; block++) {
+				ciphertexts[batch * blocks + block] = *handles[i] + (firstBlock + block) * AES256_BLOCK_SIZE;
+			}
+			indexes[batch++] = i;
+		}
+
+		legacyKey.decryptBlocks(batch * blocks, ciphertexts, outputs);
+		for (uint32_t j=0; j<batch * blocks; j++) {
+			for (int k=0; k<AES256_BLOCK_SIZE; k++) {
+				plaintexts[j][k] ^= ciphertexts[j][k - AES256_BLOCK_SIZE];
+			}
+		}
+		for (uint32_t j=0; j<batch; j++) {
+			owned[indexes[j]] = !memcmp(plaintexts[j * blocks], applicationHash, sizeof(crypto::Hash));
+		}
+	}
+}
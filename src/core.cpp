@@ -1,8 +1,16 @@
 #include <u2f/core.h>
-#include <stdio.h>
+#include <u2f/crypto-attestation.h>
+#include <u2f/crypto-sha256.h>
+#include <u2f/log.h>
 #include <string.h>
+#include <stdlib.h>
 
-#define LOG(fmt, ...) fprintf(stderr, "u2f-core: " fmt "\n", ##__VA_ARGS__)
+#ifdef U2F_STATS
+#include <typeinfo>
+#include <cxxabi.h>
+#endif
+
+#define LOG_TAG "u2f-core"
 
 #define SW_NO_ERROR                 0x9000 // The command completed successfully without error.
 #define SW_CONDITIONS_NOT_SATISFIED 0x6985 // The request was rejected due to test-of-user-presence being required.
@@ -19,24 +27,152 @@
 #define AUTH_ENFORCE_USER_SIGN        0x03
 #define AUTH_DONT_ENFORCE_USER_SIGN   0x08
 
+// Largest batch handed to Signer::signBatch() by signDeferred(). Larger ones are split.
+#define SIGN_DEFERRED_MAX_BATCH 32
+
+// Response of the allocating processRawAdpu(), before it is copied
+static thread_local uint8_t responseBuffer[U2F_MAX_RESPONSE_SIZE];
 
 bool u2f::Core::processRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, const uint8_t *&rawResponse, uint32_t& rawResponseSize) {
-	if (rawRequestSize < 4)
+	uint8_t cla, ins, p1, p2;
+	const uint8_t* request = nullptr;
+	uint32_t requestSize = 0;
+	uint32_t responseSize = 0;
+
+	if (!parseRawAdpu(rawRequest, rawRequestSize, cla, ins, p1, p2, request, requestSize, responseSize))
 		return false;
 
-	uint8_t cla = rawRequest[0];
-	uint8_t ins = rawRequest[1];
-	uint8_t p1 = rawRequest[2];
-	uint8_t p2 = rawRequest[3];
+	// Le defaults to 65536 bytes, while responses are a few hundred: Only allocate what was written
+	if (!processRawAdpu(rawRequest, rawRequestSize, responseBuffer, responseSize+2, rawResponseSize))
+		return false;
+
+	uint8_t* response = new uint8_t[rawResponseSize];
+	memcpy(response, responseBuffer, rawResponseSize);
+	rawResponse = response;
+	return true;
+}
 
+bool u2f::Core::processRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, uint8_t *rawResponse, uint32_t rawResponseCapacity, uint32_t& rawResponseSize) {
+	DeferredAdpu deferred;
+	if (!beginRawAdpu(rawRequest, rawRequestSize, rawResponse, rawResponseCapacity, deferred))
+		return false;
+
+	if (deferred.signer.get()) {
+		stats::Scope statsScope(getStats(), deferred.instruction);
+		crypto::Signature &signature = *(crypto::Signature*)&deferred.rawResponse[deferred.responseSize];
+		deferred.signatureValid = deferred.signer.get()->sign(deferred.messageHash, signature);
+	}
+	finishRawAdpu(deferred, rawResponseSize);
+	return true;
+}
+
+bool u2f::Core::beginRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, uint8_t *rawResponse, uint32_t rawResponseCapacity, DeferredAdpu &deferred) {
+	uint8_t cla, ins, p1, p2;
 	const uint8_t* request = nullptr;
 	uint32_t requestSize = 0;
-
-	uint8_t* response = nullptr;
 	uint32_t responseSize = 0;
 
+	if (rawResponseCapacity < 2)
+		return false; // Not even the status word fits
+
+	deferred.rawResponse = rawResponse;
+	deferred.signer.release();
+	deferred.signatureValid = false;
+	deferred.recorder = traceRecorder.load(std::memory_order_relaxed);
+	if (deferred.recorder)
+		deferred.recorder->record(trace::RECORD_APDU_REQUEST, rawRequest, rawRequestSize);
+
+	// STAGE_REQUEST is recorded by finishRawAdpu()
+	deferred.startedAt = stats::now();
+	stats::Scope statsScope(getStats());
+	stats::Timer parseTimer(stats::STAGE_PARSE);
+	if (!parseRawAdpu(rawRequest, rawRequestSize, cla, ins, p1, p2, request, requestSize, responseSize))
+		return false;
+	deferred.instruction = stats::getInstruction(ins);
+	statsScope.setInstruction(deferred.instruction);
+	parseTimer.stop();
+
+	// Never write past the caller's buffer, whatever the request's Le says
+	if (responseSize > rawResponseCapacity - 2)
+		responseSize = rawResponseCapacity - 2;
+
+	deferred.sw = processRequest(cla, ins, p1, p2, request, requestSize, rawResponse, responseSize, deferred);
+	deferred.responseSize = responseSize;
+	return true;
+}
+
+void u2f::Core::signDeferred(uint32_t count, DeferredAdpu* const deferred[]) {
+	crypto::Signer* signers[SIGN_DEFERRED_MAX_BATCH];
+	const crypto::Hash* messageHashes[SIGN_DEFERRED_MAX_BATCH];
+	crypto::Signature* signatures[SIGN_DEFERRED_MAX_BATCH];
+	bool success[SIGN_DEFERRED_MAX_BATCH];
+	DeferredAdpu* pending[SIGN_DEFERRED_MAX_BATCH];
+
+	uint32_t i = 0;
+	while (i < count) {
+		uint32_t batchSize = 0;
+		for (; i < count && batchSize < SIGN_DEFERRED_MAX_BATCH; i++) {
+			if (deferred[i]->signer.get() == nullptr)
+				continue;
+			pending[batchSize] = deferred[i];
+			signers[batchSize] = deferred[i]->signer.get();
+			messageHashes[batchSize] = &deferred[i]->messageHash;
+			signatures[batchSize] = (crypto::Signature*)&deferred[i]->rawResponse[deferred[i]->responseSize];
+			batchSize++;
+		}
+
+		crypto::Signer::signBatch(batchSize, signers, messageHashes, signatures, success);
+		for (uint32_t j=0; j<batchSize; j++) {
+			pending[j]->signatureValid = success[j];
+		}
+	}
+}
+
+void u2f::Core::finishRawAdpu(DeferredAdpu &deferred, uint32_t& rawResponseSize) {
+	uint8_t* rawResponse = deferred.rawResponse;
+	uint32_t responseSize = deferred.responseSize;
+	uint16_t sw = deferred.sw;
+
+	if (deferred.signer.get()) {
+		if (deferred.signatureValid) {
+			responseSize += crypto::signatureSize(*(crypto::Signature*)&rawResponse[responseSize]);
+		} else {
+			LOG_ERROR("Failed to sign the response");
+			responseSize = 0;
+			sw = SW_CONDITIONS_NOT_SATISFIED;
+		}
+		deferred.signer.release();
+	}
+
+	rawResponse[responseSize  ] = (sw >> 8);
+	rawResponse[responseSize+1] = (sw >> 0);
+
+	rawResponseSize = responseSize + 2;
+
+	if (deferred.recorder)
+		deferred.recorder->record(trace::RECORD_APDU_RESPONSE, rawResponse, rawResponseSize);
+
+	stats::Scope statsScope(getStats(), deferred.instruction);
+	stats::record(stats::STAGE_REQUEST, stats::now() - deferred.startedAt);
+}
+
+bool u2f::Core::parseRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSize, uint8_t &cla, uint8_t &ins, uint8_t &p1, uint8_t &p2, const uint8_t *&request, uint32_t &requestSize, uint32_t &responseSize) {
+	if (rawRequestSize < 4)
+		return false;
+
+	cla = rawRequest[0];
+	ins = rawRequest[1];
+	p1 = rawRequest[2];
+	p2 = rawRequest[3];
+
+	request = nullptr;
+	requestSize = 0;
+
+	// Clients often omit Le, so treat a missing Le as "as much as you need"
+	responseSize = 0x10000;
+
 	if (rawRequestSize == 4) {
-		// Valid request, with empty request and response
+		// Valid request, with empty request and no response size
 	} else if (rawRequestSize < 7) {
 		// Invalid size
 		return false;
@@ -57,7 +193,7 @@ bool u2f::Core::processRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSiz
 		request = rawRequest + 7;
 
 		if (requestSize == rawRequestSize - 7) {
-			//Valid, empty response
+			//Valid, no response size
 		} else if (requestSize == rawRequestSize - 9) {
 			//Payload followed by response size
 			responseSize = (rawRequest[7+requestSize] << 8) | (rawRequest[8+requestSize] << 0);
@@ -69,37 +205,29 @@ bool u2f::Core::processRawAdpu(const uint8_t* rawRequest, uint32_t rawRequestSiz
 		}
 	}
 
-	response = new uint8_t[responseSize+2];
-	uint16_t sw = processRequest(cla, ins, p1, p2, request, requestSize, response, responseSize);
-	response[responseSize  ] = (sw >> 8);
-	response[responseSize+1] = (sw >> 0);
-
-	rawResponse = response;
-	rawResponseSize = responseSize + 2;
-
 	return true;
 }
 
-uint16_t u2f::Core::processRequest(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize) {
+uint16_t u2f::Core::processRequest(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize, DeferredAdpu &deferred) {
 	if (cla != 0) {
-		LOG("Unknown CLA: %d", cla);
+		LOG_INFO("Unknown CLA: %d", cla);
 		responseSize = 0;
 		return SW_CLA_NOT_SUPPORTED;
 	}
 
 	switch (ins) {
 		case INS_REGISTER: {
-			LOG("Register");
-			return processRegisterRequest(request, requestSize, response, responseSize);
+			LOG_DEBUG("Register");
+			return processRegisterRequest(request, requestSize, response, responseSize, deferred);
 		}
 
 		case INS_AUTHENTICATE: {
-			LOG("Authenticate - %d", p1);
-			return processAuthenticationRequest(p1, request, requestSize, response, responseSize);
+			LOG_DEBUG("Authenticate - %d", p1);
+			return processAuthenticationRequest(p1, request, requestSize, response, responseSize, deferred);
 		}
 
 		case INS_VERSION: {
-			LOG("Version");
+			LOG_DEBUG("Version");
 			if (responseSize < 6) {
 				responseSize = 0;
 				return SW_WRONG_LENGTH;
@@ -110,16 +238,16 @@ uint16_t u2f::Core::processRequest(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t
 		}
 
 		default: {
-			LOG("Unknown INS:%d", ins);
+			LOG_INFO("Unknown INS:%d", ins);
 			responseSize = 0;
 			return SW_INS_NOT_SUPPORTED;
 		}
 	}
 }
 
-uint16_t u2f::Core::processRegisterRequest(const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize) {
+uint16_t u2f::Core::processRegisterRequest(const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize, DeferredAdpu &deferred) {
 	if (requestSize != 64) {
-		LOG("Register request with wrong length: %d", requestSize);
+		LOG_INFO("Register request with wrong length: %d", requestSize);
 		responseSize = 0;
 		return SW_WRONG_LENGTH;
 	}
@@ -127,6 +255,28 @@ uint16_t u2f::Core::processRegisterRequest(const uint8_t *request, uint32_t requ
 	crypto::Hash &challengeHash = *(crypto::Hash*)&request[0];
 	crypto::Hash &applicationHash = *(crypto::Hash*)&request[32];
 
+	// Attestation
+	stats::Timer attestationTimer(stats::STAGE_ATTESTATION);
+	crypto::Signer *attestationSigner = getAttestationSigner();
+	attestationTimer.stop();
+	if (attestationSigner == nullptr) {
+		LOG_ERROR("No attestation signer");
+		responseSize = 0;
+		return SW_CONDITIONS_NOT_SATISFIED;
+	}
+
+	const uint8_t *attestationCertificate = nullptr;
+	uint16_t attestationCertificateSize = 0;
+	attestationSigner->getCertificate(attestationCertificate, attestationCertificateSize);
+
+	// Make sure the largest possible registration fits in the response
+	uint32_t maxResponseSize = 1 + sizeof(crypto::PublicKey) + 1 + sizeof(Handle) + attestationCertificateSize + sizeof(crypto::Signature);
+	if (responseSize < maxResponseSize) {
+		LOG_WARN("Register response may need %d bytes, only %d available", maxResponseSize, responseSize);
+		responseSize = 0;
+		return SW_WRONG_LENGTH;
+	}
+
 	responseSize = 0;
 
 	//Reserved byte
@@ -141,7 +291,10 @@ uint16_t u2f::Core::processRegisterRequest(const uint8_t *request, uint32_t requ
 	uint8_t &responseKeyHandleSize = response[responseSize++];
 	Handle &responseKeyHandle = *(Handle*)&response[responseSize];
 
-	if (!enroll(applicationHash, responseKeyHandle, responseKeyHandleSize, responsePublicKey)) {
+	stats::Timer enrollTimer(stats::STAGE_ENROLL);
+	bool enrolled = enroll(applicationHash, responseKeyHandle, responseKeyHandleSize, responsePublicKey);
+	enrollTimer.stop();
+	if (!enrolled) {
 		//Failed to create a key, probably because the user isn't present
 		responseSize = 0;
 		return SW_CONDITIONS_NOT_SATISFIED;
@@ -149,14 +302,7 @@ uint16_t u2f::Core::processRegisterRequest(const uint8_t *request, uint32_t requ
 
 	responseSize += responseKeyHandleSize;
 
-	// Attestation
-	crypto::Signer *attestationSigner = getAttestationSigner();
-
 	// Copy the attestation Certificate to the response
-	const uint8_t *attestationCertificate = nullptr;
-	uint16_t attestationCertificateSize = 0;
-	attestationSigner->getCertificate(attestationCertificate, attestationCertificateSize);
-
 	uint8_t *responseAttestationCertificate = &response[responseSize];
 	memcpy(responseAttestationCertificate, attestationCertificate, attestationCertificateSize);
 	responseSize += attestationCertificateSize;
@@ -164,33 +310,32 @@ uint16_t u2f::Core::processRegisterRequest(const uint8_t *request, uint32_t requ
 	// Calculates the challenge hash
 	crypto::Hash hash;
 	uint8_t hash_reserved = 0;
-	crypto::sha256(
-		hash,
-		&hash_reserved, 1,
-		applicationHash, sizeof(crypto::Hash),
-		challengeHash, sizeof(crypto::Hash),
-		responseKeyHandle, responseKeyHandleSize,
-		&responsePublicKey, sizeof(crypto::PublicKey),
-		nullptr);
-
-	//Sign the challenge
-	crypto::Signature &responseSignature = *(crypto::Signature*)&response[responseSize];
-	attestationSigner->sign(hash, responseSignature);
-	responseSize += crypto::signatureSize(responseSignature);
-
-	delete attestationSigner;
+	stats::Timer hashTimer(stats::STAGE_SHA256);
+	crypto::Sha256()
+		.update(&hash_reserved, 1)
+		.update(applicationHash, sizeof(crypto::Hash))
+		.update(challengeHash, sizeof(crypto::Hash))
+		.update(responseKeyHandle, responseKeyHandleSize)
+		.update(responsePublicKey, sizeof(crypto::PublicKey))
+		.finish(hash);
+	hashTimer.stop();
+
+	//Sign the challenge, right after the certificate
+	deferred.signer.borrow(attestationSigner);
+	memcpy(deferred.messageHash, hash, sizeof(crypto::Hash));
+
 	return SW_NO_ERROR;
 }
 
-uint16_t u2f::Core::processAuthenticationRequest(uint8_t control, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize) {
+uint16_t u2f::Core::processAuthenticationRequest(uint8_t control, const uint8_t *request, uint32_t requestSize, uint8_t *response, uint32_t &responseSize, DeferredAdpu &deferred) {
 	if (control != AUTH_CHECK_ONLY && control != AUTH_ENFORCE_USER_SIGN && control != AUTH_DONT_ENFORCE_USER_SIGN) {
-		LOG("Authenticate - Invalid sign condition %d", control);
+		LOG_INFO("Authenticate - Invalid sign condition %d", control);
 		responseSize = 0;
 		return SW_WRONG_DATA;
 	}
 
 	if (requestSize < 65) {
-		LOG("Authenticate - Request size is too small: %d", requestSize);
+		LOG_INFO("Authenticate - Request size is too small: %d", requestSize);
 		responseSize = 0;
 		return SW_WRONG_LENGTH;
 	}
@@ -202,26 +347,35 @@ uint16_t u2f::Core::processAuthenticationRequest(uint8_t control, const uint8_t
 	bool userPresent = false;
 	uint32_t authCounter = 0;
 
-	if (requestSize != handleSize + 65) {
-		LOG("Authenticate - Request size should be %d, was %d", handleSize + 65, requestSize);
+	if (requestSize != handleSize + 65u) {
+		LOG_INFO("Authenticate - Request size should be %d, was %d", handleSize + 65, requestSize);
+		responseSize = 0;
+		return SW_WRONG_LENGTH;
+	}
+
+	if (control != AUTH_CHECK_ONLY && responseSize < 5 + sizeof(crypto::Signature)) {
+		LOG_WARN("Authenticate - Response may need %d bytes, only %d available", (int)(5 + sizeof(crypto::Signature)), responseSize);
 		responseSize = 0;
 		return SW_WRONG_LENGTH;
 	}
 
-	crypto::Signer *signer = authenticate(applicationHash, handle, handleSize, control != AUTH_CHECK_ONLY, userPresent, authCounter);
+	stats::Timer authenticateTimer(stats::STAGE_AUTHENTICATE);
+	bool authenticated = authenticate(applicationHash, handle, handleSize, control != AUTH_CHECK_ONLY, userPresent, authCounter, deferred.signer);
+	authenticateTimer.stop();
 
 	// Check for invalid Handle
-	if (signer == nullptr) {
-		LOG("Authenticate - Invalid handle");
+	if (!authenticated || deferred.signer.get() == nullptr) {
+		LOG_DEBUG("Authenticate - Invalid handle");
 		responseSize = 0;
+		deferred.signer.release();
 		return SW_WRONG_DATA;
 	}
 
 	// Check for user not present
 	if (control == AUTH_CHECK_ONLY || (control == AUTH_ENFORCE_USER_SIGN && !userPresent)) {
-		LOG("Authenticate - User not present");
+		LOG_DEBUG("Authenticate - User not present");
 		responseSize = 0;
-		delete signer;
+		deferred.signer.release();
 		return SW_CONDITIONS_NOT_SATISFIED;
 	}
 
@@ -234,25 +388,77 @@ uint16_t u2f::Core::processAuthenticationRequest(uint8_t control, const uint8_t
 
 	// Perform signature
 	crypto::Hash hash;
-	crypto::sha256(
-		hash,
-		applicationHash, sizeof(crypto::Hash),
-		response, responseSize,
-		challengeHash, sizeof(crypto::Hash),
-		nullptr);
-
-	crypto::Signature &signature = *(crypto::Signature*)&response[responseSize];
-	signer->sign(hash, signature);
-	delete signer;
-	responseSize += crypto::signatureSize(signature);
-
-	LOG("Authenticate - Success");
+	stats::Timer hashTimer(stats::STAGE_SHA256);
+	crypto::Sha256()
+		.update(applicationHash, sizeof(crypto::Hash))
+		.update(response, responseSize)
+		.update(challengeHash, sizeof(crypto::Hash))
+		.finish(hash);
+	hashTimer.stop();
+
+	// Signature goes right after the counter
+	memcpy(deferred.messageHash, hash, sizeof(crypto::Hash));
+
+	LOG_DEBUG("Authenticate - Success");
 	return SW_NO_ERROR;
 }
 
+void u2f::Core::checkHandles(const crypto::Hash &applicationHash, uint32_t count, const Handle* const handles[], const uint8_t handleSizes[], bool owned[]) {
+	crypto::SignerSlot signer;
+	for (uint32_t i=0; i<count; i++) {
+		bool userPresent = false;
+		uint32_t authCounter = 0;
+		owned[i] = authenticate(applicationHash, *handles[i], handleSizes[i], false, userPresent, authCounter, signer);
+	}
+}
+
 void u2f::Core::wink() {
 }
 
+u2f::stats::Collector* u2f::Core::getStats() {
+#ifdef U2F_STATS
+	stats::Collector* collector = statsCollector.load(std::memory_order_acquire);
+	if (collector == nullptr) {
+		// Group statistics by the concrete type of the core
+		const char* mangledName = typeid(*this).name();
+		int status = 0;
+		char* name = abi::__cxa_demangle(mangledName, nullptr, nullptr, &status);
+		collector = stats::getCollector(status == 0 ? name : mangledName);
+		free(name);
+		statsCollector.store(collector, std::memory_order_release);
+	}
+	return collector;
+#else
+	return nullptr;
+#endif
+}
+
 bool u2f::Core::supportsWink() {
 	return false;
 }
+
+u2f::crypto::Signer* u2f::Core::getAttestationSigner() {
+	crypto::Signer* signer = attestationSigner.load(std::memory_order_acquire);
+	return signer ? signer : crypto::AttestationSigner::getDefault();
+}
+
+void u2f::Core::setAttestationSigner(crypto::Signer* signer) {
+	attestationSigner.store(signer, std::memory_order_release);
+}
+
+u2f::KeyPool* u2f::Core::getKeyPool() {
+	return keyPool.load(std::memory_order_acquire);
+}
+
+void u2f::Core::setKeyPool(KeyPool* pool) {
+	keyPool.store(pool, std::memory_order_release);
+}
+
+bool u2f::Core::makeKeyPair(crypto::PublicKey &publicKey, crypto::PrivateKey &privateKey) {
+	KeyPool* pool = getKeyPool();
+	return pool ? pool->makeKeyPair(publicKey, privateKey) : crypto::makeKeyPair(publicKey, privateKey);
+}
+
+void u2f::Core::setTraceRecorder(trace::Recorder* recorder) {
+	traceRecorder.store(recorder);
+}
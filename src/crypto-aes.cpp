@@ -0,0 +1,544 @@
+#include <u2f/crypto-aes.h>
+#include <aes.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AES_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && defined(__linux__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define AES_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Independent blocks in flight: Enough to cover the latency of an AES round on current cores.
+// BLOCK_LANES must be a multiple of 4, for the halving batches of decryptBlocks.
+#define CBC_LANES 4
+#define BLOCK_LANES 8
+
+typedef void (*SetKeyFunction)(u2f::crypto::AesSchedule &schedule, const uint8_t key[AES256_KEY_SIZE]);
+typedef void (*CbcFunction)(const u2f::crypto::AesSchedule &schedule, const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]);
+typedef void (*CbcBatchFunction)(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]);
+typedef void (*BlocksFunction)(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], uint8_t* const out[]);
+typedef uint32_t (*SubWordFunction)(uint32_t word);
+
+static void setKeyPortable(u2f::crypto::AesSchedule &schedule, const uint8_t key[AES256_KEY_SIZE]) {
+	aes_key_setup(key, schedule.words, 256);
+}
+
+static void encryptCbcPortable(const u2f::crypto::AesSchedule &schedule, const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) {
+	aes_encrypt_cbc(in, size, out, schedule.words, 256, iv);
+}
+
+static void encryptCbcBatchPortable(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]) {
+	for (uint32_t i=0; i<count; i++) {
+		aes_encrypt_cbc(in[i], size, out[i], schedule.words, 256, iv[i]);
+	}
+}
+
+static void decryptCbcPortable(const u2f::crypto::AesSchedule &schedule, const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) {
+	aes_decrypt_cbc(in, size, out, schedule.words, 256, iv);
+}
+
+static void decryptBlocksPortable(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], uint8_t* const out[]) {
+	for (uint32_t i=0; i<count; i++) {
+		aes_decrypt(in[i], out[i], schedule.words, 256);
+	}
+}
+
+#if defined(AES_X86) || defined(AES_ARM)
+/**
+ * FIPS-197 key expansion into the round keys used by the AES instructions, with SubWord done by the instructions too.
+ * Words are little-endian, so RotWord is a right rotation, and the round constant goes in the low byte.
+ */
+static void expandKey(const uint8_t key[AES256_KEY_SIZE], SubWordFunction subWord, uint8_t roundKeys[AES256_ROUNDS + 1][AES256_BLOCK_SIZE]) {
+	uint32_t w[4 * (AES256_ROUNDS + 1)];
+	memcpy(w, key, AES256_KEY_SIZE);
+	uint32_t rcon = 1;
+	for (int i=8; i<4 * (AES256_ROUNDS + 1); i++) {
+		uint32_t temp = w[i-1];
+		if (i % 8 == 0) {
+			temp = subWord((temp >> 8) | (temp << 24)) ^ rcon;
+			rcon <<= 1;
+		} else if (i % 8 == 4) {
+			temp = subWord(temp);
+		}
+		w[i] = w[i-8] ^ temp;
+	}
+	memcpy(roundKeys, w, sizeof(w));
+	memset(w, 0, sizeof(w));
+}
+#endif
+
+#ifdef AES_X86
+/**
+ * With the word in every column, ShiftRows has no effect, so AESENCLAST with a zero key is just SubBytes
+ */
+__attribute__((target("aes,sse2")))
+static uint32_t subWordAesNi(uint32_t word) {
+	__m128i state = _mm_set1_epi32((int)word);
+	state = _mm_aesenclast_si128(state, _mm_setzero_si128());
+	return (uint32_t)_mm_cvtsi128_si32(state);
+}
+
+__attribute__((target("aes,sse2")))
+static void setKeyAesNi(u2f::crypto::AesSchedule &schedule, const uint8_t key[AES256_KEY_SIZE]) {
+	expandKey(key, subWordAesNi, schedule.encrypt);
+
+	// Equivalent inverse cipher: Round keys in reverse order, with InvMixColumns applied to the inner ones
+	memcpy(schedule.decrypt[0], schedule.encrypt[AES256_ROUNDS], AES256_BLOCK_SIZE);
+	for (int round=1; round<AES256_ROUNDS; round++) {
+		__m128i roundKey = _mm_load_si128((const __m128i*)schedule.encrypt[AES256_ROUNDS - round]);
+		_mm_store_si128((__m128i*)schedule.decrypt[round], _mm_aesimc_si128(roundKey));
+	}
+	memcpy(schedule.decrypt[AES256_ROUNDS], schedule.encrypt[0], AES256_BLOCK_SIZE);
+}
+
+__attribute__((target("aes,sse2")))
+static void encryptCbcAesNi(const u2f::crypto::AesSchedule &schedule, const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) {
+	__m128i keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = _mm_load_si128((const __m128i*)schedule.encrypt[round]);
+	}
+
+	// Each block depends on the previous one: Nothing to interleave
+	__m128i state = _mm_loadu_si128((const __m128i*)iv);
+	for (size_t offset=0; offset + AES256_BLOCK_SIZE <= size; offset += AES256_BLOCK_SIZE) {
+		state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i*)(in + offset)));
+		state = _mm_xor_si128(state, keys[0]);
+		for (int round=1; round<AES256_ROUNDS; round++) {
+			state = _mm_aesenc_si128(state, keys[round]);
+		}
+		state = _mm_aesenclast_si128(state, keys[AES256_ROUNDS]);
+		_mm_storeu_si128((__m128i*)(out + offset), state);
+	}
+}
+
+/**
+ * Encrypts LANES independent CBC messages, block by block, interleaving their rounds
+ */
+template<int LANES>
+__attribute__((target("aes,sse2"))) inline
+static void encryptCbcLanesAesNi(const __m128i keys[AES256_ROUNDS + 1], const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]) {
+	__m128i state[LANES];
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		state[lane] = _mm_loadu_si128((const __m128i*)iv[lane]);
+	}
+	for (size_t offset=0; offset + AES256_BLOCK_SIZE <= size; offset += AES256_BLOCK_SIZE) {
+		#pragma GCC unroll 8
+		for (int lane=0; lane<LANES; lane++) {
+			state[lane] = _mm_xor_si128(state[lane], _mm_loadu_si128((const __m128i*)(in[lane] + offset)));
+			state[lane] = _mm_xor_si128(state[lane], keys[0]);
+		}
+		for (int round=1; round<AES256_ROUNDS; round++) {
+			#pragma GCC unroll 8
+			for (int lane=0; lane<LANES; lane++) {
+				state[lane] = _mm_aesenc_si128(state[lane], keys[round]);
+			}
+		}
+		#pragma GCC unroll 8
+		for (int lane=0; lane<LANES; lane++) {
+			state[lane] = _mm_aesenclast_si128(state[lane], keys[AES256_ROUNDS]);
+			_mm_storeu_si128((__m128i*)(out[lane] + offset), state[lane]);
+		}
+	}
+}
+
+__attribute__((target("aes,sse2")))
+static void encryptCbcBatchAesNi(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]) {
+	__m128i keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = _mm_load_si128((const __m128i*)schedule.encrypt[round]);
+	}
+
+	// Full batches, then the rest in halving batches
+	uint32_t i = 0;
+	for (; i + BLOCK_LANES <= count; i += BLOCK_LANES) {
+		encryptCbcLanesAesNi<BLOCK_LANES>(keys, in + i, size, out + i, iv + i);
+	}
+	if (i + BLOCK_LANES / 2 <= count) {
+		encryptCbcLanesAesNi<BLOCK_LANES / 2>(keys, in + i, size, out + i, iv + i);
+		i += BLOCK_LANES / 2;
+	}
+	if (i + BLOCK_LANES / 4 <= count) {
+		encryptCbcLanesAesNi<BLOCK_LANES / 4>(keys, in + i, size, out + i, iv + i);
+		i += BLOCK_LANES / 4;
+	}
+	if (i < count) {
+		encryptCbcLanesAesNi<1>(keys, in + i, size, out + i, iv + i);
+	}
+}
+
+/**
+ * Decrypts LANES independent blocks, round by round, so that the AESDEC of one block overlaps with the others
+ */
+template<int LANES>
+__attribute__((target("aes,sse2"))) inline
+static void decryptLanesAesNi(const __m128i keys[AES256_ROUNDS + 1], __m128i state[LANES]) {
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		state[lane] = _mm_xor_si128(state[lane], keys[0]);
+	}
+	for (int round=1; round<AES256_ROUNDS; round++) {
+		#pragma GCC unroll 8
+		for (int lane=0; lane<LANES; lane++) {
+			state[lane] = _mm_aesdec_si128(state[lane], keys[round]);
+		}
+	}
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		state[lane] = _mm_aesdeclast_si128(state[lane], keys[AES256_ROUNDS]);
+	}
+}
+
+/**
+ * Decrypts LANES consecutive CBC blocks, #previous being the ciphertext block before them
+ */
+template<int LANES>
+__attribute__((target("aes,sse2"))) inline
+static void decryptCbcLanesAesNi(const __m128i keys[AES256_ROUNDS + 1], const uint8_t* in, uint8_t* out, __m128i &previous) {
+	__m128i ciphertext[LANES], state[LANES];
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		ciphertext[lane] = _mm_loadu_si128((const __m128i*)(in + lane * AES256_BLOCK_SIZE));
+		state[lane] = ciphertext[lane];
+	}
+	decryptLanesAesNi<LANES>(keys, state);
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		_mm_storeu_si128((__m128i*)(out + lane * AES256_BLOCK_SIZE), _mm_xor_si128(state[lane], previous));
+		previous = ciphertext[lane];
+	}
+}
+
+__attribute__((target("aes,sse2")))
+static void decryptCbcAesNi(const u2f::crypto::AesSchedule &schedule, const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) {
+	__m128i keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = _mm_load_si128((const __m128i*)schedule.decrypt[round]);
+	}
+
+	// Unlike encryption, every block can be decrypted at once, and then XORed with the previous ciphertext block
+	__m128i previous = _mm_loadu_si128((const __m128i*)iv);
+	size_t offset = 0;
+	for (; offset + CBC_LANES * AES256_BLOCK_SIZE <= size; offset += CBC_LANES * AES256_BLOCK_SIZE) {
+		decryptCbcLanesAesNi<CBC_LANES>(keys, in + offset, out + offset, previous);
+	}
+	for (; offset + AES256_BLOCK_SIZE <= size; offset += AES256_BLOCK_SIZE) {
+		decryptCbcLanesAesNi<1>(keys, in + offset, out + offset, previous);
+	}
+}
+
+template<int LANES>
+__attribute__((target("aes,sse2"))) inline
+static void decryptBlockLanesAesNi(const __m128i keys[AES256_ROUNDS + 1], const uint8_t* const in[], uint8_t* const out[]) {
+	__m128i state[LANES];
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		state[lane] = _mm_loadu_si128((const __m128i*)in[lane]);
+	}
+	decryptLanesAesNi<LANES>(keys, state);
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		_mm_storeu_si128((__m128i*)out[lane], state[lane]);
+	}
+}
+
+__attribute__((target("aes,sse2")))
+static void decryptBlocksAesNi(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], uint8_t* const out[]) {
+	__m128i keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = _mm_load_si128((const __m128i*)schedule.decrypt[round]);
+	}
+
+	// Full batches, then the rest in halving batches
+	uint32_t i = 0;
+	for (; i + BLOCK_LANES <= count; i += BLOCK_LANES) {
+		decryptBlockLanesAesNi<BLOCK_LANES>(keys, in + i, out + i);
+	}
+	if (i + BLOCK_LANES / 2 <= count) {
+		decryptBlockLanesAesNi<BLOCK_LANES / 2>(keys, in + i, out + i);
+		i += BLOCK_LANES / 2;
+	}
+	if (i + BLOCK_LANES / 4 <= count) {
+		decryptBlockLanesAesNi<BLOCK_LANES / 4>(keys, in + i, out + i);
+		i += BLOCK_LANES / 4;
+	}
+	if (i < count) {
+		decryptBlockLanesAesNi<1>(keys, in + i, out + i);
+	}
+}
+
+static bool cpuSupportsAesNi() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+#endif
+
+#ifdef AES_ARM
+/**
+ * With the word in every column, ShiftRows has no effect, so AESE with a zero key is just SubBytes
+ */
+__attribute__((target("+crypto")))
+static uint32_t subWordArm(uint32_t word) {
+	uint8x16_t state = vreinterpretq_u8_u32(vdupq_n_u32(word));
+	state = vaeseq_u8(state, vdupq_n_u8(0));
+	return vgetq_lane_u32(vreinterpretq_u32_u8(state), 0);
+}
+
+__attribute__((target("+crypto")))
+static void setKeyArm(u2f::crypto::AesSchedule &schedule, const uint8_t key[AES256_KEY_SIZE]) {
+	expandKey(key, subWordArm, schedule.encrypt);
+
+	// Equivalent inverse cipher: Round keys in reverse order, with InvMixColumns applied to the inner ones
+	memcpy(schedule.decrypt[0], schedule.encrypt[AES256_ROUNDS], AES256_BLOCK_SIZE);
+	for (int round=1; round<AES256_ROUNDS; round++) {
+		vst1q_u8(schedule.decrypt[round], vaesimcq_u8(vld1q_u8(schedule.encrypt[AES256_ROUNDS - round])));
+	}
+	memcpy(schedule.decrypt[AES256_ROUNDS], schedule.encrypt[0], AES256_BLOCK_SIZE);
+}
+
+__attribute__((target("+crypto")))
+static void encryptCbcArm(const u2f::crypto::AesSchedule &schedule, const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) {
+	uint8x16_t keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = vld1q_u8(schedule.encrypt[round]);
+	}
+
+	// AESE adds the round key before SubBytes and ShiftRows, so the last round key is added on its own
+	uint8x16_t state = vld1q_u8(iv);
+	for (size_t offset=0; offset + AES256_BLOCK_SIZE <= size; offset += AES256_BLOCK_SIZE) {
+		state = veorq_u8(state, vld1q_u8(in + offset));
+		for (int round=0; round<AES256_ROUNDS - 1; round++) {
+			state = vaesmcq_u8(vaeseq_u8(state, keys[round]));
+		}
+		state = vaeseq_u8(state, keys[AES256_ROUNDS - 1]);
+		state = veorq_u8(state, keys[AES256_ROUNDS]);
+		vst1q_u8(out + offset, state);
+	}
+}
+
+/**
+ * Encrypts LANES independent CBC messages, block by block, interleaving their rounds
+ */
+template<int LANES>
+__attribute__((target("+crypto"))) inline
+static void encryptCbcLanesArm(const uint8x16_t keys[AES256_ROUNDS + 1], const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]) {
+	uint8x16_t state[LANES];
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		state[lane] = vld1q_u8(iv[lane]);
+	}
+	for (size_t offset=0; offset + AES256_BLOCK_SIZE <= size; offset += AES256_BLOCK_SIZE) {
+		#pragma GCC unroll 8
+		for (int lane=0; lane<LANES; lane++) {
+			state[lane] = veorq_u8(state[lane], vld1q_u8(in[lane] + offset));
+		}
+		for (int round=0; round<AES256_ROUNDS - 1; round++) {
+			#pragma GCC unroll 8
+			for (int lane=0; lane<LANES; lane++) {
+				state[lane] = vaesmcq_u8(vaeseq_u8(state[lane], keys[round]));
+			}
+		}
+		#pragma GCC unroll 8
+		for (int lane=0; lane<LANES; lane++) {
+			state[lane] = veorq_u8(vaeseq_u8(state[lane], keys[AES256_ROUNDS - 1]), keys[AES256_ROUNDS]);
+			vst1q_u8(out[lane] + offset, state[lane]);
+		}
+	}
+}
+
+__attribute__((target("+crypto")))
+static void encryptCbcBatchArm(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]) {
+	uint8x16_t keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = vld1q_u8(schedule.encrypt[round]);
+	}
+
+	// Full batches, then the rest in halving batches
+	uint32_t i = 0;
+	for (; i + BLOCK_LANES <= count; i += BLOCK_LANES) {
+		encryptCbcLanesArm<BLOCK_LANES>(keys, in + i, size, out + i, iv + i);
+	}
+	if (i + BLOCK_LANES / 2 <= count) {
+		encryptCbcLanesArm<BLOCK_LANES / 2>(keys, in + i, size, out + i, iv + i);
+		i += BLOCK_LANES / 2;
+	}
+	if (i + BLOCK_LANES / 4 <= count) {
+		encryptCbcLanesArm<BLOCK_LANES / 4>(keys, in + i, size, out + i, iv + i);
+		i += BLOCK_LANES / 4;
+	}
+	if (i < count) {
+		encryptCbcLanesArm<1>(keys, in + i, size, out + i, iv + i);
+	}
+}
+
+/**
+ * Decrypts LANES independent blocks, round by round, so that the AESD of one block overlaps with the others
+ */
+template<int LANES>
+__attribute__((target("+crypto"))) inline
+static void decryptLanesArm(const uint8x16_t keys[AES256_ROUNDS + 1], uint8x16_t state[LANES]) {
+	for (int round=0; round<AES256_ROUNDS - 1; round++) {
+		#pragma GCC unroll 8
+		for (int lane=0; lane<LANES; lane++) {
+			state[lane] = vaesimcq_u8(vaesdq_u8(state[lane], keys[round]));
+		}
+	}
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		state[lane] = veorq_u8(vaesdq_u8(state[lane], keys[AES256_ROUNDS - 1]), keys[AES256_ROUNDS]);
+	}
+}
+
+/**
+ * Decrypts LANES consecutive CBC blocks, #previous being the ciphertext block before them
+ */
+template<int LANES>
+__attribute__((target("+crypto"))) inline
+static void decryptCbcLanesArm(const uint8x16_t keys[AES256_ROUNDS + 1], const uint8_t* in, uint8_t* out, uint8x16_t &previous) {
+	uint8x16_t ciphertext[LANES], state[LANES];
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		ciphertext[lane] = vld1q_u8(in + lane * AES256_BLOCK_SIZE);
+		state[lane] = ciphertext[lane];
+	}
+	decryptLanesArm<LANES>(keys, state);
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		vst1q_u8(out + lane * AES256_BLOCK_SIZE, veorq_u8(state[lane], previous));
+		previous = ciphertext[lane];
+	}
+}
+
+__attribute__((target("+crypto")))
+static void decryptCbcArm(const u2f::crypto::AesSchedule &schedule, const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) {
+	uint8x16_t keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = vld1q_u8(schedule.decrypt[round]);
+	}
+
+	// Unlike encryption, every block can be decrypted at once, and then XORed with the previous ciphertext block
+	uint8x16_t previous = vld1q_u8(iv);
+	size_t offset = 0;
+	for (; offset + CBC_LANES * AES256_BLOCK_SIZE <= size; offset += CBC_LANES * AES256_BLOCK_SIZE) {
+		decryptCbcLanesArm<CBC_LANES>(keys, in + offset, out + offset, previous);
+	}
+	for (; offset + AES256_BLOCK_SIZE <= size; offset += AES256_BLOCK_SIZE) {
+		decryptCbcLanesArm<1>(keys, in + offset, out + offset, previous);
+	}
+}
+
+template<int LANES>
+__attribute__((target("+crypto"))) inline
+static void decryptBlockLanesArm(const uint8x16_t keys[AES256_ROUNDS + 1], const uint8_t* const in[], uint8_t* const out[]) {
+	uint8x16_t state[LANES];
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		state[lane] = vld1q_u8(in[lane]);
+	}
+	decryptLanesArm<LANES>(keys, state);
+	#pragma GCC unroll 8
+	for (int lane=0; lane<LANES; lane++) {
+		vst1q_u8(out[lane], state[lane]);
+	}
+}
+
+__attribute__((target("+crypto")))
+static void decryptBlocksArm(const u2f::crypto::AesSchedule &schedule, uint32_t count, const uint8_t* const in[], uint8_t* const out[]) {
+	uint8x16_t keys[AES256_ROUNDS + 1];
+	for (int round=0; round<=AES256_ROUNDS; round++) {
+		keys[round] = vld1q_u8(schedule.decrypt[round]);
+	}
+
+	// Full batches, then the rest in halving batches
+	uint32_t i = 0;
+	for (; i + BLOCK_LANES <= count; i += BLOCK_LANES) {
+		decryptBlockLanesArm<BLOCK_LANES>(keys, in + i, out + i);
+	}
+	if (i + BLOCK_LANES / 2 <= count) {
+		decryptBlockLanesArm<BLOCK_LANES / 2>(keys, in + i, out + i);
+		i += BLOCK_LANES / 2;
+	}
+	if (i + BLOCK_LANES / 4 <= count) {
+		decryptBlockLanesArm<BLOCK_LANES / 4>(keys, in + i, out + i);
+		i += BLOCK_LANES / 4;
+	}
+	if (i < count) {
+		decryptBlockLanesArm<1>(keys, in + i, out + i);
+	}
+}
+
+static bool cpuSupportsArmAes() {
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+#endif
+
+struct Implementation {
+	SetKeyFunction setKey;
+	CbcFunction encryptCbc;
+	CbcBatchFunction encryptCbcBatch;
+	CbcFunction decryptCbc;
+	BlocksFunction decryptBlocks;
+	const char* name;
+};
+
+static const Implementation& getImplementation() {
+	static const Implementation implementation = []() -> Implementation {
+#ifdef AES_X86
+		if (cpuSupportsAesNi())
+			return { setKeyAesNi, encryptCbcAesNi, encryptCbcBatchAesNi, decryptCbcAesNi, decryptBlocksAesNi, "aes-ni" };
+#endif
+#ifdef AES_ARM
+		if (cpuSupportsArmAes())
+			return { setKeyArm, encryptCbcArm, encryptCbcBatchArm, decryptCbcArm, decryptBlocksArm, "armv8-ce" };
+#endif
+		return { setKeyPortable, encryptCbcPortable, encryptCbcBatchPortable, decryptCbcPortable, decryptBlocksPortable, "portable" };
+	}();
+	return implementation;
+}
+
+
+u2f::crypto::Aes256::Aes256() {
+	memset(&schedule, 0, sizeof(schedule));
+}
+
+u2f::crypto::Aes256::Aes256(const uint8_t key[AES256_KEY_SIZE]) {
+	setKey(key);
+}
+
+u2f::crypto::Aes256::~Aes256() {
+	memset(&schedule, 0, sizeof(schedule));
+}
+
+void u2f::crypto::Aes256::setKey(const uint8_t key[AES256_KEY_SIZE]) {
+	memset(&schedule, 0, sizeof(schedule));
+	getImplementation().setKey(schedule, key);
+}
+
+void u2f::crypto::Aes256::encryptCbc(const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) const {
+	getImplementation().encryptCbc(schedule, in, size, out, iv);
+}
+
+void u2f::crypto::Aes256::encryptCbcBatch(uint32_t count, const uint8_t* const in[], size_t size, uint8_t* const out[], const uint8_t* const iv[]) const {
+	getImplementation().encryptCbcBatch(schedule, count, in, size, out, iv);
+}
+
+void u2f::crypto::Aes256::decryptCbc(const uint8_t* in, size_t size, uint8_t* out, const uint8_t iv[AES256_BLOCK_SIZE]) const {
+	getImplementation().decryptCbc(schedule, in, size, out, iv);
+}
+
+void u2f::crypto::Aes256::decryptBlocks(uint32_t count, const uint8_t* const in[], uint8_t* const out[]) const {
+	getImplementation().decryptBlocks(schedule, count, in, out);
+}
+
+const char* u2f::crypto::Aes256::getImplementationName() {
+	return getImplementation().name;
+}
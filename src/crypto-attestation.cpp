@@ -0,0 +1,251 @@
+#include <u2f/crypto-attestation.h>
+#include <u2f/crypto-p256.h>
+#include <u2f/log.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_TAG "u2f-attestation"
+
+// Attestation keys and certificates are tiny, anything larger than this is not what we are looking for
+#define ATTESTATION_MAX_FILE_SIZE 0x10000
+
+// Well-known attestation key and self-signed certificate, used when nothing else is configured
+static const u2f::crypto::PrivateKey defaultPrivateKey = {
+	0xf3, 0xfc, 0xcc, 0x0d, 0x00, 0xd8, 0x03, 0x19, 0x54, 0xf9, 0x08, 0x64, 0xd4, 0x3c, 0x24, 0x7f,
+	0x4b, 0xf5, 0xf0, 0x66, 0x5c, 0x6b, 0x50, 0xcc, 0x17, 0x74, 0x9a, 0x27, 0xd1, 0xcf, 0x76, 0x64
+};
+static const uint8_t defaultCertificate[] = {
+	0x30, 0x82, 0x01, 0x3c, 0x30, 0x81, 0xe4, 0xa0, 0x03, 0x02, 0x01, 0x02, 0x02, 0x0a, 0x47, 0x90,
+	0x12, 0x80, 0x00, 0x11, 0x55, 0x95, 0x73, 0x52, 0x30, 0x0a, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce,
+	0x3d, 0x04, 0x03, 0x02, 0x30, 0x17, 0x31, 0x15, 0x30, 0x13, 0x06, 0x03, 0x55, 0x04, 0x03, 0x13,
+	0x0c, 0x47, 0x6e, 0x75, 0x62, 0x62, 0x79, 0x20, 0x50, 0x69, 0x6c, 0x6f, 0x74, 0x30, 0x1e, 0x17,
+	0x0d, 0x31, 0x32, 0x30, 0x38, 0x31, 0x34, 0x31, 0x38, 0x32, 0x39, 0x33, 0x32, 0x5a, 0x17, 0x0d,
+	0x31, 0x33, 0x30, 0x38, 0x31, 0x34, 0x31, 0x38, 0x32, 0x39, 0x33, 0x32, 0x5a, 0x30, 0x31, 0x31,
+	0x2f, 0x30, 0x2d, 0x06, 0x03, 0x55, 0x04, 0x03, 0x13, 0x26, 0x50, 0x69, 0x6c, 0x6f, 0x74, 0x47,
+	0x6e, 0x75, 0x62, 0x62, 0x79, 0x2d, 0x30, 0x2e, 0x34, 0x2e, 0x31, 0x2d, 0x34, 0x37, 0x39, 0x30,
+	0x31, 0x32, 0x38, 0x30, 0x30, 0x30, 0x31, 0x31, 0x35, 0x35, 0x39, 0x35, 0x37, 0x33, 0x35, 0x32,
+	0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x08, 0x2a,
+	0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07, 0x03, 0x42, 0x00, 0x04, 0x8d, 0x61, 0x7e, 0x65, 0xc9,
+	0x50, 0x8e, 0x64, 0xbc, 0xc5, 0x67, 0x3a, 0xc8, 0x2a, 0x67, 0x99, 0xda, 0x3c, 0x14, 0x46, 0x68,
+	0x2c, 0x25, 0x8c, 0x46, 0x3f, 0xff, 0xdf, 0x58, 0xdf, 0xd2, 0xfa, 0x3e, 0x6c, 0x37, 0x8b, 0x53,
+	0xd7, 0x95, 0xc4, 0xa4, 0xdf, 0xfb, 0x41, 0x99, 0xed, 0xd7, 0x86, 0x2f, 0x23, 0xab, 0xaf, 0x02,
+	0x03, 0xb4, 0xb8, 0x91, 0x1b, 0xa0, 0x56, 0x99, 0x94, 0xe1, 0x01, 0x30, 0x0a, 0x06, 0x08, 0x2a,
+	0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x02, 0x03, 0x47, 0x00, 0x30, 0x44, 0x02, 0x20, 0x60, 0xcd,
+	0xb6, 0x06, 0x1e, 0x9c, 0x22, 0x26, 0x2d, 0x1a, 0xac, 0x1d, 0x96, 0xd8, 0xc7, 0x08, 0x29, 0xb2,
+	0x36, 0x65, 0x31, 0xdd, 0xa2, 0x68, 0x83, 0x2c, 0xb8, 0x36, 0xbc, 0xd3, 0x0d, 0xfa, 0x02, 0x20,
+	0x63, 0x1b, 0x14, 0x59, 0xf0, 0x9e, 0x63, 0x30, 0x05, 0x57, 0x22, 0xc8, 0xd8, 0x9b, 0x7f, 0x48,
+	0x88, 0x3b, 0x90, 0x89, 0xb8, 0x8d, 0x60, 0xd1, 0xd9, 0x79, 0x59, 0x02, 0xb3, 0x04, 0x10, 0xdf
+};
+
+
+/**
+ * Reads a whole file into a new buffer, which must be deleted (with delete[]) by the caller.
+ */
+static uint8_t* readFile(const char* filename, uint32_t &size) {
+	FILE* file = fopen(filename, "rb");
+	if (file == nullptr) {
+		LOG_ERROR("Cannot open %s", filename);
+		return nullptr;
+	}
+
+	uint8_t* buffer = new uint8_t[ATTESTATION_MAX_FILE_SIZE + 1];
+	size = fread(buffer, 1, ATTESTATION_MAX_FILE_SIZE + 1, file);
+	bool failed = ferror(file);
+	fclose(file);
+
+	if (failed || size > ATTESTATION_MAX_FILE_SIZE) {
+		LOG_ERROR("Cannot read %s", filename);
+		delete[] buffer;
+		return nullptr;
+	}
+	return buffer;
+}
+
+static int base64Value(uint8_t c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+/**
+ * If #data is PEM, decodes (in-place) the base64 body of its first block.
+ *
+ * @return false if #data looks like PEM but is malformed
+ */
+static bool decodePem(uint8_t *data, uint32_t &size) {
+	static const char begin[] = "-----BEGIN ";
+	static const char end[] = "-----END ";
+
+	// Skip leading whitespace
+	uint32_t pos = 0;
+	while (pos < size && (data[pos] == ' ' || data[pos] == '\t' || data[pos] == '\r' || data[pos] == '\n')) {
+		pos++;
+	}
+	if (size - pos < sizeof(begin) - 1 || memcmp(&data[pos], begin, sizeof(begin) - 1)) {
+		return true;  // Not PEM, leave it alone
+	}
+
+	// Skip the rest of the BEGIN line
+	while (pos < size && data[pos] != '\n') {
+		pos++;
+	}
+
+	uint32_t outSize = 0;
+	uint32_t bits = 0;
+	int bitCount = 0;
+	while (pos < size) {
+		if (data[pos] == '-') {
+			if (size - pos < sizeof(end) - 1 || memcmp(&data[pos], end, sizeof(end) - 1)) {
+				return false;
+			}
+			size = outSize;
+			return true;
+		}
+		int value = base64Value(data[pos++]);
+		if (value < 0) {
+			continue;  // Whitespace and padding
+		}
+		bits = (bits << 6) | value;
+		bitCount += 6;
+		if (bitCount >= 8) {
+			bitCount -= 8;
+			data[outSize++] = bits >> bitCount;  // outSize is always behind pos
+		}
+	}
+	return false;  // No END line
+}
+
+/**
+ * Reads the length of a DER element, advancing #pos.
+ */
+static bool readDerLength(const uint8_t *data, uint32_t size, uint32_t &pos, uint32_t &length) {
+	if (pos >= size) return false;
+	length = data[pos++];
+	if (length & 0x80) {
+		int lengthBytes = length & 0x7F;
+		if (lengthBytes == 0 || lengthBytes > 2) return false;
+		length = 0;
+		while (lengthBytes--) {
+			if (pos >= size) return false;
+			length = (length << 8) | data[pos++];
+		}
+	}
+	return length <= size - pos;
+}
+
+/**
+ * Extracts the private key from a raw 32-byte key or from a SEC1 ECPrivateKey:
+ *   SEQUENCE { INTEGER 1, OCTET STRING privateKey, ... }
+ */
+static bool parsePrivateKey(const uint8_t *data, uint32_t size, u2f::crypto::PrivateKey &privateKey) {
+	if (size == sizeof(u2f::crypto::PrivateKey)) {
+		memcpy(privateKey, data, sizeof(u2f::crypto::PrivateKey));
+		return true;
+	}
+
+	uint32_t pos = 0, length;
+	if (pos >= size || data[pos++] != 0x30 || !readDerLength(data, size, pos, length)) return false;
+	if (size - pos < 3 || memcmp(&data[pos], "\x02\x01\x01", 3)) return false;
+	pos += 3;
+	if (pos >= size || data[pos++] != 0x04 || !readDerLength(data, size, pos, length)) return false;
+	if (length != sizeof(u2f::crypto::PrivateKey)) return false;
+
+	memcpy(privateKey, &data[pos], sizeof(u2f::crypto::PrivateKey));
+	return true;
+}
+
+
+u2f::crypto::AttestationSigner::AttestationSigner(const PrivateKey &privateKey, const PublicKey &publicKey, const uint8_t *certificate, uint16_t certificateSize)
+: certificate(new uint8_t[certificateSize]), certificateSize(certificateSize)
+{
+	memcpy(this->privateKey, privateKey, sizeof(PrivateKey));
+	memcpy(this->publicKey, publicKey, sizeof(PublicKey));
+	memcpy(this->certificate, certificate, certificateSize);
+}
+
+u2f::crypto::AttestationSigner::~AttestationSigner() {
+	memset(privateKey, 0, sizeof(PrivateKey));
+	delete[] certificate;
+}
+
+u2f::crypto::AttestationSigner* u2f::crypto::AttestationSigner::fromFile(const char* privateKeyFilename, const char* certificateFilename) {
+	uint32_t privateKeySize, certificateSize;
+	uint8_t *privateKey = readFile(privateKeyFilename, privateKeySize);
+	if (privateKey == nullptr) {
+		return nullptr;
+	}
+	uint8_t *certificate = readFile(certificateFilename, certificateSize);
+	if (certificate == nullptr) {
+		memset(privateKey, 0, privateKeySize);
+		delete[] privateKey;
+		return nullptr;
+	}
+
+	AttestationSigner* ret = fromMemory(privateKey, privateKeySize, certificate, certificateSize);
+
+	memset(privateKey, 0, privateKeySize);
+	delete[] privateKey;
+	delete[] certificate;
+	return ret;
+}
+
+u2f::crypto::AttestationSigner* u2f::crypto::AttestationSigner::fromMemory(const uint8_t *privateKeyData, uint32_t privateKeyDataSize, const uint8_t *certificateData, uint32_t certificateDataSize) {
+	if (privateKeyDataSize > ATTESTATION_MAX_FILE_SIZE || certificateDataSize > ATTESTATION_MAX_FILE_SIZE) {
+		LOG_ERROR("Attestation key or certificate is too large");
+		return nullptr;
+	}
+
+	// PEM is decoded in-place, so work on copies
+	uint8_t *keyBuffer = new uint8_t[privateKeyDataSize];
+	uint8_t *certificate = new uint8_t[certificateDataSize];
+	memcpy(keyBuffer, privateKeyData, privateKeyDataSize);
+	memcpy(certificate, certificateData, certificateDataSize);
+	uint32_t keyBufferSize = privateKeyDataSize;
+	uint32_t certificateSize = certificateDataSize;
+
+	AttestationSigner* ret = nullptr;
+	PrivateKey privateKey;
+	PublicKey publicKey;
+
+	if (!decodePem(keyBuffer, keyBufferSize) || !parsePrivateKey(keyBuffer, keyBufferSize, privateKey)) {
+		LOG_ERROR("Invalid attestation private key");
+	} else if (!decodePem(certificate, certificateSize) || certificateSize == 0 || certificate[0] != 0x30 || certificateSize > UINT16_MAX) {
+		LOG_ERROR("Invalid attestation certificate");
+	} else if (!p256::computePublicKey(privateKey, publicKey)) {
+		LOG_ERROR("Invalid attestation private key");
+	} else {
+		// The certificate carries the uncompressed public key, it should match the private key
+		if (memmem(certificate, certificateSize, publicKey, sizeof(PublicKey)) == nullptr) {
+			LOG_WARN("Attestation certificate doesn't contain the public key of the attestation private key");
+		}
+		ret = new AttestationSigner(privateKey, publicKey, certificate, certificateSize);
+	}
+
+	memset(privateKey, 0, sizeof(PrivateKey));
+	memset(keyBuffer, 0, privateKeyDataSize);
+	delete[] keyBuffer;
+	delete[] certificate;
+	return ret;
+}
+
+u2f::crypto::AttestationSigner* u2f::crypto::AttestationSigner::getDefault() {
+	static AttestationSigner* signer = fromMemory(defaultPrivateKey, sizeof(defaultPrivateKey), defaultCertificate, sizeof(defaultCertificate));
+	return signer;
+}
+
+bool u2f::crypto::AttestationSigner::sign(const Hash &messageHash, Signature &signature) {
+	return crypto::sign(privateKey, messageHash, signature);
+}
+
+bool u2f::crypto::AttestationSigner::getCertificate(const uint8_t *&certificate, uint16_t &certificateSize) {
+	certificate = this->certificate;
+	certificateSize = this->certificateSize;
+	return true;
+}
+
+const u2f::crypto::PrivateKey* u2f::crypto::AttestationSigner::getBatchKey() {
+	return &privateKey;
+}
@@ -0,0 +1,445 @@
+#include <u2f/crypto-backend.h>
+#include <u2f/crypto-p256.h>
+#include <u2f/crypto-sha256.h>
+#include <u2f/log.h>
+
+#include <uECC.h>
+#include <string.h>
+#include <atomic>
+
+#ifdef U2F_CRYPTO_OPENSSL
+#include <openssl/bn.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/param_build.h>
+#endif
+
+#define LOG_TAG "u2f-crypto"
+
+#ifndef U2F_CRYPTO_DEFAULT_BACKEND
+#ifdef U2F_CRYPTO_OPENSSL
+#define U2F_CRYPTO_DEFAULT_BACKEND "openssl"
+#else
+#define U2F_CRYPTO_DEFAULT_BACKEND "native"
+#endif
+#endif
+
+// Nonces derived before giving up on a signature. Each one only fails with negligible probability.
+#define RFC6979_MAX_TRIES 64
+
+// Signatures computed together by the native backend
+#define NATIVE_MAX_BATCH 32
+
+// Imported private keys kept by each thread for the openssl backend
+#define OPENSSL_KEY_CACHE_SIZE 8
+
+namespace u2f {
+	namespace crypto {
+		/**
+		 * RFC6979 nonces, derived exactly like micro-ecc's uECC_sign_deterministic.
+		 *
+		 * Every HMAC key is used twice in a row, so its padded blocks are only hashed once. The first key is always zero:
+		 * Its padded blocks are hashed once per process.
+		 */
+		class Rfc6979 {
+			Hash K, V;
+			bool first;
+			HmacSha256 hmac;
+
+			static const HmacSha256& getZeroKey() {
+				static const HmacSha256 zeroKey = []() {
+					Hash key;
+					memset(key, 0x00, sizeof(Hash));
+					HmacSha256 hmac;
+					hmac.init(key);
+					return hmac;
+				}();
+				return zeroKey;
+			}
+
+		public:
+			Rfc6979(const PrivateKey &privateKey, const Hash &messageHash)
+			: first(true), hmac(getZeroKey())
+			{
+				const uint8_t zero = 0x00, one = 0x01;
+				memset(V, 0x01, sizeof(Hash));
+				hmac.update(V, sizeof(Hash)).update(&zero, 1).update(privateKey, sizeof(PrivateKey)).update(messageHash, sizeof(Hash)).finish(K);
+				hmac.init(K).update(V, sizeof(Hash)).finish(V);
+				hmac.restart().update(V, sizeof(Hash)).update(&one, 1).update(privateKey, sizeof(PrivateKey)).update(messageHash, sizeof(Hash)).finish(K);
+				hmac.init(K).update(V, sizeof(Hash)).finish(V);
+			}
+
+			~Rfc6979() {
+				memset(K, 0, sizeof(Hash));
+				memset(V, 0, sizeof(Hash));
+			}
+
+			/**
+			 * @param[out] k Big-endian nonce. The previous one must have been rejected.
+			 */
+			void next(uint8_t k[32]) {
+				const uint8_t zero = 0x00;
+				if (!first) {
+					hmac.restart().update(V, sizeof(Hash)).update(&zero, 1).finish(K);
+					hmac.init(K).update(V, sizeof(Hash)).finish(V);
+				}
+				first = false;
+				hmac.restart().update(V, sizeof(Hash)).finish(V);
+
+				// micro-ecc copies V into its native words, so k is V read as a little-endian number
+				for (int i=0; i<32; i++) {
+					k[i] = V[31 - i];
+				}
+			}
+		};
+
+
+		/**
+		 * crypto::p256, with RFC6979 nonces, so signatures match the "micro-ecc" backend.
+		 *
+		 * Batches share their scalar multiplications and inversions with p256::makeNonceBatch().
+		 */
+		class NativeBackend : public Backend {
+		public:
+			virtual const char* getName() const {
+				return "native";
+			}
+
+			virtual bool makeKeyPair(PublicKey &publicKey, PrivateKey &privateKey) {
+				uECC_RNG_Function rng = uECC_get_rng();
+				if (rng == nullptr)
+					return false;
+
+				for (int tries=0; tries<RFC6979_MAX_TRIES; tries++) {
+					if (!rng(privateKey, sizeof(PrivateKey)))
+						return false;
+					if (p256::computePublicKey(privateKey, publicKey))
+						return true;
+				}
+				return false;
+			}
+
+			virtual bool sign(const PrivateKey &privateKey, const Hash &messageHash, uint8_t rawSignature[64]) {
+				Rfc6979 nonces(privateKey, messageHash);
+				uint8_t k[32];
+
+				bool sign_success = false;
+				for (int tries=0; tries<RFC6979_MAX_TRIES && !sign_success; tries++) {
+					nonces.next(k);
+					sign_success = p256::sign(privateKey, messageHash, k, rawSignature);
+				}
+				memset(k, 0, sizeof(k));
+				return sign_success;
+			}
+
+			virtual void signBatch(uint32_t count, const PrivateKey* const privateKeys[], const Hash* const messageHashes[], uint8_t rawSignatures[][64], bool success[]) {
+				uint8_t k[NATIVE_MAX_BATCH][32], r[NATIVE_MAX_BATCH][32], kInverse[NATIVE_MAX_BATCH][32];
+
+				for (uint32_t offset=0; offset<count; offset+=NATIVE_MAX_BATCH) {
+					uint32_t n = count - offset < NATIVE_MAX_BATCH ? count - offset : NATIVE_MAX_BATCH;
+
+					// Same first nonce as sign(), so signatures don't depend on batching
+					for (uint32_t i=0; i<n; i++) {
+						Rfc6979(*privateKeys[offset + i], *messageHashes[offset + i]).next(k[i]);
+					}
+					p256::makeNonceBatch(n, k, r, kInverse, &success[offset]);
+
+					for (uint32_t i=0; i<n; i++) {
+						uint32_t j = offset + i;
+						if (success[j])
+							success[j] = p256::signWithNonce(*privateKeys[j], *messageHashes[j], r[i], kInverse[i], rawSignatures[j]);
+						if (!success[j])
+							success[j] = sign(*privateKeys[j], *messageHashes[j], rawSignatures[j]); // Next nonces, with negligible probability
+					}
+				}
+
+				memset(k, 0, sizeof(k));
+				memset(kInverse, 0, sizeof(kInverse));
+			}
+		};
+
+
+		/**
+		 * micro-ecc, with its own deterministic signatures
+		 */
+		class MicroEccBackend : public Backend {
+			/**
+			 * SHA256 adapter for uECC
+			 */
+			struct uECC_SHA256 {
+				uECC_HashContext uECC;
+				Sha256 ctx;
+				uint8_t tmp[128];
+
+				static void init(const uECC_HashContext *base) {
+					uECC_SHA256 *context = (uECC_SHA256 *)base;
+					context->ctx.reset();
+				}
+
+				static void update(const uECC_HashContext *base, const uint8_t *message, unsigned message_size) {
+					uECC_SHA256 *context = (uECC_SHA256 *)base;
+					context->ctx.update(message, message_size);
+				}
+
+				static void finish(const uECC_HashContext *base, uint8_t *hash_result) {
+					uECC_SHA256 *context = (uECC_SHA256 *)base;
+					context->ctx.finish(*(Hash*)hash_result);
+				}
+
+				uECC_SHA256() {
+					uECC.init_hash = &init;
+					uECC.update_hash = &update;
+					uECC.finish_hash = &finish;
+					uECC.block_size = 64;
+					uECC.result_size = 32;
+					uECC.tmp = tmp;
+				}
+			};
+
+		public:
+			virtual const char* getName() const {
+				return "micro-ecc";
+			}
+
+			virtual bool makeKeyPair(PublicKey &publicKey, PrivateKey &privateKey) {
+				publicKey[0] = 0x04;  // Curve name: P-256
+				return uECC_make_key(publicKey + 1, privateKey, uECC_secp256r1());
+			}
+
+			virtual bool sign(const PrivateKey &privateKey, const Hash &messageHash, uint8_t rawSignature[64]) {
+				uECC_SHA256 eccHash;
+				return uECC_sign_deterministic(
+					privateKey,
+					messageHash,
+					sizeof(Hash),
+					&eccHash.uECC,
+					rawSignature,
+					uECC_secp256r1());
+			}
+		};
+
+
+#ifdef U2F_CRYPTO_OPENSSL
+		/**
+		 * Signing contexts of the last private keys used by a thread, since importing a key costs as much as a signature:
+		 * OpenSSL computes its public key. The attestation key, and the keys of credentials used repeatedly, stay imported.
+		 *
+		 * Keys are replaced in a round-robin, and wiped when the thread exits.
+		 */
+		class OpenSslKeyCache {
+			struct Entry {
+				PrivateKey privateKey;
+				EVP_PKEY_CTX* ctx;  // Ready to sign, owns the imported key
+			};
+
+			Entry entries[OPENSSL_KEY_CACHE_SIZE];
+			uint32_t count;
+			uint32_t next;
+
+		public:
+			OpenSslKeyCache()
+			: count(0), next(0)
+			{ }
+
+			~OpenSslKeyCache() {
+				for (uint32_t i=0; i<count; i++) {
+					EVP_PKEY_CTX_free(entries[i].ctx);
+				}
+				OPENSSL_cleanse(entries, sizeof(entries));
+			}
+
+			EVP_PKEY_CTX* find(const PrivateKey &privateKey) const {
+				for (uint32_t i=0; i<count; i++) {
+					if (CRYPTO_memcmp(entries[i].privateKey, privateKey, sizeof(PrivateKey)) == 0)
+						return entries[i].ctx;
+				}
+				return nullptr;
+			}
+
+			void add(const PrivateKey &privateKey, EVP_PKEY_CTX* ctx) {
+				Entry &entry = entries[next];
+				if (next < count) {
+					EVP_PKEY_CTX_free(entry.ctx);
+				} else {
+					count++;
+				}
+				memcpy(entry.privateKey, privateKey, sizeof(PrivateKey));
+				entry.ctx = ctx;
+				next = (next + 1) % OPENSSL_KEY_CACHE_SIZE;
+			}
+		};
+
+		/**
+		 * libcrypto's EVP interface (OpenSSL 3), which uses assembly P-256 on most servers
+		 */
+		class OpenSslBackend : public Backend {
+			static thread_local OpenSslKeyCache keyCache;
+
+			/**
+			 * Imports a private key. OpenSSL computes its public key, which costs about as much as a signature.
+			 */
+			static EVP_PKEY* importPrivateKey(const PrivateKey &privateKey) {
+				EVP_PKEY* pkey = nullptr;
+				OSSL_PARAM* params = nullptr;
+				EVP_PKEY_CTX* ctx = nullptr;
+
+				OSSL_PARAM_BLD* builder = OSSL_PARAM_BLD_new();
+				BIGNUM* d = BN_secure_new();
+				if (builder && d && BN_bin2bn(privateKey, sizeof(PrivateKey), d)) {
+					BN_set_flags(d, BN_FLG_CONSTTIME);
+					if (OSSL_PARAM_BLD_push_utf8_string(builder, OSSL_PKEY_PARAM_GROUP_NAME, "prime256v1", 0)
+					 && OSSL_PARAM_BLD_push_BN(builder, OSSL_PKEY_PARAM_PRIV_KEY, d)) {
+						params = OSSL_PARAM_BLD_to_param(builder);
+						ctx = EVP_PKEY_CTX_new_from_name(nullptr, "EC", nullptr);
+					}
+				}
+				if (params && ctx && EVP_PKEY_fromdata_init(ctx) > 0) {
+					if (EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_KEYPAIR, params) <= 0)
+						pkey = nullptr;
+				}
+
+				EVP_PKEY_CTX_free(ctx);
+				OSSL_PARAM_free(params);
+				BN_clear_free(d);
+				OSSL_PARAM_BLD_free(builder);
+				return pkey;
+			}
+
+			/**
+			 * @return A signing context for the key, from the thread's cache or newly imported, or nullptr on failure
+			 */
+			static EVP_PKEY_CTX* getSigningContext(const PrivateKey &privateKey) {
+				EVP_PKEY_CTX* ctx = keyCache.find(privateKey);
+				if (ctx)
+					return ctx;
+
+				EVP_PKEY* pkey = importPrivateKey(privateKey);
+				if (pkey == nullptr) {
+					LOG_ERROR("Failed to import private key");
+					return nullptr;
+				}
+				ctx = EVP_PKEY_CTX_new_from_pkey(nullptr, pkey, nullptr);
+				EVP_PKEY_free(pkey); // Kept alive by the context
+				if (ctx == nullptr || EVP_PKEY_sign_init(ctx) <= 0) {
+					LOG_ERROR("EVP_PKEY_sign_init failed");
+					EVP_PKEY_CTX_free(ctx);
+					return nullptr;
+				}
+
+				keyCache.add(privateKey, ctx);
+				return ctx;
+			}
+
+		public:
+			virtual const char* getName() const {
+				return "openssl";
+			}
+
+			virtual bool makeKeyPair(PublicKey &publicKey, PrivateKey &privateKey) {
+				EVP_PKEY* pkey = EVP_PKEY_Q_keygen(nullptr, nullptr, "EC", "P-256");
+				if (pkey == nullptr) {
+					LOG_ERROR("EVP_PKEY_Q_keygen failed");
+					return false;
+				}
+
+				BIGNUM* d = nullptr;
+				size_t publicKeySize = 0;
+				bool success = EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_PRIV_KEY, &d)
+					&& BN_bn2binpad(d, privateKey, sizeof(PrivateKey)) == sizeof(PrivateKey)
+					&& EVP_PKEY_get_octet_string_param(pkey, OSSL_PKEY_PARAM_PUB_KEY, publicKey, sizeof(PublicKey), &publicKeySize)
+					&& publicKeySize == sizeof(PublicKey)
+					&& publicKey[0] == 0x04;
+
+				BN_clear_free(d);
+				EVP_PKEY_free(pkey);
+				return success;
+			}
+
+			virtual bool sign(const PrivateKey &privateKey, const Hash &messageHash, uint8_t rawSignature[64]) {
+				EVP_PKEY_CTX* ctx = getSigningContext(privateKey);
+				if (ctx == nullptr)
+					return false;
+
+				uint8_t der[80];
+				size_t derSize = sizeof(der);
+				const uint8_t* derPtr = der;
+				ECDSA_SIG* sig = nullptr;
+				if (EVP_PKEY_sign(ctx, der, &derSize, messageHash, sizeof(Hash)) > 0) {
+					sig = d2i_ECDSA_SIG(nullptr, &derPtr, derSize);
+				}
+
+				bool success = false;
+				if (sig) {
+					const BIGNUM *r, *s;
+					ECDSA_SIG_get0(sig, &r, &s);
+					success = BN_bn2binpad(r, &rawSignature[0], 32) == 32
+					       && BN_bn2binpad(s, &rawSignature[32], 32) == 32;
+				} else {
+					LOG_ERROR("EVP_PKEY_sign failed");
+				}
+
+				ECDSA_SIG_free(sig);
+				return success;
+			}
+		};
+
+		thread_local OpenSslKeyCache OpenSslBackend::keyCache;
+#endif
+
+
+		static NativeBackend nativeBackend;
+		static MicroEccBackend microEccBackend;
+#ifdef U2F_CRYPTO_OPENSSL
+		static OpenSslBackend openSslBackend;
+#endif
+
+		static Backend* const backends[] = {
+			&nativeBackend,
+			&microEccBackend,
+#ifdef U2F_CRYPTO_OPENSSL
+			&openSslBackend,
+#endif
+		};
+
+		static std::atomic<Backend*> currentBackend{nullptr};
+	}
+}
+
+
+void u2f::crypto::Backend::signBatch(uint32_t count, const PrivateKey* const privateKeys[], const Hash* const messageHashes[], uint8_t rawSignatures[][64], bool success[]) {
+	for (uint32_t i=0; i<count; i++) {
+		success[i] = sign(*privateKeys[i], *messageHashes[i], rawSignatures[i]);
+	}
+}
+
+u2f::crypto::Backend* u2f::crypto::listBackends(unsigned index) {
+	return index < sizeof(backends) / sizeof(backends[0]) ? backends[index] : nullptr;
+}
+
+u2f::crypto::Backend* u2f::crypto::findBackend(const char* name) {
+	Backend* backend;
+	for (unsigned i=0; (backend = listBackends(i)) != nullptr; i++) {
+		if (!strcmp(backend->getName(), name))
+			return backend;
+	}
+	return nullptr;
+}
+
+u2f::crypto::Backend* u2f::crypto::getBackend() {
+	Backend* backend = currentBackend.load(std::memory_order_acquire);
+	if (backend == nullptr) {
+		backend = findBackend(U2F_CRYPTO_DEFAULT_BACKEND);
+		if (backend == nullptr) {
+			LOG_WARN("Unknown crypto backend %s, using %s", U2F_CRYPTO_DEFAULT_BACKEND, nativeBackend.getName());
+			backend = &nativeBackend;
+		}
+		currentBackend.store(backend, std::memory_order_release);
+	}
+	return backend;
+}
+
+void u2f::crypto::setBackend(Backend* backend) {
+	currentBackend.store(backend, std::memory_order_release);
+}
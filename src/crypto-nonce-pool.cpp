@@ -0,0 +1,59 @@
+#include <u2f/crypto-nonce-pool.h>
+#include <u2f/crypto-p256.h>
+
+#include <uECC.h>
+#include <string.h>
+
+// Nonces drawn before giving up. Each one only fails with negligible probability.
+#define NONCE_MAX_TRIES 64
+
+namespace u2f {
+	namespace crypto {
+		static std::atomic<NoncePool*> noncePool{nullptr};
+	}
+}
+
+u2f::crypto::NoncePool::NoncePool(uint32_t depth, uint32_t lowWatermark, uint32_t highWatermark)
+: PrefillPool(sizeof(Nonce), depth, lowWatermark, highWatermark)
+{
+	start();
+}
+
+u2f::crypto::NoncePool::~NoncePool() {
+	stop();
+}
+
+bool u2f::crypto::NoncePool::generate(void* item) {
+	Nonce* nonce = (Nonce*)item;
+	uECC_RNG_Function rng = uECC_get_rng();
+	if (rng == nullptr)
+		return false;
+
+	uint8_t k[32];
+	bool success = false;
+	for (int tries=0; tries<NONCE_MAX_TRIES && !success; tries++) {
+		if (!rng(k, sizeof(k)))
+			break;
+		success = p256::makeNonce(k, nonce->r, nonce->kInverse);
+	}
+	memset(k, 0, sizeof(k));
+	return success;
+}
+
+bool u2f::crypto::NoncePool::sign(const PrivateKey &privateKey, const Hash &messageHash, uint8_t rawSignature[64]) {
+	Nonce nonce;
+	if (!take(&nonce))
+		return false;
+
+	bool success = p256::signWithNonce(privateKey, messageHash, nonce.r, nonce.kInverse, rawSignature);
+	memset(&nonce, 0, sizeof(nonce));
+	return success;
+}
+
+void u2f::crypto::setNoncePool(NoncePool* pool) {
+	noncePool.store(pool, std::memory_order_release);
+}
+
+u2f::crypto::NoncePool* u2f::crypto::getNoncePool() {
+	return noncePool.load(std::memory_order_acquire);
+}
@@ -0,0 +1,805 @@
+#include <u2f/crypto-p256.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__SIZEOF_INT128__)
+#define P256_MULX
+#include <cpuid.h>
+#endif
+
+// Numbers are little-endian arrays of the widest limbs the CPU multiplies natively.
+// With 64-bit limbs, field elements are kept in the Montgomery domain (a·2^256 mod P), otherwise they are plain integers.
+// Either way, they are always fully reduced.
+#if defined(__SIZEOF_INT128__)
+typedef uint64_t Limb;
+typedef unsigned __int128 DoubleLimb;
+#define LIMB_BITS 64
+#define L(hi, lo) (((uint64_t)(hi) << 32) | (lo))
+#else
+typedef uint32_t Limb;
+typedef uint64_t DoubleLimb;
+#define LIMB_BITS 32
+#define L(hi, lo) (lo), (hi)
+#endif
+#define LIMBS (256 / LIMB_BITS)
+
+typedef Limb Felem[LIMBS];
+typedef Limb Scalar[LIMBS];
+
+struct AffinePoint {
+	Felem x, y;
+};
+
+struct JacobianPoint {
+	Felem x, y, z;
+};
+
+// Signed 4-bit windows of a 256-bit scalar, plus the final carry
+#define COMB_WINDOWS 65
+#define COMB_POINTS 8
+
+// Largest batch computed at once. Larger ones are split.
+#define P256_MAX_BATCH 32
+
+// Constants are written as 32-bit halves of each 64-bit limb, high half first, whatever the limb size
+static const Felem P = { L(0xffffffff, 0xffffffff), L(0x00000000, 0xffffffff), L(0x00000000, 0x00000000), L(0xffffffff, 0x00000001) };
+static const Scalar N = { L(0xf3b9cac2, 0xfc632551), L(0xbce6faad, 0xa7179e84), L(0xffffffff, 0xffffffff), L(0xffffffff, 0x00000000) };
+#if LIMB_BITS == 64
+static const Limb N0_INV = 0xccd1c8aaee00bc4f;  // -N^-1 mod 2^64
+static const Felem FE_ONE = { L(0x00000000, 0x00000001), L(0xffffffff, 0x00000000), L(0xffffffff, 0xffffffff), L(0x00000000, 0xfffffffe) };  // 2^256 mod P
+static const Felem FE_RR = { L(0x00000000, 0x00000003), L(0xfffffffb, 0xffffffff), L(0xffffffff, 0xfffffffe), L(0x00000004, 0xfffffffd) };  // 2^512 mod P
+#else
+static const Limb N0_INV = 0xee00bc4f;  // -N^-1 mod 2^32
+static const Felem FE_ONE = { 1 };
+#endif
+
+// Plain integers
+static const Felem GX = { L(0xf4a13945, 0xd898c296), L(0x77037d81, 0x2deb33a0), L(0xf8bce6e5, 0x63a440f2), L(0x6b17d1f2, 0xe12c4247) };
+static const Felem GY = { L(0xcbb64068, 0x37bf51f5), L(0x2bce3357, 0x6b315ece), L(0x8ee7eb4a, 0x7c0f9e16), L(0x4fe342e2, 0xfe1a7f9b) };
+
+
+// ---- Helpers ----
+
+static inline Limb isZero(const Limb a[LIMBS]) {
+	Limb bits = 0;
+	for (int i=0; i<LIMBS; i++) {
+		bits |= a[i];
+	}
+	return ((bits | (0 - bits)) >> (LIMB_BITS - 1)) ^ 1;
+}
+
+static inline uint32_t isEqual(uint32_t a, uint32_t b) {
+	uint32_t x = a ^ b;
+	return ((x | (0 - x)) >> 31) ^ 1;
+}
+
+// r = mask ? a : r, with mask 0 or all ones
+static inline void select(Limb r[LIMBS], const Limb a[LIMBS], Limb mask) {
+	for (int i=0; i<LIMBS; i++) {
+		r[i] = (r[i] & ~mask) | (a[i] & mask);
+	}
+}
+
+// r = a - b, returns the borrow
+static inline Limb subtract(Limb r[LIMBS], const Limb a[LIMBS], const Limb b[LIMBS]) {
+	Limb borrow = 0;
+	for (int i=0; i<LIMBS; i++) {
+		DoubleLimb d = (DoubleLimb)a[i] - b[i] - borrow;
+		r[i] = (Limb)d;
+		borrow = (Limb)(d >> LIMB_BITS) & 1;
+	}
+	return borrow;
+}
+
+// r = a + b, returns the carry
+static inline Limb add(Limb r[LIMBS], const Limb a[LIMBS], const Limb b[LIMBS]) {
+	DoubleLimb acc = 0;
+	for (int i=0; i<LIMBS; i++) {
+		acc += (DoubleLimb)a[i] + b[i];
+		r[i] = (Limb)acc;
+		acc >>= LIMB_BITS;
+	}
+	return (Limb)acc;
+}
+
+// r = a >= m ? a - m : a, where carry is an extra top bit of a
+static inline void reduceOnce(Limb r[LIMBS], const Limb a[LIMBS], const Limb m[LIMBS], Limb carry = 0) {
+	Limb t[LIMBS];
+	Limb borrow = subtract(t, a, m);
+	memcpy(r, a, LIMBS * sizeof(Limb));
+	select(r, t, 0 - (carry | (borrow ^ 1)));
+}
+
+static void fromBytes(Limb r[LIMBS], const uint8_t bytes[32]) {
+	for (int i=0; i<LIMBS; i++) {
+		const uint8_t* b = bytes + 32 - (i + 1) * sizeof(Limb);
+		Limb limb = 0;
+		for (unsigned j=0; j<sizeof(Limb); j++) {
+			limb = (limb << 8) | b[j];
+		}
+		r[i] = limb;
+	}
+}
+
+static void toBytes(uint8_t bytes[32], const Limb a[LIMBS]) {
+	for (int i=0; i<LIMBS; i++) {
+		uint8_t* b = bytes + 32 - (i + 1) * sizeof(Limb);
+		for (unsigned j=0; j<sizeof(Limb); j++) {
+			b[j] = (uint8_t)(a[i] >> (8 * (sizeof(Limb) - 1 - j)));
+		}
+	}
+}
+
+// Bits 4*i to 4*i+3 of a
+static inline uint32_t nibble(const Limb a[LIMBS], int i) {
+	return (uint32_t)(a[i / (LIMB_BITS / 4)] >> (4 * (i % (LIMB_BITS / 4)))) & 0xf;
+}
+
+// 1 if 0 < a < N
+static Limb isValidScalar(const Scalar a) {
+	Scalar t;
+	return subtract(t, a, N) & (isZero(a) ^ 1);
+}
+
+// c = a * b, 512 bits
+static inline void multiplyPortable(Limb c[2 * LIMBS], const Limb a[LIMBS], const Limb b[LIMBS]) {
+	memset(c, 0, 2 * LIMBS * sizeof(Limb));
+	for (int i=0; i<LIMBS; i++) {
+		DoubleLimb carry = 0;
+		for (int j=0; j<LIMBS; j++) {
+			carry += (DoubleLimb)a[j] * b[i] + c[i+j];
+			c[i+j] = (Limb)carry;
+			carry >>= LIMB_BITS;
+		}
+		c[i+LIMBS] = (Limb)carry;
+	}
+}
+
+#ifdef P256_MULX
+// Row by row. MULX doesn't touch the flags, so the low halves of the products are added on the carry flag chain (ADCX)
+// while the high halves are added on the overflow flag chain (ADOX).
+static inline void multiplyMulx(Limb c[2 * LIMBS], const Limb a[LIMBS], const Limb b[LIMBS]) {
+	uint64_t c0, c1, c2, c3, c4, c5, c6, c7, lo, hi;
+	__asm__ (
+		"movq 0(%[b]), %%rdx\n\t"
+		"mulxq 0(%[a]), %[c0], %[c1]\n\t"
+		"mulxq 8(%[a]), %[lo], %[c2]\n\t"
+		"addq %[lo], %[c1]\n\t"
+		"mulxq 16(%[a]), %[lo], %[c3]\n\t"
+		"adcq %[lo], %[c2]\n\t"
+		"mulxq 24(%[a]), %[lo], %[c4]\n\t"
+		"adcq %[lo], %[c3]\n\t"
+		"adcq $0, %[c4]\n\t"
+
+		"movq 8(%[b]), %%rdx\n\t"
+		"xorl %k[c5], %k[c5]\n\t"
+		"mulxq 0(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c1]\n\t"
+		"adoxq %[hi], %[c2]\n\t"
+		"mulxq 8(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c2]\n\t"
+		"adoxq %[hi], %[c3]\n\t"
+		"mulxq 16(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c3]\n\t"
+		"adoxq %[hi], %[c4]\n\t"
+		"mulxq 24(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c4]\n\t"
+		"adoxq %[hi], %[c5]\n\t"
+		"movl $0, %k[hi]\n\t"
+		"adcxq %[hi], %[c5]\n\t"
+
+		"movq 16(%[b]), %%rdx\n\t"
+		"xorl %k[c6], %k[c6]\n\t"
+		"mulxq 0(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c2]\n\t"
+		"adoxq %[hi], %[c3]\n\t"
+		"mulxq 8(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c3]\n\t"
+		"adoxq %[hi], %[c4]\n\t"
+		"mulxq 16(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c4]\n\t"
+		"adoxq %[hi], %[c5]\n\t"
+		"mulxq 24(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c5]\n\t"
+		"adoxq %[hi], %[c6]\n\t"
+		"movl $0, %k[hi]\n\t"
+		"adcxq %[hi], %[c6]\n\t"
+
+		"movq 24(%[b]), %%rdx\n\t"
+		"xorl %k[c7], %k[c7]\n\t"
+		"mulxq 0(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c3]\n\t"
+		"adoxq %[hi], %[c4]\n\t"
+		"mulxq 8(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c4]\n\t"
+		"adoxq %[hi], %[c5]\n\t"
+		"mulxq 16(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c5]\n\t"
+		"adoxq %[hi], %[c6]\n\t"
+		"mulxq 24(%[a]), %[lo], %[hi]\n\t"
+		"adcxq %[lo], %[c6]\n\t"
+		"adoxq %[hi], %[c7]\n\t"
+		"movl $0, %k[hi]\n\t"
+		"adcxq %[hi], %[c7]\n\t"
+		: [c0] "=&r" (c0), [c1] "=&r" (c1), [c2] "=&r" (c2), [c3] "=&r" (c3), [c4] "=&r" (c4), [c5] "=&r" (c5), [c6] "=&r" (c6), [c7] "=&r" (c7),
+		  [lo] "=&r" (lo), [hi] "=&r" (hi)
+		: [a] "r" (a), [b] "r" (b)
+		: "rdx", "cc", "memory"
+	);
+	c[0] = c0; c[1] = c1; c[2] = c2; c[3] = c3;
+	c[4] = c4; c[5] = c5; c[6] = c6; c[7] = c7;
+}
+
+static bool cpuSupportsMulx() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx & bit_BMI2) && (ebx & bit_ADX);
+}
+
+// Set before main(). Anything that runs earlier just gets the portable code.
+static const bool useMulx = cpuSupportsMulx();
+#endif
+
+static inline void multiply(Limb c[2 * LIMBS], const Limb a[LIMBS], const Limb b[LIMBS]) {
+#ifdef P256_MULX
+	if (useMulx) {
+		multiplyMulx(c, a, b);
+		return;
+	}
+#endif
+	multiplyPortable(c, a, b);
+}
+
+// r = c / 2^256 mod m, for c < m * 2^256 (Montgomery reduction, one limb at a time)
+static inline void montgomeryReduce(Limb r[LIMBS], Limb c[2 * LIMBS], const Limb m[LIMBS], Limb m0Inverse) {
+	Limb pending = 0;  // Carry into c[i + LIMBS]
+	for (int i=0; i<LIMBS; i++) {
+		Limb q = c[i] * m0Inverse;
+		DoubleLimb acc = ((DoubleLimb)q * m[0] + c[i]) >> LIMB_BITS;  // The low limb cancels out
+		for (int j=1; j<LIMBS; j++) {
+			acc += (DoubleLimb)q * m[j] + c[i+j];
+			c[i+j] = (Limb)acc;
+			acc >>= LIMB_BITS;
+		}
+		acc += (DoubleLimb)c[i+LIMBS] + pending;
+		c[i+LIMBS] = (Limb)acc;
+		pending = (Limb)(acc >> LIMB_BITS);
+	}
+	reduceOnce(r, &c[LIMBS], m, pending);
+}
+
+
+// ---- Field arithmetic, mod P ----
+
+static void feAdd(Felem r, const Felem a, const Felem b) {
+	Felem t;
+	Limb carry = add(t, a, b);
+	reduceOnce(r, t, P, carry);
+}
+
+static void feSub(Felem r, const Felem a, const Felem b) {
+	Felem t, u;
+	Limb borrow = subtract(t, a, b);
+	add(u, t, P);
+	memcpy(r, t, sizeof(Felem));
+	select(r, u, 0 - borrow);
+}
+
+#if LIMB_BITS == 64
+
+// Montgomery multiplication: -P^-1 mod 2^64 is 1, so each quotient limb is just the low limb
+static void feMul(Felem r, const Felem a, const Felem b) {
+	Limb c[2 * LIMBS];
+	multiply(c, a, b);
+	montgomeryReduce(r, c, P, 1);
+}
+
+// Converts a plain integer into the Montgomery domain
+static void feEncode(Felem r, const Felem a) {
+	feMul(r, a, FE_RR);
+}
+
+// Converts back into a plain integer
+static void feDecode(Felem r, const Felem a) {
+	static const Felem one = { 1 };
+	feMul(r, a, one);
+}
+
+#else
+
+// Adds top * 2^256 = top * (2^224 - 2^192 - 2^96 + 1) mod P back into the low limbs
+static inline void fold(uint32_t r[8], int64_t &top) {
+	int64_t acc = 0;
+	for (int i=0; i<8; i++) {
+		acc += r[i];
+		if (i == 0 || i == 7)
+			acc += top;
+		if (i == 3 || i == 6)
+			acc -= top;
+		r[i] = (uint32_t)acc;
+		acc >>= 32;
+	}
+	top = acc;
+}
+
+// NIST fast reduction of a 512-bit product (FIPS 186-4, D.2.3)
+static void feReduce(Felem r, const uint32_t c[16]) {
+	int64_t t[8];
+	t[0] = (int64_t)c[0] + c[8] + c[9] - c[11] - c[12] - c[13] - c[14];
+	t[1] = (int64_t)c[1] + c[9] + c[10] - c[12] - c[13] - c[14] - c[15];
+	t[2] = (int64_t)c[2] + c[10] + c[11] - c[13] - c[14] - c[15];
+	t[3] = (int64_t)c[3] + 2*(int64_t)c[11] + 2*(int64_t)c[12] + c[13] - c[15] - c[8] - c[9];
+	t[4] = (int64_t)c[4] + 2*(int64_t)c[12] + 2*(int64_t)c[13] + c[14] - c[9] - c[10];
+	t[5] = (int64_t)c[5] + 2*(int64_t)c[13] + 2*(int64_t)c[14] + c[15] - c[10] - c[11];
+	t[6] = (int64_t)c[6] + 3*(int64_t)c[14] + 2*(int64_t)c[15] + c[13] - c[8] - c[9];
+	t[7] = (int64_t)c[7] + 3*(int64_t)c[15] + c[8] - c[10] - c[11] - c[12] - c[13];
+
+	int64_t acc = 0;
+	for (int i=0; i<8; i++) {
+		acc += t[i];
+		r[i] = (uint32_t)acc;
+		acc >>= 32;
+	}
+
+	// The carry is small: Two folds always bring it down to zero
+	int64_t top = acc;
+	fold(r, top);
+	fold(r, top);
+	reduceOnce(r, r, P);
+}
+
+static void feMul(Felem r, const Felem a, const Felem b) {
+	uint32_t c[16];
+	multiply(c, a, b);
+	feReduce(r, c);
+}
+
+static inline void feEncode(Felem r, const Felem a) {
+	memcpy(r, a, sizeof(Felem));
+}
+
+static inline void feDecode(Felem r, const Felem a) {
+	memcpy(r, a, sizeof(Felem));
+}
+
+#endif
+
+static inline void feSqr(Felem r, const Felem a) {
+	feMul(r, a, a);
+}
+
+static inline void feSqrN(Felem r, const Felem a, int n) {
+	feSqr(r, a);
+	while (--n) {
+		feSqr(r, r);
+	}
+}
+
+// r = a^(P-2) = a^-1
+static void feInv(Felem r, const Felem a) {
+	Felem x2, x3, x6, x12, x15, x30, x32, t;
+	feSqr(t, a);         feMul(x2, t, a);     // 2 ones
+	feSqr(t, x2);        feMul(x3, t, a);     // 3 ones
+	feSqrN(t, x3, 3);    feMul(x6, t, x3);    // 6 ones
+	feSqrN(t, x6, 6);    feMul(x12, t, x6);   // 12 ones
+	feSqrN(t, x12, 3);   feMul(x15, t, x3);   // 15 ones
+	feSqrN(t, x15, 15);  feMul(x30, t, x15);  // 30 ones
+	feSqrN(t, x30, 2);   feMul(x32, t, x2);   // 32 ones
+
+	// P-2 = ffffffff 00000001 00000000 00000000 00000000 ffffffff ffffffff fffffffd
+	feSqrN(t, x32, 32);  feMul(t, t, a);
+	feSqrN(t, t, 128);   feMul(t, t, x32);
+	feSqrN(t, t, 32);    feMul(t, t, x32);
+	feSqrN(t, t, 30);    feMul(t, t, x30);
+	feSqrN(t, t, 2);     feMul(r, t, a);
+}
+
+
+// ---- Scalar arithmetic, mod N, in the Montgomery domain ----
+
+static void scMontMul(Scalar r, const Scalar a, const Scalar b) {
+	Limb c[2 * LIMBS];
+	multiply(c, a, b);
+	montgomeryReduce(r, c, N, N0_INV);
+}
+
+struct Tables {
+	AffinePoint comb[COMB_WINDOWS][COMB_POINTS];  // comb[i][j] = (j+1) * 16^i * G
+	Scalar r2;                                    // 2^512 mod N, to enter the Montgomery domain
+
+	Tables();
+};
+
+static const Tables& getTables();
+
+// r = a * b mod N
+static void scMul(Scalar r, const Scalar a, const Scalar b) {
+	Scalar t;
+	scMontMul(t, a, b);
+	scMontMul(r, t, getTables().r2);
+}
+
+// r = a + b mod N
+static void scAdd(Scalar r, const Scalar a, const Scalar b) {
+	Scalar t;
+	Limb carry = add(t, a, b);
+	reduceOnce(r, t, N, carry);
+}
+
+// r = a^(N-2) = a^-1 mod N
+static void scInv(Scalar r, const Scalar a) {
+	static const Scalar one = { 1 };
+	Scalar exponent;
+	memcpy(exponent, N, sizeof(exponent));
+	exponent[0] -= 2;
+
+	// 4-bit fixed window. The exponent is public, so plain table indexing is fine.
+	Scalar powers[16];
+	scMontMul(powers[0], getTables().r2, one);  // R mod N: 1 in the Montgomery domain
+	scMontMul(powers[1], a, getTables().r2);
+	for (int i=2; i<16; i++) {
+		scMontMul(powers[i], powers[i-1], powers[1]);
+	}
+
+	Scalar t;
+	memcpy(t, powers[0], sizeof(t));
+	for (int i=63; i>=0; i--) {
+		for (int j=0; j<4; j++) {
+			scMontMul(t, t, t);
+		}
+		scMontMul(t, t, powers[nibble(exponent, i)]);
+	}
+	scMontMul(r, t, one);
+}
+
+
+// Montgomery's trick: Replaces count inversions with one inversion and 3*(count-1) multiplications.
+// a[i] must not be zero. r and a may overlap.
+static void feBatchInv(Felem r[], const Felem a[], uint32_t count) {
+	Felem prefix[P256_MAX_BATCH];
+	memcpy(prefix[0], a[0], sizeof(Felem));
+	for (uint32_t i=1; i<count; i++) {
+		feMul(prefix[i], prefix[i-1], a[i]);
+	}
+
+	Felem inverse, t;
+	feInv(inverse, prefix[count-1]);
+	for (uint32_t i=count-1; i>0; i--) {
+		feMul(t, inverse, prefix[i-1]);   // 1 / a[i]
+		feMul(inverse, inverse, a[i]);    // 1 / (a[0] ... a[i-1])
+		memcpy(r[i], t, sizeof(Felem));
+	}
+	memcpy(r[0], inverse, sizeof(Felem));
+}
+
+// Same as feBatchInv, mod N
+static void scBatchInv(Scalar r[], const Scalar a[], uint32_t count) {
+	Scalar prefix[P256_MAX_BATCH];
+	memcpy(prefix[0], a[0], sizeof(prefix[0]));
+	for (uint32_t i=1; i<count; i++) {
+		scMul(prefix[i], prefix[i-1], a[i]);
+	}
+
+	Scalar inverse, t;
+	scInv(inverse, prefix[count-1]);
+	for (uint32_t i=count-1; i>0; i--) {
+		scMul(t, inverse, prefix[i-1]);
+		scMul(inverse, inverse, a[i]);
+		memcpy(r[i], t, sizeof(t));
+	}
+	memcpy(r[0], inverse, sizeof(inverse));
+
+	memset(prefix, 0, sizeof(prefix));
+	memset(inverse, 0, sizeof(inverse));
+	memset(t, 0, sizeof(t));
+}
+
+// ---- Point arithmetic ----
+
+// Jacobian doubling, a = -3 (dbl-2001-b)
+static void pointDouble(JacobianPoint &r, const JacobianPoint &p) {
+	Felem delta, gamma, beta, alpha, t1, t2;
+	feSqr(delta, p.z);
+	feSqr(gamma, p.y);
+	feMul(beta, p.x, gamma);
+
+	feSub(t1, p.x, delta);
+	feAdd(t2, p.x, delta);
+	feMul(alpha, t1, t2);
+	feAdd(t1, alpha, alpha);
+	feAdd(alpha, alpha, t1);
+
+	// Z3 = (Y1+Z1)^2 - gamma - delta
+	feAdd(t1, p.y, p.z);
+	feSqr(t1, t1);
+	feSub(t1, t1, gamma);
+	feSub(r.z, t1, delta);
+
+	// X3 = alpha^2 - 8*beta
+	feAdd(beta, beta, beta);
+	feAdd(beta, beta, beta);  // 4*beta
+	feSqr(t1, alpha);
+	feAdd(t2, beta, beta);
+	feSub(r.x, t1, t2);
+
+	// Y3 = alpha*(4*beta - X3) - 8*gamma^2
+	feSub(t1, beta, r.x);
+	feMul(t1, alpha, t1);
+	feSqr(gamma, gamma);
+	feAdd(gamma, gamma, gamma);
+	feAdd(gamma, gamma, gamma);
+	feAdd(gamma, gamma, gamma);
+	feSub(r.y, t1, gamma);
+}
+
+// Mixed addition, Jacobian + affine (madd-2007-bl)
+static void pointAddMixed(JacobianPoint &r, const JacobianPoint &p, const AffinePoint &q) {
+	Felem z1z1, u2, s2, h, hh, i, j, rr, v, t;
+	feSqr(z1z1, p.z);
+	feMul(u2, q.x, z1z1);
+	feMul(s2, q.y, p.z);
+	feMul(s2, s2, z1z1);
+	feSub(h, u2, p.x);
+	feSub(rr, s2, p.y);
+
+	if (isZero(h)) {
+		// Never happens in the comb for valid scalars, except for one specific scalar: Not worth being constant-time
+		if (isZero(rr)) {
+			pointDouble(r, p);
+		} else {
+			memset(&r, 0, sizeof(r));  // Point at infinity
+		}
+		return;
+	}
+
+	feSqr(hh, h);
+	feAdd(i, hh, hh);
+	feAdd(i, i, i);
+	feMul(j, h, i);
+	feAdd(rr, rr, rr);
+	feMul(v, p.x, i);
+
+	// X3 = r^2 - J - 2*V
+	feSqr(t, rr);
+	feSub(t, t, j);
+	feSub(t, t, v);
+	feSub(t, t, v);
+
+	// Y3 = r*(V - X3) - 2*Y1*J
+	Felem y;
+	feSub(y, v, t);
+	feMul(y, rr, y);
+	feMul(j, p.y, j);
+	feAdd(j, j, j);
+	feSub(r.y, y, j);
+
+	// Z3 = (Z1+H)^2 - Z1Z1 - HH
+	feAdd(r.z, p.z, h);
+	feSqr(r.z, r.z);
+	feSub(r.z, r.z, z1z1);
+	feSub(r.z, r.z, hh);
+
+	memcpy(r.x, t, sizeof(Felem));
+}
+
+static void toAffine(AffinePoint &r, const JacobianPoint &p) {
+	Felem zInv, zInv2;
+	feInv(zInv, p.z);
+	feSqr(zInv2, zInv);
+	feMul(r.x, p.x, zInv2);
+	feMul(zInv2, zInv2, zInv);
+	feMul(r.y, p.y, zInv2);
+}
+
+Tables::Tables() {
+	AffinePoint base;
+	feEncode(base.x, GX);
+	feEncode(base.y, GY);
+	for (int i=0; i<COMB_WINDOWS; i++) {
+		// Multiples of this window's base
+		JacobianPoint multiple;
+		memcpy(multiple.x, base.x, sizeof(Felem));
+		memcpy(multiple.y, base.y, sizeof(Felem));
+		memcpy(multiple.z, FE_ONE, sizeof(Felem));
+		comb[i][0] = base;
+		for (int j=1; j<COMB_POINTS; j++) {
+			pointAddMixed(multiple, multiple, base);
+			toAffine(comb[i][j], multiple);
+		}
+
+		// Next base is 16 times this one
+		JacobianPoint next;
+		memcpy(next.x, base.x, sizeof(Felem));
+		memcpy(next.y, base.y, sizeof(Felem));
+		memcpy(next.z, FE_ONE, sizeof(Felem));
+		for (int j=0; j<4; j++) {
+			pointDouble(next, next);
+		}
+		toAffine(base, next);
+	}
+
+	// 2^512 mod N, by doubling
+	memset(r2, 0, sizeof(r2));
+	r2[0] = 1;
+	for (int i=0; i<512; i++) {
+		scAdd(r2, r2, r2);
+	}
+}
+
+static const Tables& getTables() {
+	static const Tables tables;
+	return tables;
+}
+
+const char* u2f::crypto::p256::getImplementationName() {
+#ifdef P256_MULX
+	if (useMulx)
+		return "64-bit mulx";
+#endif
+	return LIMB_BITS == 64 ? "64-bit" : "32-bit";
+}
+
+// r[i] = k[i] * G, for 0 < k[i] < N
+// Windows are processed in lockstep for every scalar, so each window of the table is only brought into the cache once.
+static void multiplyGeneratorBatch(JacobianPoint r[], const Scalar k[], uint32_t count) {
+	const Tables& tables = getTables();
+
+	Limb accIsInfinity[P256_MAX_BATCH];
+	int32_t carry[P256_MAX_BATCH];
+	for (uint32_t n=0; n<count; n++) {
+		// Any point with Z = 0. X and Y are set so that adding to it doesn't take the doubling branch.
+		memcpy(r[n].x, FE_ONE, sizeof(Felem));
+		memcpy(r[n].y, FE_ONE, sizeof(Felem));
+		memset(r[n].z, 0, sizeof(Felem));
+		accIsInfinity[n] = ~(Limb)0;
+		carry[n] = 0;
+	}
+
+	for (int i=0; i<COMB_WINDOWS; i++) {
+		for (uint32_t n=0; n<count; n++) {
+			JacobianPoint &acc = r[n];
+
+			// Signed digit in [-8, 8]
+			int32_t digit = carry[n] + (i < 64 ? (int32_t)nibble(k[n], i) : 0);
+			carry[n] = (digit + 7) >> 4;
+			digit -= carry[n] << 4;
+
+			uint32_t sign = (uint32_t)digit >> 31;
+			uint32_t absDigit = ((uint32_t)digit ^ (0 - sign)) + sign;
+
+			// Constant-time lookup of |digit| * 16^i * G
+			AffinePoint point;
+			memset(&point, 0, sizeof(point));
+			for (int j=0; j<COMB_POINTS; j++) {
+				Limb mask = 0 - (Limb)isEqual(absDigit, j + 1);
+				select(point.x, tables.comb[i][j].x, mask);
+				select(point.y, tables.comb[i][j].y, mask);
+			}
+			Felem negativeY;
+			feSub(negativeY, P, point.y);
+			select(point.y, negativeY, 0 - (Limb)sign);
+
+			JacobianPoint sum;
+			pointAddMixed(sum, acc, point);
+
+			Limb nonZero = 0 - (Limb)(isEqual(absDigit, 0) ^ 1);
+			Limb useSum = nonZero & ~accIsInfinity[n];
+			Limb usePoint = nonZero & accIsInfinity[n];
+			select(acc.x, sum.x, useSum);
+			select(acc.y, sum.y, useSum);
+			select(acc.z, sum.z, useSum);
+			select(acc.x, point.x, usePoint);
+			select(acc.y, point.y, usePoint);
+			select(acc.z, FE_ONE, usePoint);
+			accIsInfinity[n] &= ~nonZero;
+		}
+	}
+}
+
+// r = k * G, for 0 < k < N
+static void multiplyGenerator(AffinePoint &r, const Scalar k) {
+	JacobianPoint acc;
+	multiplyGeneratorBatch(&acc, (const Scalar*)k, 1);
+	toAffine(r, acc);
+	feDecode(r.x, r.x);
+	feDecode(r.y, r.y);
+}
+
+
+bool u2f::crypto::p256::computePublicKey(const PrivateKey &privateKey, PublicKey &publicKey) {
+	Scalar d;
+	fromBytes(d, privateKey);
+	if (!isValidScalar(d))
+		return false;
+
+	AffinePoint q;
+	multiplyGenerator(q, d);
+	publicKey[0] = 0x04;
+	toBytes(publicKey + 1, q.x);
+	toBytes(publicKey + 33, q.y);
+	return true;
+}
+
+bool u2f::crypto::p256::makeNonce(const uint8_t k[32], uint8_t r[32], uint8_t kInverse[32]) {
+	bool success;
+	makeNonceBatch(1, (const uint8_t (*)[32])k, (uint8_t (*)[32])r, (uint8_t (*)[32])kInverse, &success);
+	return success;
+}
+
+void u2f::crypto::p256::makeNonceBatch(uint32_t count, const uint8_t kBytes[][32], uint8_t rBytes[][32], uint8_t kInverseBytes[][32], bool success[]) {
+	Scalar k[P256_MAX_BATCH];
+	JacobianPoint points[P256_MAX_BATCH];
+	Felem zInverse[P256_MAX_BATCH];
+
+	for (uint32_t offset=0; offset<count; offset+=P256_MAX_BATCH) {
+		uint32_t n = count - offset < P256_MAX_BATCH ? count - offset : P256_MAX_BATCH;
+
+		for (uint32_t i=0; i<n; i++) {
+			fromBytes(k[i], kBytes[offset + i]);
+			success[offset + i] = isValidScalar(k[i]);
+			if (!success[offset + i]) {
+				// Keeps the batch inversions away from zero
+				memset(k[i], 0, sizeof(k[i]));
+				k[i][0] = 1;
+			}
+		}
+
+		// r = x(k*G) mod N = X / Z^2 mod N
+		multiplyGeneratorBatch(points, k, n);
+		for (uint32_t i=0; i<n; i++) {
+			memcpy(zInverse[i], points[i].z, sizeof(Felem));
+		}
+		feBatchInv(zInverse, zInverse, n);
+		for (uint32_t i=0; i<n; i++) {
+			Felem r;
+			feSqr(zInverse[i], zInverse[i]);
+			feMul(r, points[i].x, zInverse[i]);
+			feDecode(r, r);
+			reduceOnce(r, r, N);
+			if (isZero(r))
+				success[offset + i] = false;
+			toBytes(rBytes[offset + i], r);
+		}
+
+		scBatchInv(k, k, n);
+		for (uint32_t i=0; i<n; i++) {
+			toBytes(kInverseBytes[offset + i], k[i]);
+		}
+	}
+
+	memset(k, 0, sizeof(k));
+	memset(points, 0, sizeof(points));
+}
+
+bool u2f::crypto::p256::signWithNonce(const PrivateKey &privateKey, const Hash &messageHash, const uint8_t rBytes[32], const uint8_t kInverseBytes[32], uint8_t rawSignature[64]) {
+	Scalar kInverse, d, e, r, s, t;
+	fromBytes(kInverse, kInverseBytes);
+	fromBytes(r, rBytes);
+	fromBytes(d, privateKey);
+	if (!isValidScalar(d))
+		return false;
+
+	// s = (e + r*d) / k mod N
+	fromBytes(e, messageHash);
+	reduceOnce(e, e, N);
+	scMul(t, r, d);
+	scAdd(t, e, t);
+	scMul(s, kInverse, t);
+
+	memset(kInverse, 0, sizeof(kInverse));
+	memset(d, 0, sizeof(d));
+	memset(t, 0, sizeof(t));
+	if (isZero(s))
+		return false;
+
+	toBytes(rawSignature, r);
+	toBytes(rawSignature + 32, s);
+	return true;
+}
+
+bool u2f::crypto::p256::sign(const PrivateKey &privateKey, const Hash &messageHash, const uint8_t k[32], uint8_t rawSignature[64]) {
+	uint8_t r[32], kInverse[32];
+	bool success = makeNonce(k, r, kInverse) && signWithNonce(privateKey, messageHash, r, kInverse, rawSignature);
+	memset(kInverse, 0, sizeof(kInverse));
+	return success;
+}
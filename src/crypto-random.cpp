@@ -0,0 +1,207 @@
+#include <u2f/crypto-random.h>
+#include <u2f/log.h>
+
+#include <uECC.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <atomic>
+#include <mutex>
+
+#define LOG_TAG "u2f-random"
+
+// ChaCha20 blocks generated at once. The first 32 bytes of them become the next key.
+#define RANDOM_BLOCKS 4
+#define RANDOM_BUFFER_SIZE (RANDOM_BLOCKS * 64)
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d,  8); \
+	c += d; b ^= c; b = ROTL(b,  7);
+
+namespace u2f {
+	namespace crypto {
+		struct Generator {
+			uint8_t key[32];
+			uint8_t buffer[RANDOM_BUFFER_SIZE];
+			uint32_t position;      // First unused byte of the buffer
+			uint64_t sinceReseed;   // Bytes handed out since the key came from the operating system
+			uint32_t generation;    // Value of randomGeneration when keyed, 0 if never
+			bool deterministic;
+
+			~Generator() {
+				memset((void*)this, 0, sizeof(*this));
+			}
+		};
+
+		static thread_local Generator generator;
+
+		// Bumped by setRandomSeed() and in the child after a fork, so that every thread rekeys
+		static std::atomic<uint32_t> randomGeneration{1};
+
+		static std::mutex seedMutex;
+		static bool seeded = false;
+		static Hash seed;
+		static uint32_t seededThreads = 0;
+	}
+}
+
+static void chacha20Block(const uint8_t key[32], uint32_t counter, uint8_t output[64]) {
+	uint32_t input[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };  // "expand 32-byte k"
+	for (int i=0; i<8; i++) {
+		input[4 + i] = (uint32_t)key[4*i] | ((uint32_t)key[4*i+1] << 8) | ((uint32_t)key[4*i+2] << 16) | ((uint32_t)key[4*i+3] << 24);
+	}
+	input[12] = counter;  // Nonce of zeroes: Every key only ever produces one buffer
+
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+	for (int round=0; round<10; round++) {
+		QUARTER_ROUND(x[0], x[4], x[ 8], x[12]);
+		QUARTER_ROUND(x[1], x[5], x[ 9], x[13]);
+		QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+		QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+		QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+		QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+		QUARTER_ROUND(x[2], x[7], x[ 8], x[13]);
+		QUARTER_ROUND(x[3], x[4], x[ 9], x[14]);
+	}
+
+	for (int i=0; i<16; i++) {
+		uint32_t word = x[i] + input[i];
+		output[4*i  ] = (uint8_t)(word >>  0);
+		output[4*i+1] = (uint8_t)(word >>  8);
+		output[4*i+2] = (uint8_t)(word >> 16);
+		output[4*i+3] = (uint8_t)(word >> 24);
+	}
+	memset(x, 0, sizeof(x));
+	memset(input, 0, sizeof(input));
+}
+
+static bool readDevUrandom(uint8_t* data, size_t size) {
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open /dev/urandom: %s", strerror(errno));
+		return false;
+	}
+	while (size) {
+		ssize_t n = read(fd, data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOG_ERROR("Failed to read /dev/urandom: %s", n < 0 ? strerror(errno) : "End of file");
+			close(fd);
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	close(fd);
+	return true;
+}
+
+static bool readSystemRandom(uint8_t* data, size_t size) {
+	while (size) {
+		ssize_t n = getrandom(data, size, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS)
+				return readDevUrandom(data, size);  // Kernels older than 3.17
+			LOG_ERROR("getrandom failed: %s", strerror(errno));
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool rekey(u2f::crypto::Generator &generator) {
+	uint32_t generation = u2f::crypto::randomGeneration.load(std::memory_order_acquire);
+	bool deterministic;
+	{
+		std::unique_lock<std::mutex> lck(u2f::crypto::seedMutex);
+		deterministic = u2f::crypto::seeded;
+		if (deterministic) {
+			uint32_t thread = u2f::crypto::seededThreads++;
+			u2f::crypto::sha256(*(u2f::crypto::Hash*)generator.key, u2f::crypto::seed, (int)sizeof(u2f::crypto::Hash), &thread, (int)sizeof(thread), nullptr);
+		}
+	}
+	if (!deterministic && !readSystemRandom(generator.key, sizeof(generator.key)))
+		return false;
+
+	memset(generator.buffer, 0, sizeof(generator.buffer));
+	generator.position = RANDOM_BUFFER_SIZE;
+	generator.sinceReseed = 0;
+	generator.generation = generation;
+	generator.deterministic = deterministic;
+	return true;
+}
+
+static void refill(u2f::crypto::Generator &generator) {
+	for (uint32_t i=0; i<RANDOM_BLOCKS; i++) {
+		chacha20Block(generator.key, i, generator.buffer + 64*i);
+	}
+	memcpy(generator.key, generator.buffer, sizeof(generator.key));
+	memset(generator.buffer, 0, sizeof(generator.key));
+	generator.position = sizeof(generator.key);
+}
+
+bool u2f::crypto::randomBytes(void* data, size_t size) {
+	Generator &generator = crypto::generator;
+	if (generator.generation != randomGeneration.load(std::memory_order_acquire) ||
+		(!generator.deterministic && generator.sinceReseed >= RANDOM_RESEED_INTERVAL)) {
+		if (!rekey(generator))
+			return false;
+	}
+
+	uint8_t* bytes = (uint8_t*)data;
+	generator.sinceReseed += size;
+	while (size) {
+		if (generator.position == RANDOM_BUFFER_SIZE)
+			refill(generator);
+		size_t n = RANDOM_BUFFER_SIZE - generator.position;
+		if (n > size)
+			n = size;
+		memcpy(bytes, generator.buffer + generator.position, n);
+		memset(generator.buffer + generator.position, 0, n);
+		generator.position += n;
+		bytes += n;
+		size -= n;
+	}
+	return true;
+}
+
+void u2f::crypto::setRandomSeed(const void* seed, size_t size) {
+	{
+		std::unique_lock<std::mutex> lck(seedMutex);
+		seeded = seed != nullptr;
+		if (seeded) {
+			sha256(crypto::seed, seed, (int)size, nullptr);
+		} else {
+			memset(crypto::seed, 0, sizeof(crypto::seed));
+		}
+		seededThreads = 0;
+	}
+	randomGeneration.fetch_add(1, std::memory_order_acq_rel);
+}
+
+static int uEccRandom(uint8_t* dest, unsigned size) {
+	return u2f::crypto::randomBytes(dest, size) ? 1 : 0;
+}
+
+static void onFork() {
+	// The child must not repeat its parent's output
+	u2f::crypto::randomGeneration.fetch_add(1, std::memory_order_acq_rel);
+}
+
+static const bool registered = []() {
+	uECC_set_rng(uEccRandom);
+	pthread_atfork(nullptr, nullptr, onFork);
+	return true;
+}();
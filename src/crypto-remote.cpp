@@ -0,0 +1,448 @@
+#include <u2f/crypto-remote.h>
+#include <u2f/log.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LOG_TAG "u2f-remote-signer"
+
+static bool sendFully(int fd, const uint8_t* buffer, size_t size) {
+	while (size) {
+		ssize_t ret = send(fd, buffer, size, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		buffer += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+static bool readFully(int fd, uint8_t* buffer, size_t size) {
+	while (size) {
+		ssize_t ret = read(fd, buffer, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		buffer += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+static void encodeRequest(uint8_t* request, uint32_t id, uint8_t command, uint8_t key, const u2f::crypto::Hash* messageHash) {
+	request[0] = id >> 24;
+	request[1] = id >> 16;
+	request[2] = id >>  8;
+	request[3] = id >>  0;
+	request[4] = command;
+	request[5] = key;
+	request[6] = 0;
+	request[7] = 0;
+	if (messageHash) {
+		memcpy(&request[8], *messageHash, sizeof(u2f::crypto::Hash));
+	} else {
+		memset(&request[8], 0, sizeof(u2f::crypto::Hash));
+	}
+}
+
+u2f::crypto::RemoteSigner::RemoteSigner(const char* socketPath, uint8_t key)
+: key(key), certificate(nullptr), certificateSize(0), fd(-1), connected(false), generation(0), reader(nullptr), nextId(0), nextSlot(0), freeSlots(REMOTE_SIGNER_MAX_PENDING)
+{
+	this->socketPath = new char[strlen(socketPath) + 1];
+	strcpy(this->socketPath, socketPath);
+	for (uint32_t i=0; i<REMOTE_SIGNER_MAX_PENDING; i++) {
+		slots[i].state = SLOT_FREE;
+		slots[i].id = 0;
+		slots[i].signature = nullptr;
+		slots[i].success = false;
+	}
+}
+
+u2f::crypto::RemoteSigner::~RemoteSigner() {
+	{
+		std::unique_lock<std::mutex> lck(connectMutex);
+		disconnect();
+	}
+	delete[] certificate;
+	delete[] socketPath;
+}
+
+u2f::crypto::RemoteSigner* u2f::crypto::RemoteSigner::connect(const char* socketPath, uint8_t key) {
+	RemoteSigner* signer = new RemoteSigner(socketPath, key);
+	std::unique_lock<std::mutex> lck(signer->connectMutex);
+	if (!signer->openSocket() || !signer->fetchCertificate()) {
+		signer->disconnect();
+		lck.unlock();
+		delete signer;
+		return nullptr;
+	}
+
+	std::unique_lock<std::mutex> slotsLck(signer->mutex);
+	signer->connected = true;
+	signer->generation++;
+	signer->reader = new std::thread(readerFunc, signer, signer->fd);
+	return signer;
+}
+
+bool u2f::crypto::RemoteSigner::openSocket() {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		LOG_ERROR("Socket path is too long: %s", socketPath);
+		return false;
+	}
+	strcpy(address.sun_path, socketPath);
+
+	int socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (socketFd < 0) {
+		LOG_ERROR("Failed to create socket: %s", strerror(errno));
+		return false;
+	}
+	if (::connect(socketFd, (sockaddr*)&address, sizeof(address)) != 0) {
+		LOG_ERROR("Failed to connect to %s: %s", socketPath, strerror(errno));
+		close(socketFd);
+		return false;
+	}
+
+	std::unique_lock<std::mutex> writeLck(writeMutex);
+	std::unique_lock<std::mutex> lck(mutex);
+	fd = socketFd;
+	return true;
+}
+
+// Done once, synchronously, before the reader thread starts
+bool u2f::crypto::RemoteSigner::fetchCertificate() {
+	uint8_t request[REMOTE_SIGNER_REQUEST_SIZE];
+	encodeRequest(request, 0, REMOTE_SIGNER_CMD_CERTIFICATE, key, nullptr);
+	uint8_t header[REMOTE_SIGNER_RESPONSE_HEADER_SIZE];
+	if (!sendFully(fd, request, sizeof(request)) || !readFully(fd, header, sizeof(header))) {
+		LOG_ERROR("Failed to fetch the certificate from %s", socketPath);
+		return false;
+	}
+
+	uint8_t status = header[4];
+	uint16_t size = (header[6] << 8) | header[7];
+	uint8_t* data = size ? new uint8_t[size] : nullptr;
+	if (size && !readFully(fd, data, size)) {
+		LOG_ERROR("Failed to fetch the certificate from %s", socketPath);
+		delete[] data;
+		return false;
+	}
+	if (status != REMOTE_SIGNER_STATUS_OK) {
+		LOG_ERROR("Signing daemon at %s refused key %d: status %d", socketPath, key, status);
+		delete[] data;
+		return false;
+	}
+
+	delete[] certificate;
+	certificate = data;
+	certificateSize = size;
+	return true;
+}
+
+bool u2f::crypto::RemoteSigner::ensureConnected() {
+	{
+		std::unique_lock<std::mutex> lck(mutex);
+		if (connected)
+			return true;
+	}
+
+	std::unique_lock<std::mutex> connectLck(connectMutex);
+	{
+		std::unique_lock<std::mutex> lck(mutex);
+		if (connected)
+			return true; // Another thread reconnected meanwhile
+	}
+
+	disconnect();
+	if (!openSocket())
+		return false;
+	LOG_INFO("Reconnected to %s", socketPath);
+
+	std::unique_lock<std::mutex> lck(mutex);
+	connected = true;
+	generation++;
+	reader = new std::thread(readerFunc, this, fd);
+	return true;
+}
+
+// Called with connectMutex held
+void u2f::crypto::RemoteSigner::disconnect() {
+	{
+		std::unique_lock<std::mutex> writeLck(writeMutex);
+		std::unique_lock<std::mutex> lck(mutex);
+		connected = false;
+		if (fd >= 0)
+			shutdown(fd, SHUT_RDWR); // Wakes up the reader
+	}
+
+	if (reader) {
+		reader->join();
+		delete reader;
+		reader = nullptr;
+	}
+
+	std::unique_lock<std::mutex> writeLck(writeMutex);
+	std::unique_lock<std::mutex> lck(mutex);
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	connected = false;
+}
+
+bool u2f::crypto::RemoteSigner::writeRequests(uint32_t requestsGeneration, int requestsFd, const uint8_t* requests, uint32_t count) {
+	std::unique_lock<std::mutex> writeLck(writeMutex);
+	{
+		// The socket may have been replaced since the slots were taken: Their requests have failed already
+		std::unique_lock<std::mutex> lck(mutex);
+		if (!connected || generation != requestsGeneration)
+			return false;
+	}
+
+	if (!sendFully(requestsFd, requests, count * REMOTE_SIGNER_REQUEST_SIZE)) {
+		LOG_ERROR("Failed to send requests to %s: %s", socketPath, strerror(errno));
+		shutdown(requestsFd, SHUT_RDWR); // The reader fails every pending request
+		return false;
+	}
+	return true;
+}
+
+bool u2f::crypto::RemoteSigner::sendRequests(uint32_t count, const Hash* const messageHashes[], Signature* const signatures[], int32_t slotIndexes[], bool wait) {
+	for (uint32_t i=0; i<count; i++) {
+		slotIndexes[i] = -1;
+	}
+	if (!ensureConnected())
+		return true;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REMOTE_SIGNER_TIMEOUT_MS);
+	uint8_t requests[REMOTE_SIGNER_MAX_BATCH * REMOTE_SIGNER_REQUEST_SIZE];
+	uint32_t requestsGeneration;
+	int requestsFd;
+	{
+		std::unique_lock<std::mutex> lck(mutex);
+		if (!wait && connected && freeSlots < count)
+			return false;
+		while (connected && freeSlots < count) {
+			if (slotChanged.wait_until(lck, deadline) == std::cv_status::timeout && freeSlots < count) {
+				LOG_ERROR("No free slots for %s after %d ms", socketPath, REMOTE_SIGNER_TIMEOUT_MS);
+				abandonConnection();
+			}
+		}
+		if (!connected)
+			return true;
+
+		uint32_t slot = nextSlot;
+		for (uint32_t i=0; i<count; i++) {
+			while (slots[slot].state != SLOT_FREE) {
+				slot = (slot + 1) % REMOTE_SIGNER_MAX_PENDING;
+			}
+			slots[slot].state = SLOT_WAITING;
+			slots[slot].id = (nextId++ * REMOTE_SIGNER_MAX_PENDING) + slot;
+			slots[slot].signature = signatures[i];
+			slots[slot].success = false;
+			slotIndexes[i] = slot;
+			encodeRequest(&requests[i * REMOTE_SIGNER_REQUEST_SIZE], slots[slot].id, REMOTE_SIGNER_CMD_SIGN, key, messageHashes[i]);
+		}
+		nextSlot = (slot + 1) % REMOTE_SIGNER_MAX_PENDING;
+		freeSlots -= count;
+		requestsGeneration = generation;
+		requestsFd = fd;
+	}
+
+	writeRequests(requestsGeneration, requestsFd, requests, count);
+	return true;
+}
+
+void u2f::crypto::RemoteSigner::waitResponses(uint32_t count, const int32_t slotIndexes[], bool success[]) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REMOTE_SIGNER_TIMEOUT_MS);
+	std::unique_lock<std::mutex> lck(mutex);
+	for (uint32_t i=0; i<count; i++) {
+		int32_t slot = slotIndexes[i];
+		if (slot < 0) {
+			success[i] = false;
+			continue;
+		}
+		while (slots[slot].state != SLOT_DONE) {
+			if (slotChanged.wait_until(lck, deadline) == std::cv_status::timeout && slots[slot].state != SLOT_DONE) {
+				LOG_ERROR("No response from %s after %d ms", socketPath, REMOTE_SIGNER_TIMEOUT_MS);
+				abandonConnection(); // Fails this slot too
+			}
+		}
+		success[i] = slots[slot].success;
+		slots[slot].state = SLOT_FREE;
+		slots[slot].signature = nullptr;
+		freeSlots++;
+	}
+	slotChanged.notify_all();
+}
+
+void u2f::crypto::RemoteSigner::abandonConnection() {
+	// Every pending request went through the current connection: Requests left on a previous one failed when it was lost
+	if (connected) {
+		connected = false;
+		shutdown(fd, SHUT_RDWR); // The reader exits, and the next request reconnects
+	}
+	for (uint32_t i=0; i<REMOTE_SIGNER_MAX_PENDING; i++) {
+		if (slots[i].state == SLOT_WAITING) {
+			slots[i].success = false;
+			slots[i].state = SLOT_DONE;
+		}
+	}
+	slotChanged.notify_all();
+}
+
+void u2f::crypto::RemoteSigner::readerFunc(RemoteSigner* signer, int fd) {
+	uint8_t buffer[4096];
+	uint32_t size = 0;
+	while (true) {
+		ssize_t ret = read(fd, &buffer[size], sizeof(buffer) - size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		size += ret;
+
+		uint32_t offset = 0;
+		bool valid = true;
+		{
+			std::unique_lock<std::mutex> lck(signer->mutex);
+			while (size - offset >= REMOTE_SIGNER_RESPONSE_HEADER_SIZE) {
+				const uint8_t* response = &buffer[offset];
+				uint32_t id = ((uint32_t)response[0] << 24) | (response[1] << 16) | (response[2] << 8) | response[3];
+				uint8_t status = response[4];
+				uint16_t dataSize = (response[6] << 8) | response[7];
+				if (dataSize > sizeof(Signature)) {
+					valid = false;
+					break;
+				}
+				if (size - offset < (uint32_t)REMOTE_SIGNER_RESPONSE_HEADER_SIZE + dataSize)
+					break; // Incomplete
+				const uint8_t* data = &response[REMOTE_SIGNER_RESPONSE_HEADER_SIZE];
+
+				Slot &slot = signer->slots[id % REMOTE_SIGNER_MAX_PENDING];
+				if (slot.state == SLOT_WAITING && slot.id == id) {
+					slot.success = status == REMOTE_SIGNER_STATUS_OK && dataSize >= 2 && data[0] == 0x30 && data[1] + 2 == dataSize;
+					if (slot.success) {
+						memcpy(*slot.signature, data, dataSize);
+					} else {
+						LOG_WARN("Remote signature failed: status %d", status);
+					}
+					slot.state = SLOT_DONE;
+				}
+				offset += REMOTE_SIGNER_RESPONSE_HEADER_SIZE + dataSize;
+			}
+			signer->slotChanged.notify_all();
+		}
+		if (!valid) {
+			LOG_ERROR("Invalid response from the signing daemon");
+			break;
+		}
+		memmove(buffer, &buffer[offset], size - offset);
+		size -= offset;
+	}
+
+	// Fail everything in flight, the next signature reconnects
+	std::unique_lock<std::mutex> lck(signer->mutex);
+	if (signer->connected) {
+		LOG_WARN("Lost connection to the signing daemon");
+	}
+	signer->connected = false;
+	for (uint32_t i=0; i<REMOTE_SIGNER_MAX_PENDING; i++) {
+		if (signer->slots[i].state == SLOT_WAITING) {
+			signer->slots[i].success = false;
+			signer->slots[i].state = SLOT_DONE;
+		}
+	}
+	signer->slotChanged.notify_all();
+}
+
+bool u2f::crypto::RemoteSigner::sign(const Hash &messageHash, Signature &signature) {
+	const Hash* messageHashes[1] = { &messageHash };
+	Signature* signatures[1] = { &signature };
+	int32_t slotIndexes[1];
+	bool success[1];
+	sendRequests(1, messageHashes, signatures, slotIndexes, true);
+	waitResponses(1, slotIndexes, success);
+	return success[0];
+}
+
+void u2f::crypto::RemoteSigner::signRemoteBatch(uint32_t count, Signer* const signers[], const Hash* const messageHashes[], Signature* const signatures[], bool success[]) {
+	RemoteSigner* groupSigners[REMOTE_SIGNER_MAX_BATCH];
+	uint32_t groupStarts[REMOTE_SIGNER_MAX_BATCH + 1];
+	uint32_t groupIndexes[REMOTE_SIGNER_MAX_BATCH];
+	const Hash* groupHashes[REMOTE_SIGNER_MAX_BATCH];
+	Signature* groupSignatures[REMOTE_SIGNER_MAX_BATCH];
+	int32_t slotIndexes[REMOTE_SIGNER_MAX_BATCH];
+	bool groupSuccess[REMOTE_SIGNER_MAX_BATCH];
+	bool grouped[REMOTE_SIGNER_MAX_BATCH];
+	bool sent[REMOTE_SIGNER_MAX_BATCH];
+
+	for (uint32_t offset=0; offset<count; offset+=REMOTE_SIGNER_MAX_BATCH) {
+		uint32_t n = count - offset < REMOTE_SIGNER_MAX_BATCH ? count - offset : REMOTE_SIGNER_MAX_BATCH;
+
+		// Group the requests of each connection, so that each group is a single write
+		uint32_t groupCount = 0;
+		uint32_t size = 0;
+		memset(grouped, 0, sizeof(grouped));
+		for (uint32_t i=0; i<n; i++) {
+			if (grouped[i])
+				continue;
+			RemoteSigner* signer = (RemoteSigner*)signers[offset + i];
+			groupSigners[groupCount] = signer;
+			groupStarts[groupCount] = size;
+			for (uint32_t j=i; j<n; j++) {
+				if (!grouped[j] && signers[offset + j] == signer) {
+					grouped[j] = true;
+					groupIndexes[size] = offset + j;
+					groupHashes[size] = messageHashes[offset + j];
+					groupSignatures[size] = signatures[offset + j];
+					size++;
+				}
+			}
+			groupCount++;
+		}
+		groupStarts[groupCount] = size;
+
+		// Send everything first, so that all the daemons work while we wait.
+		// Only the first group may wait for slots: Waiting while holding the slots of other groups could deadlock.
+		for (uint32_t g=0; g<groupCount; g++) {
+			uint32_t start = groupStarts[g];
+			sent[g] = groupSigners[g]->sendRequests(groupStarts[g + 1] - start, &groupHashes[start], &groupSignatures[start], &slotIndexes[start], g == 0);
+		}
+		for (uint32_t g=0; g<groupCount; g++) {
+			uint32_t start = groupStarts[g];
+			if (sent[g])
+				groupSigners[g]->waitResponses(groupStarts[g + 1] - start, &slotIndexes[start], &groupSuccess[start]);
+		}
+		// The rest once no slot is held
+		for (uint32_t g=0; g<groupCount; g++) {
+			uint32_t start = groupStarts[g];
+			if (!sent[g]) {
+				groupSigners[g]->sendRequests(groupStarts[g + 1] - start, &groupHashes[start], &groupSignatures[start], &slotIndexes[start], true);
+				groupSigners[g]->waitResponses(groupStarts[g + 1] - start, &slotIndexes[start], &groupSuccess[start]);
+			}
+		}
+
+		for (uint32_t i=0; i<size; i++) {
+			success[groupIndexes[i]] = groupSuccess[i];
+		}
+	}
+}
+
+bool u2f::crypto::RemoteSigner::getCertificate(const uint8_t *&certificate, uint16_t &certificateSize) {
+	certificate = this->certificate;
+	certificateSize = this->certificateSize;
+	return certificate != nullptr;
+}
+
+u2f::crypto::Signer::BatchFunc u2f::crypto::RemoteSigner::getBatchFunc() {
+	return signRemoteBatch;
+}
@@ -0,0 +1,257 @@
+#include <u2f/crypto-sha256.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*CompressFunction)(uint32_t state[8], const uint8_t* blocks, size_t blockCount);
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t initialState[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void compressPortable(uint32_t state[8], const uint8_t* blocks, size_t blockCount) {
+	uint32_t w[64];
+	while (blockCount--) {
+		for (int i=0; i<16; i++) {
+			w[i] = ((uint32_t)blocks[4*i] << 24) | ((uint32_t)blocks[4*i+1] << 16) | ((uint32_t)blocks[4*i+2] << 8) | blocks[4*i+3];
+		}
+		for (int i=16; i<64; i++) {
+			uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i=0; i<64; i++) {
+			uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+		blocks += 64;
+	}
+}
+
+#ifdef SHA256_X86
+__attribute__((target("sha,sse4.1")))
+static void compressShaNi(uint32_t state[8], const uint8_t* blocks, size_t blockCount) {
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// The instructions want the state as ABEF and CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);   // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);  // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+	while (blockCount--) {
+		__m128i savedState0 = state0;
+		__m128i savedState1 = state1;
+
+		// Message schedule, 4 words at a time, in a ring of 4 registers
+		__m128i w[4];
+		for (int i=0; i<4; i++) {
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 16*i)), byteSwap);
+		}
+
+		// The schedule of the next words is interleaved with the rounds, so that they overlap.
+		// Must be unrolled to keep w[] in registers.
+		#pragma GCC unroll 16
+		for (int i=0; i<16; i++) {
+			__m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*)&K[4*i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if (i >= 3 && i < 15) {
+				// Completes w[i+1], started 2 iterations ago
+				w[(i+1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(w[(i+1) & 3], _mm_alignr_epi8(w[i & 3], w[(i-1) & 3], 4)), w[i & 3]);
+			}
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+			if (i >= 1 && i < 13) {
+				// Starts w[i+3], replacing w[i-1]
+				w[(i-1) & 3] = _mm_sha256msg1_epu32(w[(i-1) & 3], w[i & 3]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, savedState0);
+		state1 = _mm_add_epi32(state1, savedState1);
+		blocks += 64;
+	}
+
+	// Back to ABCD and EFGH
+	tmp = _mm_shuffle_epi32(state0, 0x1B);             // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);          // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);       // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);          // HGFE
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static bool cpuSupportsShaNi() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return false;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx & (1 << 29)) != 0;  // SHA
+}
+#endif
+
+struct Implementation {
+	CompressFunction compress;
+	const char* name;
+};
+
+static const Implementation& getImplementation() {
+	static const Implementation implementation = []() -> Implementation {
+#ifdef SHA256_X86
+		if (cpuSupportsShaNi())
+			return { compressShaNi, "sha-ni" };
+#endif
+		return { compressPortable, "portable" };
+	}();
+	return implementation;
+}
+
+
+u2f::crypto::Sha256::Sha256() {
+	reset();
+}
+
+void u2f::crypto::Sha256::reset() {
+	memcpy(state, initialState, sizeof(state));
+	bufferSize = 0;
+	totalSize = 0;
+}
+
+u2f::crypto::Sha256& u2f::crypto::Sha256::update(const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	CompressFunction compress = getImplementation().compress;
+	totalSize += size;
+
+	// Complete a partial block first
+	if (bufferSize) {
+		size_t n = sizeof(buffer) - bufferSize;
+		if (n > size)
+			n = size;
+		memcpy(buffer + bufferSize, bytes, n);
+		bufferSize += n;
+		bytes += n;
+		size -= n;
+		if (bufferSize < sizeof(buffer))
+			return *this;
+		compress(state, buffer, 1);
+		bufferSize = 0;
+	}
+
+	// Whole blocks straight from the input
+	if (size >= sizeof(buffer)) {
+		size_t blockCount = size / sizeof(buffer);
+		compress(state, bytes, blockCount);
+		bytes += blockCount * sizeof(buffer);
+		size -= blockCount * sizeof(buffer);
+	}
+
+	memcpy(buffer, bytes, size);
+	bufferSize = size;
+	return *this;
+}
+
+void u2f::crypto::Sha256::finish(Hash &hash) {
+	CompressFunction compress = getImplementation().compress;
+	uint64_t bitCount = totalSize * 8;
+
+	// Padding: 0x80, zeroes, then the length in bits (big-endian), in one or two blocks
+	buffer[bufferSize++] = 0x80;
+	if (bufferSize > sizeof(buffer) - 8) {
+		memset(buffer + bufferSize, 0, sizeof(buffer) - bufferSize);
+		compress(state, buffer, 1);
+		bufferSize = 0;
+	}
+	memset(buffer + bufferSize, 0, sizeof(buffer) - 8 - bufferSize);
+	for (int i=0; i<8; i++) {
+		buffer[sizeof(buffer) - 1 - i] = (uint8_t)(bitCount >> (8 * i));
+	}
+	compress(state, buffer, 1);
+
+	for (int i=0; i<8; i++) {
+		hash[4*i  ] = (uint8_t)(state[i] >> 24);
+		hash[4*i+1] = (uint8_t)(state[i] >> 16);
+		hash[4*i+2] = (uint8_t)(state[i] >>  8);
+		hash[4*i+3] = (uint8_t)(state[i] >>  0);
+	}
+
+	reset();
+}
+
+const char* u2f::crypto::Sha256::getImplementationName() {
+	return getImplementation().name;
+}
+
+
+static void padKey(uint8_t block[64], const u2f::crypto::Hash &key, uint8_t value) {
+	for (int i=0; i<64; i++) {
+		block[i] = (i < (int)sizeof(u2f::crypto::Hash) ? key[i] : 0) ^ value;
+	}
+}
+
+u2f::crypto::HmacSha256::~HmacSha256() {
+	memset((void*)this, 0, sizeof(*this));
+}
+
+u2f::crypto::HmacSha256& u2f::crypto::HmacSha256::init(const Hash &key) {
+	uint8_t block[64];
+	padKey(block, key, 0x36);
+	innerStart.reset();
+	innerStart.update(block, sizeof(block));
+	padKey(block, key, 0x5c);
+	outerStart.reset();
+	outerStart.update(block, sizeof(block));
+	memset(block, 0, sizeof(block));
+	inner = innerStart;
+	return *this;
+}
+
+u2f::crypto::HmacSha256& u2f::crypto::HmacSha256::restart() {
+	inner = innerStart;
+	return *this;
+}
+
+u2f::crypto::HmacSha256& u2f::crypto::HmacSha256::update(const void* data, size_t size) {
+	inner.update(data, size);
+	return *this;
+}
+
+void u2f::crypto::HmacSha256::finish(Hash &mac) {
+	Hash innerHash;
+	inner.finish(innerHash);
+	Sha256 outer = outerStart;
+	outer.update(innerHash, sizeof(Hash)).finish(mac);
+	memset(innerHash, 0, sizeof(innerHash));
+}
@@ -0,0 +1,32 @@
+#include <u2f/crypto-signer-slot.h>
+#include <string.h>
+
+void u2f::crypto::SignerSlot::borrow(Signer* signer) {
+	release();
+	this->signer = signer;
+	ownership = signer ? BORROWED : NONE;
+}
+
+void u2f::crypto::SignerSlot::adopt(Signer* signer) {
+	release();
+	this->signer = signer;
+	ownership = signer ? ADOPTED : NONE;
+}
+
+void u2f::crypto::SignerSlot::release() {
+	switch (ownership) {
+		case EMPLACED:
+			signer->~Signer();
+			// Private keys must not outlive the request. The barrier keeps the compiler from dropping the "dead" store.
+			memset(storage, 0, sizeof(storage));
+			__asm__ __volatile__("" : : "r"(storage) : "memory");
+			break;
+		case ADOPTED:
+			delete signer;
+			break;
+		default:
+			break;
+	}
+	signer = nullptr;
+	ownership = NONE;
+}
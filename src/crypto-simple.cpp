@@ -14,6 +14,10 @@ u2f::crypto::SimpleSigner::SimpleSigner(const u2f::crypto::PrivateKey &privateKe
 	memcpy(this->privateKey, privateKey, sizeof(PrivateKey));
 }
 
+u2f::crypto::SimpleSigner::~SimpleSigner() {
+	memset(privateKey, 0, sizeof(PrivateKey));
+}
+
 bool u2f::crypto::SimpleSigner::sign(const u2f::crypto::Hash &messageHash, u2f::crypto::Signature &signature) {
 	return crypto::sign(privateKey, messageHash, signature);
 }
@@ -23,3 +27,7 @@ bool u2f::crypto::SimpleSigner::getCertificate(const uint8_t *&certificate, uint
 	certificateSize = this->certificateSize;
 	return certificate != nullptr;
 }
+
+const u2f::crypto::PrivateKey* u2f::crypto::SimpleSigner::getBatchKey() {
+	return &privateKey;
+}
@@ -1,88 +1,44 @@
 #include <u2f/core.h>
+#include <u2f/crypto-backend.h>
+#include <u2f/crypto-nonce-pool.h>
+#include <u2f/crypto-sha256.h>
+#include <u2f/stats.h>
 
 #include <stdarg.h>
-#include <uECC.h>
-#include <sha256.h>
 #include <string.h>
 
-/**
- * SHA256 adapter for uECC
- */
-namespace u2f {
-	namespace crypto {
-		struct uECC_SHA256 {
-			uECC_HashContext uECC;
-			SHA256_CTX ctx;
-			uint8_t tmp[128];
-
-			static void init(const uECC_HashContext *base) {
-				uECC_SHA256 *context = (uECC_SHA256 *)base;
-				sha256_init(&context->ctx);
-			}
-			static void update(const uECC_HashContext *base, const uint8_t *message, unsigned message_size) {
-				uECC_SHA256 *context = (uECC_SHA256 *)base;
-				sha256_update(&context->ctx, message, message_size);
-			}
-			static void finish(const uECC_HashContext *base, uint8_t *hash_result) {
-				uECC_SHA256 *context = (uECC_SHA256 *)base;
-				sha256_final(&context->ctx, hash_result);
-			}
-
-			uECC_SHA256() {
-				uECC.init_hash = &init;
-				uECC.update_hash = &update;
-				uECC.finish_hash = &finish;
-				uECC.block_size = 64;
-				uECC.result_size = 32;
-				uECC.tmp = tmp;
-			}
-		};
-	}
-}
-
-
+// Largest batch signed at once. Larger ones are split.
+#define SIGN_MAX_BATCH 32
 
 void u2f::crypto::sha256(Hash &hash, ...) {
+	stats::Timer timer(stats::STAGE_SHA256);
 	va_list ap;
 	va_start(ap, hash);
 
-	SHA256_CTX hashContext;
-	sha256_init(&hashContext);
+	Sha256 hashContext;
 
 	while (true) {
 		uint8_t* buffer = va_arg(ap, uint8_t*);
 		if (buffer == nullptr) break;
 		int bufferSize = va_arg(ap, int);
-		sha256_update(&hashContext, buffer, bufferSize);
+		hashContext.update(buffer, bufferSize);
 	}
+	va_end(ap);
 
-	sha256_final(&hashContext, hash);
+	hashContext.finish(hash);
 }
 
 
 bool u2f::crypto::makeKeyPair(PublicKey &publicKey, PrivateKey &privateKey) {
-	publicKey[0] = 0x04;  // Curve name: P-256
-	return uECC_make_key(publicKey + 1, privateKey, uECC_secp256r1());
+	return getBackend()->makeKeyPair(publicKey, privateKey);
 }
 
 
-bool u2f::crypto::sign(const u2f::crypto::PrivateKey &privateKey, const u2f::crypto::Hash &messageHash, u2f::crypto::Signature &signature) {
-	uECC_SHA256 eccHash;
-	uint8_t rawSignature[64]; //Maybe use signature and perform DER bullshit in-place?
-
-	int sign_success = uECC_sign_deterministic(
-		privateKey,
-		messageHash,
-		sizeof(u2f::crypto::Hash),
-		&eccHash.uECC,
-		rawSignature,
-		uECC_secp256r1());
-
-	if (!sign_success)
-		return false;
-
+/**
+ * Wraps a raw signature in a DER container
+ */
+static void encodeSignature(const uint8_t rawSignature[64], u2f::crypto::Signature &signature) {
 	uint8_t signatureSize = 0;
-	//Wraps the key in a fucking DER container
 	signature[signatureSize++] = 0x30; //A header byte indicating a compound structure.
 	signature[signatureSize++] = 0; // Will fill later
 
@@ -109,10 +65,138 @@ bool u2f::crypto::sign(const u2f::crypto::PrivateKey &privateKey, const u2f::cry
 	signatureSize += 32;
 
 	signature[1] = signatureSize - 2; //Fill Signature size
+}
+
+bool u2f::crypto::sign(const u2f::crypto::PrivateKey &privateKey, const u2f::crypto::Hash &messageHash, u2f::crypto::Signature &signature) {
+	uint8_t rawSignature[64]; //Maybe use signature and perform DER bullshit in-place?
+
+	stats::Timer signTimer(stats::STAGE_SIGN);
+	NoncePool* noncePool = getNoncePool();
+	bool sign_success = (noncePool && noncePool->sign(privateKey, messageHash, rawSignature))
+		|| getBackend()->sign(privateKey, messageHash, rawSignature);
+	signTimer.stop();
+
+	if (!sign_success)
+		return false;
+
+	stats::Timer derTimer(stats::STAGE_DER);
+	encodeSignature(rawSignature, signature);
 	return true;
 }
 
 
+void u2f::crypto::signBatch(uint32_t count, const PrivateKey* const privateKeys[], const Hash* const messageHashes[], Signature* const signatures[], bool success[]) {
+	const PrivateKey* batchKeys[SIGN_MAX_BATCH];
+	const Hash* batchHashes[SIGN_MAX_BATCH];
+	uint8_t rawSignatures[SIGN_MAX_BATCH][64];
+	bool batchSuccess[SIGN_MAX_BATCH];
+	uint32_t batchIndexes[SIGN_MAX_BATCH];
+
+	NoncePool* noncePool = getNoncePool();
+	Backend* backend = getBackend();
+	for (uint32_t offset=0; offset<count; offset+=SIGN_MAX_BATCH) {
+		uint32_t n = count - offset < SIGN_MAX_BATCH ? count - offset : SIGN_MAX_BATCH;
+
+		// Precomputed nonces are already cheaper than any batch. The rest goes to the backend together.
+		stats::Timer signTimer(stats::STAGE_SIGN);
+		uint32_t batchSize = 0;
+		for (uint32_t i=0; i<n; i++) {
+			uint32_t j = offset + i;
+			success[j] = noncePool && noncePool->sign(*privateKeys[j], *messageHashes[j], rawSignatures[i]);
+			if (!success[j]) {
+				batchKeys[batchSize] = privateKeys[j];
+				batchHashes[batchSize] = messageHashes[j];
+				batchIndexes[batchSize] = i;
+				batchSize++;
+			}
+		}
+		if (batchSize) {
+			uint8_t backendSignatures[SIGN_MAX_BATCH][64];
+			backend->signBatch(batchSize, batchKeys, batchHashes, backendSignatures, batchSuccess);
+			for (uint32_t b=0; b<batchSize; b++) {
+				uint32_t i = batchIndexes[b];
+				success[offset + i] = batchSuccess[b];
+				memcpy(rawSignatures[i], backendSignatures[b], 64);
+			}
+		}
+		signTimer.stop();
+
+		stats::Timer derTimer(stats::STAGE_DER);
+		for (uint32_t i=0; i<n; i++) {
+			if (success[offset + i])
+				encodeSignature(rawSignatures[i], *signatures[offset + i]);
+		}
+	}
+}
+
+
+void u2f::crypto::Signer::signBatch(uint32_t count, Signer* const signers[], const Hash* const messageHashes[], Signature* const signatures[], bool success[]) {
+	const PrivateKey* batchKeys[SIGN_MAX_BATCH];
+	const Hash* batchHashes[SIGN_MAX_BATCH];
+	Signature* batchSignatures[SIGN_MAX_BATCH];
+	bool batchSuccess[SIGN_MAX_BATCH];
+	uint32_t batchIndexes[SIGN_MAX_BATCH];
+	BatchFunc batchFuncs[SIGN_MAX_BATCH];
+	Signer* funcSigners[SIGN_MAX_BATCH];
+
+	for (uint32_t offset=0; offset<count; offset+=SIGN_MAX_BATCH) {
+		uint32_t n = count - offset < SIGN_MAX_BATCH ? count - offset : SIGN_MAX_BATCH;
+
+		uint32_t batchSize = 0;
+		uint32_t funcCount = 0;
+		for (uint32_t i=offset; i<offset+n; i++) {
+			batchFuncs[i - offset] = nullptr;
+			if (count == 1) {
+				success[i] = signers[i]->sign(*messageHashes[i], *signatures[i]);
+				continue;
+			}
+			const PrivateKey* key = signers[i]->getBatchKey();
+			if (key == nullptr) {
+				batchFuncs[i - offset] = signers[i]->getBatchFunc();
+				if (batchFuncs[i - offset] == nullptr) {
+					success[i] = signers[i]->sign(*messageHashes[i], *signatures[i]);
+				} else {
+					funcCount++;
+				}
+				continue;
+			}
+			batchKeys[batchSize] = key;
+			batchHashes[batchSize] = messageHashes[i];
+			batchSignatures[batchSize] = signatures[i];
+			batchIndexes[batchSize] = i;
+			batchSize++;
+		}
+
+		crypto::signBatch(batchSize, batchKeys, batchHashes, batchSignatures, batchSuccess);
+		for (uint32_t b=0; b<batchSize; b++) {
+			success[batchIndexes[b]] = batchSuccess[b];
+		}
+
+		// One call per distinct batch function, with all of its signers
+		while (funcCount) {
+			BatchFunc func = nullptr;
+			uint32_t funcSize = 0;
+			for (uint32_t i=0; i<n; i++) {
+				if (batchFuncs[i] == nullptr || (func && batchFuncs[i] != func))
+					continue;
+				func = batchFuncs[i];
+				batchFuncs[i] = nullptr;
+				funcSigners[funcSize] = signers[offset + i];
+				batchHashes[funcSize] = messageHashes[offset + i];
+				batchSignatures[funcSize] = signatures[offset + i];
+				batchIndexes[funcSize] = offset + i;
+				funcSize++;
+			}
+			func(funcSize, funcSigners, batchHashes, batchSignatures, batchSuccess);
+			for (uint32_t b=0; b<funcSize; b++) {
+				success[batchIndexes[b]] = batchSuccess[b];
+			}
+			funcCount -= funcSize;
+		}
+	}
+}
+
+
 uint8_t u2f::crypto::signatureSize(const u2f::crypto::Signature &signature) {
 	return signature[1] + 2;
 }
@@ -0,0 +1,156 @@
+#include <u2f/handle-filter.h>
+#include <u2f/crypto-random.h>
+#include <u2f/log.h>
+#include <string.h>
+
+#define LOG_TAG "u2f-handle-filter"
+
+static inline uint64_t mix(uint64_t h) {
+	// MurmurHash3 finalizer
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t hashBytes(uint64_t h, const uint8_t* data, uint32_t size) {
+	while (size >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		h = mix(h ^ word) + 0x9e3779b97f4a7c15ULL;
+		data += 8;
+		size -= 8;
+	}
+	uint64_t tail = size;  // Also distinguishes inputs that only differ by trailing zeroes
+	for (uint32_t i=0; i<size; i++) {
+		tail |= (uint64_t)data[i] << (8 * (i + 1));
+	}
+	return mix(h ^ tail);
+}
+
+
+u2f::HandleFilter::Bits::Bits(uint32_t capacity)
+: capacity(capacity), count(0), next(nullptr)
+{
+	uint64_t wordCount = ((uint64_t)capacity * HANDLE_FILTER_BITS_PER_HANDLE + 63) / 64;
+	bitCount = wordCount * 64;
+	words = new std::atomic<uint64_t>[wordCount];
+	for (uint64_t i=0; i<wordCount; i++) {
+		words[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+u2f::HandleFilter::Bits::~Bits() {
+	delete[] words;
+}
+
+
+u2f::HandleFilter::HandleFilter()
+: bits(nullptr), retired(nullptr)
+{
+	// Random seed, so that nobody can craft handles that collide with ours
+	if (!crypto::randomBytes(seed, sizeof(seed))) {
+		LOG_WARN("Failed to generate a seed, handles can be crafted to collide");
+	}
+}
+
+u2f::HandleFilter::~HandleFilter() {
+	delete bits.load();
+	while (retired) {
+		Bits* next = retired->next;
+		delete retired;
+		retired = next;
+	}
+}
+
+void u2f::HandleFilter::hash(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, uint64_t &h1, uint64_t &h2) const {
+	uint64_t h = hashBytes(seed[0], applicationHash, sizeof(crypto::Hash));
+	h1 = hashBytes(h, handle, handleSize);
+	h2 = mix(h1 ^ seed[1]) | 1;
+}
+
+bool u2f::HandleFilter::load(sqlite3* db) {
+	Bits* newBits = nullptr;
+	sqlite3_stmt *stmt = nullptr;
+
+	// Count the handles first, to size the filter
+	int ret = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM Handle;", -1, &stmt, nullptr);
+	if (ret == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		uint64_t capacity = 2 * (uint64_t)sqlite3_column_int64(stmt, 0);
+		if (capacity < HANDLE_FILTER_MIN_CAPACITY)
+			capacity = HANDLE_FILTER_MIN_CAPACITY;
+		if (capacity > UINT32_MAX)
+			capacity = UINT32_MAX;
+		newBits = new Bits(capacity);
+	}
+	sqlite3_finalize(stmt);
+	stmt = nullptr;
+
+	if (newBits) {
+		ret = sqlite3_prepare_v2(db, "SELECT applicationHash, handle FROM Handle;", -1, &stmt, nullptr);
+		if (ret == SQLITE_OK) {
+			while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+				if (sqlite3_column_bytes(stmt, 0) != sizeof(crypto::Hash) || sqlite3_column_bytes(stmt, 1) > (int)sizeof(Handle))
+					continue;  // Can't be used anyway
+
+				uint64_t h1, h2;
+				hash(*(const crypto::Hash*)sqlite3_column_blob(stmt, 0), *(const Handle*)sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), h1, h2);
+				for (int i=0; i<HANDLE_FILTER_HASHES; i++) {
+					uint64_t bit = (h1 + i * h2) % newBits->bitCount;
+					newBits->words[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_relaxed);
+				}
+				newBits->count++;
+			}
+		}
+		sqlite3_finalize(stmt);
+
+		if (ret != SQLITE_DONE) {
+			delete newBits;
+			newBits = nullptr;
+		}
+	}
+
+	if (newBits == nullptr) {
+		LOG_ERROR("Failed to load handle filter: %s", sqlite3_errmsg(db));
+	} else {
+		LOG_DEBUG("Loaded %d handles into filter with capacity %d", newBits->count, newBits->capacity);
+	}
+
+	Bits* oldBits = bits.exchange(newBits, std::memory_order_acq_rel);
+	if (oldBits) {
+		oldBits->next = retired;
+		retired = oldBits;
+	}
+	return newBits != nullptr;
+}
+
+bool u2f::HandleFilter::add(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize) {
+	Bits* currentBits = bits.load(std::memory_order_acquire);
+	if (currentBits == nullptr)
+		return true;  // Not loaded, everything goes through anyway
+
+	uint64_t h1, h2;
+	hash(applicationHash, handle, handleSize, h1, h2);
+	for (int i=0; i<HANDLE_FILTER_HASHES; i++) {
+		uint64_t bit = (h1 + i * h2) % currentBits->bitCount;
+		currentBits->words[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_release);
+	}
+	return ++currentBits->count <= currentBits->capacity;
+}
+
+bool u2f::HandleFilter::mightContain(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize) const {
+	Bits* currentBits = bits.load(std::memory_order_acquire);
+	if (currentBits == nullptr)
+		return true;
+
+	uint64_t h1, h2;
+	hash(applicationHash, handle, handleSize, h1, h2);
+	for (int i=0; i<HANDLE_FILTER_HASHES; i++) {
+		uint64_t bit = (h1 + i * h2) % currentBits->bitCount;
+		if (!(currentBits->words[bit / 64].load(std::memory_order_acquire) & (1ULL << (bit % 64))))
+			return false;
+	}
+	return true;
+}
@@ -1,33 +1,11 @@
 #include <u2f/hid.h>
+#include <u2f/stats.h>
+#include <u2f/log.h>
 
 #include <string.h>
+#include <memory>
 
-#ifdef U2FHID_LOG
-
-#include <stdio.h>
-
-#define LOG(fmt, ...) fprintf(stderr, "u2f-hid: " fmt "\n", ##__VA_ARGS__)
-
-static void dump(const char* name, const void* buffer, int length) {
-	fprintf(stderr, "u2f-hid: %s: {", name);
-	for (int i=0; i<length; i++) {
-		if (i % 16 == 0) {
-			fprintf(stderr, "\n    ");
-		} else {
-			fprintf(stderr, " ");
-		}
-
-		fprintf(stderr, "%02x", ((uint8_t*)buffer)[i]);
-	}
-	fprintf(stderr, "\n}\n");
-}
-
-#else
-
-#define LOG(fmt, ...)
-static inline void dump(const char* name, const void* buffer, int length) {}
-
-#endif
+#define LOG_TAG "u2f-hid"
 
 
 #define min(a,b) (a<b?a:b)
@@ -44,6 +22,7 @@ static inline void dump(const char* name, const void* buffer, int length) {}
 #define CMD_INIT                0x86 // Channel initialization
 #define CMD_WINK                0x88 // Send device identification wink
 #define CMD_ERROR               0xbf // Error response
+#define CMD_CHECK_HANDLES       0xc1 // Vendor: Check which of many key handles belong to this device
 
 #define ERR_NONE                0x00 // No error
 #define ERR_INVALID_CMD         0x01 // Invalid command
@@ -130,6 +109,10 @@ uint16_t u2f::Hid::getReportSize(hiddev::ReportType reportType, uint8_t reportNu
 }
 
 bool u2f::Hid::receivedOutputReport(hiddev::ReportType reportType, uint8_t reportNum, const uint8_t* reportBuffer, uint16_t reportSize) {
+	trace::Recorder* recorder = traceRecorder.load(std::memory_order_relaxed);
+	if (recorder && reportType == hiddev::ReportType::Output && reportNum == 0)
+		recorder->record(trace::RECORD_HID_OUTPUT_REPORT, reportBuffer, reportSize);
+
 	if (reportType != hiddev::ReportType::Output)
 		return false;
 	if (reportNum != 0)
@@ -155,13 +138,19 @@ bool u2f::Hid::receivedOutputReport(hiddev::ReportType reportType, uint8_t repor
 			pendingMultipartRequest->cancel();
 
 
+		if (payloadSize > HID_MAX_PAYLOAD_SIZE) {
+			LOG_DEBUG("Payload too large: %d", payloadSize);
+			sendErrorResponse(cid, ERR_INVALID_LEN);
+			return true;
+		}
+
 		if (payloadSize <= reportSize - 7) {
 			handleRequest(cid, cmd, reportBuffer + 7, payloadSize);
 		} else {
 			//Start new multipart request
 			u2f::MultipartHidRequest* newMultipartRequest = getFreeMultipartHidRequest();
 			if (newMultipartRequest == nullptr) {
-				LOG("Failed to starting multi-part request -- No free objects");
+				LOG_WARN("Failed to starting multi-part request -- No free objects");
 				sendErrorResponse(cid, ERR_CHANNEL_BUSY);
 				return true;
 			}
@@ -170,19 +159,23 @@ bool u2f::Hid::receivedOutputReport(hiddev::ReportType reportType, uint8_t repor
 	} else {
 		//continue multipart request
 		if (pendingMultipartRequest == nullptr) {
-			LOG("Failed to continue multi-part request -- Mutipart request not found");
+			LOG_DEBUG("Failed to continue multi-part request -- Mutipart request not found");
 			sendErrorResponse(cid, ERR_INVALID_SEQ);
 			return true;
 		}
 
 		if (!pendingMultipartRequest->append(cmd, reportBuffer + 5, reportSize - 5)) {
-			LOG("Failed to continue multi-part request -- Invalid sequencing");
+			LOG_DEBUG("Failed to continue multi-part request -- Invalid sequencing");
 			pendingMultipartRequest->cancel();
 			sendErrorResponse(cid, ERR_INVALID_SEQ);
 			return true;
 		}
 
 		if (pendingMultipartRequest->isComplete()) {
+			{
+				stats::Scope statsScope(core.getStats(), getInstruction(pendingMultipartRequest->cmd, pendingMultipartRequest->payload, pendingMultipartRequest->payloadSize));
+				stats::record(stats::STAGE_HID_REASSEMBLY, stats::now() - pendingMultipartRequest->startedAt);
+			}
 			handleRequest(cid, pendingMultipartRequest->cmd, pendingMultipartRequest->payload, pendingMultipartRequest->payloadSize);
 			pendingMultipartRequest->cancel();
 		}
@@ -191,13 +184,15 @@ bool u2f::Hid::receivedOutputReport(hiddev::ReportType reportType, uint8_t repor
 }
 
 void u2f::Hid::handleRequest(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize) {
-	LOG("handleRequest: cid=%d, cmd=%d, size=%d", cid, cmd, payloadSize);
-	dump("Payload", payload, payloadSize);
+	LOG_DEBUG("handleRequest: cid=%d, cmd=%d, size=%d", cid, cmd, payloadSize);
+	LOG_DUMP("Payload", payload, payloadSize);
+
+	stats::Scope statsScope(core.getStats(), getInstruction(cmd, payload, payloadSize));
 
 	// Fail requests if there is an active lock on other channel
 	// I've decided to make exceptions to INIT and PING, which are stateless and can go through :)
 	if (lock.isLocked(cid) && (cmd != CMD_INIT) && (cmd != CMD_PING)) {
-		LOG("CMD %d on cid=%d failed due to lock from cid=%d :/", cmd, cid, lock.channel);
+		LOG_DEBUG("CMD %d on cid=%d failed due to lock from cid=%d :/", cmd, cid, lock.channel);
 		sendErrorResponse(cid, ERR_LOCK_REQUIRED);
 		return;
 	}
@@ -205,12 +200,12 @@ void u2f::Hid::handleRequest(uint32_t cid, uint8_t cmd, const uint8_t* payload,
 	switch (cmd) {
 		case CMD_INIT: {
 			if (cid != CID_BROADCAST) {
-				LOG("CMD_INIT failed: Must use broadcast CID");
+				LOG_DEBUG("CMD_INIT failed: Must use broadcast CID");
 				sendErrorResponse(cid, ERR_INVALID_CMD);
 				return;
 			}
 			if (payloadSize != 8) {
-				LOG("CMD_INIT failed: Payload must have 8 bytes");
+				LOG_DEBUG("CMD_INIT failed: Payload must have 8 bytes");
 				sendErrorResponse(cid, ERR_INVALID_LEN);
 				return;
 			}
@@ -230,32 +225,34 @@ void u2f::Hid::handleRequest(uint32_t cid, uint8_t cmd, const uint8_t* payload,
 				response[16] |= CAPFLAG_WINK;
 			}
 
-			LOG("CMD_INIT succeeded: CID=%d", new_cid);
+			LOG_DEBUG("CMD_INIT succeeded: CID=%d", new_cid);
 			sendResponse(CID_BROADCAST, CMD_INIT, response, sizeof(response));
 			break;
 		}
-		case CMD_MSG: {
+		case CMD_MSG:
+		case CMD_CHECK_HANDLES: {
 			if (cid == CID_BROADCAST) {
-				LOG("CMD_MSG failed: Cannot use broadcast CID");
+				LOG_DEBUG("CMD %d failed: Cannot use broadcast CID", cmd);
 				sendErrorResponse(cid, ERR_INVALID_CMD);
 				return;
 			}
-			const uint8_t* response = nullptr;
-			uint32_t responseSize = 0;
-			if (!core.processRawAdpu(payload, payloadSize, response, responseSize)) {
-				sendErrorResponse(cid, ERR_INVALID_PAR);
-				LOG("CMD_MSG failed: Cannot parse ADPU");
+			if (pool) {
+				dispatchMessage(cid, cmd, payload, payloadSize);
+			} else if (buffers) {
+				uint8_t* buffer = buffers->acquire();
+				processMessage(cid, cmd, payload, payloadSize, buffer);
+				buffers->release(buffer);
 			} else {
-				sendResponse(cid, CMD_MSG, response, responseSize);
-				LOG("CMD_MSG succeeded");
+				if (!responseBuffer) {
+					responseBuffer = new uint8_t[HID_MAX_PAYLOAD_SIZE];
+				}
+				processMessage(cid, cmd, payload, payloadSize, responseBuffer);
 			}
-			if (response)
-				delete response;
 			break;
 		}
 		case CMD_PING: {
 			sendResponse(cid, CMD_PING, payload, payloadSize);
-			LOG("CMD_PING succeeded");
+			LOG_DEBUG("CMD_PING succeeded");
 			break;
 		}
 		case CMD_WINK: {
@@ -265,35 +262,226 @@ void u2f::Hid::handleRequest(uint32_t cid, uint8_t cmd, const uint8_t* payload,
 			}
 			core.wink();
 			sendResponse(cid, CMD_WINK, nullptr, 0);
-			LOG("CMD_WINK succeeded");
+			LOG_DEBUG("CMD_WINK succeeded");
 			break;
 		}
 		case CMD_LOCK: {
 			if (payloadSize != 1) {
 				sendErrorResponse(cid, ERR_INVALID_LEN);
-				LOG("CMD_LOCK failed: Payload must have 1 byte");
+				LOG_DEBUG("CMD_LOCK failed: Payload must have 1 byte");
 				return;
 			}
 			if (payload[0] > MAX_LOCK_TIMEOUT) {
 				sendErrorResponse(cid, ERR_INVALID_PAR);
-				LOG("CMD_LOCK failed: Timeout must be <= %d, was %d", MAX_LOCK_TIMEOUT, payload[0]);
+				LOG_DEBUG("CMD_LOCK failed: Timeout must be <= %d, was %d", MAX_LOCK_TIMEOUT, payload[0]);
 				return;
 			}
 			lock.lock(cid, payload[0]);
 			sendResponse(cid, CMD_LOCK, nullptr, 0);
-			LOG("CMD_LOCK succeeded: %d seconds", payload[0]);
+			LOG_DEBUG("CMD_LOCK succeeded: %d seconds", payload[0]);
 			break;
 		}
 		default: {
 			sendErrorResponse(cid, ERR_INVALID_CMD);
-			LOG("Unknown CMD: %d", cmd);
+			LOG_DEBUG("Unknown CMD: %d", cmd);
 			break;
 		}
 	}
 }
 
+void u2f::Hid::processMessage(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize, uint8_t* responseBuffer) {
+	if (cmd == CMD_CHECK_HANDLES) {
+		processCheckHandles(cid, payload, payloadSize, responseBuffer);
+		return;
+	}
+
+	uint32_t responseSize = 0;
+	if (!core.processRawAdpu(payload, payloadSize, responseBuffer, HID_MAX_PAYLOAD_SIZE, responseSize)) {
+		sendErrorResponse(cid, ERR_INVALID_PAR);
+		LOG_DEBUG("CMD_MSG failed: Cannot parse ADPU");
+	} else {
+		sendResponse(cid, CMD_MSG, responseBuffer, responseSize);
+		LOG_DEBUG("CMD_MSG succeeded");
+	}
+}
+
+void u2f::Hid::processCheckHandles(uint32_t cid, const uint8_t* payload, uint16_t payloadSize, uint8_t* responseBuffer) {
+	// Request: applicationHash, followed by [handleSize, handle] for each handle
+	// Response: One byte for each handle, 1 if it belongs to this device
+	if (payloadSize < sizeof(crypto::Hash)) {
+		sendErrorResponse(cid, ERR_INVALID_LEN);
+		LOG_DEBUG("CMD_CHECK_HANDLES failed: Payload too short");
+		return;
+	}
+	const crypto::Hash &applicationHash = *(const crypto::Hash*)payload;
+
+	const Handle* handles[HID_MAX_CHECK_HANDLES];
+	uint8_t handleSizes[HID_MAX_CHECK_HANDLES];
+	bool owned[HID_MAX_CHECK_HANDLES];
+	uint32_t count = 0;
+	for (uint16_t offset = sizeof(crypto::Hash); offset < payloadSize; ) {
+		uint8_t handleSize = payload[offset++];
+		if (count == HID_MAX_CHECK_HANDLES || handleSize > payloadSize - offset) {
+			sendErrorResponse(cid, ERR_INVALID_LEN);
+			LOG_DEBUG("CMD_CHECK_HANDLES failed: Too many handles or truncated handle");
+			return;
+		}
+		handles[count] = (const Handle*)&payload[offset];
+		handleSizes[count] = handleSize;
+		count++;
+		offset += handleSize;
+	}
+
+	if (count) {
+		core.checkHandles(applicationHash, count, handles, handleSizes, owned);
+	}
+	for (uint32_t i=0; i<count; i++) {
+		responseBuffer[i] = owned[i] ? 1 : 0;
+	}
+	sendResponse(cid, CMD_CHECK_HANDLES, responseBuffer, count);
+	LOG_DEBUG("CMD_CHECK_HANDLES succeeded: %d handles", count);
+}
+
+void u2f::Hid::dispatchMessage(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize) {
+	HidJob* job = nullptr;
+	bool channelBusy = false;
+	{
+		std::unique_lock<std::mutex> lck(jobsMutex);
+		for (int i=0; i<HID_MAX_PENDING_REQUESTS; i++) {
+			if (jobs[i].busy && jobs[i].cid == cid) {
+				// Only one transaction at a time on each channel
+				channelBusy = true;
+				break;
+			}
+			if (!jobs[i].busy && job == nullptr) {
+				job = &jobs[i];
+			}
+		}
+		if (channelBusy || job == nullptr) {
+			LOG_DEBUG("CMD_MSG failed: cid=%d is busy", cid);
+			sendErrorResponse(cid, ERR_CHANNEL_BUSY);
+			return;
+		}
+		job->busy = true;
+		job->cid = cid;
+		job->cmd = cmd;
+	}
+
+	if (!job->payload) {
+		job->payload = buffers ? buffers->acquire() : new uint8_t[HID_MAX_PAYLOAD_SIZE];
+	}
+	memcpy(job->payload, payload, payloadSize);
+	job->payloadSize = payloadSize;
+	job->hid = this;
+
+	if (!pool->submitBatch(runJobs, job)) {
+		LOG_WARN("CMD_MSG failed: Worker queue is full");
+		std::unique_lock<std::mutex> lck(jobsMutex);
+		if (buffers) {
+			buffers->release(job->payload);
+			job->payload = nullptr;
+		}
+		job->busy = false;
+		sendErrorResponse(cid, ERR_CHANNEL_BUSY);
+	}
+}
+
+// Each worker thread reuses its own response buffers
+static thread_local uint8_t workerResponseBuffer[HID_MAX_PAYLOAD_SIZE];
+static thread_local std::unique_ptr<uint8_t[]> workerBatchResponseBuffers;  // For the rest of a batch, only allocated if needed
+
+void u2f::Hid::runJobs(void* const args[], uint32_t count) {
+	HidJob* const* jobs = (HidJob* const*)args;
+	if (count == 1) {
+		HidJob* job = jobs[0];
+		Hid* hid = job->hid;
+		{
+			stats::Scope statsScope(hid->core.getStats(), getInstruction(job->cmd, job->payload, job->payloadSize));
+			hid->processMessage(job->cid, job->cmd, job->payload, job->payloadSize, workerResponseBuffer);
+		}
+		hid->finishJob(job);
+		return;
+	}
+
+	// Many requests are waiting: Process them up to their signatures, which are then computed together
+	if (!workerBatchResponseBuffers) {
+		workerBatchResponseBuffers.reset(new uint8_t[(WORKER_POOL_MAX_BATCH - 1) * HID_MAX_PAYLOAD_SIZE]);
+	}
+
+	DeferredAdpu deferred[WORKER_POOL_MAX_BATCH];
+	DeferredAdpu* pending[WORKER_POOL_MAX_BATCH];
+	bool begun[WORKER_POOL_MAX_BATCH];
+	uint32_t pendingCount = 0;
+	for (uint32_t i=0; i<count; i++) {
+		HidJob* job = jobs[i];
+		Hid* hid = job->hid;
+		uint8_t* responseBuffer = i == 0 ? workerResponseBuffer : &workerBatchResponseBuffers[(i - 1) * HID_MAX_PAYLOAD_SIZE];
+
+		begun[i] = false;
+		stats::Scope statsScope(hid->core.getStats(), getInstruction(job->cmd, job->payload, job->payloadSize));
+		if (job->cmd != CMD_MSG) {
+			hid->processMessage(job->cid, job->cmd, job->payload, job->payloadSize, responseBuffer);
+		} else if (!hid->core.beginRawAdpu(job->payload, job->payloadSize, responseBuffer, HID_MAX_PAYLOAD_SIZE, deferred[i])) {
+			hid->sendErrorResponse(job->cid, ERR_INVALID_PAR);
+			LOG_DEBUG("CMD_MSG failed: Cannot parse ADPU");
+		} else {
+			begun[i] = true;
+			pending[pendingCount++] = &deferred[i];
+			continue;
+		}
+		hid->finishJob(job);
+	}
+
+	Core::signDeferred(pendingCount, pending);
+
+	for (uint32_t i=0; i<count; i++) {
+		if (!begun[i])
+			continue;
+		HidJob* job = jobs[i];
+		Hid* hid = job->hid;
+		uint32_t responseSize = 0;
+		hid->core.finishRawAdpu(deferred[i], responseSize);
+		hid->sendResponse(job->cid, CMD_MSG, deferred[i].rawResponse, responseSize);
+		LOG_DEBUG("CMD_MSG succeeded");
+		hid->finishJob(job);
+	}
+}
+
+void u2f::Hid::finishJob(HidJob* job) {
+	std::unique_lock<std::mutex> lck(jobsMutex);
+	if (buffers) {
+		buffers->release(job->payload);
+		job->payload = nullptr;
+	}
+	job->busy = false;
+	jobFinished.notify_all();
+}
+
+u2f::Hid::Hid(Core& core, WorkerPool* pool, BufferPool* buffers)
+: Protocol(core), channelIdCount(0), responseBuffer(nullptr), pool(pool), buffers(buffers)
+{
+	for (int i=0; i<HID_MAX_PENDING_REQUESTS; i++) {
+		multipartRequest[i].buffers = buffers;
+	}
+}
+
+u2f::Hid::~Hid() {
+	std::unique_lock<std::mutex> lck(jobsMutex);
+	for (int i=0; i<HID_MAX_PENDING_REQUESTS; i++) {
+		while (jobs[i].busy) {
+			jobFinished.wait(lck);
+		}
+	}
+	delete[] responseBuffer;
+}
+
 void u2f::Hid::sendResponse(uint32_t cid, uint8_t cmd, const uint8_t* payload, uint16_t payloadSize) {
-	dump("Response", payload, payloadSize);
+	LOG_DUMP("Response", payload, payloadSize);
+	stats::Timer timer(stats::STAGE_HID_SEND);
+	trace::Recorder* recorder = traceRecorder.load(std::memory_order_relaxed);
+
+	// Packets of different responses must not interleave
+	std::unique_lock<std::mutex> lck(sendMutex);
 	uint8_t msg[RESPONSE_PACKET_SIZE];
 	msg[0] = (uint8_t)(cid >> 24);
 	msg[1] = (uint8_t)(cid >> 16);
@@ -307,6 +495,8 @@ void u2f::Hid::sendResponse(uint32_t cid, uint8_t cmd, const uint8_t* payload, u
 	memcpy(msg + 7, payload, sz);
 	memset(msg + 7 + sz, 0, RESPONSE_PACKET_SIZE - sz - 7);
 	sendInputReport(0, msg, RESPONSE_PACKET_SIZE);
+	if (recorder)
+		recorder->record(trace::RECORD_HID_INPUT_REPORT, msg, RESPONSE_PACKET_SIZE);
 
 	uint8_t seq = 0;
 	payload += sz;
@@ -319,13 +509,25 @@ void u2f::Hid::sendResponse(uint32_t cid, uint8_t cmd, const uint8_t* payload, u
 		payload += sz;
 		payloadSize -= sz;
 		sendInputReport(0, msg, RESPONSE_PACKET_SIZE);
+		if (recorder)
+			recorder->record(trace::RECORD_HID_INPUT_REPORT, msg, RESPONSE_PACKET_SIZE);
 	}
 }
 
+void u2f::Hid::setTraceRecorder(trace::Recorder* recorder) {
+	traceRecorder.store(recorder);
+}
+
 void u2f::Hid::sendErrorResponse(uint32_t cid, uint8_t err) {
 	sendResponse(cid, CMD_ERROR, &err, 1);
 }
 
+u2f::stats::Instruction u2f::Hid::getInstruction(uint8_t cmd, const uint8_t* payload, uint16_t payloadSize) {
+	if (cmd == CMD_MSG && payloadSize >= 2)
+		return stats::getInstruction(payload[1]);
+	return stats::INSTRUCTION_OTHER;
+}
+
 u2f::MultipartHidRequest* u2f::Hid::getPendingMultipartHidRequest(uint32_t cid) {
 	for (int i=0; i<HID_MAX_PENDING_REQUESTS; i++) {
 		if (multipartRequest[i].cid == cid && !multipartRequest[i].isExpired()) {
@@ -344,23 +546,38 @@ u2f::MultipartHidRequest* u2f::Hid::getFreeMultipartHidRequest() {
 	return nullptr;
 }
 
+u2f::HidJob::HidJob()
+: hid(nullptr), cid(0), cmd(0), busy(false), payload(nullptr), payloadSize(0)
+{ }
+
+u2f::HidJob::~HidJob() {
+	if (payload) {
+		delete[] payload;
+		payload = nullptr;
+	}
+}
+
 u2f::MultipartHidRequest::MultipartHidRequest() {
 	cid = 0;
 	expiresAt = now();
 	payload = nullptr;
+	buffers = nullptr;
 }
 u2f::MultipartHidRequest::~MultipartHidRequest() {
-	if (payload) {
-		delete payload;
-		payload = nullptr;
+	if (buffers) {
+		buffers->release(payload);
+	} else {
+		delete[] payload;
 	}
+	payload = nullptr;
 }
 void u2f::MultipartHidRequest::cancel() {
-	expiresAt = now();
-	if (payload) {
-		delete payload;
+	// Unless it is borrowed from a pool, the payload buffer is kept around and reused by the next request
+	if (buffers && payload) {
+		buffers->release(payload);
 		payload = nullptr;
 	}
+	expiresAt = now();
 }
 
 void u2f::MultipartHidRequest::start(uint32_t cid, uint8_t cmd, uint16_t payloadSize, const uint8_t* firstPayload, uint16_t firstPayloadSize) {
@@ -368,13 +585,13 @@ void u2f::MultipartHidRequest::start(uint32_t cid, uint8_t cmd, uint16_t payload
 	this->cmd = cmd;
 	this->seq = 0;
 	this->payloadSize = payloadSize;
-	if (this->payload) {
-		delete this->payload;
+	if (!this->payload) {
+		this->payload = buffers ? buffers->acquire() : new uint8_t[HID_MAX_PAYLOAD_SIZE];
 	}
-	this->payload = new uint8_t[payloadSize];
 	memcpy(this->payload, firstPayload, min(firstPayloadSize, payloadSize));
 	this->currentPayloadSize = min(this->payloadSize, firstPayloadSize);
 	this->expiresAt = now() + 3000;
+	this->startedAt = stats::now();
 }
 
 bool u2f::MultipartHidRequest::append(uint8_t seq, const uint8_t* partialPayload, uint16_t partialPayloadSize) {
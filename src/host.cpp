@@ -0,0 +1,245 @@
+#include <u2f/host.h>
+#include <u2f/crypto-random.h>
+#include <u2f/log.h>
+#include <string.h>
+#include <new>
+
+#define LOG_TAG "u2f-host"
+
+struct u2f::Host::Slab {
+	uint64_t used;  // Bitmask of slots in use
+	alignas(HostedToken) uint8_t tokens[HOST_SLAB_SIZE][sizeof(HostedToken)];
+
+	inline HostedToken* get(uint32_t slot) {
+		return (used & (1ULL << slot)) ? (HostedToken*)tokens[slot] : nullptr;
+	}
+};
+
+
+u2f::HostedCore::HostedCore(Host& host, uint32_t tokenId)
+: host(host), tokenId(tokenId)
+{ }
+
+bool u2f::HostedCore::createHandle(const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize) {
+	return host.createHandle(tokenId, applicationHash, privateKey, handle, handleSize);
+}
+
+bool u2f::HostedCore::fetchHandle(const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter) {
+	return host.fetchHandle(tokenId, applicationHash, handle, handleSize, privateKey, authCounter);
+}
+
+u2f::crypto::Signer* u2f::HostedCore::getAttestationSigner() {
+	crypto::Signer* signer = host.attestationSigner.load(std::memory_order_acquire);
+	return signer ? signer : Core::getAttestationSigner();
+}
+
+u2f::KeyPool* u2f::HostedCore::getKeyPool() {
+	KeyPool* pool = host.keyPool.load(std::memory_order_acquire);
+	return pool ? pool : Core::getKeyPool();
+}
+
+
+u2f::HostedToken::HostedToken(Host& host, uint32_t id)
+: core(host, id), hid(core, &host.pool, &host.buffers)
+{ }
+
+
+u2f::Host::Host(const char* filename, uint32_t maxTokens, int threadCount)
+: pool(threadCount), buffers(HID_MAX_PAYLOAD_SIZE), db(nullptr),
+  insertHandleStatement(nullptr), selectHandleStatement(nullptr), updateCounterStatement(nullptr),
+  maxTokens(maxTokens), tokenCount(0)
+{
+	uint32_t slabCount = (maxTokens + HOST_SLAB_SIZE - 1) / HOST_SLAB_SIZE;
+	slabs = new Slab*[slabCount];
+	memset(slabs, 0, slabCount * sizeof(Slab*));
+
+	// Open the DB
+	int ret = sqlite3_open(filename, &db);
+	if (ret != SQLITE_OK) {
+		LOG_ERROR("Can't open database: %s", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		db = nullptr;
+		return;
+	}
+
+	// Setup the table
+	ret = sqlite3_exec(db,
+			"CREATE TABLE IF NOT EXISTS TokenHandle ("
+			"	token INTEGER,"
+			"	applicationHash BLOB,"
+			"	handle BLOB,"
+			"	privateKey BLOB,"
+			"	authCounter INTEGER DEFAULT 0,"
+			"	PRIMARY KEY (token, applicationHash, handle)"
+			");",
+			nullptr, nullptr, nullptr);
+	if (ret != SQLITE_OK) {
+		LOG_ERROR("Can't create table TokenHandle: %s", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		db = nullptr;
+		return;
+	}
+
+	// Statements are shared by all tokens
+	if (sqlite3_prepare_v2(db, "INSERT INTO TokenHandle (token, applicationHash, handle, privateKey) VALUES (?1, ?2, ?3, ?4);", -1, &insertHandleStatement, nullptr) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "SELECT privateKey, authCounter FROM TokenHandle WHERE token = ?1 AND applicationHash = ?2 AND handle = ?3;", -1, &selectHandleStatement, nullptr) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "UPDATE TokenHandle SET authCounter = authCounter + 1 WHERE token = ?1 AND applicationHash = ?2 AND handle = ?3;", -1, &updateCounterStatement, nullptr) != SQLITE_OK) {
+		LOG_ERROR("Failed to prepare statements: %s", sqlite3_errmsg(db));
+		sqlite3_finalize(insertHandleStatement);
+		sqlite3_finalize(selectHandleStatement);
+		sqlite3_finalize(updateCounterStatement);
+		insertHandleStatement = selectHandleStatement = updateCounterStatement = nullptr;
+		sqlite3_close(db);
+		db = nullptr;
+	}
+}
+
+u2f::Host::~Host() {
+	for (uint32_t id=0; id<maxTokens; id++) {
+		destroyToken(id);
+	}
+	delete[] slabs;
+
+	if (db) {
+		sqlite3_finalize(insertHandleStatement);
+		sqlite3_finalize(selectHandleStatement);
+		sqlite3_finalize(updateCounterStatement);
+		sqlite3_close(db);
+	}
+}
+
+u2f::HostedToken* u2f::Host::createToken(uint32_t id) {
+	if (id >= maxTokens)
+		return nullptr;
+
+	std::unique_lock<std::mutex> lck(tokensMutex);
+	Slab* &slab = slabs[id / HOST_SLAB_SIZE];
+	uint32_t slot = id % HOST_SLAB_SIZE;
+	if (slab == nullptr) {
+		slab = new Slab;
+		slab->used = 0;
+	} else if (slab->get(slot)) {
+		return nullptr;  // Already exists
+	}
+
+	HostedToken* token = new (slab->tokens[slot]) HostedToken(*this, id);
+	slab->used |= 1ULL << slot;
+	tokenCount++;
+	return token;
+}
+
+u2f::HostedToken* u2f::Host::getToken(uint32_t id) {
+	if (id >= maxTokens)
+		return nullptr;
+
+	std::unique_lock<std::mutex> lck(tokensMutex);
+	Slab* slab = slabs[id / HOST_SLAB_SIZE];
+	return slab ? slab->get(id % HOST_SLAB_SIZE) : nullptr;
+}
+
+void u2f::Host::destroyToken(uint32_t id) {
+	if (id >= maxTokens)
+		return;
+
+	std::unique_lock<std::mutex> lck(tokensMutex);
+	Slab* &slab = slabs[id / HOST_SLAB_SIZE];
+	uint32_t slot = id % HOST_SLAB_SIZE;
+	HostedToken* token = slab ? slab->get(slot) : nullptr;
+	if (token == nullptr)
+		return;
+
+	token->~HostedToken();
+	slab->used &= ~(1ULL << slot);
+	tokenCount--;
+
+	// Give empty slabs back
+	if (slab->used == 0) {
+		delete slab;
+		slab = nullptr;
+	}
+}
+
+uint32_t u2f::Host::getTokenCount() {
+	std::unique_lock<std::mutex> lck(tokensMutex);
+	return tokenCount;
+}
+
+void u2f::Host::setAttestationSigner(crypto::Signer* signer) {
+	attestationSigner.store(signer, std::memory_order_release);
+}
+
+void u2f::Host::setKeyPool(KeyPool* pool) {
+	keyPool.store(pool, std::memory_order_release);
+}
+
+bool u2f::Host::createHandle(uint32_t tokenId, const crypto::Hash &applicationHash, const crypto::PrivateKey &privateKey, Handle &handle, uint8_t &handleSize) {
+	if (!db)
+		return false; // Database is closed
+
+	std::unique_lock<std::mutex> lck(dbMutex);
+
+	//Create a new random handle
+	handleSize = 64;
+	if (!crypto::randomBytes(handle, handleSize)) {
+		LOG_ERROR("Failed to generate a handle");
+		return false;
+	}
+
+	sqlite3_stmt *stmt = insertHandleStatement;
+	sqlite3_bind_int64(stmt, 1, tokenId);
+	sqlite3_bind_blob(stmt, 2, applicationHash, sizeof(crypto::Hash), SQLITE_STATIC);
+	sqlite3_bind_blob(stmt, 3, handle, handleSize, SQLITE_STATIC);
+	sqlite3_bind_blob(stmt, 4, privateKey, sizeof(crypto::PrivateKey), SQLITE_STATIC);
+
+	int ret = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	if (ret != SQLITE_DONE) {
+		LOG_ERROR("Failed to insert handle: %s", sqlite3_errmsg(db));
+		return false;
+	}
+	return true;
+}
+
+bool u2f::Host::fetchHandle(uint32_t tokenId, const crypto::Hash &applicationHash, const Handle &handle, uint8_t handleSize, crypto::PrivateKey &privateKey, uint32_t &authCounter) {
+	if (!db)
+		return false; // Database is closed
+
+	// Select + update of the counter must be atomic
+	std::unique_lock<std::mutex> lck(dbMutex);
+
+	sqlite3_stmt *stmt = selectHandleStatement;
+	sqlite3_bind_int64(stmt, 1, tokenId);
+	sqlite3_bind_blob(stmt, 2, applicationHash, sizeof(crypto::Hash), SQLITE_STATIC);
+	sqlite3_bind_blob(stmt, 3, handle, handleSize, SQLITE_STATIC);
+
+	bool found = false;
+	int ret = sqlite3_step(stmt);
+	if (ret == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == sizeof(crypto::PrivateKey)) {
+		memcpy(privateKey, sqlite3_column_blob(stmt, 0), sizeof(crypto::PrivateKey));
+		authCounter = sqlite3_column_int(stmt, 1);
+		found = true;
+	} else if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
+		LOG_ERROR("Failed select handle: %s", sqlite3_errmsg(db));
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	if (!found) {
+		return false;
+	}
+
+	// Increment authCounter
+	stmt = updateCounterStatement;
+	sqlite3_bind_int64(stmt, 1, tokenId);
+	sqlite3_bind_blob(stmt, 2, applicationHash, sizeof(crypto::Hash), SQLITE_STATIC);
+	sqlite3_bind_blob(stmt, 3, handle, handleSize, SQLITE_STATIC);
+	ret = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	if (ret != SQLITE_DONE) {
+		LOG_ERROR("Failed to update authCounter: %s", sqlite3_errmsg(db));
+		return false;
+	}
+	return true;
+}
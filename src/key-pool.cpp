@@ -0,0 +1,29 @@
+#include <u2f/key-pool.h>
+#include <string.h>
+
+u2f::KeyPool::KeyPool(uint32_t depth, uint32_t lowWatermark, uint32_t highWatermark)
+: PrefillPool(sizeof(KeyPair), depth, lowWatermark, highWatermark)
+{
+	start();
+}
+
+u2f::KeyPool::~KeyPool() {
+	stop();
+}
+
+bool u2f::KeyPool::generate(void* item) {
+	KeyPair* keyPair = (KeyPair*)item;
+	return crypto::makeKeyPair(keyPair->publicKey, keyPair->privateKey);
+}
+
+bool u2f::KeyPool::makeKeyPair(crypto::PublicKey &publicKey, crypto::PrivateKey &privateKey) {
+	KeyPair keyPair;
+	if (!take(&keyPair)) {
+		return crypto::makeKeyPair(publicKey, privateKey);
+	}
+
+	memcpy(publicKey, keyPair.publicKey, sizeof(crypto::PublicKey));
+	memcpy(privateKey, keyPair.privateKey, sizeof(crypto::PrivateKey));
+	memset(&keyPair, 0, sizeof(keyPair));
+	return true;
+}
@@ -0,0 +1,514 @@
+#include <u2f/log.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+// Dumps are split in chunks of whole 16-byte lines
+#define DUMP_CHUNK_SIZE ((sizeof(u2f::log::Record::data) / 16) * 16)
+
+#define OUTPUT_BUFFER_SIZE 16384
+
+static const char levelNames[] = "TDIWE";
+
+static std::mutex ringsMutex;
+static u2f::log::Ring* rings = nullptr;
+static std::thread* drainerThread = nullptr;
+static std::atomic<bool> drainerRunning(false);
+static std::atomic<bool> drainerForked(false);   // Set in a forked child, which has no drainer until something is logged
+static std::atomic<int> outputFd(2);
+static uint64_t startTime = 0;
+
+static uint64_t now() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (uint64_t)spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+/**
+ * Owns the ring of the current thread, and marks it as orphaned when the thread exits.
+ *
+ * The ring itself is freed by the drainer, after it has been emptied.
+ */
+struct RingHolder {
+	u2f::log::Ring* ring;
+
+	RingHolder();
+	~RingHolder() {
+		ring->orphaned.store(true, std::memory_order_release);
+	}
+};
+
+static thread_local RingHolder ringHolder;
+static thread_local u2f::log::Ring* threadRing = nullptr;  // Same as ringHolder.ring, without constructing it
+
+
+/**
+ * Buffers formatted text and writes it to the output
+ */
+class Output {
+	char buffer[OUTPUT_BUFFER_SIZE];
+	size_t size;
+
+public:
+	Output()
+	: size(0)
+	{ }
+
+	void flush() {
+		size_t written = 0;
+		while (written < size) {
+			ssize_t ret = ::write(outputFd.load(), buffer + written, size - written);
+			if (ret <= 0)
+				break;
+			written += ret;
+		}
+		size = 0;
+	}
+
+	void printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+		va_list ap;
+		va_start(ap, format);
+		int len = vsnprintf(buffer + size, sizeof(buffer) - size, format, ap);
+		va_end(ap);
+
+		if (len >= 0 && size + len >= sizeof(buffer) && size > 0) {
+			// Didn't fit, retry on an empty buffer
+			flush();
+			va_start(ap, format);
+			len = vsnprintf(buffer, sizeof(buffer), format, ap);
+			va_end(ap);
+		}
+		if (len > 0) {
+			size += len;
+			if (size >= sizeof(buffer))
+				size = sizeof(buffer) - 1;
+		}
+	}
+};
+
+/**
+ * Sequential reader of the arguments stored by Encoder
+ */
+struct Decoder {
+	const uint8_t* pos;
+	const uint8_t* end;
+
+	bool next(u2f::log::ArgumentType &type, const uint8_t *&value, uint16_t &size) {
+		if (pos + 3 > end)
+			return false;
+		type = (u2f::log::ArgumentType)pos[0];
+		size = pos[1] | (pos[2] << 8);
+		value = pos + 3;
+		pos += 3 + size;
+		return pos <= end;
+	}
+};
+
+static int64_t asInt(u2f::log::ArgumentType type, const uint8_t* value) {
+	int64_t i;
+	double d;
+	switch (type) {
+		case u2f::log::ARGUMENT_DOUBLE:
+			memcpy(&d, value, sizeof(d));
+			return (int64_t)d;
+		case u2f::log::ARGUMENT_STRING:
+			return 0;
+		default:
+			memcpy(&i, value, sizeof(i));
+			return i;
+	}
+}
+
+static double asDouble(u2f::log::ArgumentType type, const uint8_t* value) {
+	int64_t i;
+	uint64_t u;
+	double d;
+	switch (type) {
+		case u2f::log::ARGUMENT_DOUBLE:
+			memcpy(&d, value, sizeof(d));
+			return d;
+		case u2f::log::ARGUMENT_INT:
+			memcpy(&i, value, sizeof(i));
+			return i;
+		case u2f::log::ARGUMENT_STRING:
+			return 0;
+		default:
+			memcpy(&u, value, sizeof(u));
+			return u;
+	}
+}
+
+/**
+ * printf, but arguments come from a Decoder.
+ *
+ * Every conversion is formatted individually, using the conversion character to pick the argument type.
+ */
+static void formatText(Output &output, const char* format, Decoder &decoder) {
+	const char* literal = format;
+	const char* p = format;
+	while (*p) {
+		if (*p != '%') {
+			p++;
+			continue;
+		}
+
+		// Flush pending literal text
+		if (p > literal)
+			output.printf("%.*s", (int)(p - literal), literal);
+
+		if (p[1] == '%') {
+			output.printf("%%");
+			p += 2;
+			literal = p;
+			continue;
+		}
+
+		// Copy flags, width and precision, skip length modifiers
+		char spec[32];
+		size_t specSize = 0;
+		spec[specSize++] = *p++;
+		while (*p && strchr("-+ #0123456789.*", *p)) {
+			if (specSize < sizeof(spec) - 4)
+				spec[specSize++] = *p;
+			p++;
+		}
+		while (*p && strchr("hlLqjzt", *p)) {
+			p++;
+		}
+		char conversion = *p;
+		if (conversion)
+			p++;
+		literal = p;
+
+		u2f::log::ArgumentType type;
+		const uint8_t* value;
+		uint16_t size;
+		if (!decoder.next(type, value, size)) {
+			output.printf("<missing>");
+			continue;
+		}
+
+		switch (conversion) {
+			case 'd':
+			case 'i':
+				spec[specSize++] = 'l';
+				spec[specSize++] = 'l';
+				spec[specSize++] = conversion;
+				spec[specSize] = 0;
+				output.printf(spec, (long long)asInt(type, value));
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				spec[specSize++] = 'l';
+				spec[specSize++] = 'l';
+				spec[specSize++] = conversion;
+				spec[specSize] = 0;
+				output.printf(spec, (unsigned long long)asInt(type, value));
+				break;
+			case 'c':
+				spec[specSize++] = conversion;
+				spec[specSize] = 0;
+				output.printf(spec, (int)asInt(type, value));
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+				spec[specSize++] = conversion;
+				spec[specSize] = 0;
+				output.printf(spec, asDouble(type, value));
+				break;
+			case 's':
+				spec[specSize++] = 's';
+				spec[specSize] = 0;
+				if (type == u2f::log::ARGUMENT_STRING) {
+					// Strings are stored without the terminator
+					char str[sizeof(u2f::log::Record::data) + 1];
+					memcpy(str, value, size);
+					str[size] = 0;
+					output.printf(spec, str);
+				} else {
+					output.printf(spec, "<?>");
+				}
+				break;
+			case 'p':
+				output.printf("%p", (void*)(uintptr_t)asInt(type, value));
+				break;
+			default:
+				output.printf("<bad format>");
+				break;
+		}
+	}
+
+	if (p > literal)
+		output.printf("%.*s", (int)(p - literal), literal);
+}
+
+static void formatRecord(Output &output, const u2f::log::Record &record) {
+	uint64_t timestamp = record.timestamp - startTime;
+	char level = levelNames[record.level < sizeof(levelNames) - 1 ? record.level : sizeof(levelNames) - 2];
+
+	if (record.type == u2f::log::RECORD_TEXT) {
+		output.printf("[%5" PRIu64 ".%06" PRIu64 "] %c %s: ", timestamp / 1000000000, (timestamp / 1000) % 1000000, level, record.tag);
+		Decoder decoder = {record.data, record.data + record.size};
+		formatText(output, record.format, decoder);
+		output.printf("\n");
+	} else {
+		if (record.offset == 0) {
+			output.printf("[%5" PRIu64 ".%06" PRIu64 "] %c %s: %s: {", timestamp / 1000000000, (timestamp / 1000) % 1000000, level, record.tag, record.format);
+		}
+		for (int i=0; i<record.size; i++) {
+			output.printf(i % 16 == 0 ? "\n    %02x" : " %02x", record.data[i]);
+		}
+		if (record.offset + record.size >= record.total) {
+			output.printf("\n}\n");
+		}
+	}
+}
+
+/**
+ * Formats and writes every pending record.
+ *
+ * @return true if anything was written
+ */
+static bool drain(Output &output) {
+	bool drained = false;
+	std::unique_lock<std::mutex> lck(ringsMutex);
+
+	u2f::log::Ring** prev = &rings;
+	while (*prev) {
+		u2f::log::Ring* ring = *prev;
+		bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+
+		uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+		uint32_t head = ring->head.load(std::memory_order_acquire);
+		while (tail != head) {
+			formatRecord(output, ring->records[tail & (LOG_RING_SIZE - 1)]);
+			tail++;
+			ring->tail.store(tail, std::memory_order_release);
+			drained = true;
+		}
+
+		uint32_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped) {
+			output.printf("u2f-log: %u records dropped\n", dropped);
+		}
+
+		if (orphaned) {
+			// The thread is gone and the ring is empty, get rid of it
+			*prev = ring->next;
+			delete ring;
+		} else {
+			prev = &ring->next;
+		}
+	}
+
+	output.flush();
+	return drained;
+}
+
+static void drainerThreadFunc() {
+	Output* output = new Output();
+	while (drainerRunning.load()) {
+		if (!drain(*output)) {
+			std::this_thread::sleep_for(1ms);
+		}
+	}
+	drain(*output);
+	delete output;
+}
+
+static void stopDrainer() {
+	drainerRunning.store(false);
+	if (drainerThread) {
+		drainerThread->join();
+		delete drainerThread;
+		drainerThread = nullptr;
+	}
+}
+
+// ringsMutex is held across the fork, so that the child has a consistent list of rings
+static void prepareFork() {
+	ringsMutex.lock();
+}
+
+static void parentAfterFork() {
+	ringsMutex.unlock();
+}
+
+/**
+ * The child has none of the parent's threads: Not the drainer, which is restarted by the next record or flush,
+ * and not the owners of the other rings, which are orphaned.
+ * Records still pending are the parent's to write, so they are discarded.
+ */
+static void childAfterFork() {
+	for (u2f::log::Ring* ring = rings; ring; ring = ring->next) {
+		ring->tail.store(ring->head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		ring->dropped.store(0, std::memory_order_relaxed);
+		if (ring != threadRing)
+			ring->orphaned.store(true, std::memory_order_relaxed);
+	}
+
+	if (drainerThread) {
+		// Its std::thread can be neither joined nor destroyed, since the thread isn't there: Leak it
+		drainerThread = nullptr;
+		drainerRunning.store(false);
+		drainerForked.store(true);
+	}
+	ringsMutex.unlock();
+}
+
+static const bool registered = []() {
+	pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
+	return true;
+}();
+
+// Called with ringsMutex held
+static void startDrainer() {
+	drainerRunning.store(true);
+	drainerThread = new std::thread(drainerThreadFunc);
+}
+
+static void restartForkedDrainer() {
+	std::unique_lock<std::mutex> lck(ringsMutex);
+	if (drainerForked.exchange(false))
+		startDrainer();
+}
+
+RingHolder::RingHolder()
+: ring(new u2f::log::Ring())
+{
+	threadRing = ring;
+	std::unique_lock<std::mutex> lck(ringsMutex);
+	ring->next = rings;
+	rings = ring;
+
+	if (!drainerThread && !drainerForked.load()) {
+		startTime = now();
+		startDrainer();
+		atexit(stopDrainer);
+	}
+}
+
+
+u2f::log::Ring::Ring()
+: head(0), tail(0), dropped(0), orphaned(false), next(nullptr)
+{ }
+
+bool u2f::log::Encoder::put(ArgumentType type, const void* value, uint16_t size) {
+	if ((size_t)record->size + 3 + size > sizeof(record->data))
+		return false;
+
+	uint8_t* data = record->data + record->size;
+	data[0] = type;
+	data[1] = size;
+	data[2] = size >> 8;
+	memcpy(data + 3, value, size);
+	record->size += 3 + size;
+	return true;
+}
+
+void u2f::log::Encoder::putString(const char* value) {
+	if (value == nullptr)
+		value = "(null)";
+
+	// Truncate strings to whatever still fits
+	size_t size = strlen(value);
+	size_t available = sizeof(record->data) - record->size;
+	if (available < 3)
+		return;
+	if (size > available - 3)
+		size = available - 3;
+	put(ARGUMENT_STRING, value, size);
+}
+
+u2f::log::Record* u2f::log::begin(uint8_t level, const char* tag, const char* format, RecordType type) {
+	if (drainerForked.load(std::memory_order_relaxed))
+		restartForkedDrainer();
+
+	Ring* ring = ringHolder.ring;
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	uint32_t tail = ring->tail.load(std::memory_order_acquire);
+	if (head - tail >= LOG_RING_SIZE) {
+		// Never block, drop the record instead
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	Record* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+	record->timestamp = now();
+	record->tag = tag;
+	record->format = format;
+	record->level = level;
+	record->type = type;
+	record->size = 0;
+	record->offset = 0;
+	record->total = 0;
+	return record;
+}
+
+void u2f::log::commit() {
+	Ring* ring = ringHolder.ring;
+	ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void u2f::log::dump(uint8_t level, const char* tag, const char* name, const void* buffer, int size) {
+	const uint8_t* bytes = (const uint8_t*)buffer;
+	int offset = 0;
+	do {
+		Record* record = begin(level, tag, name, RECORD_DUMP);
+		if (record == nullptr)
+			return;
+
+		int chunkSize = size - offset;
+		if (chunkSize > (int)DUMP_CHUNK_SIZE)
+			chunkSize = DUMP_CHUNK_SIZE;
+		if (chunkSize > 0)
+			memcpy(record->data, bytes + offset, chunkSize);
+		record->size = chunkSize;
+		record->offset = offset;
+		record->total = size;
+		commit();
+
+		offset += chunkSize;
+	} while (offset < size);
+}
+
+void u2f::log::setOutput(int fd) {
+	outputFd.store(fd);
+}
+
+void u2f::log::flush() {
+	if (drainerForked.load())
+		restartForkedDrainer();
+
+	while (true) {
+		bool empty = true;
+		{
+			std::unique_lock<std::mutex> lck(ringsMutex);
+			for (Ring* ring = rings; ring; ring = ring->next) {
+				if (ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_acquire)) {
+					empty = false;
+					break;
+				}
+			}
+		}
+		if (empty || !drainerRunning.load())
+			return;
+		std::this_thread::sleep_for(1ms);
+	}
+}
@@ -0,0 +1,294 @@
+#include <u2f/prefill-pool.h>
+#include <u2f/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define LOG_TAG "u2f-prefill-pool"
+
+namespace u2f {
+	// Every pool with items, guarded by poolsMutex
+	static std::mutex poolsMutex;
+	static PrefillPool* pools = nullptr;
+}
+
+u2f::PrefillPool::PrefillPool(size_t itemSize, uint32_t depth, uint32_t lowWatermark, uint32_t highWatermark)
+: itemSize(itemSize), pushPosition(0), popPosition(0), hits(0), misses(0), stopping(false), thread(nullptr), restartThread(false),
+  previous(nullptr), next(nullptr)
+{
+	uint32_t size = 1;
+	while (size < depth && size < 0x80000000u) {
+		size <<= 1;
+	}
+	mask = size - 1;
+
+	this->highWatermark = highWatermark > size ? size : highWatermark;
+	if (this->highWatermark == 0)
+		this->highWatermark = 1;
+	this->lowWatermark = lowWatermark == UINT32_MAX ? this->highWatermark / 4 : lowWatermark;
+	if (this->lowWatermark >= this->highWatermark)
+		this->lowWatermark = this->highWatermark - 1;
+
+	sequences = new std::atomic<uint32_t>[size];
+	for (uint32_t i=0; i<size; i++) {
+		sequences[i].store(i, std::memory_order_relaxed);
+	}
+
+	// Keep secrets out of swap and core dumps
+	itemsSize = itemSize * size;
+	void* memory = mmap(nullptr, itemsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		LOG_ERROR("Failed to allocate %zu bytes for the pool", itemsSize);
+		items = nullptr;
+		return;
+	}
+	items = (uint8_t*)memory;
+	if (mlock(items, itemsSize) != 0) {
+		LOG_WARN("Failed to lock the pool in memory, it may be swapped out");
+	}
+#ifdef MADV_DONTDUMP
+	madvise(items, itemsSize, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+	// The child wipes them anyway, but this keeps them out of its memory altogether
+	madvise(items, itemsSize, MADV_WIPEONFORK);
+#endif
+
+	registerForkHandlers();
+	std::unique_lock<std::mutex> lck(poolsMutex);
+	next = pools;
+	if (next)
+		next->previous = this;
+	pools = this;
+}
+
+u2f::PrefillPool::~PrefillPool() {
+	stop();
+	if (items) {
+		{
+			std::unique_lock<std::mutex> lck(poolsMutex);
+			if (previous) {
+				previous->next = next;
+			} else {
+				pools = next;
+			}
+			if (next)
+				next->previous = previous;
+		}
+
+		munlock(items, itemsSize);
+		munmap(items, itemsSize);
+	}
+	delete[] sequences;
+}
+
+void u2f::PrefillPool::start() {
+	if (items && !thread) {
+		thread = new std::thread(threadFunc, this);
+	}
+}
+
+void u2f::PrefillPool::stop() {
+	if (thread) {
+		{
+			std::unique_lock<std::mutex> lck(mutex);
+			stopping = true;
+			refill.notify_all();
+		}
+		thread->join();
+		delete thread;
+		thread = nullptr;
+	}
+
+	if (items) {
+		while (pop(nullptr)) { }
+		memset(items, 0, itemsSize);
+	}
+}
+
+// Bounded MPMC queue: Each slot's sequence tells whether it is ready to be written (== position) or read (== position + 1)
+bool u2f::PrefillPool::push(const void* item) {
+	uint32_t position = pushPosition.load(std::memory_order_relaxed);
+	uint32_t slot;
+	while (true) {
+		slot = position & mask;
+		int32_t diff = (int32_t)(sequences[slot].load(std::memory_order_acquire) - position);
+		if (diff == 0) {
+			if (pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false; // Full
+		} else {
+			position = pushPosition.load(std::memory_order_relaxed);
+		}
+	}
+
+	memcpy(&items[slot * itemSize], item, itemSize);
+	sequences[slot].store(position + 1, std::memory_order_release);
+	return true;
+}
+
+bool u2f::PrefillPool::pop(void* item) {
+	uint32_t position = popPosition.load(std::memory_order_relaxed);
+	uint32_t slot;
+	while (true) {
+		slot = position & mask;
+		int32_t diff = (int32_t)(sequences[slot].load(std::memory_order_acquire) - (position + 1));
+		if (diff == 0) {
+			if (popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false; // Empty
+		} else {
+			position = popPosition.load(std::memory_order_relaxed);
+		}
+	}
+
+	if (item) {
+		memcpy(item, &items[slot * itemSize], itemSize);
+	}
+	memset(&items[slot * itemSize], 0, itemSize);
+	sequences[slot].store(position + mask + 1, std::memory_order_release);
+	return true;
+}
+
+void* u2f::PrefillPool::operator new(size_t size) {
+	void* pointer;
+	if (posix_memalign(&pointer, alignof(PrefillPool), size) != 0)
+		throw std::bad_alloc();
+	return pointer;
+}
+
+void* u2f::PrefillPool::operator new[](size_t size) {
+	return operator new(size);
+}
+
+void u2f::PrefillPool::operator delete(void* pointer) {
+	free(pointer);
+}
+
+void u2f::PrefillPool::operator delete[](void* pointer) {
+	free(pointer);
+}
+
+uint32_t u2f::PrefillPool::getSize() const {
+	uint32_t popped = popPosition.load(std::memory_order_acquire);
+	uint32_t pushed = pushPosition.load(std::memory_order_acquire);
+	int32_t size = (int32_t)(pushed - popped);
+	return size < 0 ? 0 : size;
+}
+
+bool u2f::PrefillPool::take(void* item) {
+	if (!items) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (restartThread.load(std::memory_order_acquire)) {
+		std::unique_lock<std::mutex> lck(mutex);
+		if (restartThread.exchange(false, std::memory_order_acq_rel)) {
+			start();
+		}
+	}
+
+	bool taken = pop(item);
+	if (getSize() <= lowWatermark) {
+		std::unique_lock<std::mutex> lck(mutex);
+		refill.notify_one();
+	}
+
+	(taken ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+	return taken;
+}
+
+void u2f::PrefillPool::threadFunc(PrefillPool* pool) {
+	// Only use CPU time nobody else wants
+#ifdef SCHED_IDLE
+	sched_param param;
+	param.sched_priority = 0;
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+		LOG_WARN("Failed to lower the priority of the pool thread");
+	}
+#endif
+
+	uint8_t* item = new uint8_t[pool->itemSize];
+
+	std::unique_lock<std::mutex> lck(pool->mutex);
+	while (!pool->stopping) {
+		lck.unlock();
+		bool failed = false;
+		while (!pool->stopping && pool->getSize() < pool->highWatermark) {
+			if (!pool->generate(item)) {
+				LOG_ERROR("Failed to generate an item");
+				failed = true;
+				break;
+			}
+			if (!pool->push(item))
+				break;
+		}
+		memset(item, 0, pool->itemSize);
+		lck.lock();
+
+		if (failed) {
+			// Don't spin on a broken RNG: Retry on the next take()
+			if (!pool->stopping)
+				pool->refill.wait(lck);
+		} else {
+			while (!pool->stopping && pool->getSize() > pool->lowWatermark) {
+				pool->refill.wait(lck);
+			}
+		}
+	}
+
+	delete[] item;
+}
+
+void u2f::PrefillPool::resetAfterFork() {
+	// The parent's thread doesn't exist here: Its std::thread can be neither joined nor destroyed, so it is leaked
+	restartThread.store(thread != nullptr, std::memory_order_relaxed);
+	thread = nullptr;
+
+	// It may have been waited on by that thread, which would otherwise remain counted as a waiter
+	new (&refill) std::condition_variable();
+
+	memset(items, 0, itemsSize);
+	for (uint32_t i=0; i<=mask; i++) {
+		sequences[i].store(i, std::memory_order_relaxed);
+	}
+	pushPosition.store(0, std::memory_order_relaxed);
+	popPosition.store(0, std::memory_order_release);
+}
+
+void u2f::PrefillPool::registerForkHandlers() {
+	static const bool registered = []() {
+		pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
+		return true;
+	}();
+	(void)registered;
+}
+
+// Every pool mutex is held across the fork, so that the child doesn't inherit one locked by a thread it doesn't have
+void u2f::PrefillPool::prepareFork() {
+	poolsMutex.lock();
+	for (PrefillPool* pool=pools; pool; pool=pool->next) {
+		pool->mutex.lock();
+	}
+}
+
+void u2f::PrefillPool::parentAfterFork() {
+	for (PrefillPool* pool=pools; pool; pool=pool->next) {
+		pool->mutex.unlock();
+	}
+	poolsMutex.unlock();
+}
+
+void u2f::PrefillPool::childAfterFork() {
+	for (PrefillPool* pool=pools; pool; pool=pool->next) {
+		pool->resetAfterFork();
+		pool->mutex.unlock();
+	}
+	poolsMutex.unlock();
+}
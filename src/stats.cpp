@@ -0,0 +1,263 @@
+#include <u2f/stats.h>
+#include <string.h>
+#include <time.h>
+#include <mutex>
+
+static const char* stageNames[u2f::stats::STAGE_COUNT] = {
+	"request",
+	"parse",
+	"enroll",
+	"authenticate",
+	"fetchHandle",
+	"attestation",
+	"sha256",
+	"sign",
+	"der",
+	"hid-reassembly",
+	"hid-send",
+};
+
+static const char* instructionNames[u2f::stats::INSTRUCTION_COUNT] = {
+	"other",
+	"register",
+	"authenticate",
+	"version",
+};
+
+const char* u2f::stats::getStageName(Stage stage) {
+	return stageNames[stage];
+}
+
+const char* u2f::stats::getInstructionName(Instruction instruction) {
+	return instructionNames[instruction];
+}
+
+u2f::stats::Instruction u2f::stats::getInstruction(uint8_t ins) {
+	return ins < INSTRUCTION_COUNT ? (Instruction)ins : INSTRUCTION_OTHER;
+}
+
+uint64_t u2f::stats::now() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (uint64_t)spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+
+u2f::stats::Histogram::Histogram() {
+	reset();
+}
+
+int u2f::stats::Histogram::getBucket(uint64_t value) {
+	if (value < (1 << STATS_SUB_BUCKET_BITS))
+		return value;
+
+	int magnitude = 63 - __builtin_clzll(value);
+	if (magnitude > STATS_MAX_MAGNITUDE)
+		return STATS_HISTOGRAM_BUCKETS - 1;
+
+	int group = magnitude - STATS_SUB_BUCKET_BITS + 1;
+	int subBucket = (value >> (magnitude - STATS_SUB_BUCKET_BITS)) & ((1 << STATS_SUB_BUCKET_BITS) - 1);
+	return (group << STATS_SUB_BUCKET_BITS) + subBucket;
+}
+
+uint64_t u2f::stats::Histogram::getBucketValue(int bucket) {
+	int group = bucket >> STATS_SUB_BUCKET_BITS;
+	uint64_t subBucket = bucket & ((1 << STATS_SUB_BUCKET_BITS) - 1);
+	if (group == 0)
+		return subBucket;
+
+	// Highest value that falls in the bucket
+	int shift = group - 1;
+	return (((1 << STATS_SUB_BUCKET_BITS) + subBucket + 1) << shift) - 1;
+}
+
+void u2f::stats::Histogram::record(uint64_t value) {
+	buckets[getBucket(value)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t current = min.load(std::memory_order_relaxed);
+	while (value < current && !min.compare_exchange_weak(current, value, std::memory_order_relaxed));
+
+	current = max.load(std::memory_order_relaxed);
+	while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed));
+}
+
+void u2f::stats::Histogram::snapshot(HistogramSnapshot &snapshot) const {
+	// Not atomic as a whole, but good enough for monitoring
+	snapshot.count = count.load(std::memory_order_relaxed);
+	snapshot.sum = sum.load(std::memory_order_relaxed);
+	snapshot.min = min.load(std::memory_order_relaxed);
+	snapshot.max = max.load(std::memory_order_relaxed);
+	for (int i=0; i<STATS_HISTOGRAM_BUCKETS; i++) {
+		snapshot.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+	}
+	if (snapshot.count == 0) {
+		snapshot.min = 0;
+	}
+}
+
+void u2f::stats::Histogram::reset() {
+	for (int i=0; i<STATS_HISTOGRAM_BUCKETS; i++) {
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+	count.store(0, std::memory_order_relaxed);
+	sum.store(0, std::memory_order_relaxed);
+	min.store(UINT64_MAX, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+double u2f::stats::HistogramSnapshot::mean() const {
+	return count ? (double)sum / count : 0;
+}
+
+uint64_t u2f::stats::HistogramSnapshot::percentile(double percentile) const {
+	uint64_t total = 0;
+	for (int i=0; i<STATS_HISTOGRAM_BUCKETS; i++) {
+		total += buckets[i];
+	}
+	if (total == 0)
+		return 0;
+
+	uint64_t target = (uint64_t)(percentile / 100 * total + 0.5);
+	if (target < 1)
+		target = 1;
+
+	uint64_t seen = 0;
+	for (int i=0; i<STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= target) {
+			uint64_t value = Histogram::getBucketValue(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+
+u2f::stats::Collector::Collector(const char* name)
+: name(name)
+{ }
+
+void u2f::stats::Collector::record(Instruction instruction, Stage stage, uint64_t duration) {
+	histograms[instruction][stage].record(duration);
+}
+
+void u2f::stats::Collector::snapshot(Snapshot &snapshot) const {
+	snapshot.name = name;
+	for (int i=0; i<INSTRUCTION_COUNT; i++) {
+		for (int s=0; s<STAGE_COUNT; s++) {
+			histograms[i][s].snapshot(snapshot.histograms[i][s]);
+		}
+	}
+}
+
+void u2f::stats::Collector::reset() {
+	for (int i=0; i<INSTRUCTION_COUNT; i++) {
+		for (int s=0; s<STAGE_COUNT; s++) {
+			histograms[i][s].reset();
+		}
+	}
+}
+
+void u2f::stats::Snapshot::print(FILE* file) const {
+	fprintf(file, "%s:\n", name);
+	fprintf(file, "  %-14s %-16s %10s %10s %10s %10s %10s %10s %10s\n", "instruction", "stage", "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+	for (int i=0; i<INSTRUCTION_COUNT; i++) {
+		for (int s=0; s<STAGE_COUNT; s++) {
+			const HistogramSnapshot &histogram = histograms[i][s];
+			if (histogram.count == 0)
+				continue;
+
+			fprintf(file, "  %-14s %-16s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				getInstructionName((Instruction)i),
+				getStageName((Stage)s),
+				histogram.count,
+				histogram.mean() / 1000,
+				histogram.percentile(50) / 1000.,
+				histogram.percentile(90) / 1000.,
+				histogram.percentile(99) / 1000.,
+				histogram.percentile(99.9) / 1000.,
+				histogram.max / 1000.);
+		}
+	}
+}
+
+
+static std::mutex collectorsMutex;
+static u2f::stats::Collector* collectors[STATS_MAX_COLLECTORS];
+static std::atomic<int> collectorCount(0);
+
+u2f::stats::Collector* u2f::stats::getCollector(const char* name) {
+	std::unique_lock<std::mutex> lck(collectorsMutex);
+	int count = collectorCount.load();
+	for (int i=0; i<count; i++) {
+		if (!strcmp(collectors[i]->getName(), name)) {
+			return collectors[i];
+		}
+	}
+
+	if (count == STATS_MAX_COLLECTORS)
+		return nullptr;
+
+	collectors[count] = new Collector(strdup(name));
+	collectorCount.store(count + 1);
+	return collectors[count];
+}
+
+int u2f::stats::getCollectors(Collector** out, int maxCollectors) {
+	int count = collectorCount.load();
+	for (int i=0; i<count && i<maxCollectors; i++) {
+		out[i] = collectors[i];
+	}
+	return count;
+}
+
+void u2f::stats::print(FILE* file) {
+	Collector* all[STATS_MAX_COLLECTORS];
+	int count = getCollectors(all, STATS_MAX_COLLECTORS);
+
+	Snapshot* snapshot = new Snapshot;
+	for (int i=0; i<count; i++) {
+		all[i]->snapshot(*snapshot);
+		snapshot->print(file);
+	}
+	delete snapshot;
+}
+
+
+#ifdef U2F_STATS
+
+static thread_local u2f::stats::Collector* currentCollector = nullptr;
+static thread_local u2f::stats::Instruction currentInstruction = u2f::stats::INSTRUCTION_OTHER;
+
+u2f::stats::Scope::Scope(Collector* collector, Instruction instruction)
+: previousCollector(currentCollector), previousInstruction(currentInstruction)
+{
+	currentCollector = collector;
+	currentInstruction = instruction;
+}
+
+u2f::stats::Scope::~Scope() {
+	currentCollector = previousCollector;
+	currentInstruction = previousInstruction;
+}
+
+void u2f::stats::Scope::setInstruction(Instruction instruction) {
+	currentInstruction = instruction;
+}
+
+void u2f::stats::Timer::stop() {
+	if (start) {
+		record(stage, now() - start);
+		start = 0;
+	}
+}
+
+void u2f::stats::record(Stage stage, uint64_t duration) {
+	if (currentCollector) {
+		currentCollector->record(currentInstruction, stage, duration);
+	}
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include <u2f/trace.h>
+#include <u2f/stats.h>
+#include <u2f/log.h>
+#include <string.h>
+
+#define LOG_TAG "u2f-trace"
+
+static void putLE32(uint8_t* buffer, uint32_t value) {
+	for (int i=0; i<4; i++) {
+		buffer[i] = value >> (8*i);
+	}
+}
+
+static void putLE64(uint8_t* buffer, uint64_t value) {
+	for (int i=0; i<8; i++) {
+		buffer[i] = value >> (8*i);
+	}
+}
+
+static uint32_t getLE32(const uint8_t* buffer) {
+	uint32_t value = 0;
+	for (int i=3; i>=0; i--) {
+		value = (value << 8) | buffer[i];
+	}
+	return value;
+}
+
+static uint64_t getLE64(const uint8_t* buffer) {
+	uint64_t value = 0;
+	for (int i=7; i>=0; i--) {
+		value = (value << 8) | buffer[i];
+	}
+	return value;
+}
+
+const char* u2f::trace::getRecordTypeName(RecordType type) {
+	switch (type) {
+		case RECORD_HID_OUTPUT_REPORT:
+			return "hid-output";
+		case RECORD_HID_INPUT_REPORT:
+			return "hid-input";
+		case RECORD_APDU_REQUEST:
+			return "apdu-request";
+		case RECORD_APDU_RESPONSE:
+			return "apdu-response";
+		default:
+			return "unknown";
+	}
+}
+
+
+u2f::trace::Recorder::Recorder()
+: file(nullptr), openedAt(0)
+{ }
+
+u2f::trace::Recorder::~Recorder() {
+	close();
+}
+
+bool u2f::trace::Recorder::open(const char* filename) {
+	close();
+
+	FILE* newFile = fopen(filename, "wb");
+	if (newFile == nullptr) {
+		LOG_ERROR("Cannot create trace %s", filename);
+		return false;
+	}
+
+	uint8_t header[TRACE_FILE_HEADER_SIZE] = {0};
+	memcpy(header, TRACE_MAGIC, 8);
+	putLE32(header + 8, TRACE_VERSION);
+	if (fwrite(header, sizeof(header), 1, newFile) != 1) {
+		LOG_ERROR("Cannot write trace %s", filename);
+		fclose(newFile);
+		return false;
+	}
+
+	openedAt = stats::now();
+	file = newFile;
+	return true;
+}
+
+void u2f::trace::Recorder::close() {
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+}
+
+void u2f::trace::Recorder::record(RecordType type, const uint8_t* data, uint32_t size) {
+	FILE* file = this->file;
+	if (file == nullptr)
+		return;
+
+	uint8_t header[TRACE_RECORD_HEADER_SIZE] = {0};
+	putLE64(header, stats::now() - openedAt);
+	header[8] = type;
+	putLE32(header + 12, size);
+
+	// Header and data must be written together
+	flockfile(file);
+	fwrite_unlocked(header, sizeof(header), 1, file);
+	fwrite_unlocked(data, size, 1, file);
+	funlockfile(file);
+}
+
+
+u2f::trace::Reader::Reader()
+: file(nullptr), buffer(nullptr)
+{ }
+
+u2f::trace::Reader::~Reader() {
+	close();
+}
+
+bool u2f::trace::Reader::open(const char* filename) {
+	close();
+
+	file = fopen(filename, "rb");
+	if (file == nullptr) {
+		LOG_ERROR("Cannot open trace %s", filename);
+		return false;
+	}
+	if (!rewind()) {
+		LOG_ERROR("%s is not a trace", filename);
+		close();
+		return false;
+	}
+
+	buffer = new uint8_t[TRACE_MAX_RECORD_SIZE];
+	return true;
+}
+
+void u2f::trace::Reader::close() {
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+	delete[] buffer;
+	buffer = nullptr;
+}
+
+bool u2f::trace::Reader::rewind() {
+	if (file == nullptr)
+		return false;
+
+	::rewind(file);
+	uint8_t header[TRACE_FILE_HEADER_SIZE];
+	if (fread(header, sizeof(header), 1, file) != 1)
+		return false;
+	return !memcmp(header, TRACE_MAGIC, 8) && getLE32(header + 8) == TRACE_VERSION;
+}
+
+bool u2f::trace::Reader::next(RecordHeader &header, const uint8_t* &data) {
+	if (file == nullptr)
+		return false;
+
+	uint8_t rawHeader[TRACE_RECORD_HEADER_SIZE];
+	if (fread(rawHeader, sizeof(rawHeader), 1, file) != 1)
+		return false;
+
+	header.timestamp = getLE64(rawHeader);
+	header.type = (RecordType)rawHeader[8];
+	header.size = getLE32(rawHeader + 12);
+	if (header.size > TRACE_MAX_RECORD_SIZE) {
+		LOG_WARN("Trace record too large: %d", header.size);
+		return false;
+	}
+	if (header.size && fread(buffer, header.size, 1, file) != 1) {
+		LOG_WARN("Truncated trace record");
+		return false;
+	}
+
+	data = buffer;
+	return true;
+}
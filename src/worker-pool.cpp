@@ -0,0 +1,109 @@
+#include <u2f/worker-pool.h>
+
+u2f::WorkerPool::WorkerPool(int threadCount, uint32_t queueSize)
+: stopping(false), queueSize(queueSize), queueHead(0), queueCount(0), running(0)
+{
+	if (threadCount <= 0) {
+		threadCount = std::thread::hardware_concurrency();
+		if (threadCount <= 0)
+			threadCount = 1;
+	}
+
+	queue = new Task[queueSize];
+
+	this->threadCount = threadCount;
+	threads = new std::thread*[threadCount];
+	for (int i=0; i<threadCount; i++) {
+		threads[i] = new std::thread(threadFunc, this);
+	}
+}
+
+u2f::WorkerPool::~WorkerPool() {
+	{
+		std::unique_lock<std::mutex> lck(mutex);
+		stopping = true;
+		taskAvailable.notify_all();
+	}
+
+	for (int i=0; i<threadCount; i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	delete[] threads;
+	delete[] queue;
+}
+
+void u2f::WorkerPool::threadFunc(WorkerPool* pool) {
+	void* args[WORKER_POOL_MAX_BATCH];
+
+	std::unique_lock<std::mutex> lck(pool->mutex);
+	while (true) {
+		while (pool->queueCount == 0 && !pool->stopping) {
+			pool->taskAvailable.wait(lck);
+		}
+		if (pool->queueCount == 0)
+			return; // Stopping, and nothing left to do
+
+		Task task = pool->queue[pool->queueHead];
+		uint32_t count = 1;
+		args[0] = task.arg;
+		if (task.batchFunc) {
+			// Only batch the backlog that the other threads won't get to: This thread's share of the queue
+			uint32_t share = (pool->queueCount + pool->threadCount - 1) / pool->threadCount;
+			if (share > WORKER_POOL_MAX_BATCH)
+				share = WORKER_POOL_MAX_BATCH;
+			while (count < share && pool->queue[(pool->queueHead + count) % pool->queueSize].batchFunc == task.batchFunc) {
+				args[count] = pool->queue[(pool->queueHead + count) % pool->queueSize].arg;
+				count++;
+			}
+		}
+		pool->queueHead = (pool->queueHead + count) % pool->queueSize;
+		pool->queueCount -= count;
+		pool->running += count;
+
+		lck.unlock();
+		if (task.batchFunc) {
+			task.batchFunc(args, count);
+		} else {
+			task.func(task.arg);
+		}
+		lck.lock();
+
+		pool->running -= count;
+	}
+}
+
+bool u2f::WorkerPool::submit(TaskFunc func, void* arg) {
+	std::unique_lock<std::mutex> lck(mutex);
+	if (queueCount == queueSize || stopping)
+		return false;
+
+	Task &task = queue[(queueHead + queueCount) % queueSize];
+	task.func = func;
+	task.batchFunc = nullptr;
+	task.arg = arg;
+	queueCount++;
+
+	taskAvailable.notify_one();
+	return true;
+}
+
+bool u2f::WorkerPool::submitBatch(BatchFunc func, void* arg) {
+	std::unique_lock<std::mutex> lck(mutex);
+	if (queueCount == queueSize || stopping)
+		return false;
+
+	Task &task = queue[(queueHead + queueCount) % queueSize];
+	task.func = nullptr;
+	task.batchFunc = func;
+	task.arg = arg;
+	queueCount++;
+
+	taskAvailable.notify_one();
+	return true;
+}
+
+uint32_t u2f::WorkerPool::getQueueDepth() {
+	std::unique_lock<std::mutex> lck(mutex);
+	return queueCount + running;
+}
@@ -0,0 +1,419 @@
+/**
+ * Behavior tests of the built-in cores, driven with raw APDUs through Core::processRawAdpu, as a transport would.
+ *
+ * For each core:
+ * - Registration: The response parses, and its attestation signature verifies with the attestation key
+ * - Authentication: Check-only requests are refused with SW_CONDITIONS_NOT_SATISFIED, signatures verify with the registered key,
+ *   and stored counters increase on every use
+ * - Rejection with SW_WRONG_DATA of handles with a flipped bit, a missing byte, or used with another applicationHash
+ *   (Except for UnsafeCore's private key bytes, which aren't authenticated)
+ * - Core::checkHandles on a mix of owned, tampered and foreign handles, for the right and for another applicationHash
+ *
+ * And then what is specific to each core:
+ * - StatelessCore: Versioned handles, and legacy handles accepted only while acceptLegacyHandles is set
+ * - DerivedCore: Handles are accepted by any core with the same password, and by no other
+ * - SQLiteCore: A handle registered through one connection is found through another one, whose filter was loaded earlier
+ *
+ * BiometricCore runs against benchmarks/veridis-mock.cpp, which always has a matching finger on the scanner.
+ * Since user presence is asynchronous, requests that fail with SW_CONDITIONS_NOT_SATISFIED are retried, like U2F clients do.
+ *
+ * Usage: u2f-test-cores [database directory]
+ *   The databases of SQLiteCore and BiometricCore are created there, and removed afterwards (Default: /tmp)
+ *
+ * Build it with every file in src/, plus benchmarks/veridis-mock.cpp instead of the Veridis SDK.
+ */
+
+#include "test.h"
+#include <u2f/core-unsafe.h>
+#include <u2f/core-stateless.h>
+#include <u2f/core-derived.h>
+#include <u2f/core-sqlite.h>
+#include <u2f/core-biometric.h>
+#include <u2f/crypto-aes.h>
+#include <u2f/crypto-attestation.h>
+#include <u2f/crypto-random.h>
+#include <u2f/crypto-sha256.h>
+#include <u2f/stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+
+#define U2F_INS_REGISTER     0x01
+#define U2F_INS_AUTHENTICATE 0x02
+
+#define AUTH_ENFORCE_USER_SIGN 0x03
+#define AUTH_CHECK_ONLY        0x07
+
+#define SW_NO_ERROR                 0x9000
+#define SW_CONDITIONS_NOT_SATISFIED 0x6985
+#define SW_WRONG_DATA               0x6A80
+
+// How long to keep retrying a request waiting for user presence
+#define RETRY_TIMEOUT_NS 5000000000ULL
+
+// Largest APDU we build: Header + extended Lc + challenge + application + handle + extended Le
+#define MAX_REQUEST_SIZE (4 + 3 + 32 + 32 + 1 + 255 + 2)
+
+#define CHECK_HANDLES_COUNT 6
+
+static uint8_t response[U2F_MAX_RESPONSE_SIZE];
+
+struct Registration {
+	u2f::crypto::PublicKey publicKey;
+	u2f::Handle handle;
+	uint8_t handleSize;
+};
+
+/**
+ * Builds an extended-length APDU, expecting up to 65536 bytes of response.
+ */
+static uint32_t buildApdu(uint8_t *apdu, uint8_t ins, uint8_t p1, const uint8_t *data, uint32_t dataSize) {
+	uint32_t size = 0;
+	apdu[size++] = 0x00;  // CLA
+	apdu[size++] = ins;
+	apdu[size++] = p1;
+	apdu[size++] = 0x00;  // P2
+	apdu[size++] = 0x00;  // Extended Lc
+	apdu[size++] = dataSize >> 8;
+	apdu[size++] = dataSize;
+	memcpy(&apdu[size], data, dataSize);
+	size += dataSize;
+	apdu[size++] = 0x00;  // Le = 65536
+	apdu[size++] = 0x00;
+	return size;
+}
+
+/**
+ * Sends a request, retrying while the user isn't present.
+ *
+ * @return The status word of the last response
+ */
+static uint16_t send(u2f::Core &core, const uint8_t* request, uint32_t requestSize, bool retry, uint32_t &responseSize) {
+	uint64_t deadline = u2f::stats::now() + RETRY_TIMEOUT_NS;
+	while (true) {
+		CHECK(core.processRawAdpu(request, requestSize, response, sizeof(response), responseSize));
+		CHECK(responseSize >= 2);
+		uint16_t sw = (response[responseSize - 2] << 8) | response[responseSize - 1];
+		if (!retry || sw != SW_CONDITIONS_NOT_SATISFIED || u2f::stats::now() > deadline) {
+			return sw;
+		}
+		std::this_thread::yield();
+	}
+}
+
+/**
+ * Registers a new handle, and checks the attestation signature of the response.
+ */
+static void registerHandle(u2f::Core &core, const u2f::crypto::Hash &application, Registration &registration) {
+	u2f::crypto::Hash challenge;
+	u2f::crypto::randomBytes(challenge, sizeof(challenge));
+
+	uint8_t data[2 * sizeof(u2f::crypto::Hash)];
+	memcpy(&data[0], challenge, sizeof(challenge));
+	memcpy(&data[sizeof(challenge)], application, sizeof(application));
+	uint8_t request[MAX_REQUEST_SIZE];
+	uint32_t requestSize = buildApdu(request, U2F_INS_REGISTER, 0x00, data, sizeof(data));
+
+	uint32_t responseSize;
+	CHECK(send(core, request, requestSize, true, responseSize) == SW_NO_ERROR);
+
+	// [0x05, publicKey, handleSize, handle, certificate, signature, sw]
+	const uint8_t* certificate;
+	uint16_t certificateSize;
+	u2f::crypto::Signer* attestationSigner = core.getAttestationSigner();
+	CHECK(attestationSigner->getCertificate(certificate, certificateSize));
+
+	CHECK(responseSize > 1 + sizeof(u2f::crypto::PublicKey) + 1);
+	CHECK(response[0] == 0x05);
+	memcpy(registration.publicKey, &response[1], sizeof(u2f::crypto::PublicKey));
+	registration.handleSize = response[1 + sizeof(u2f::crypto::PublicKey)];
+	const uint8_t* handle = &response[1 + sizeof(u2f::crypto::PublicKey) + 1];
+	CHECK(registration.handleSize > 0);
+	memcpy(registration.handle, handle, registration.handleSize);
+
+	const uint8_t* signature = handle + registration.handleSize + certificateSize;
+	CHECK(signature < &response[responseSize - 2]);
+	CHECK(!memcmp(handle + registration.handleSize, certificate, certificateSize));
+
+	// The attestation signs [0x00, application, challenge, handle, publicKey]
+	uint8_t reserved = 0x00;
+	u2f::crypto::Hash hash;
+	u2f::crypto::Sha256()
+		.update(&reserved, 1)
+		.update(application, sizeof(application))
+		.update(challenge, sizeof(challenge))
+		.update(registration.handle, registration.handleSize)
+		.update(registration.publicKey, sizeof(registration.publicKey))
+		.finish(hash);
+	CHECK(verifySignature(u2f::crypto::AttestationSigner::getDefault()->getPublicKey(), hash, signature, (uint32_t)(&response[responseSize - 2] - signature)));
+}
+
+/**
+ * Sends an authentication request for #handle.
+ *
+ * @return The status word of the response
+ */
+static uint16_t authenticate(u2f::Core &core, uint8_t control, const u2f::crypto::Hash &challenge, const u2f::crypto::Hash &application, const u2f::Handle &handle, uint8_t handleSize, uint32_t &responseSize) {
+	uint8_t data[2 * sizeof(u2f::crypto::Hash) + 1 + sizeof(u2f::Handle)];
+	memcpy(&data[0], challenge, sizeof(u2f::crypto::Hash));
+	memcpy(&data[sizeof(u2f::crypto::Hash)], application, sizeof(u2f::crypto::Hash));
+	data[2 * sizeof(u2f::crypto::Hash)] = handleSize;
+	memcpy(&data[2 * sizeof(u2f::crypto::Hash) + 1], handle, handleSize);
+
+	uint8_t request[MAX_REQUEST_SIZE];
+	uint32_t requestSize = buildApdu(request, U2F_INS_AUTHENTICATE, control, data, 2 * sizeof(u2f::crypto::Hash) + 1 + handleSize);
+	return send(core, request, requestSize, control == AUTH_ENFORCE_USER_SIGN, responseSize);
+}
+
+/**
+ * Authenticates with a valid handle, and checks the signature of the response.
+ *
+ * @return The counter of the response
+ */
+static uint32_t checkAuthentication(u2f::Core &core, const u2f::crypto::Hash &application, const u2f::crypto::PublicKey &publicKey, const u2f::Handle &handle, uint8_t handleSize) {
+	u2f::crypto::Hash challenge;
+	u2f::crypto::randomBytes(challenge, sizeof(challenge));
+
+	uint32_t responseSize;
+	CHECK(authenticate(core, AUTH_CHECK_ONLY, challenge, application, handle, handleSize, responseSize) == SW_CONDITIONS_NOT_SATISFIED);
+	CHECK(authenticate(core, AUTH_ENFORCE_USER_SIGN, challenge, application, handle, handleSize, responseSize) == SW_NO_ERROR);
+
+	// [flags, counter, signature, sw], where the signature covers [application, flags, counter, challenge]
+	CHECK(responseSize > 1 + 4 + 2);
+	CHECK(response[0] & 0x01);
+	u2f::crypto::Hash hash;
+	u2f::crypto::Sha256()
+		.update(application, sizeof(application))
+		.update(response, 1 + 4)
+		.update(challenge, sizeof(challenge))
+		.finish(hash);
+	CHECK(verifySignature(publicKey, hash, &response[1 + 4], responseSize - 2 - (1 + 4)));
+	return ((uint32_t)response[1] << 24) | ((uint32_t)response[2] << 16) | ((uint32_t)response[3] << 8) | response[4];
+}
+
+/**
+ * Checks that #handle is refused, both by check-only and by signing authentications.
+ */
+static void checkRejected(u2f::Core &core, const u2f::crypto::Hash &application, const u2f::Handle &handle, uint8_t handleSize) {
+	u2f::crypto::Hash challenge = {0};
+	uint32_t responseSize;
+	CHECK(authenticate(core, AUTH_CHECK_ONLY, challenge, application, handle, handleSize, responseSize) == SW_WRONG_DATA);
+	CHECK(authenticate(core, AUTH_ENFORCE_USER_SIGN, challenge, application, handle, handleSize, responseSize) == SW_WRONG_DATA);
+	CHECK(responseSize == 2);
+}
+
+/**
+ * Runs the tests every core must pass.
+ *
+ * @param[in] foreign A handle of another core
+ * @param[in] tamperFrom First byte of the handles which is authenticated
+ * @param[in] storedCounter Whether the counter is stored, and so must increase on every use. Others are timestamps.
+ */
+static void checkCore(const char* name, u2f::Core &core, const Registration &foreign, uint8_t tamperFrom, bool storedCounter) {
+	u2f::crypto::Hash application, otherApplication;
+	u2f::crypto::randomBytes(application, sizeof(application));
+	memcpy(otherApplication, application, sizeof(application));
+	otherApplication[0] ^= 0x01;
+
+	Registration registration, otherRegistration;
+	registerHandle(core, application, registration);
+	registerHandle(core, otherApplication, otherRegistration);
+
+	// Round trip
+	uint32_t counter = checkAuthentication(core, application, registration.publicKey, registration.handle, registration.handleSize);
+	uint32_t nextCounter = checkAuthentication(core, application, registration.publicKey, registration.handle, registration.handleSize);
+	CHECK(storedCounter ? nextCounter > counter : nextCounter >= counter);
+	checkAuthentication(core, otherApplication, otherRegistration.publicKey, otherRegistration.handle, otherRegistration.handleSize);
+
+	// Tampered handles, the wrong application, and handles of other cores
+	u2f::Handle tampered;
+	for (uint8_t i=tamperFrom; i<registration.handleSize; i++) {
+		memcpy(tampered, registration.handle, registration.handleSize);
+		tampered[i] ^= 1 << (i % 8);
+		checkRejected(core, application, tampered, registration.handleSize);
+	}
+	checkRejected(core, application, registration.handle, registration.handleSize - 1);
+	checkRejected(core, otherApplication, registration.handle, registration.handleSize);
+	checkRejected(core, application, otherRegistration.handle, otherRegistration.handleSize);
+	checkRejected(core, application, foreign.handle, foreign.handleSize);
+
+	// Many handles at once
+	memcpy(tampered, registration.handle, registration.handleSize);
+	tampered[registration.handleSize - 1] ^= 0x80;
+	const u2f::Handle* handles[CHECK_HANDLES_COUNT] = { &registration.handle, &tampered, &foreign.handle, &otherRegistration.handle, &registration.handle, &registration.handle };
+	uint8_t handleSizes[CHECK_HANDLES_COUNT] = { registration.handleSize, registration.handleSize, foreign.handleSize, otherRegistration.handleSize, registration.handleSize, 0 };
+	bool owned[CHECK_HANDLES_COUNT];
+	memset(owned, 0, sizeof(owned));
+	core.checkHandles(application, CHECK_HANDLES_COUNT, handles, handleSizes, owned);
+	CHECK(owned[0] && !owned[1] && !owned[2] && !owned[3] && owned[4] && !owned[5]);
+
+	memset(owned, 1, sizeof(owned));
+	core.checkHandles(otherApplication, CHECK_HANDLES_COUNT, handles, handleSizes, owned);
+	CHECK(!owned[0] && !owned[1] && !owned[2] && owned[3] && !owned[4] && !owned[5]);
+
+	printf("%s: OK (%d-byte handles)\n", name, registration.handleSize);
+}
+
+/**
+ * Builds a handle as StatelessCore did before handles were versioned: AES-CBC([privateKey, applicationHash]),
+ * with SHA-256("U2F Device Library", password) as the key and the applicationHash as the IV.
+ */
+static void makeLegacyHandle(const char* password, const u2f::crypto::Hash &application, const u2f::crypto::PrivateKey &privateKey, u2f::Handle &handle) {
+	const char* salt = "U2F Device Library";
+	u2f::crypto::Hash key;
+	u2f::crypto::Sha256()
+		.update(salt, strlen(salt))
+		.update(password, strlen(password))
+		.finish(key);
+
+	uint8_t plaintext[STATELESS_LEGACY_HANDLE_SIZE];
+	memcpy(&plaintext[0], privateKey, sizeof(u2f::crypto::PrivateKey));
+	memcpy(&plaintext[sizeof(u2f::crypto::PrivateKey)], application, sizeof(application));
+	u2f::crypto::Aes256(key).encryptCbc(plaintext, sizeof(plaintext), handle, application);
+}
+
+static void checkStatelessCore(const Registration &foreign) {
+	u2f::StatelessCore core("Password");
+	checkCore("stateless", core, foreign, 0, false);
+
+	u2f::crypto::Hash application;
+	u2f::crypto::randomBytes(application, sizeof(application));
+	Registration registration;
+	registerHandle(core, application, registration);
+	CHECK(registration.handleSize == STATELESS_HANDLE_SIZE);
+	CHECK(registration.handle[0] == STATELESS_HANDLE_VERSION);
+
+	// Handles of another password
+	u2f::StatelessCore other("Other password");
+	checkRejected(other, application, registration.handle, registration.handleSize);
+
+	// Legacy handles
+	Registration legacy;
+	u2f::crypto::PrivateKey privateKey;
+	u2f::crypto::makeKeyPair(legacy.publicKey, privateKey);
+	makeLegacyHandle("Password", application, privateKey, legacy.handle);
+	legacy.handleSize = STATELESS_LEGACY_HANDLE_SIZE;
+	checkAuthentication(core, application, legacy.publicKey, legacy.handle, legacy.handleSize);
+
+	u2f::crypto::Hash otherApplication;
+	memcpy(otherApplication, application, sizeof(application));
+	otherApplication[31] ^= 0x01;
+	checkRejected(core, otherApplication, legacy.handle, legacy.handleSize);
+	checkRejected(other, application, legacy.handle, legacy.handleSize);
+
+	const u2f::Handle* handles[3] = { &registration.handle, &legacy.handle, &foreign.handle };
+	uint8_t handleSizes[3] = { registration.handleSize, legacy.handleSize, foreign.handleSize };
+	bool owned[3];
+	core.checkHandles(application, 3, handles, handleSizes, owned);
+	CHECK(owned[0] && owned[1] && !owned[2]);
+	core.checkHandles(otherApplication, 3, handles, handleSizes, owned);
+	CHECK(!owned[0] && !owned[1] && !owned[2]);
+
+	u2f::StatelessCore strict("Password", false);
+	checkAuthentication(strict, application, registration.publicKey, registration.handle, registration.handleSize);
+	checkRejected(strict, application, legacy.handle, legacy.handleSize);
+	strict.checkHandles(application, 3, handles, handleSizes, owned);
+	CHECK(owned[0] && !owned[1] && !owned[2]);
+
+	printf("stateless: Legacy handles OK\n");
+}
+
+static void checkDerivedCore(const Registration &foreign) {
+	u2f::DerivedCore core("Password");
+	checkCore("derived", core, foreign, 0, false);
+
+	u2f::crypto::Hash application;
+	u2f::crypto::randomBytes(application, sizeof(application));
+	Registration registration;
+	registerHandle(core, application, registration);
+	CHECK(registration.handleSize == DERIVED_HANDLE_SIZE);
+	CHECK(registration.handle[0] == DERIVED_HANDLE_VERSION);
+
+	// The key is derived again from the handle, by any core with the same password
+	u2f::DerivedCore same("Password");
+	checkAuthentication(same, application, registration.publicKey, registration.handle, registration.handleSize);
+
+	u2f::DerivedCore other("Other password");
+	checkRejected(other, application, registration.handle, registration.handleSize);
+
+	printf("derived: Handles across instances OK\n");
+}
+
+static void checkSQLiteCore(const char* databaseFilename, const Registration &foreign) {
+	unlink(databaseFilename);
+	{
+		u2f::SQLiteCore core(databaseFilename);
+		checkCore("sqlite", core, foreign, 0, true);
+	}
+
+	// Another connection to the same database loads its filter before the handle exists
+	unlink(databaseFilename);
+	u2f::SQLiteCore core(databaseFilename);
+	u2f::SQLiteCore other(databaseFilename);
+
+	u2f::crypto::Hash application;
+	u2f::crypto::randomBytes(application, sizeof(application));
+	checkRejected(other, application, foreign.handle, foreign.handleSize);
+
+	Registration registration;
+	registerHandle(core, application, registration);
+	checkAuthentication(other, application, registration.publicKey, registration.handle, registration.handleSize);
+
+	Registration next;
+	registerHandle(core, application, next);
+	const u2f::Handle* handles[3] = { &registration.handle, &next.handle, &foreign.handle };
+	uint8_t handleSizes[3] = { registration.handleSize, next.handleSize, foreign.handleSize };
+	bool owned[3];
+	other.checkHandles(application, 3, handles, handleSizes, owned);
+	CHECK(owned[0] && owned[1] && !owned[2]);
+
+	unlink(databaseFilename);
+	printf("sqlite: Handles across connections OK\n");
+}
+
+static void checkBiometricCore(const char* databaseFilename, const Registration &foreign) {
+	unlink(databaseFilename);
+	{
+		u2f::BiometricCore core(databaseFilename);
+		checkCore("biometric", core, foreign, 0, true);
+	}
+	unlink(databaseFilename);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [database directory]\n", name);
+}
+
+int main(int argc, char** argv) {
+	if (argc > 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char* databaseDirectory = argc > 1 ? argv[1] : "/tmp";
+	char databaseFilename[1024];
+	snprintf(databaseFilename, sizeof(databaseFilename), "%s/u2f-test-%d.db", databaseDirectory, getpid());
+
+	// A handle no other core should accept
+	Registration foreign;
+	{
+		u2f::UnsafeCore core;
+		u2f::crypto::Hash application;
+		u2f::crypto::randomBytes(application, sizeof(application));
+		registerHandle(core, application, foreign);
+	}
+
+	// UnsafeCore only checks the applicationHash, after the private key
+	u2f::UnsafeCore unsafeCore;
+	checkCore("unsafe", unsafeCore, foreign, sizeof(u2f::crypto::PrivateKey), false);
+
+	checkStatelessCore(foreign);
+	checkDerivedCore(foreign);
+	checkSQLiteCore(databaseFilename, foreign);
+	checkBiometricCore(databaseFilename, foreign);
+
+	u2f::log::flush();
+	printf("All cores OK\n");
+	return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * Behavior tests of the asynchronous logger, u2f::log:
+ * - Records of every thread are written, including those of threads which exited before they were drained
+ * - Arguments are formatted, and long strings are truncated rather than overflowing their record
+ * - After fork(), while another thread of the parent keeps logging, the child can log from any thread and flush,
+ *   its records reach the output, and no record is written twice
+ *
+ * Usage: u2f-test-log
+ *
+ * Build it with every file in src/.
+ */
+
+#define LOG_TAG "u2f-test-log"
+
+#include "test.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define THREADS 8
+#define RECORDS_PER_THREAD 50
+#define FORKS 20
+
+// How long a forked child may take to log and flush
+#define CHILD_TIMEOUT_US 5000000
+
+static int outputFd;
+
+/**
+ * Reads back everything written so far, one entry per line
+ */
+static std::vector<std::string> readOutput() {
+	u2f::log::flush();
+
+	std::string output;
+	char buffer[4096];
+	off_t offset = 0;
+	ssize_t size;
+	while ((size = pread(outputFd, buffer, sizeof(buffer), offset)) > 0) {
+		output.append(buffer, size);
+		offset += size;
+	}
+
+	std::vector<std::string> lines;
+	size_t start = 0, end;
+	while ((end = output.find('\n', start)) != std::string::npos) {
+		lines.push_back(output.substr(start, end - start));
+		start = end + 1;
+	}
+	return lines;
+}
+
+/**
+ * Counts the lines with each message, which is what follows the tag
+ */
+static std::map<std::string, int> countMessages(const std::vector<std::string> &lines) {
+	std::map<std::string, int> counts;
+	for (const std::string &line : lines) {
+		size_t tag = line.find(LOG_TAG ": ");
+		if (tag != std::string::npos)
+			counts[line.substr(tag + strlen(LOG_TAG ": "))]++;
+	}
+	return counts;
+}
+
+static void checkThreads() {
+	std::thread threads[THREADS];
+	for (int t=0; t<THREADS; t++) {
+		threads[t] = std::thread([t]() {
+			for (int i=0; i<RECORDS_PER_THREAD; i++) {
+				LOG_INFO("thread %d record %u of %s", t, (unsigned)i, "checkThreads");
+			}
+		});
+	}
+	for (int t=0; t<THREADS; t++) {
+		threads[t].join();
+	}
+
+	char longString[3 * LOG_RECORD_SIZE];
+	memset(longString, 'x', sizeof(longString) - 1);
+	longString[sizeof(longString) - 1] = 0;
+	LOG_WARN("long %s", longString);
+	LOG_ERROR("numbers %d %u %.2f %x", -42, 42u, 1.5, 0xabcu);
+
+	std::map<std::string, int> counts = countMessages(readOutput());
+	for (int t=0; t<THREADS; t++) {
+		for (int i=0; i<RECORDS_PER_THREAD; i++) {
+			char message[64];
+			snprintf(message, sizeof(message), "thread %d record %d of checkThreads", t, i);
+			CHECK(counts[message] == 1);
+		}
+	}
+	CHECK(counts["numbers -42 42 1.50 abc"] == 1);
+
+	bool foundLong = false;
+	for (const auto &count : counts) {
+		if (count.first.compare(0, 6, "long x") == 0) {
+			CHECK(count.first.size() < sizeof(longString));
+			foundLong = true;
+		}
+	}
+	CHECK(foundLong);
+	printf("Threads OK\n");
+}
+
+/**
+ * Waits for a child, killing it if it takes too long
+ */
+static bool waitChild(pid_t pid) {
+	int status;
+	for (uint32_t waited = 0; waitpid(pid, &status, WNOHANG) == 0; waited += 1000) {
+		if (waited >= CHILD_TIMEOUT_US) {
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			return false;
+		}
+		usleep(1000);
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void checkFork() {
+	// Forks happen while another thread is in the middle of logging
+	std::atomic<bool> stopping(false);
+	std::thread busy([&stopping]() {
+		for (uint32_t i=0; !stopping; i++) {
+			LOG_INFO("busy %u", i);
+		}
+	});
+
+	for (int round=0; round<FORKS; round++) {
+		LOG_INFO("parent before fork %d", round);
+		fflush(stdout);
+		pid_t pid = fork();
+		CHECK(pid >= 0);
+		if (pid == 0) {
+			LOG_INFO("child %d", round);
+			std::thread thread([round]() {
+				LOG_INFO("child %d thread", round);
+			});
+			thread.join();
+			u2f::log::flush();
+			_exit(0);
+		}
+		CHECK(waitChild(pid));
+	}
+	stopping = true;
+	busy.join();
+
+	std::map<std::string, int> counts = countMessages(readOutput());
+	for (int round=0; round<FORKS; round++) {
+		char message[64];
+		snprintf(message, sizeof(message), "parent before fork %d", round);
+		CHECK(counts[message] == 1);
+		snprintf(message, sizeof(message), "child %d", round);
+		CHECK(counts[message] == 1);
+		snprintf(message, sizeof(message), "child %d thread", round);
+		CHECK(counts[message] == 1);
+	}
+
+	// The busy thread overflows its ring, so some of its records are dropped, but none is written twice
+	for (const auto &count : counts) {
+		CHECK(count.second == 1);
+	}
+	printf("Fork OK\n");
+}
+
+int main(int argc, char** argv) {
+	char path[] = "/tmp/u2f-test-log-XXXXXX";
+	outputFd = mkstemp(path);
+	CHECK(outputFd >= 0);
+	unlink(path);
+	CHECK(fcntl(outputFd, F_SETFL, O_APPEND) == 0);
+	u2f::log::setOutput(outputFd);
+
+	checkThreads();
+	checkFork();
+
+	u2f::log::setOutput(STDERR_FILENO);
+	close(outputFd);
+	printf("All log checks OK\n");
+	return 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * Behavior tests of the pools refilled in the background, u2f::KeyPool and u2f::crypto::NoncePool:
+ * - Items are valid: Public keys match their private keys, and signatures with pooled nonces verify
+ * - Items are never handed out twice, by concurrent threads nor after the pool empties and items are made inline
+ * - Pools are allocated on their alignment, even with new
+ * - After a fork, parent and child share no item, and the child refills its pool with its own thread
+ *
+ * Usage: u2f-test-prefill-pools
+ *
+ * Build it with every file in src/.
+ */
+
+#include "test.h"
+#include <u2f/key-pool.h>
+#include <u2f/crypto-nonce-pool.h>
+#include <u2f/crypto-p256.h>
+#include <u2f/crypto-random.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define POOL_DEPTH 16
+#define POOL_LOW_WATERMARK 4
+#define THREADS 4
+#define ITEMS_PER_THREAD (4 * POOL_DEPTH)
+
+// How long to wait for a pool to be refilled
+#define REFILL_TIMEOUT_US 5000000
+
+typedef uint8_t Item[32];
+
+/**
+ * Takes an item from #pool, checks it, and returns the bytes that must differ between items.
+ */
+typedef void (*TakeFunc)(u2f::PrefillPool &pool, Item &item);
+
+static void takeKeyPair(u2f::PrefillPool &pool, Item &item) {
+	u2f::crypto::PublicKey publicKey, expected;
+	u2f::crypto::PrivateKey privateKey;
+	CHECK(static_cast<u2f::KeyPool&>(pool).makeKeyPair(publicKey, privateKey));
+	CHECK(u2f::crypto::p256::computePublicKey(privateKey, expected));
+	CHECK(!memcmp(publicKey, expected, sizeof(expected)));
+	memcpy(item, privateKey, sizeof(item));
+}
+
+static void takeNonce(u2f::PrefillPool &pool, Item &item) {
+	u2f::crypto::PublicKey publicKey;
+	u2f::crypto::PrivateKey privateKey;
+	u2f::crypto::Hash messageHash;
+	CHECK(u2f::crypto::makeKeyPair(publicKey, privateKey));
+	u2f::crypto::randomBytes(messageHash, sizeof(messageHash));
+
+	// Unlike KeyPool, an empty NoncePool fails: Wait for its thread
+	uint8_t signature[64];
+	for (uint32_t waited = 0; !static_cast<u2f::crypto::NoncePool&>(pool).sign(privateKey, messageHash, signature); waited += 100) {
+		CHECK(waited < REFILL_TIMEOUT_US);
+		usleep(100);
+	}
+	CHECK(uECC_verify(publicKey + 1, messageHash, sizeof(messageHash), signature, uECC_secp256r1()));
+
+	// r is the x coordinate of k·G, so it differs for every nonce
+	memcpy(item, signature, sizeof(item));
+}
+
+static bool waitForSize(u2f::PrefillPool &pool, uint32_t size) {
+	for (uint32_t waited = 0; pool.getSize() < size; waited += 1000) {
+		if (waited >= REFILL_TIMEOUT_US)
+			return false;
+		usleep(1000);
+	}
+	return true;
+}
+
+/**
+ * Takes items from many threads at once, until the pool has been emptied several times.
+ */
+static void checkConcurrent(u2f::PrefillPool &pool, TakeFunc take) {
+	CHECK(waitForSize(pool, pool.getDepth()));
+
+	std::vector<std::string> items[THREADS];
+	std::thread threads[THREADS];
+	for (int t=0; t<THREADS; t++) {
+		threads[t] = std::thread([&pool, take, &items, t]() {
+			for (int i=0; i<ITEMS_PER_THREAD; i++) {
+				Item item;
+				take(pool, item);
+				items[t].push_back(std::string((const char*)item, sizeof(item)));
+			}
+		});
+	}
+	for (int t=0; t<THREADS; t++) {
+		threads[t].join();
+	}
+
+	std::set<std::string> unique;
+	for (int t=0; t<THREADS; t++) {
+		unique.insert(items[t].begin(), items[t].end());
+	}
+	CHECK(unique.size() == THREADS * ITEMS_PER_THREAD);
+	CHECK(pool.getHits() >= pool.getDepth());
+	CHECK(pool.getHits() + pool.getMisses() >= THREADS * ITEMS_PER_THREAD);
+}
+
+/**
+ * Forks with a full pool, and takes as many items as it holds on both sides.
+ */
+static void checkFork(u2f::PrefillPool &pool, TakeFunc take) {
+	CHECK(waitForSize(pool, pool.getDepth()));
+
+	int fds[2];
+	CHECK(pipe(fds) == 0);
+	fflush(stdout);
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		close(fds[0]);
+		CHECK(pool.getSize() == 0);
+		for (uint32_t i=0; i<pool.getDepth(); i++) {
+			Item item;
+			take(pool, item);
+			CHECK(write(fds[1], item, sizeof(item)) == sizeof(item));
+		}
+		CHECK(waitForSize(pool, POOL_LOW_WATERMARK));
+		_exit(0);
+	}
+	close(fds[1]);
+
+	std::set<std::string> parentItems;
+	for (uint32_t i=0; i<pool.getDepth(); i++) {
+		Item item;
+		take(pool, item);
+		parentItems.insert(std::string((const char*)item, sizeof(item)));
+	}
+
+	Item item;
+	uint32_t childItems = 0;
+	while (read(fds[0], item, sizeof(item)) == sizeof(item)) {
+		CHECK(parentItems.count(std::string((const char*)item, sizeof(item))) == 0);
+		childItems++;
+	}
+	close(fds[0]);
+
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECK(childItems == pool.getDepth());
+}
+
+/**
+ * Creates a pool, which is refilled until it's full, and then only once it's down to POOL_LOW_WATERMARK.
+ * So each check starts with a new one.
+ */
+typedef u2f::PrefillPool* (*CreateFunc)();
+
+static void checkPool(const char* name, CreateFunc create, TakeFunc take) {
+	u2f::PrefillPool* pool = create();
+	CHECK(((uintptr_t)pool % alignof(u2f::PrefillPool)) == 0);
+	CHECK(pool->getDepth() == POOL_DEPTH);
+	checkConcurrent(*pool, take);
+	delete pool;
+
+	pool = create();
+	checkFork(*pool, take);
+	delete pool;
+
+	printf("%s: OK\n", name);
+}
+
+int main(int argc, char** argv) {
+	checkPool("KeyPool", []() -> u2f::PrefillPool* { return new u2f::KeyPool(POOL_DEPTH, POOL_LOW_WATERMARK, POOL_DEPTH); }, takeKeyPair);
+	checkPool("NoncePool", []() -> u2f::PrefillPool* { return new u2f::crypto::NoncePool(POOL_DEPTH, POOL_LOW_WATERMARK, POOL_DEPTH); }, takeNonce);
+
+	u2f::log::flush();
+	printf("All pools OK\n");
+	return 0;
+}
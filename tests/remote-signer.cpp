@@ -0,0 +1,267 @@
+/**
+ * Behavior tests of u2f::crypto::RemoteSigner against a running tools/signer-daemon.cpp:
+ * - Signatures and the certificate match the built-in attestation key, and unknown keys are refused
+ * - Concurrent Signer::signBatch() calls of REMOTE_SIGNER_MAX_BATCH signatures, from many more threads than
+ *   a connection has room for at once, over one connection and mixed across two with local signers
+ * - After the daemon restarts, the next signature reconnects
+ * - When the daemon stops answering, pending signatures fail after REMOTE_SIGNER_TIMEOUT_MS, and later ones reconnect
+ *
+ * Usage: u2f-test-remote-signer signer-daemon [socket directory]
+ *   signer-daemon     Path to the u2f-signer-daemon binary, which is started and stopped by the test
+ *   socket directory  Where the daemon listens (Default: /tmp)
+ *
+ * Build it with every file in src/.
+ */
+
+#include "test.h"
+#include <u2f/crypto-remote.h>
+#include <u2f/crypto-attestation.h>
+#include <u2f/crypto-simple.h>
+#include <u2f/stats.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define DAEMON_WORKERS "4"
+
+// How long to wait for the daemon to create its socket
+#define STARTUP_TIMEOUT_US 5000000
+
+#define BATCHES_PER_THREAD 5
+
+static const char* daemonPath;
+static char socketPath[sizeof(sockaddr_un::sun_path)];
+
+/**
+ * Whether the daemon accepts connections yet. Its socket exists a little before it listens.
+ */
+static bool isListening() {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	CHECK(fd >= 0);
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+	bool connected = connect(fd, (sockaddr*)&address, sizeof(address)) == 0;
+	close(fd);
+	return connected;
+}
+
+/**
+ * Starts the daemon, which is killed if this test dies first
+ */
+static pid_t startDaemon() {
+	unlink(socketPath);
+
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		execl(daemonPath, daemonPath, "-w", DAEMON_WORKERS, socketPath, (char*)nullptr);
+		_exit(127);
+	}
+
+	for (uint32_t waited = 0; !isListening(); waited += 1000) {
+		CHECK(waited < STARTUP_TIMEOUT_US);
+		CHECK(waitpid(pid, nullptr, WNOHANG) == 0);
+		usleep(1000);
+	}
+	return pid;
+}
+
+static void stopDaemon(pid_t pid) {
+	CHECK(kill(pid, SIGTERM) == 0);
+	CHECK(waitpid(pid, nullptr, 0) == pid);
+}
+
+/**
+ * Waits until #pid is stopped by a signal, as seen in /proc/pid/stat
+ */
+static void waitStopped(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	for (uint32_t waited = 0; ; waited += 1000) {
+		CHECK(waited < STARTUP_TIMEOUT_US);
+		FILE* file = fopen(path, "r");
+		CHECK(file);
+		char state = 0;
+		int fields = fscanf(file, "%*d (%*[^)]) %c", &state);
+		fclose(file);
+		if (fields == 1 && state == 'T')
+			return;
+		usleep(1000);
+	}
+}
+
+static bool verify(const u2f::crypto::PublicKey &publicKey, const u2f::crypto::Hash &messageHash, const u2f::crypto::Signature &signature) {
+	return verifySignature(publicKey, messageHash, signature, u2f::crypto::signatureSize(signature));
+}
+
+static void checkSign(u2f::crypto::Signer* signer, uint8_t seed) {
+	u2f::crypto::Hash messageHash;
+	u2f::crypto::Signature signature;
+	memset(messageHash, seed, sizeof(messageHash));
+	CHECK(signer->sign(messageHash, signature));
+	CHECK(verify(u2f::crypto::AttestationSigner::getDefault()->getPublicKey(), messageHash, signature));
+}
+
+static void checkBasics(u2f::crypto::RemoteSigner* signer) {
+	checkSign(signer, 1);
+
+	const uint8_t *certificate, *expected;
+	uint16_t certificateSize, expectedSize;
+	CHECK(signer->getCertificate(certificate, certificateSize));
+	CHECK(u2f::crypto::AttestationSigner::getDefault()->getCertificate(expected, expectedSize));
+	CHECK(certificateSize == expectedSize && !memcmp(certificate, expected, certificateSize));
+
+	// Only key 0, the built-in one, is loaded
+	CHECK(u2f::crypto::RemoteSigner::connect(socketPath, 1) == nullptr);
+}
+
+/**
+ * Signs batches of REMOTE_SIGNER_MAX_BATCH on #threadCount threads at once.
+ *
+ * With #mixed, each batch alternates between both remote signers and a local one, so that the batch is split by signer.
+ */
+static void checkConcurrentBatches(u2f::crypto::RemoteSigner* first, u2f::crypto::RemoteSigner* second, int threadCount, bool mixed) {
+	const u2f::crypto::PublicKey &remotePublicKey = u2f::crypto::AttestationSigner::getDefault()->getPublicKey();
+	u2f::crypto::PublicKey localPublicKey;
+	u2f::crypto::PrivateKey localPrivateKey;
+	CHECK(u2f::crypto::makeKeyPair(localPublicKey, localPrivateKey));
+	u2f::crypto::SimpleSigner local(localPrivateKey);
+
+	std::atomic<uint32_t> failures(0);
+	uint64_t startedAt = u2f::stats::now();
+	std::vector<std::thread> threads;
+	for (int t=0; t<threadCount; t++) {
+		threads.emplace_back([&, t]() {
+			u2f::crypto::Signer* signers[REMOTE_SIGNER_MAX_BATCH];
+			u2f::crypto::Hash messageHashes[REMOTE_SIGNER_MAX_BATCH];
+			const u2f::crypto::Hash* messageHashPointers[REMOTE_SIGNER_MAX_BATCH];
+			u2f::crypto::Signature signatures[REMOTE_SIGNER_MAX_BATCH];
+			u2f::crypto::Signature* signaturePointers[REMOTE_SIGNER_MAX_BATCH];
+			bool success[REMOTE_SIGNER_MAX_BATCH];
+
+			for (int batch=0; batch<BATCHES_PER_THREAD; batch++) {
+				for (int i=0; i<REMOTE_SIGNER_MAX_BATCH; i++) {
+					signers[i] = !mixed ? first : (i + t) % 3 == 0 ? first : (i + t) % 3 == 1 ? second : (u2f::crypto::Signer*)&local;
+					memset(messageHashes[i], i, sizeof(messageHashes[i]));
+					messageHashes[i][0] = t;
+					messageHashes[i][1] = batch;
+					messageHashPointers[i] = &messageHashes[i];
+					signaturePointers[i] = &signatures[i];
+				}
+				u2f::crypto::Signer::signBatch(REMOTE_SIGNER_MAX_BATCH, signers, messageHashPointers, signaturePointers, success);
+				for (int i=0; i<REMOTE_SIGNER_MAX_BATCH; i++) {
+					const u2f::crypto::PublicKey &publicKey = signers[i] == &local ? localPublicKey : remotePublicKey;
+					if (!success[i] || !verify(publicKey, messageHashes[i], signatures[i]))
+						failures++;
+				}
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	// A stall would only be resolved by the timeout, which drops the connection and fails the signatures
+	uint64_t elapsed = u2f::stats::now() - startedAt;
+	CHECK(failures == 0);
+	CHECK(elapsed < REMOTE_SIGNER_TIMEOUT_MS * 1000000ULL);
+	printf("%d threads%s: %d signatures in %.1f ms\n", threadCount, mixed ? ", mixed" : "", threadCount * BATCHES_PER_THREAD * REMOTE_SIGNER_MAX_BATCH, elapsed / 1e6);
+}
+
+static pid_t checkRestart(u2f::crypto::RemoteSigner* signer, pid_t pid) {
+	stopDaemon(pid);
+
+	u2f::crypto::Hash messageHash = {0};
+	u2f::crypto::Signature signature;
+	CHECK(!signer->sign(messageHash, signature));
+
+	pid = startDaemon();
+	checkSign(signer, 2);
+	return pid;
+}
+
+static void checkTimeout(u2f::crypto::RemoteSigner* signer, pid_t pid) {
+	CHECK(kill(pid, SIGSTOP) == 0);
+	waitStopped(pid);
+
+	std::atomic<uint32_t> successes(0);
+	uint64_t startedAt = u2f::stats::now();
+	std::vector<std::thread> threads;
+	for (int t=0; t<4; t++) {
+		threads.emplace_back([&, t]() {
+			u2f::crypto::Hash messageHash;
+			u2f::crypto::Signature signature;
+			memset(messageHash, t, sizeof(messageHash));
+			if (signer->sign(messageHash, signature))
+				successes++;
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	uint64_t elapsed = u2f::stats::now() - startedAt;
+	CHECK(successes == 0);
+	CHECK(elapsed >= REMOTE_SIGNER_TIMEOUT_MS * 1000000ULL * 9 / 10);
+	CHECK(elapsed < REMOTE_SIGNER_TIMEOUT_MS * 1000000ULL * 2);
+
+	CHECK(kill(pid, SIGCONT) == 0);
+	checkSign(signer, 3);
+	printf("Timeout after %.0f ms\n", elapsed / 1e6);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s signer-daemon [socket directory]\n", name);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 3) {
+		usage(argv[0]);
+		return 1;
+	}
+	daemonPath = argv[1];
+	if (snprintf(socketPath, sizeof(socketPath), "%s/u2f-test-signer-%d.sock", argc > 2 ? argv[2] : "/tmp", getpid()) >= (int)sizeof(socketPath)) {
+		fprintf(stderr, "Socket directory is too long: %s\n", argv[2]);
+		return 1;
+	}
+
+	pid_t pid = startDaemon();
+	u2f::crypto::RemoteSigner* first = u2f::crypto::RemoteSigner::connect(socketPath);
+	u2f::crypto::RemoteSigner* second = u2f::crypto::RemoteSigner::connect(socketPath);
+	CHECK(first && second);
+
+	checkBasics(first);
+	printf("Signatures and certificate OK\n");
+
+	for (int threadCount : {1, 8, 16, 32}) {
+		checkConcurrentBatches(first, second, threadCount, false);
+		checkConcurrentBatches(first, second, threadCount, true);
+	}
+
+	pid = checkRestart(first, pid);
+	checkConcurrentBatches(first, second, 16, true);
+	printf("Reconnection OK\n");
+
+	checkTimeout(first, pid);
+	checkConcurrentBatches(first, second, 16, true);
+
+	delete first;
+	delete second;
+	stopDaemon(pid);
+
+	u2f::log::flush();
+	printf("All remote signer checks OK\n");
+	return 0;
+}
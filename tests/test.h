@@ -0,0 +1,74 @@
+#pragma once
+
+/**
+ * Helpers shared by the tests in this directory.
+ *
+ * Each test is a standalone program: It stops at the first failed check, prints it, and exits with status 1.
+ */
+
+#include <u2f/crypto.h>
+#include <u2f/log.h>
+#include <uECC.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Fails the test unless #condition holds.
+ *
+ * Exits with _exit(), so that it also works in forked children and with threads still running.
+ * So stdout must be flushed before forking, or the child would print what the parent buffered.
+ */
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #condition); \
+			fflush(stdout); \
+			u2f::log::flush(); \
+			_exit(1); \
+		} \
+	} while (0)
+
+/**
+ * Decodes one INTEGER of a DER signature into 32 big-endian bytes.
+ */
+static inline bool decodeDerInteger(const uint8_t *&der, const uint8_t* end, uint8_t value[32]) {
+	if (end - der < 2 || der[0] != 0x02)
+		return false;
+	uint8_t size = der[1];
+	const uint8_t* bytes = der + 2;
+	if (end - bytes < size)
+		return false;
+	der = bytes + size;
+
+	// Skip the leading zero of positive numbers with the high bit set
+	while (size > 32 && bytes[0] == 0) {
+		bytes++;
+		size--;
+	}
+	if (size > 32)
+		return false;
+	memset(value, 0, 32 - size);
+	memcpy(value + 32 - size, bytes, size);
+	return true;
+}
+
+/**
+ * Verifies a DER signature with micro-ecc.
+ *
+ * @param[in] publicKey Uncompressed public key, as in registration responses
+ * @param[in] messageHash The hash that was signed
+ * @param[in] signature The DER signature
+ * @param[in] signatureSize Size of #signature
+ */
+static inline bool verifySignature(const u2f::crypto::PublicKey &publicKey, const u2f::crypto::Hash &messageHash, const uint8_t* signature, uint32_t signatureSize) {
+	const uint8_t* end = signature + signatureSize;
+	if (signatureSize < 2 || signature[0] != 0x30 || signature[1] != signatureSize - 2 || publicKey[0] != 0x04)
+		return false;
+
+	const uint8_t* der = signature + 2;
+	uint8_t raw[64];
+	if (!decodeDerInteger(der, end, &raw[0]) || !decodeDerInteger(der, end, &raw[32]) || der != end)
+		return false;
+	return uECC_verify(publicKey + 1, messageHash, sizeof(messageHash), raw, uECC_secp256r1()) != 0;
+}
@@ -0,0 +1,210 @@
+/**
+ * Checks crypto::p256 against micro-ecc, which is the reference for the "native" backend:
+ * - Public keys: p256::computePublicKey and uECC_compute_public_key, including private keys at the edges of [1, n-1] and out of range
+ * - Raw signatures: The "native" and "micro-ecc" backends, which both use RFC6979 nonces, so they must match exactly
+ * - DER signatures: crypto::sign with each backend, byte for byte, and verified with uECC_verify
+ * - Nonces: p256::makeNonceBatch and p256::makeNonce, for every batch size up to twice the largest internal batch
+ *
+ * Inputs are derived from the seed with SHA-256, so that a failure can be reproduced.
+ * Every mismatch is printed, and the exit status is 1 if there was any.
+ *
+ * Usage: u2f-p256-verify [-n vectors] [-s seed]
+ *   -n vectors  Number of random keys and signatures (Default: 10000)
+ *   -s seed     Seed of the random inputs (Default: 1)
+ *
+ * Build it with every file in src/.
+ */
+
+#include <u2f/crypto-backend.h>
+#include <u2f/crypto-p256.h>
+#include <uECC.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_NONCE_BATCH 64
+
+static const uint8_t N[32] = {
+	0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xbc, 0xe6, 0xfa, 0xad, 0xa7, 0x17, 0x9e, 0x84, 0xf3, 0xb9, 0xca, 0xc2, 0xfc, 0x63, 0x25, 0x51,
+};
+
+static u2f::crypto::Hash state;
+static uint32_t failures = 0;
+
+/**
+ * Next 32 pseudorandom bytes
+ */
+static void nextRandom(uint8_t bytes[32]) {
+	u2f::crypto::sha256(state, state, (int)sizeof(state), nullptr);
+	memcpy(bytes, state, sizeof(state));
+}
+
+static void printHex(const char* name, const uint8_t* data, uint32_t size) {
+	fprintf(stderr, "  %s: ", name);
+	for (uint32_t i=0; i<size; i++) {
+		fprintf(stderr, "%02x", data[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+static void fail(const char* check, const u2f::crypto::PrivateKey &privateKey, const u2f::crypto::Hash* messageHash) {
+	fprintf(stderr, "Mismatch: %s\n", check);
+	printHex("private key", privateKey, sizeof(privateKey));
+	if (messageHash) {
+		printHex("hash", *messageHash, sizeof(*messageHash));
+	}
+	failures++;
+}
+
+/**
+ * @return The size of a DER signature
+ */
+static uint32_t derSize(const u2f::crypto::Signature &signature) {
+	return signature[1] + 2u;
+}
+
+static void checkPublicKey(const u2f::crypto::PrivateKey &privateKey) {
+	u2f::crypto::PublicKey publicKey;
+	uint8_t expected[64];
+	bool success = u2f::crypto::p256::computePublicKey(privateKey, publicKey);
+	bool expectedSuccess = uECC_compute_public_key(privateKey, expected, uECC_secp256r1()) != 0;
+	if (success != expectedSuccess) {
+		fail(success ? "public key of an invalid private key" : "public key of a valid private key rejected", privateKey, nullptr);
+	} else if (success && (publicKey[0] != 0x04 || memcmp(publicKey + 1, expected, sizeof(expected)))) {
+		fail("public key", privateKey, nullptr);
+	}
+}
+
+static void checkSignature(u2f::crypto::Backend* native, u2f::crypto::Backend* microEcc, const u2f::crypto::PrivateKey &privateKey, const u2f::crypto::Hash &messageHash) {
+	uint8_t publicKey[64];
+	if (!uECC_compute_public_key(privateKey, publicKey, uECC_secp256r1()))
+		return;
+
+	uint8_t raw[64], expectedRaw[64];
+	bool success = native->sign(privateKey, messageHash, raw);
+	bool expectedSuccess = microEcc->sign(privateKey, messageHash, expectedRaw);
+	if (success != expectedSuccess || !success) {
+		fail("raw signature failed", privateKey, &messageHash);
+		return;
+	}
+	if (memcmp(raw, expectedRaw, sizeof(raw))) {
+		fail("raw signature", privateKey, &messageHash);
+		return;
+	}
+	if (!uECC_verify(publicKey, messageHash, sizeof(messageHash), raw, uECC_secp256r1())) {
+		fail("signature doesn't verify", privateKey, &messageHash);
+		return;
+	}
+
+	u2f::crypto::Signature der, expectedDer;
+	u2f::crypto::setBackend(native);
+	success = u2f::crypto::sign(privateKey, messageHash, der);
+	u2f::crypto::setBackend(microEcc);
+	expectedSuccess = u2f::crypto::sign(privateKey, messageHash, expectedDer);
+	if (!success || !expectedSuccess || derSize(der) != derSize(expectedDer) || memcmp(der, expectedDer, derSize(der))) {
+		fail("DER signature", privateKey, &messageHash);
+	}
+}
+
+static void checkNonces(uint32_t count) {
+	uint8_t k[MAX_NONCE_BATCH][32], r[MAX_NONCE_BATCH][32], kInverse[MAX_NONCE_BATCH][32];
+	bool success[MAX_NONCE_BATCH];
+	for (uint32_t i=0; i<count; i++) {
+		nextRandom(k[i]);
+	}
+	// Invalid nonces must not affect the others
+	if (count > 2) {
+		memset(k[1], 0, sizeof(k[1]));
+		memcpy(k[2], N, sizeof(N));
+	}
+
+	u2f::crypto::p256::makeNonceBatch(count, k, r, kInverse, success);
+	for (uint32_t i=0; i<count; i++) {
+		uint8_t expectedR[32], expectedKInverse[32];
+		bool expectedSuccess = u2f::crypto::p256::makeNonce(k[i], expectedR, expectedKInverse);
+		if (success[i] != expectedSuccess || (success[i] && (memcmp(r[i], expectedR, 32) || memcmp(kInverse[i], expectedKInverse, 32)))) {
+			fprintf(stderr, "Mismatch: nonce %u of a batch of %u\n", i, count);
+			printHex("k", k[i], 32);
+			failures++;
+		}
+	}
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-n vectors] [-s seed]\n", name);
+}
+
+int main(int argc, char** argv) {
+	uint32_t vectors = 10000;
+	const char* seed = "1";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				vectors = atoi(optarg);
+				break;
+			case 's':
+				seed = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	u2f::crypto::Backend* native = u2f::crypto::findBackend("native");
+	u2f::crypto::Backend* microEcc = u2f::crypto::findBackend("micro-ecc");
+	if (native == nullptr || microEcc == nullptr) {
+		fprintf(stderr, "The native and micro-ecc backends are both required\n");
+		return 2;
+	}
+	u2f::crypto::sha256(state, seed, (int)strlen(seed), nullptr);
+
+	// Edges: Small keys, keys around n, and keys with long runs of equal digits for the comb
+	u2f::crypto::PrivateKey privateKey;
+	u2f::crypto::Hash messageHash;
+	uint32_t edges = 0;
+	for (uint32_t value=0; value<=0x11; value++) {
+		memset(privateKey, 0, sizeof(privateKey));
+		privateKey[31] = (uint8_t)value;
+		checkPublicKey(privateKey);
+		edges++;
+	}
+	for (uint32_t offset=0; offset<=8; offset++) {
+		memcpy(privateKey, N, sizeof(N));
+		privateKey[31] -= (uint8_t)offset;
+		checkPublicKey(privateKey);
+		edges++;
+	}
+	const uint8_t patterns[] = { 0x00, 0x11, 0x77, 0x88, 0x99, 0xff };
+	for (uint32_t i=0; i<sizeof(patterns); i++) {
+		memset(privateKey, patterns[i], sizeof(privateKey));
+		privateKey[0] = 0x7f;
+		checkPublicKey(privateKey);
+		memset(messageHash, patterns[i], sizeof(messageHash));
+		checkSignature(native, microEcc, privateKey, messageHash);
+		edges++;
+	}
+
+	// Random vectors, with a hash of all ones every few of them, which is larger than n
+	for (uint32_t i=0; i<vectors; i++) {
+		nextRandom(privateKey);
+		nextRandom(messageHash);
+		if (i % 16 == 0) {
+			memset(messageHash, 0xff, sizeof(messageHash));
+		}
+		checkPublicKey(privateKey);
+		checkSignature(native, microEcc, privateKey, messageHash);
+	}
+	u2f::crypto::setBackend(nullptr);
+
+	for (uint32_t count=1; count<=MAX_NONCE_BATCH; count++) {
+		checkNonces(count);
+	}
+
+	printf("%s: %u edge cases, %u random vectors, %u nonce batches: %u mismatches\n", u2f::crypto::p256::getImplementationName(), edges, vectors, MAX_NONCE_BATCH, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,268 @@
+/**
+ * Replays a trace recorded with u2f::trace::Recorder.
+ *
+ * By default, the APDU requests in the trace are fed straight into a new Core, and the latency of each request is reported per instruction.
+ * With -H, the HID output reports are fed into a Hid instead, exercising packet reassembly and channel handling too.
+ *
+ * The trace can be replayed as fast as possible (Default), or with the original pacing between records (-p).
+ *
+ * Usage: u2f-replay [-H] [-p] [-l loops] [-t threads] [-w workers] [-c core] trace
+ *   -H          Replay HID output reports instead of APDU requests
+ *   -p          Keep the original pacing
+ *   -l loops    Replay the whole trace this many times (Default: 1)
+ *   -t threads  APDU replay only: Replay the trace on this many threads concurrently (Default: 1)
+ *   -w workers  HID replay only: Process messages in a WorkerPool with this many threads (Default: No pool)
+ *   -c core     unsafe (Default), stateless:<password>, derived:<password> or sqlite:<filename>
+ *
+ * Keep in mind that handles in the trace are only valid for the core that created them:
+ * To replay authentications successfully, use the same stateless or derived password or a copy of the same SQLite database.
+ */
+
+#include <u2f/core-unsafe.h>
+#include <u2f/core-stateless.h>
+#include <u2f/core-derived.h>
+#include <u2f/core-sqlite.h>
+#include <u2f/hid.h>
+#include <u2f/trace.h>
+#include <u2f/stats.h>
+#include <u2f/worker-pool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <chrono>
+#include <vector>
+
+struct TraceRecord {
+	uint64_t timestamp;
+	uint32_t size;
+	uint8_t* data;
+};
+
+struct Results {
+	u2f::stats::Histogram latency[u2f::stats::INSTRUCTION_COUNT];
+	std::atomic<uint64_t> noError{0};
+	std::atomic<uint64_t> conditionsNotSatisfied{0};
+	std::atomic<uint64_t> wrongData{0};
+	std::atomic<uint64_t> otherErrors{0};
+};
+
+/**
+ * Loads every record of the specified type in memory, so that reading the trace isn't part of the measurement.
+ */
+static bool loadTrace(const char* filename, u2f::trace::RecordType type, std::vector<TraceRecord> &records) {
+	u2f::trace::Reader reader;
+	if (!reader.open(filename)) {
+		return false;
+	}
+
+	u2f::trace::RecordHeader header;
+	const uint8_t* data;
+	while (reader.next(header, data)) {
+		if (header.type != type)
+			continue;
+		TraceRecord record;
+		record.timestamp = header.timestamp;
+		record.size = header.size;
+		record.data = new uint8_t[header.size];
+		memcpy(record.data, data, header.size);
+		records.push_back(record);
+	}
+	return true;
+}
+
+/**
+ * Sleeps until #timestamp (relative to #startedAt) if pacing, otherwise does nothing
+ */
+static void waitFor(bool paced, uint64_t startedAt, uint64_t timestamp) {
+	if (!paced)
+		return;
+	uint64_t now = u2f::stats::now() - startedAt;
+	if (timestamp > now) {
+		std::this_thread::sleep_for(std::chrono::nanoseconds(timestamp - now));
+	}
+}
+
+static void replayApdus(u2f::Core* core, const std::vector<TraceRecord>* records, int loops, bool paced, Results* results) {
+	uint8_t* response = new uint8_t[U2F_MAX_RESPONSE_SIZE];
+	uint64_t traceDuration = records->back().timestamp - records->front().timestamp + 1;
+	uint64_t startedAt = u2f::stats::now();
+
+	for (int loop=0; loop<loops; loop++) {
+		for (const TraceRecord &record : *records) {
+			waitFor(paced, startedAt, loop * traceDuration + record.timestamp - records->front().timestamp);
+
+			uint32_t responseSize = 0;
+			uint64_t requestStartedAt = u2f::stats::now();
+			bool processed = core->processRawAdpu(record.data, record.size, response, U2F_MAX_RESPONSE_SIZE, responseSize);
+			uint64_t latency = u2f::stats::now() - requestStartedAt;
+
+			results->latency[u2f::stats::getInstruction(record.size >= 2 ? record.data[1] : 0)].record(latency);
+			uint16_t sw = processed && responseSize >= 2 ? (response[responseSize-2] << 8) | response[responseSize-1] : 0;
+			switch (sw) {
+				case 0x9000:
+					results->noError++;
+					break;
+				case 0x6985:
+					results->conditionsNotSatisfied++;
+					break;
+				case 0x6A80:
+					results->wrongData++;
+					break;
+				default:
+					results->otherErrors++;
+					break;
+			}
+		}
+	}
+
+	delete[] response;
+}
+
+static void replayHidReports(u2f::Hid* hid, const std::vector<TraceRecord>* records, int loops, bool paced, Results* results) {
+	uint64_t traceDuration = records->back().timestamp - records->front().timestamp + 1;
+	uint64_t startedAt = u2f::stats::now();
+
+	for (int loop=0; loop<loops; loop++) {
+		for (const TraceRecord &record : *records) {
+			waitFor(paced, startedAt, loop * traceDuration + record.timestamp - records->front().timestamp);
+
+			uint64_t reportStartedAt = u2f::stats::now();
+			bool accepted = hid->receivedOutputReport(hiddev::ReportType::Output, 0, record.data, record.size);
+			results->latency[u2f::stats::INSTRUCTION_OTHER].record(u2f::stats::now() - reportStartedAt);
+			if (accepted) {
+				results->noError++;
+			} else {
+				results->otherErrors++;
+			}
+		}
+	}
+}
+
+static u2f::Core* createCore(const char* spec) {
+	if (!strcmp(spec, "unsafe")) {
+		return new u2f::UnsafeCore();
+	} else if (!strncmp(spec, "stateless:", 10)) {
+		return new u2f::StatelessCore(spec + 10);
+	} else if (!strncmp(spec, "derived:", 8)) {
+		return new u2f::DerivedCore(spec + 8);
+	} else if (!strncmp(spec, "sqlite:", 7)) {
+		return new u2f::SQLiteCore(spec + 7);
+	}
+	return nullptr;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-H] [-p] [-l loops] [-t threads] [-w workers] [-c unsafe|stateless:<password>|derived:<password>|sqlite:<filename>] trace\n", name);
+}
+
+int main(int argc, char** argv) {
+	bool hidMode = false;
+	bool paced = false;
+	int loops = 1;
+	int threadCount = 1;
+	int workerCount = 0;
+	const char* coreSpec = "unsafe";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "Hpl:t:w:c:h")) != -1) {
+		switch (opt) {
+			case 'H':
+				hidMode = true;
+				break;
+			case 'p':
+				paced = true;
+				break;
+			case 'l':
+				loops = atoi(optarg);
+				break;
+			case 't':
+				threadCount = atoi(optarg);
+				break;
+			case 'w':
+				workerCount = atoi(optarg);
+				break;
+			case 'c':
+				coreSpec = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1 || loops <= 0 || threadCount <= 0 || workerCount < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<TraceRecord> records;
+	if (!loadTrace(argv[optind], hidMode ? u2f::trace::RECORD_HID_OUTPUT_REPORT : u2f::trace::RECORD_APDU_REQUEST, records)) {
+		return 1;
+	}
+	if (records.empty()) {
+		fprintf(stderr, "No %s records in %s\n", u2f::trace::getRecordTypeName(hidMode ? u2f::trace::RECORD_HID_OUTPUT_REPORT : u2f::trace::RECORD_APDU_REQUEST), argv[optind]);
+		return 1;
+	}
+
+	u2f::Core* core = createCore(coreSpec);
+	if (core == nullptr) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	Results* results = new Results();
+	uint64_t startedAt = u2f::stats::now();
+	uint64_t total;
+	if (hidMode) {
+		u2f::WorkerPool* pool = workerCount ? new u2f::WorkerPool(workerCount) : nullptr;
+		u2f::Hid* hid = new u2f::Hid(*core, pool);
+		replayHidReports(hid, &records, loops, paced, results);
+		delete hid;  // Waits for messages still being processed
+		delete pool;
+		total = (uint64_t)records.size() * loops;
+	} else {
+		std::thread* threads = new std::thread[threadCount];
+		for (int i=0; i<threadCount; i++) {
+			threads[i] = std::thread(replayApdus, core, &records, loops, paced, results);
+		}
+		for (int i=0; i<threadCount; i++) {
+			threads[i].join();
+		}
+		delete[] threads;
+		total = (uint64_t)records.size() * loops * threadCount;
+	}
+	uint64_t elapsed = u2f::stats::now() - startedAt;
+
+	printf("Replayed %" PRIu64 " %s records in %.3fs: %.1f records/s\n", total, hidMode ? "HID report" : "APDU", elapsed / 1e9, total * 1e9 / elapsed);
+	if (hidMode) {
+		printf("Accepted: %" PRIu64 ", rejected: %" PRIu64 "\n", results->noError.load(), results->otherErrors.load());
+	} else {
+		printf("SW 9000: %" PRIu64 ", 6985: %" PRIu64 ", 6A80: %" PRIu64 ", other: %" PRIu64 "\n",
+			results->noError.load(), results->conditionsNotSatisfied.load(), results->wrongData.load(), results->otherErrors.load());
+	}
+
+	printf("%-14s %10s %10s %10s %10s %10s %10s\n", hidMode ? "" : "instruction", "count", "mean(us)", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+	u2f::stats::HistogramSnapshot* snapshot = new u2f::stats::HistogramSnapshot;
+	for (int i=0; i<u2f::stats::INSTRUCTION_COUNT; i++) {
+		results->latency[i].snapshot(*snapshot);
+		if (snapshot->count == 0)
+			continue;
+		printf("%-14s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			hidMode ? "report" : u2f::stats::getInstructionName((u2f::stats::Instruction)i),
+			snapshot->count,
+			snapshot->mean() / 1000,
+			snapshot->percentile(50) / 1000.,
+			snapshot->percentile(99) / 1000.,
+			snapshot->percentile(99.9) / 1000.,
+			snapshot->max / 1000.);
+	}
+	delete snapshot;
+
+	delete results;
+	delete core;
+	for (TraceRecord &record : records) {
+		delete[] record.data;
+	}
+	return 0;
+}
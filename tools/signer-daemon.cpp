@@ -0,0 +1,339 @@
+/**
+ * Signing daemon for u2f::crypto::RemoteSigner.
+ *
+ * It holds the private keys, so that the process handling the transport never has them in memory.
+ * Keys are numbered in the order they are given. Without any, key 0 is the built-in (testing only) attestation key.
+ *
+ * Each connection has its own reader thread. Signatures run on a WorkerPool: When requests pile up,
+ * each worker takes its share of them and signs them together with Signer::signBatch(),
+ * then writes all of its responses to a connection at once.
+ *
+ * The socket is only accessible to the user running the daemon. The memory of the daemon is locked,
+ * and it can't be dumped or traced by other processes of the same user.
+ *
+ * Usage: u2f-signer-daemon [-w workers] [-k private key -c certificate]... socket
+ *   -w workers      Number of signing threads (Default: One per CPU)
+ *   -k private key  Attestation private key, PEM or DER, as for AttestationSigner::fromFile()
+ *   -c certificate  Certificate of the previous key, PEM or DER
+ *
+ * Build it with every file in src/.
+ */
+
+#include <u2f/crypto-remote.h>
+#include <u2f/crypto-attestation.h>
+#include <u2f/worker-pool.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define MAX_KEYS 256
+
+// Largest response: A header and a full certificate
+#define MAX_RESPONSE_SIZE (REMOTE_SIGNER_RESPONSE_HEADER_SIZE + 0xFFFF)
+
+struct Connection;
+
+struct Request {
+	Connection* connection;
+	uint32_t id;
+	uint8_t key;
+	u2f::crypto::Hash messageHash;
+	bool busy;
+};
+
+struct Connection {
+	int fd;
+	std::mutex writeMutex;
+	std::mutex mutex;
+	std::condition_variable drained;
+	uint32_t outstanding;
+	Request requests[REMOTE_SIGNER_MAX_PENDING];
+};
+
+static u2f::crypto::AttestationSigner* keys[MAX_KEYS];
+static uint32_t keyCount = 0;
+static u2f::WorkerPool* pool = nullptr;
+static const char* socketPath = nullptr;
+
+static void sendFully(Connection* connection, const uint8_t* buffer, size_t size) {
+	std::unique_lock<std::mutex> lck(connection->writeMutex);
+	while (size) {
+		ssize_t ret = send(connection->fd, buffer, size, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return; // The reader sees the connection closing
+		buffer += ret;
+		size -= ret;
+	}
+}
+
+static uint32_t encodeResponse(uint8_t* response, uint32_t id, uint8_t status, const uint8_t* data, uint16_t dataSize) {
+	response[0] = id >> 24;
+	response[1] = id >> 16;
+	response[2] = id >>  8;
+	response[3] = id >>  0;
+	response[4] = status;
+	response[5] = 0;
+	response[6] = dataSize >> 8;
+	response[7] = dataSize >> 0;
+	if (dataSize) {
+		memcpy(&response[REMOTE_SIGNER_RESPONSE_HEADER_SIZE], data, dataSize);
+	}
+	return REMOTE_SIGNER_RESPONSE_HEADER_SIZE + dataSize;
+}
+
+static void sendStatus(Connection* connection, uint32_t id, uint8_t status) {
+	uint8_t response[REMOTE_SIGNER_RESPONSE_HEADER_SIZE];
+	sendFully(connection, response, encodeResponse(response, id, status, nullptr, 0));
+}
+
+/**
+ * WorkerPool::BatchFunc: Signs many requests, possibly from different connections, at once.
+ */
+static void signRequests(void* const args[], uint32_t count) {
+	u2f::crypto::Signer* signers[WORKER_POOL_MAX_BATCH] = { };
+	const u2f::crypto::Hash* messageHashes[WORKER_POOL_MAX_BATCH] = { };
+	u2f::crypto::Signature signatures[WORKER_POOL_MAX_BATCH];
+	u2f::crypto::Signature* signaturePointers[WORKER_POOL_MAX_BATCH] = { };
+	bool success[WORKER_POOL_MAX_BATCH];
+	uint8_t responses[WORKER_POOL_MAX_BATCH * (REMOTE_SIGNER_RESPONSE_HEADER_SIZE + sizeof(u2f::crypto::Signature))];
+
+	for (uint32_t i=0; i<count; i++) {
+		Request* request = (Request*)args[i];
+		signers[i] = keys[request->key];
+		messageHashes[i] = &request->messageHash;
+		signaturePointers[i] = &signatures[i];
+	}
+	u2f::crypto::Signer::signBatch(count, signers, messageHashes, signaturePointers, success);
+
+	uint32_t responsesSize = 0;
+	uint32_t responseEnds[WORKER_POOL_MAX_BATCH];
+	Connection* connections[WORKER_POOL_MAX_BATCH];
+	for (uint32_t i=0; i<count; i++) {
+		Request* request = (Request*)args[i];
+		if (success[i]) {
+			responsesSize += encodeResponse(&responses[responsesSize], request->id, REMOTE_SIGNER_STATUS_OK, signatures[i], u2f::crypto::signatureSize(signatures[i]));
+		} else {
+			responsesSize += encodeResponse(&responses[responsesSize], request->id, REMOTE_SIGNER_STATUS_FAILED, nullptr, 0);
+		}
+		responseEnds[i] = responsesSize;
+		connections[i] = request->connection;
+	}
+
+	// The client may reuse an id as soon as it gets its response
+	for (uint32_t i=0; i<count; i++) {
+		std::unique_lock<std::mutex> lck(connections[i]->mutex);
+		((Request*)args[i])->busy = false;
+	}
+
+	// One write per run of responses to the same connection
+	uint32_t runStart = 0;
+	for (uint32_t i=0; i<count; i++) {
+		if (i + 1 == count || connections[i + 1] != connections[i]) {
+			sendFully(connections[i], &responses[runStart], responseEnds[i] - runStart);
+			runStart = responseEnds[i];
+		}
+	}
+
+	for (uint32_t i=0; i<count; i++) {
+		std::unique_lock<std::mutex> lck(connections[i]->mutex);
+		if (--connections[i]->outstanding == 0) {
+			connections[i]->drained.notify_all();
+		}
+	}
+}
+
+static void processRequest(Connection* connection, const uint8_t* data) {
+	uint32_t id = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+	uint8_t command = data[4];
+	uint8_t key = data[5];
+
+	if (key >= keyCount) {
+		sendStatus(connection, id, REMOTE_SIGNER_STATUS_UNKNOWN_KEY);
+		return;
+	}
+
+	if (command == REMOTE_SIGNER_CMD_CERTIFICATE) {
+		const uint8_t* certificate = nullptr;
+		uint16_t certificateSize = 0;
+		keys[key]->getCertificate(certificate, certificateSize);
+		uint8_t* response = new uint8_t[MAX_RESPONSE_SIZE];
+		sendFully(connection, response, encodeResponse(response, id, REMOTE_SIGNER_STATUS_OK, certificate, certificate ? certificateSize : 0));
+		delete[] response;
+		return;
+	}
+
+	if (command != REMOTE_SIGNER_CMD_SIGN) {
+		sendStatus(connection, id, REMOTE_SIGNER_STATUS_INVALID);
+		return;
+	}
+
+	// Clients use the id modulo REMOTE_SIGNER_MAX_PENDING as their slot, so it's unique among the requests in flight
+	Request* request = &connection->requests[id % REMOTE_SIGNER_MAX_PENDING];
+	{
+		std::unique_lock<std::mutex> lck(connection->mutex);
+		if (request->busy) {
+			lck.unlock();
+			sendStatus(connection, id, REMOTE_SIGNER_STATUS_BUSY);
+			return;
+		}
+		request->busy = true;
+		connection->outstanding++;
+	}
+	request->connection = connection;
+	request->id = id;
+	request->key = key;
+	memcpy(request->messageHash, &data[8], sizeof(u2f::crypto::Hash));
+
+	if (!pool->submitBatch(signRequests, request)) {
+		// Queue is full: Sign it right away, which also slows this client down
+		void* args[1] = { request };
+		signRequests(args, 1);
+	}
+}
+
+static void serveConnection(Connection* connection) {
+	uint8_t buffer[REMOTE_SIGNER_MAX_BATCH * REMOTE_SIGNER_REQUEST_SIZE];
+	uint32_t size = 0;
+	while (true) {
+		ssize_t ret = read(connection->fd, &buffer[size], sizeof(buffer) - size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		size += ret;
+
+		uint32_t offset = 0;
+		for (; size - offset >= REMOTE_SIGNER_REQUEST_SIZE; offset += REMOTE_SIGNER_REQUEST_SIZE) {
+			processRequest(connection, &buffer[offset]);
+		}
+		memmove(buffer, &buffer[offset], size - offset);
+		size -= offset;
+	}
+
+	// Requests still being signed point to this connection
+	{
+		std::unique_lock<std::mutex> lck(connection->mutex);
+		while (connection->outstanding) {
+			connection->drained.wait(lck);
+		}
+	}
+	close(connection->fd);
+	delete connection;
+}
+
+static void removeSocket(int) {
+	unlink(socketPath);
+	_exit(0);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-w workers] [-k private key -c certificate]... socket\n", name);
+}
+
+int main(int argc, char** argv) {
+	int workers = 0;
+	const char* privateKeyFilename = nullptr;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:k:c:h")) != -1) {
+		switch (opt) {
+			case 'w':
+				workers = atoi(optarg);
+				break;
+			case 'k':
+				privateKeyFilename = optarg;
+				break;
+			case 'c':
+				if (privateKeyFilename == nullptr || keyCount == MAX_KEYS) {
+					usage(argv[0]);
+					return 1;
+				}
+				keys[keyCount] = u2f::crypto::AttestationSigner::fromFile(privateKeyFilename, optarg);
+				if (keys[keyCount] == nullptr) {
+					fprintf(stderr, "Failed to load %s and %s\n", privateKeyFilename, optarg);
+					return 2;
+				}
+				keyCount++;
+				privateKeyFilename = nullptr;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind + 1 != argc || privateKeyFilename != nullptr) {
+		usage(argv[0]);
+		return 1;
+	}
+	socketPath = argv[optind];
+
+	if (keyCount == 0) {
+		fprintf(stderr, "No key given, serving the built-in attestation key\n");
+		keys[keyCount++] = u2f::crypto::AttestationSigner::getDefault();
+	}
+
+	// Keep the keys out of swap, core dumps and debuggers
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		fprintf(stderr, "Failed to lock memory, keys may be swapped out: %s\n", strerror(errno));
+	}
+	prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path is too long: %s\n", socketPath);
+		return 2;
+	}
+	strcpy(address.sun_path, socketPath);
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd < 0) {
+		fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+		return 2;
+	}
+	unlink(socketPath);
+	mode_t previousMask = umask(0077);
+	int ret = bind(listenFd, (sockaddr*)&address, sizeof(address));
+	umask(previousMask);
+	if (ret != 0 || listen(listenFd, SOMAXCONN) != 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", socketPath, strerror(errno));
+		return 2;
+	}
+	signal(SIGINT, removeSocket);
+	signal(SIGTERM, removeSocket);
+
+	pool = new u2f::WorkerPool(workers, 4096);
+	fprintf(stderr, "Serving %u key(s) on %s with %d workers\n", keyCount, socketPath, pool->getThreadCount());
+
+	while (true) {
+		int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+			}
+			continue;
+		}
+
+		Connection* connection = new Connection();
+		connection->fd = fd;
+		connection->outstanding = 0;
+		for (uint32_t i=0; i<REMOTE_SIGNER_MAX_PENDING; i++) {
+			connection->requests[i].busy = false;
+		}
+		std::thread(serveConnection, connection).detach();
+	}
+}